@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "buffer_pool.h"
+#include "common.h"
+#include "debug.h"
+#include "driver.h"
+#include "userspace.h"
+
+#define BufferPoolMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'lDBN')
+
+extern UNICODE_STRING GlobalRegistryPath;
+
+// The largest class fits a maximum sized NBD write, including the header.
+static const ULONG WnbdBufferPoolClassSizes[WNBD_BUFFER_POOL_CLASS_COUNT] = {
+    64 * 1024,
+    256 * 1024,
+    1024 * 1024,
+    WNBD_PREALLOC_BUFF_SZ
+};
+
+#define POOL_BUFFER_DATA(Buffer) ((PVOID)((PWNBD_POOL_BUFFER)(Buffer) + 1))
+#define POOL_BUFFER_HEADER(Data) ((PWNBD_POOL_BUFFER)(Data) - 1)
+
+static VOID
+WnbdBufferPoolUpdateHighWater(_Inout_ volatile LONG64* HighWater,
+                              _In_ LONG64 Value)
+{
+    LONG64 Current = *HighWater;
+    while (Value > Current) {
+        LONG64 Previous = InterlockedCompareExchange64(
+            HighWater, Value, Current);
+        if (Previous == Current) {
+            break;
+        }
+        Current = Previous;
+    }
+}
+
+static ULONG
+WnbdBufferPoolGetClass(_In_ ULONG Length)
+{
+    for (ULONG Index = 0; Index < WNBD_BUFFER_POOL_CLASS_COUNT; Index++) {
+        if (Length <= WnbdBufferPoolClassSizes[Index]) {
+            return Index;
+        }
+    }
+    return WNBD_BUFFER_POOL_CLASS_COUNT;
+}
+
+static PWNBD_BUFFER_CPU_CACHE
+WnbdBufferPoolGetCpuCache(_In_ PWNBD_BUFFER_POOL Pool)
+{
+    ULONG Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    // The lock is still needed, the thread may be rescheduled.
+    return &Pool->CpuCaches[Cpu % Pool->CpuCount];
+}
+
+static VOID
+WnbdBufferPoolFree(_In_ PWNBD_BUFFER_POOL Pool,
+                   _In_ PWNBD_POOL_BUFFER Buffer)
+{
+    InterlockedAdd64(&Pool->AllocatedBytes, -(LONG64)Buffer->Size);
+    ExFreePool(Buffer);
+}
+
+// Releases the idle buffers, making room for other size classes.
+static VOID
+WnbdBufferPoolTrim(_In_ PWNBD_BUFFER_POOL Pool)
+{
+    LIST_ENTRY Buffers;
+    KIRQL Irql = { 0 };
+
+    InitializeListHead(&Buffers);
+    for (ULONG Cpu = 0; Cpu < Pool->CpuCount; Cpu++) {
+        PWNBD_BUFFER_CPU_CACHE Cache = &Pool->CpuCaches[Cpu];
+        KeAcquireSpinLock(&Cache->Lock, &Irql);
+        for (ULONG Index = 0; Index < WNBD_BUFFER_POOL_CLASS_COUNT; Index++) {
+            while (Cache->Count[Index]) {
+                InsertTailList(&Buffers,
+                    &Cache->Buffers[Index][--Cache->Count[Index]]->Link);
+            }
+        }
+        KeReleaseSpinLock(&Cache->Lock, Irql);
+    }
+
+    KeAcquireSpinLock(&Pool->Lock, &Irql);
+    for (ULONG Index = 0; Index < WNBD_BUFFER_POOL_CLASS_COUNT; Index++) {
+        while (!IsListEmpty(&Pool->FreeList[Index])) {
+            InsertTailList(&Buffers, RemoveHeadList(&Pool->FreeList[Index]));
+        }
+        Pool->FreeCount[Index] = 0;
+    }
+    KeReleaseSpinLock(&Pool->Lock, Irql);
+
+    while (!IsListEmpty(&Buffers)) {
+        WnbdBufferPoolFree(Pool, CONTAINING_RECORD(
+            RemoveHeadList(&Buffers), WNBD_POOL_BUFFER, Link));
+    }
+}
+
+static PWNBD_POOL_BUFFER
+WnbdBufferPoolGetCached(_In_ PWNBD_BUFFER_POOL Pool,
+                        _In_ ULONG ClassIndex)
+{
+    PWNBD_POOL_BUFFER Buffer = NULL;
+    KIRQL Irql = { 0 };
+
+    PWNBD_BUFFER_CPU_CACHE Cache = WnbdBufferPoolGetCpuCache(Pool);
+    KeAcquireSpinLock(&Cache->Lock, &Irql);
+    if (Cache->Count[ClassIndex]) {
+        Buffer = Cache->Buffers[ClassIndex][--Cache->Count[ClassIndex]];
+    }
+    KeReleaseSpinLock(&Cache->Lock, Irql);
+    if (Buffer) {
+        return Buffer;
+    }
+
+    KeAcquireSpinLock(&Pool->Lock, &Irql);
+    if (!IsListEmpty(&Pool->FreeList[ClassIndex])) {
+        Buffer = CONTAINING_RECORD(RemoveHeadList(&Pool->FreeList[ClassIndex]),
+                                   WNBD_POOL_BUFFER, Link);
+        Pool->FreeCount[ClassIndex]--;
+    }
+    KeReleaseSpinLock(&Pool->Lock, Irql);
+    return Buffer;
+}
+
+static PWNBD_POOL_BUFFER
+WnbdBufferPoolAllocate(_In_ PWNBD_BUFFER_POOL Pool,
+                       _In_ ULONG ClassIndex,
+                       _In_ ULONG Size)
+{
+    // Requests are never blocked if no buffer is in use, otherwise a cap
+    // smaller than the largest transfer would lead to a deadlock.
+    LONG64 Allocated = InterlockedAdd64(&Pool->AllocatedBytes, Size);
+    if (Allocated > Pool->MaxBytes && Pool->InUseBytes) {
+        InterlockedAdd64(&Pool->AllocatedBytes, -(LONG64)Size);
+        return NULL;
+    }
+
+    PWNBD_POOL_BUFFER Buffer = (PWNBD_POOL_BUFFER) BufferPoolMalloc(
+        sizeof(WNBD_POOL_BUFFER) + (SIZE_T)Size);
+    if (!Buffer) {
+        InterlockedAdd64(&Pool->AllocatedBytes, -(LONG64)Size);
+        return NULL;
+    }
+    Buffer->ClassIndex = ClassIndex;
+    Buffer->Size = Size;
+
+    InterlockedIncrement64(&Pool->Allocations);
+    WnbdBufferPoolUpdateHighWater(&Pool->AllocatedHighWaterBytes, Allocated);
+    return Buffer;
+}
+
+UINT64
+WnbdBufferPoolReadMaxBytes()
+{
+    UINT32 MaxSizeMB = 0;
+    if (WNBDReadRegistryValue(
+            &GlobalRegistryPath, L"BufferPoolMaxSizeMB",
+            (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT), &MaxSizeMB) &&
+            MaxSizeMB) {
+        return (UINT64)MaxSizeMB * 1024 * 1024;
+    }
+    return WNBD_DEFAULT_BUFFER_POOL_MAX_BYTES;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdBufferPoolCreate(UINT64 MaxBytes,
+                     PWNBD_BUFFER_POOL* PPool)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(PPool);
+    *PPool = NULL;
+
+    PWNBD_BUFFER_POOL Pool = (PWNBD_BUFFER_POOL) BufferPoolMalloc(
+        sizeof(WNBD_BUFFER_POOL));
+    if (!Pool) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Pool, sizeof(WNBD_BUFFER_POOL));
+
+    Pool->CpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Pool->CpuCaches = (PWNBD_BUFFER_CPU_CACHE) BufferPoolMalloc(
+        sizeof(WNBD_BUFFER_CPU_CACHE) * Pool->CpuCount);
+    if (!Pool->CpuCaches) {
+        ExFreePool(Pool);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Pool->CpuCaches,
+                  sizeof(WNBD_BUFFER_CPU_CACHE) * Pool->CpuCount);
+    for (ULONG Cpu = 0; Cpu < Pool->CpuCount; Cpu++) {
+        KeInitializeSpinLock(&Pool->CpuCaches[Cpu].Lock);
+    }
+
+    KeInitializeSpinLock(&Pool->Lock);
+    for (ULONG Index = 0; Index < WNBD_BUFFER_POOL_CLASS_COUNT; Index++) {
+        InitializeListHead(&Pool->FreeList[Index]);
+    }
+    KeInitializeEvent(&Pool->ReleaseEvent, SynchronizationEvent, FALSE);
+    Pool->MaxBytes = MaxBytes ? MaxBytes : WNBD_DEFAULT_BUFFER_POOL_MAX_BYTES;
+    *PPool = Pool;
+
+    WNBD_LOG_INFO("Buffer pool size limit: %lld.", Pool->MaxBytes);
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdBufferPoolDelete(PWNBD_BUFFER_POOL Pool)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Pool) {
+        return;
+    }
+
+    ASSERT(!Pool->InUseBytes);
+    WnbdBufferPoolTrim(Pool);
+
+    ExFreePool(Pool->CpuCaches);
+    ExFreePool(Pool);
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+VOID
+WnbdBufferPoolSetMaxBytes(PWNBD_BUFFER_POOL Pool,
+                          UINT64 MaxBytes)
+{
+    InterlockedExchange64(&Pool->MaxBytes,
+        MaxBytes ? MaxBytes : WNBD_DEFAULT_BUFFER_POOL_MAX_BYTES);
+    WNBD_LOG_INFO("Buffer pool size limit: %lld.", Pool->MaxBytes);
+    // Borrowers may proceed if the limit was raised.
+    KeSetEvent(&Pool->ReleaseEvent, IO_NO_INCREMENT, FALSE);
+}
+
+static PVOID
+WnbdBufferPoolAcquireInternal(_In_ PWNBD_BUFFER_POOL Pool,
+                              _In_ ULONG Length,
+                              _In_ BOOLEAN Wait)
+{
+    ULONG ClassIndex = WnbdBufferPoolGetClass(Length);
+    ULONG Size = ClassIndex < WNBD_BUFFER_POOL_CLASS_COUNT ?
+        WnbdBufferPoolClassSizes[ClassIndex] : Length;
+    PWNBD_POOL_BUFFER Buffer = NULL;
+    BOOLEAN Trimmed = FALSE;
+    BOOLEAN Waited = FALSE;
+
+    LARGE_INTEGER Deadline;
+    KeQuerySystemTime(&Deadline);
+    Deadline.QuadPart += WNBD_BUFFER_POOL_WAIT_TIMEOUT_MS * 10000LL;
+
+    while (TRUE) {
+        if (ClassIndex < WNBD_BUFFER_POOL_CLASS_COUNT) {
+            Buffer = WnbdBufferPoolGetCached(Pool, ClassIndex);
+            if (Buffer) {
+                InterlockedIncrement64(&Pool->CacheHits);
+                break;
+            }
+        }
+        Buffer = WnbdBufferPoolAllocate(Pool, ClassIndex, Size);
+        if (Buffer) {
+            break;
+        }
+        if (!Trimmed) {
+            // Idle buffers of other size classes count towards the cap.
+            WnbdBufferPoolTrim(Pool);
+            Trimmed = TRUE;
+            continue;
+        }
+
+        LARGE_INTEGER Now;
+        KeQuerySystemTime(&Now);
+        if (!Wait || Now.QuadPart >= Deadline.QuadPart) {
+            break;
+        }
+        if (!Waited) {
+            InterlockedIncrement64(&Pool->Waits);
+            Waited = TRUE;
+        }
+        // Short waits, avoiding missed wake ups.
+        LARGE_INTEGER Timeout;
+        Timeout.QuadPart = -100 * 10000LL;
+        InterlockedIncrement(&Pool->Waiters);
+        KeWaitForSingleObject(&Pool->ReleaseEvent, Executive, KernelMode,
+                              FALSE, &Timeout);
+        InterlockedDecrement(&Pool->Waiters);
+        Trimmed = FALSE;
+    }
+
+    if (!Buffer) {
+        if (!Wait) {
+            return NULL;
+        }
+        WNBD_LOG_ERROR("Could not allocate a %lu bytes staging buffer. "
+                       "Pool size: %lld, limit: %lld.",
+                       Length, Pool->AllocatedBytes, Pool->MaxBytes);
+        InterlockedIncrement64(&Pool->Failures);
+        return NULL;
+    }
+
+    LONG64 InUse = InterlockedAdd64(&Pool->InUseBytes, Buffer->Size);
+    WnbdBufferPoolUpdateHighWater(&Pool->InUseHighWaterBytes, InUse);
+    return POOL_BUFFER_DATA(Buffer);
+}
+
+_Use_decl_annotations_
+PVOID
+WnbdBufferPoolAcquire(PWNBD_BUFFER_POOL Pool,
+                      ULONG Length)
+{
+    return WnbdBufferPoolAcquireInternal(Pool, Length, TRUE);
+}
+
+_Use_decl_annotations_
+PVOID
+WnbdBufferPoolTryAcquire(PWNBD_BUFFER_POOL Pool,
+                         ULONG Length)
+{
+    return WnbdBufferPoolAcquireInternal(Pool, Length, FALSE);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdBufferPoolRelease(PWNBD_BUFFER_POOL Pool,
+                      PVOID Data)
+{
+    PWNBD_POOL_BUFFER Buffer = POOL_BUFFER_HEADER(Data);
+    ULONG ClassIndex = Buffer->ClassIndex;
+    BOOLEAN Cached = FALSE;
+    KIRQL Irql = { 0 };
+
+    InterlockedAdd64(&Pool->InUseBytes, -(LONG64)Buffer->Size);
+
+    if (ClassIndex < WNBD_BUFFER_POOL_CLASS_COUNT) {
+        PWNBD_BUFFER_CPU_CACHE Cache = WnbdBufferPoolGetCpuCache(Pool);
+        KeAcquireSpinLock(&Cache->Lock, &Irql);
+        if (Cache->Count[ClassIndex] < WNBD_BUFFER_POOL_CPU_CACHE_SIZE) {
+            Cache->Buffers[ClassIndex][Cache->Count[ClassIndex]++] = Buffer;
+            Cached = TRUE;
+        }
+        KeReleaseSpinLock(&Cache->Lock, Irql);
+
+        if (!Cached) {
+            KeAcquireSpinLock(&Pool->Lock, &Irql);
+            if (Pool->FreeCount[ClassIndex] < WNBD_BUFFER_POOL_MAX_FREE) {
+                InsertHeadList(&Pool->FreeList[ClassIndex], &Buffer->Link);
+                Pool->FreeCount[ClassIndex]++;
+                Cached = TRUE;
+            }
+            KeReleaseSpinLock(&Pool->Lock, Irql);
+        }
+    }
+
+    if (!Cached) {
+        WnbdBufferPoolFree(Pool, Buffer);
+    }
+    if (Pool->Waiters) {
+        KeSetEvent(&Pool->ReleaseEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+WnbdBufferPoolGetStats(PWNBD_BUFFER_POOL Pool,
+                       PWNBD_ADAPTER_STATS Stats)
+{
+    RtlZeroMemory(Stats, sizeof(WNBD_ADAPTER_STATS));
+    Stats->BufferPoolMaxBytes = Pool->MaxBytes;
+    Stats->BufferPoolAllocatedBytes = Pool->AllocatedBytes;
+    Stats->BufferPoolAllocatedHighWaterBytes = Pool->AllocatedHighWaterBytes;
+    Stats->BufferPoolInUseBytes = Pool->InUseBytes;
+    Stats->BufferPoolInUseHighWaterBytes = Pool->InUseHighWaterBytes;
+    Stats->BufferPoolCacheHits = Pool->CacheHits;
+    Stats->BufferPoolAllocations = Pool->Allocations;
+    Stats->BufferPoolWaits = Pool->Waits;
+    Stats->BufferPoolFailures = Pool->Failures;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H 1
+
+#include "common.h"
+#include "wnbd_ioctl.h"
+
+// Overridden through the "BufferPoolMaxSizeMB" registry key.
+#define WNBD_DEFAULT_BUFFER_POOL_MAX_BYTES (256ULL * 1024 * 1024)
+#define WNBD_BUFFER_POOL_CLASS_COUNT 4
+// Idle buffers kept per size class, per CPU and globally.
+#define WNBD_BUFFER_POOL_CPU_CACHE_SIZE 2
+#define WNBD_BUFFER_POOL_MAX_FREE 16
+// Borrowers waiting for the pool to go below its cap give up after
+// this interval.
+#define WNBD_BUFFER_POOL_WAIT_TIMEOUT_MS 30000
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _WNBD_POOL_BUFFER
+{
+    LIST_ENTRY                  Link;
+    // WNBD_BUFFER_POOL_CLASS_COUNT for buffers that exceed the largest
+    // size class, which aren't cached.
+    ULONG                       ClassIndex;
+    ULONG                       Size;
+    // Followed by the buffer data.
+} WNBD_POOL_BUFFER, *PWNBD_POOL_BUFFER;
+
+typedef struct DECLSPEC_CACHEALIGN _WNBD_BUFFER_CPU_CACHE
+{
+    KSPIN_LOCK                  Lock;
+    ULONG                       Count[WNBD_BUFFER_POOL_CLASS_COUNT];
+    PWNBD_POOL_BUFFER           Buffers[WNBD_BUFFER_POOL_CLASS_COUNT]
+                                       [WNBD_BUFFER_POOL_CPU_CACHE_SIZE];
+} WNBD_BUFFER_CPU_CACHE, *PWNBD_BUFFER_CPU_CACHE;
+
+// Adapter wide staging buffers, used by the NBD transfers instead of
+// per device buffers. Buffers are only borrowed while a transfer is in
+// progress. Idle buffers are cached per CPU and in global per size
+// class lists, the total allocated size being capped.
+typedef struct _WNBD_BUFFER_POOL
+{
+    volatile LONG64             MaxBytes;
+    volatile LONG64             AllocatedBytes;
+    volatile LONG64             AllocatedHighWaterBytes;
+    volatile LONG64             InUseBytes;
+    volatile LONG64             InUseHighWaterBytes;
+    volatile LONG64             CacheHits;
+    volatile LONG64             Allocations;
+    volatile LONG64             Waits;
+    volatile LONG64             Failures;
+
+    KSPIN_LOCK                  Lock;
+    // Protected by "Lock".
+    LIST_ENTRY                  FreeList[WNBD_BUFFER_POOL_CLASS_COUNT];
+    ULONG                       FreeCount[WNBD_BUFFER_POOL_CLASS_COUNT];
+
+    // Signaled when buffers are released.
+    KEVENT                      ReleaseEvent;
+    volatile LONG               Waiters;
+
+    ULONG                       CpuCount;
+    PWNBD_BUFFER_CPU_CACHE      CpuCaches;
+} WNBD_BUFFER_POOL, *PWNBD_BUFFER_POOL;
+
+// Reads the "BufferPoolMaxSizeMB" registry key.
+_IRQL_requires_(PASSIVE_LEVEL)
+UINT64
+WnbdBufferPoolReadMaxBytes();
+
+NTSTATUS
+WnbdBufferPoolCreate(_In_ UINT64 MaxBytes,
+                     _Out_ PWNBD_BUFFER_POOL* PPool);
+
+// All the buffers must have been released.
+VOID
+WnbdBufferPoolDelete(_In_ PWNBD_BUFFER_POOL Pool);
+
+VOID
+WnbdBufferPoolSetMaxBytes(_In_ PWNBD_BUFFER_POOL Pool,
+                          _In_ UINT64 MaxBytes);
+
+// Borrows a buffer of at least "Length" bytes, waiting if the pool
+// reached its cap. Returns NULL on failure.
+_IRQL_requires_(PASSIVE_LEVEL)
+PVOID
+WnbdBufferPoolAcquire(_In_ PWNBD_BUFFER_POOL Pool,
+                      _In_ ULONG Length);
+
+// Same as above, without waiting if the pool reached its cap. Used by
+// the reply threads, which must never wait for other transfers.
+PVOID
+WnbdBufferPoolTryAcquire(_In_ PWNBD_BUFFER_POOL Pool,
+                         _In_ ULONG Length);
+
+VOID
+WnbdBufferPoolRelease(_In_ PWNBD_BUFFER_POOL Pool,
+                      _In_ PVOID Buffer);
+
+VOID
+WnbdBufferPoolGetStats(_In_ PWNBD_BUFFER_POOL Pool,
+                       _Out_ PWNBD_ADAPTER_STATS Stats);
+
+#endif
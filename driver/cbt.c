@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "cbt.h"
+#include "debug.h"
+#include "srb_helper.h"
+
+#define CbtMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'tDBN')
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdCbtCreate(UINT64 DiskSize,
+              UINT32 DiskBlockSize,
+              PUINT32 TrackingBlockSize,
+              PWNBD_CBT* PCbt)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(PCbt);
+    ASSERT(TrackingBlockSize);
+
+    NTSTATUS Status = STATUS_SUCCESS;
+    UINT32 BlockSize = *TrackingBlockSize;
+    *PCbt = NULL;
+
+    if (!DiskSize) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (!BlockSize || (BlockSize & (BlockSize - 1)) || BlockSize < DiskBlockSize) {
+        BlockSize = WNBD_CBT_DEFAULT_BLOCK_SIZE;
+    }
+
+    PWNBD_CBT Cbt = (PWNBD_CBT) CbtMalloc(sizeof(WNBD_CBT));
+    if (!Cbt) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Cbt, sizeof(WNBD_CBT));
+    Cbt->DiskBlockSize = DiskBlockSize;
+
+    while ((1UL << Cbt->BlockShift) < BlockSize) {
+        Cbt->BlockShift++;
+    }
+    while ((((DiskSize - 1) >> Cbt->BlockShift) + 1) > WNBD_CBT_MAX_BITMAP_SIZE * 8ULL) {
+        Cbt->BlockShift++;
+    }
+    Cbt->BlockCount = (ULONG)(((DiskSize - 1) >> Cbt->BlockShift) + 1);
+
+    ULONG BitmapSize = ALIGN_UP_BY(Cbt->BlockCount, 32) / 8;
+    for (ULONG Index = 0; Index < 2; Index++) {
+        PULONG Buffer = (PULONG) CbtMalloc(BitmapSize);
+        if (!Buffer) {
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        RtlInitializeBitMap(&Cbt->Bitmaps[Index], Buffer, Cbt->BlockCount);
+        RtlClearAllBits(&Cbt->Bitmaps[Index]);
+    }
+
+    Cbt->ShardCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Cbt->Shards = (PWNBD_CBT_SHARD) CbtMalloc(
+        sizeof(WNBD_CBT_SHARD) * Cbt->ShardCount);
+    if (!Cbt->Shards) {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(Cbt->Shards, sizeof(WNBD_CBT_SHARD) * Cbt->ShardCount);
+
+    Status = ExInitializeResourceLite(&Cbt->SnapshotLock);
+    if (!NT_SUCCESS(Status)) {
+        ExFreePool(Cbt->Shards);
+        Cbt->Shards = NULL;
+        goto Exit;
+    }
+
+    Cbt->Frozen = 1;
+    *TrackingBlockSize = 1UL << Cbt->BlockShift;
+    *PCbt = Cbt;
+
+    WNBD_LOG_INFO("Tracking changed blocks. Block size: %lu, block count: %lu.",
+                  1UL << Cbt->BlockShift, Cbt->BlockCount);
+
+Exit:
+    if (!NT_SUCCESS(Status)) {
+        WnbdCbtDelete(Cbt);
+    }
+    WNBD_LOG_LOUD(": Exit");
+    return Status;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdCbtDelete(PWNBD_CBT Cbt)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Cbt) {
+        return;
+    }
+
+    for (ULONG Index = 0; Index < 2; Index++) {
+        if (Cbt->Bitmaps[Index].Buffer) {
+            ExFreePool(Cbt->Bitmaps[Index].Buffer);
+        }
+    }
+    // The shards are allocated last, along with the lock.
+    if (Cbt->Shards) {
+        ExDeleteResourceLite(&Cbt->SnapshotLock);
+        ExFreePool(Cbt->Shards);
+    }
+    ExFreePool(Cbt);
+
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+VOID
+WnbdCbtMarkChanged(PWNBD_CBT Cbt,
+                   UINT64 Offset,
+                   UINT64 Length)
+{
+    if (!Length) {
+        return;
+    }
+
+    ULONG FirstBlock = (ULONG)(Offset >> Cbt->BlockShift);
+    ULONG LastBlock = (ULONG)((Offset + Length - 1) >> Cbt->BlockShift);
+    LONG64 NewBlocks = 0;
+    KIRQL OldIrql = { 0 };
+
+    if (FirstBlock >= Cbt->BlockCount) {
+        return;
+    }
+    LastBlock = min(LastBlock, Cbt->BlockCount - 1);
+
+    // Stay on the same CPU while using its shard.
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+    PWNBD_CBT_SHARD Shard = &Cbt->Shards[
+        KeGetCurrentProcessorNumberEx(NULL) % Cbt->ShardCount];
+    // Snapshots wait for the in flight marks before handing out the
+    // bitmap, so this has to be incremented before picking the bitmap.
+    InterlockedIncrement(&Shard->InFlight);
+    LONG Active = ReadNoFence(&Cbt->Active);
+    PLONG Buffer = (PLONG)Cbt->Bitmaps[Active].Buffer;
+
+    for (ULONG Block = FirstBlock; Block <= LastBlock; Block++) {
+        PLONG Word = &Buffer[Block / 32];
+        LONG Bit = Block % 32;
+        // Avoid the interlocked operation for blocks that are already
+        // marked, which is the common case for hot regions.
+        if (!(ReadNoFence(Word) & (1 << Bit)) &&
+                !InterlockedBitTestAndSet(Word, Bit)) {
+            NewBlocks++;
+        }
+    }
+
+    Shard->ChangedBlocks[Active] += NewBlocks;
+    InterlockedDecrement(&Shard->InFlight);
+    KeLowerIrql(OldIrql);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdCbtTrackElement(PWNBD_CBT Cbt,
+                    PSRB_QUEUE_ELEMENT Element)
+{
+    if (!Cbt) {
+        return;
+    }
+
+    PCDB Cdb = (PCDB)&Element->Srb->Cdb;
+    switch (Cdb->AsByte[0]) {
+    case SCSIOP_WRITE6:
+    case SCSIOP_WRITE:
+    case SCSIOP_WRITE12:
+    case SCSIOP_WRITE16:
+        WnbdCbtMarkChanged(Cbt, Element->StartingLbn, Element->ReadLength);
+        break;
+    case SCSIOP_UNMAP:
+    {
+        // The element covers the span of all the descriptors, so we're
+        // marking each range separately. The list was validated when
+        // the request was queued.
+        PUNMAP_LIST_HEADER List = SrbGetDataBuffer(Element->Srb);
+        UINT16 BlockDescLength =
+            ((UINT16)List->BlockDescrDataLength[0] << 8) |
+            List->BlockDescrDataLength[1];
+        UINT32 DescriptorCount = BlockDescLength / sizeof(UNMAP_BLOCK_DESCRIPTOR);
+        for (UINT32 i = 0; i < DescriptorCount; i++) {
+            UINT64 BlockAddress;
+            UINT32 BlockCount;
+            REVERSE_BYTES_8(&BlockAddress, &List->Descriptors[i].StartingLba);
+            REVERSE_BYTES_4(&BlockCount, &List->Descriptors[i].LbaCount);
+            WnbdCbtMarkChanged(Cbt, BlockAddress * Cbt->DiskBlockSize,
+                               (UINT64)BlockCount * Cbt->DiskBlockSize);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdCbtSnapshot(PWNBD_CBT Cbt,
+                PWNBD_CBT_SNAPSHOT_INFO SnapshotInfo)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Cbt);
+    ASSERT(SnapshotInfo);
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&Cbt->SnapshotLock, TRUE);
+
+    // The inactive bitmap holds the previous snapshot, which gets
+    // discarded.
+    LONG Next = Cbt->Frozen;
+    RtlClearAllBits(&Cbt->Bitmaps[Next]);
+    for (ULONG Index = 0; Index < Cbt->ShardCount; Index++) {
+        Cbt->Shards[Index].ChangedBlocks[Next] = 0;
+    }
+
+    LONG Frozen = InterlockedExchange(&Cbt->Active, Next);
+
+    // Wait for the marks that may still be using the frozen bitmap.
+    // Those don't block, so this won't take long.
+    UINT64 ChangedBlocks = 0;
+    for (ULONG Index = 0; Index < Cbt->ShardCount; Index++) {
+        PWNBD_CBT_SHARD Shard = &Cbt->Shards[Index];
+        while (ReadAcquire(&Shard->InFlight)) {
+            YieldProcessor();
+        }
+        ChangedBlocks += ReadAcquire64(&Shard->ChangedBlocks[Frozen]);
+    }
+
+    Cbt->Frozen = Frozen;
+    Cbt->SnapshotId += 1;
+
+    RtlZeroMemory(SnapshotInfo, sizeof(WNBD_CBT_SNAPSHOT_INFO));
+    SnapshotInfo->SnapshotId = Cbt->SnapshotId;
+    SnapshotInfo->BlockSize = 1UL << Cbt->BlockShift;
+    SnapshotInfo->BlockCount = Cbt->BlockCount;
+    SnapshotInfo->ChangedBlockCount = ChangedBlocks;
+
+    ExReleaseResourceLite(&Cbt->SnapshotLock);
+    KeLeaveCriticalRegion();
+
+    WNBD_LOG_INFO("Created CBT snapshot %llu. Changed blocks: %llu.",
+                  SnapshotInfo->SnapshotId, ChangedBlocks);
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdCbtFetch(PWNBD_CBT Cbt,
+             UINT64 SnapshotId,
+             UINT64 StartBlock,
+             PUCHAR Buffer,
+             ULONG BufferSize,
+             PUINT64 BlockCount)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Cbt);
+    ASSERT(Buffer);
+    ASSERT(BlockCount);
+
+    NTSTATUS Status = STATUS_SUCCESS;
+    *BlockCount = 0;
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceSharedLite(&Cbt->SnapshotLock, TRUE);
+
+    if (!SnapshotId || SnapshotId != Cbt->SnapshotId) {
+        WNBD_LOG_ERROR("Invalid CBT snapshot id: %llu. Current snapshot: %llu.",
+                       SnapshotId, Cbt->SnapshotId);
+        Status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+    // The bitmap is copied as is, so we need byte aligned chunks.
+    if (StartBlock % 8 || StartBlock > Cbt->BlockCount) {
+        WNBD_LOG_ERROR("Invalid CBT start block: %llu.", StartBlock);
+        Status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    UINT64 Remaining = Cbt->BlockCount - StartBlock;
+    ULONG Length = (ULONG)min((UINT64)BufferSize, (Remaining + 7) / 8);
+    PUCHAR Bitmap = (PUCHAR)Cbt->Bitmaps[Cbt->Frozen].Buffer;
+
+    RtlCopyMemory(Buffer, Bitmap + StartBlock / 8, Length);
+    *BlockCount = min((UINT64)Length * 8, Remaining);
+    // Clear the bits beyond the end of the disk.
+    if (Length && *BlockCount % 8) {
+        Buffer[Length - 1] &= (UCHAR)((1 << (*BlockCount % 8)) - 1);
+    }
+
+Exit:
+    ExReleaseResourceLite(&Cbt->SnapshotLock);
+    KeLeaveCriticalRegion();
+    WNBD_LOG_LOUD(": Exit");
+    return Status;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef CBT_H
+#define CBT_H 1
+
+#include "common.h"
+#include "util.h"
+#include "wnbd_ioctl.h"
+
+#define WNBD_CBT_DEFAULT_BLOCK_SIZE (64 * 1024)
+// The bitmap is kept in non-paged memory (twice), so we're increasing
+// the tracking granularity for large disks instead of exceeding this.
+#define WNBD_CBT_MAX_BITMAP_SIZE (32 * 1024 * 1024)
+
+// Per-CPU state, updated on the IO completion path. Cache line aligned
+// so that processors completing IO won't contend with each other.
+typedef struct DECLSPEC_CACHEALIGN _WNBD_CBT_SHARD
+{
+    // Marks that are currently being applied by this CPU.
+    volatile LONG               InFlight;
+    // Newly changed blocks, one counter per bitmap.
+    LONG64                      ChangedBlocks[2];
+} WNBD_CBT_SHARD, *PWNBD_CBT_SHARD;
+
+// Changed block tracking. Completed writes and trims are recorded in the
+// active bitmap. Taking a snapshot swaps the bitmaps, the previously
+// active one being frozen until the next snapshot so that it can be
+// fetched by backup applications.
+typedef struct _WNBD_CBT
+{
+    ULONG                       BlockShift;
+    ULONG                       BlockCount;
+    // Used for UNMAP block descriptors.
+    UINT32                      DiskBlockSize;
+    RTL_BITMAP                  Bitmaps[2];
+    volatile LONG               Active;
+    LONG                        Frozen;
+    UINT64                      SnapshotId;
+    // Serializes snapshots and fetches, never acquired on the IO path.
+    ERESOURCE                   SnapshotLock;
+
+    ULONG                       ShardCount;
+    PWNBD_CBT_SHARD             Shards;
+} WNBD_CBT, *PWNBD_CBT;
+
+NTSTATUS
+WnbdCbtCreate(_In_ UINT64 DiskSize,
+              _In_ UINT32 DiskBlockSize,
+              _Inout_ PUINT32 TrackingBlockSize,
+              _Out_ PWNBD_CBT* PCbt);
+
+VOID
+WnbdCbtDelete(_In_ PWNBD_CBT Cbt);
+
+VOID
+WnbdCbtMarkChanged(_In_ PWNBD_CBT Cbt,
+                   _In_ UINT64 Offset,
+                   _In_ UINT64 Length);
+
+// Records the range touched by a write or unmap request, ignoring
+// other request types.
+VOID
+WnbdCbtTrackElement(_In_opt_ PWNBD_CBT Cbt,
+                    _In_ PSRB_QUEUE_ELEMENT Element);
+
+NTSTATUS
+WnbdCbtSnapshot(_In_ PWNBD_CBT Cbt,
+                _Out_ PWNBD_CBT_SNAPSHOT_INFO SnapshotInfo);
+
+NTSTATUS
+WnbdCbtFetch(_In_ PWNBD_CBT Cbt,
+             _In_ UINT64 SnapshotId,
+             _In_ UINT64 StartBlock,
+             _Out_writes_bytes_(BufferSize) PUCHAR Buffer,
+             _In_ ULONG BufferSize,
+             _Out_ PUINT64 BlockCount);
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "congestion.h"
+#include "debug.h"
+#include "userspace.h"
+#include "util.h"
+
+#define CongestionMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'qDBN')
+
+VOID
+WnbdCongestionUpdateStats(_In_ PWNBD_CONGESTION Congestion)
+{
+    PWNBD_DRV_STATS Stats = &Congestion->DeviceInformation->Stats;
+
+    InterlockedExchange64(&Stats->QueueDepth, Congestion->Depth);
+    InterlockedExchange64(&Stats->QueueDepthState, Congestion->State);
+    InterlockedExchange64(&Stats->QueueBaseLatencyUs,
+                          Congestion->BaseLatency / 10);
+    InterlockedExchange64(&Stats->QueueAverageLatencyUs,
+                          Congestion->AverageLatency / 10);
+}
+
+// Adjusts the queue depth at the end of each epoch. The congestion
+// lock is held by the caller.
+VOID
+WnbdCongestionSample(_In_ PWNBD_CONGESTION Congestion,
+                     _In_ UINT64 Latency)
+{
+    Congestion->EpochLatencySum += Latency;
+    Congestion->EpochCompleted++;
+    if (!Congestion->PeriodMinLatency || Latency < Congestion->PeriodMinLatency) {
+        Congestion->PeriodMinLatency = Latency;
+    }
+    if (!Congestion->BaseLatency || Latency < Congestion->BaseLatency) {
+        Congestion->BaseLatency = Latency;
+    }
+
+    if (Congestion->EpochCompleted < Congestion->Depth) {
+        return;
+    }
+
+    Congestion->AverageLatency =
+        Congestion->EpochLatencySum / Congestion->EpochCompleted;
+    LONG Depth = Congestion->Depth;
+    if (Congestion->AverageLatency >
+            Congestion->BaseLatency * WNBD_CONGESTION_LATENCY_FACTOR +
+            WNBD_CONGESTION_LATENCY_SLACK) {
+        Depth = max(WNBD_CONGESTION_MIN_DEPTH, Depth - max(1, Depth / 4));
+        Congestion->State = WnbdQueueDepthBackoff;
+    }
+    else if (Congestion->EpochMaxInFlight >= Depth) {
+        // We're only growing the queue depth if it's actually the
+        // limiting factor.
+        if (Congestion->State == WnbdQueueDepthSlowStart) {
+            Depth *= 2;
+        } else {
+            Depth += 1;
+            Congestion->State = WnbdQueueDepthIncrease;
+        }
+        Depth = min(Congestion->MaxDepth, Depth);
+    }
+    else if (Congestion->State != WnbdQueueDepthSlowStart) {
+        Congestion->State = WnbdQueueDepthHold;
+    }
+
+    if (Depth != Congestion->Depth) {
+        WNBD_LOG_INFO("Queue depth: %d -> %d. Average latency: %llu us, "
+                      "base latency: %llu us.",
+                      Congestion->Depth, Depth,
+                      Congestion->AverageLatency / 10,
+                      Congestion->BaseLatency / 10);
+        Congestion->Depth = Depth;
+    }
+
+    if (++Congestion->EpochCount % WNBD_CONGESTION_BASE_RESET_EPOCHS == 0) {
+        Congestion->BaseLatency = Congestion->PeriodMinLatency;
+        Congestion->PeriodMinLatency = 0;
+    }
+    Congestion->EpochLatencySum = 0;
+    Congestion->EpochCompleted = 0;
+    Congestion->EpochMaxInFlight = Congestion->InFlight;
+
+    WnbdCongestionUpdateStats(Congestion);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdCongestionCreate(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                     BOOLEAN Adaptive,
+                     UINT32 MaxDepth,
+                     PWNBD_CONGESTION* PCongestion)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(DeviceInformation);
+    ASSERT(PCongestion);
+
+    PWNBD_CONGESTION Congestion = (PWNBD_CONGESTION) CongestionMalloc(
+        sizeof(WNBD_CONGESTION));
+    if (!Congestion) {
+        *PCongestion = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Congestion, sizeof(WNBD_CONGESTION));
+
+    if (!MaxDepth || MaxDepth > WNBD_MAX_IN_FLIGHT_REQUESTS) {
+        MaxDepth = WNBD_MAX_IN_FLIGHT_REQUESTS;
+    }
+
+    Congestion->DeviceInformation = DeviceInformation;
+    Congestion->Adaptive = Adaptive;
+    Congestion->MaxDepth = (LONG)MaxDepth;
+    if (Adaptive) {
+        Congestion->Depth = min(Congestion->MaxDepth,
+                                WNBD_CONGESTION_INITIAL_DEPTH);
+        Congestion->State = WnbdQueueDepthSlowStart;
+    } else {
+        Congestion->Depth = Congestion->MaxDepth;
+        Congestion->State = WnbdQueueDepthFixed;
+    }
+    KeInitializeSpinLock(&Congestion->Lock);
+    KeInitializeEvent(&Congestion->Event, SynchronizationEvent, FALSE);
+    WnbdCongestionUpdateStats(Congestion);
+
+    WNBD_LOG_INFO("Queue depth: %d, max: %d, adaptive: %d.",
+                  Congestion->Depth, Congestion->MaxDepth, Adaptive);
+    *PCongestion = Congestion;
+
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdCongestionDelete(PWNBD_CONGESTION Congestion)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Congestion) {
+        return;
+    }
+
+    ExFreePool(Congestion);
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+BOOLEAN
+WnbdCongestionAcquire(PWNBD_CONGESTION Congestion,
+                      PSRB_QUEUE_ELEMENT Element)
+{
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Congestion->DeviceInformation;
+    KIRQL Irql = { 0 };
+    LARGE_INTEGER Timeout;
+    // Used for checking the device state every once in a while.
+    Timeout.QuadPart = -100 * 10000;
+
+    while (TRUE) {
+        KeAcquireSpinLock(&Congestion->Lock, &Irql);
+        if (Congestion->InFlight < Congestion->Depth) {
+            Congestion->InFlight++;
+            Congestion->EpochMaxInFlight = max(
+                Congestion->EpochMaxInFlight, Congestion->InFlight);
+            KeReleaseSpinLock(&Congestion->Lock, Irql);
+            break;
+        }
+        KeReleaseSpinLock(&Congestion->Lock, Irql);
+
+        if (DeviceInformation->SoftTerminateDevice ||
+                DeviceInformation->HardTerminateDevice) {
+            return FALSE;
+        }
+        KeWaitForSingleObject(&Congestion->Event, Executive, KernelMode,
+                              FALSE, &Timeout);
+    }
+
+    ULONG64 Qpc;
+    Element->SubmitTime = KeQueryInterruptTimePrecise(&Qpc);
+    return TRUE;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdCongestionRelease(PWNBD_CONGESTION Congestion,
+                      PSRB_QUEUE_ELEMENT Element,
+                      BOOLEAN Sample)
+{
+    if (!Congestion || !Element->SubmitTime) {
+        return;
+    }
+
+    ULONG64 Qpc;
+    UINT64 Latency = KeQueryInterruptTimePrecise(&Qpc) - Element->SubmitTime;
+    Element->SubmitTime = 0;
+
+    KIRQL Irql = { 0 };
+    KeAcquireSpinLock(&Congestion->Lock, &Irql);
+    Congestion->InFlight--;
+    if (Sample && Congestion->Adaptive) {
+        WnbdCongestionSample(Congestion, Latency);
+    }
+    BOOLEAN Signal = Congestion->InFlight < Congestion->Depth;
+    KeReleaseSpinLock(&Congestion->Lock, Irql);
+
+    if (Signal) {
+        KeSetEvent(&Congestion->Event, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+WnbdCongestionCheckBacklog(PWNBD_CONGESTION Congestion,
+                           PVOID DeviceExtension,
+                           PSCSI_REQUEST_BLOCK Srb)
+{
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Congestion->DeviceInformation;
+    LONG Depth = Congestion->Depth;
+
+    if (DeviceInformation->Stats.UnsubmittedIORequests <=
+            (INT64)Depth * WNBD_CONGESTION_BUSY_FACTOR) {
+        return;
+    }
+
+    // Storport resumes sending requests to this LUN after "Depth"
+    // requests get completed.
+    if (StorPortDeviceBusy(DeviceExtension, Srb->PathId, Srb->TargetId,
+                           Srb->Lun, Depth)) {
+        InterlockedIncrement64(&DeviceInformation->Stats.QueueDeviceBusyEvents);
+    }
+}
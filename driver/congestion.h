@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef CONGESTION_H
+#define CONGESTION_H 1
+
+#include "common.h"
+#include "userspace.h"
+#include "util.h"
+
+#define WNBD_CONGESTION_MIN_DEPTH 1
+// Used when starting up, before having any latency samples.
+#define WNBD_CONGESTION_INITIAL_DEPTH 16
+// The queue is considered congested once the average latency exceeds
+// the base latency by this factor, plus the slack (100ns units) that
+// prevents oscillating because of jitter when dealing with low latencies.
+#define WNBD_CONGESTION_LATENCY_FACTOR 2
+#define WNBD_CONGESTION_LATENCY_SLACK (1 * 10000)
+// The base latency is refreshed periodically (in epochs), otherwise
+// we'd keep using a stale minimum after server side changes.
+#define WNBD_CONGESTION_BASE_RESET_EPOCHS 64
+// Storport is asked to hold off new requests once the unsubmitted
+// backlog exceeds this many queue depths.
+#define WNBD_CONGESTION_BUSY_FACTOR 4
+
+// Limits the number of requests submitted to the NBD server. When
+// adaptive, the queue depth is adjusted once per epoch (one queue
+// depth worth of completions) using an AIMD controller driven by the
+// observed completion latency:
+// * the depth is doubled (slow start) or incremented as long as the
+//   latency stays close to the base latency and the whole depth was
+//   actually used
+// * the depth is reduced by a quarter when the latency increases
+//
+// Excess requests are held in the request list.
+typedef struct _WNBD_CONGESTION
+{
+    PSCSI_DEVICE_INFORMATION    DeviceInformation;
+    BOOLEAN                     Adaptive;
+    LONG                        MaxDepth;
+
+    // Protects the fields below.
+    KSPIN_LOCK                  Lock;
+    LONG                        Depth;
+    LONG                        InFlight;
+    WnbdQueueDepthState         State;
+    // Latencies are measured in 100ns units.
+    UINT64                      BaseLatency;
+    UINT64                      PeriodMinLatency;
+    UINT64                      AverageLatency;
+    UINT64                      EpochLatencySum;
+    LONG                        EpochCompleted;
+    LONG                        EpochMaxInFlight;
+    ULONG                       EpochCount;
+
+    // Signaled when completing requests, waking up the submitter.
+    KEVENT                      Event;
+} WNBD_CONGESTION, *PWNBD_CONGESTION;
+
+NTSTATUS
+WnbdCongestionCreate(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                     _In_ BOOLEAN Adaptive,
+                     _In_ UINT32 MaxDepth,
+                     _Out_ PWNBD_CONGESTION* PCongestion);
+
+VOID
+WnbdCongestionDelete(_In_ PWNBD_CONGESTION Congestion);
+
+// Waits until the request may be submitted. Returns FALSE if the
+// device is being removed in the meantime.
+_IRQL_requires_(PASSIVE_LEVEL)
+BOOLEAN
+WnbdCongestionAcquire(_In_ PWNBD_CONGESTION Congestion,
+                      _In_ PSRB_QUEUE_ELEMENT Element);
+
+// Called when the request is completed or drained, has no effect for
+// requests that weren't submitted through WnbdCongestionAcquire.
+// The latency is only used by the controller if "Sample" is set.
+VOID
+WnbdCongestionRelease(_In_opt_ PWNBD_CONGESTION Congestion,
+                      _In_ PSRB_QUEUE_ELEMENT Element,
+                      _In_ BOOLEAN Sample);
+
+// Calls StorPortDeviceBusy if the unsubmitted request backlog gets
+// too large.
+VOID
+WnbdCongestionCheckBacklog(_In_ PWNBD_CONGESTION Congestion,
+                           _In_ PVOID DeviceExtension,
+                           _In_ PSCSI_REQUEST_BLOCK Srb);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "connection_table.h"
+#include "debug.h"
+#include "userspace.h"
+
+#define ConnectionTableMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'cDBN')
+
+// FNV-1a, the instance names being null terminated.
+static ULONG
+WnbdHashInstanceName(_In_ PCHAR InstanceName)
+{
+    ULONG Hash = 2166136261;
+    for (ULONG Index = 0;
+            Index < WNBD_MAX_NAME_LENGTH && InstanceName[Index];
+            Index++) {
+        Hash ^= (UCHAR)InstanceName[Index];
+        Hash *= 16777619;
+    }
+    return Hash & (WNBD_CONNECTION_NAME_BUCKETS - 1);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdConnectionTableCreate(PWNBD_CONNECTION_TABLE* PTable)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(PTable);
+
+    PWNBD_CONNECTION_TABLE Table = (PWNBD_CONNECTION_TABLE)
+        ConnectionTableMalloc(sizeof(WNBD_CONNECTION_TABLE));
+    if (!Table) {
+        *PTable = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Table, sizeof(WNBD_CONNECTION_TABLE));
+
+    for (ULONG Index = 0; Index < WNBD_MAX_CONNECTIONS; Index++) {
+        ExInitializeRundownProtection(&Table->Slots[Index].Rundown);
+    }
+    for (ULONG Index = 0; Index < WNBD_CONNECTION_NAME_BUCKETS; Index++) {
+        InitializeListHead(&Table->NameBuckets[Index]);
+    }
+    *PTable = Table;
+
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdConnectionTableDelete(PWNBD_CONNECTION_TABLE Table)
+{
+    if (Table) {
+        ExFreePool(Table);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+WnbdConnectionTableInsert(PWNBD_CONNECTION_TABLE Table,
+                          ULONG Index,
+                          PUSER_ENTRY Entry)
+{
+    ASSERT(Index < WNBD_MAX_CONNECTIONS);
+    PWNBD_CONNECTION_SLOT Slot = &Table->Slots[Index];
+    ASSERT(!Slot->Entry);
+
+    // Generation 0 is skipped, so that connection ids are never 0.
+    if (!++Table->Generation) {
+        Table->Generation++;
+    }
+    Entry->ConnectionId = ((UINT64)Table->Generation << 32) | Index;
+    InterlockedExchangePointer((PVOID*)&Slot->Entry, Entry);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdConnectionTableRemove(PWNBD_CONNECTION_TABLE Table,
+                          PUSER_ENTRY Entry)
+{
+    ULONG Index = WNBD_CONNECTION_ID_INDEX(Entry->ConnectionId);
+    if (Index >= WNBD_MAX_CONNECTIONS ||
+            Table->Slots[Index].Entry != Entry) {
+        return;
+    }
+
+    PWNBD_CONNECTION_SLOT Slot = &Table->Slots[Index];
+    InterlockedExchangePointer((PVOID*)&Slot->Entry, NULL);
+    ExWaitForRundownProtectionRelease(&Slot->Rundown);
+    ExReInitializeRundownProtection(&Slot->Rundown);
+}
+
+_Use_decl_annotations_
+PUSER_ENTRY
+WnbdConnectionTableAcquire(PWNBD_CONNECTION_TABLE Table,
+                           UINT64 ConnectionId)
+{
+    ULONG Index = WNBD_CONNECTION_ID_INDEX(ConnectionId);
+    if (Index >= WNBD_MAX_CONNECTIONS) {
+        return NULL;
+    }
+
+    PWNBD_CONNECTION_SLOT Slot = &Table->Slots[Index];
+    if (!ExAcquireRundownProtection(&Slot->Rundown)) {
+        // The slot is being cleared.
+        return NULL;
+    }
+
+    // The entry can't be released while we're holding the slot
+    // rundown protection.
+    PUSER_ENTRY Entry = (PUSER_ENTRY) ReadPointerAcquire(
+        (PVOID volatile*)&Slot->Entry);
+    if (Entry && (Entry->ConnectionId != ConnectionId ||
+            !ExAcquireRundownProtection(
+                &Entry->ScsiInformation->RundownProtection))) {
+        Entry = NULL;
+    }
+
+    ExReleaseRundownProtection(&Slot->Rundown);
+    return Entry;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdConnectionTableInsertName(PWNBD_CONNECTION_TABLE Table,
+                              PUSER_ENTRY Entry)
+{
+    ULONG Bucket = WnbdHashInstanceName(Entry->Properties.InstanceName);
+    InsertTailList(&Table->NameBuckets[Bucket], &Entry->NameLink);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdConnectionTableRemoveName(PWNBD_CONNECTION_TABLE Table,
+                              PUSER_ENTRY Entry)
+{
+    UNREFERENCED_PARAMETER(Table);
+    RemoveEntryList(&Entry->NameLink);
+}
+
+_Use_decl_annotations_
+PUSER_ENTRY
+WnbdConnectionTableFindName(PWNBD_CONNECTION_TABLE Table,
+                            PCHAR InstanceName)
+{
+    PLIST_ENTRY Head = &Table->NameBuckets[WnbdHashInstanceName(InstanceName)];
+    for (PLIST_ENTRY Link = Head->Flink; Link != Head; Link = Link->Flink) {
+        PUSER_ENTRY Entry = CONTAINING_RECORD(Link, USER_ENTRY, NameLink);
+        if (!strncmp(Entry->Properties.InstanceName, InstanceName,
+                     WNBD_MAX_NAME_LENGTH)) {
+            return Entry;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef CONNECTION_TABLE_H
+#define CONNECTION_TABLE_H 1
+
+#include "common.h"
+#include "userspace.h"
+
+// Indexed by SCSI address, see WNBD_DEVICE_INDEX.
+#define WNBD_MAX_CONNECTIONS WNBD_MAX_DEVICES
+
+// The low 32 bits of the connection id hold the slot index, the high
+// ones holding the generation. Stale ids never match a new connection
+// that reuses the slot.
+#define WNBD_CONNECTION_ID_INDEX(ConnectionId) ((ULONG)(ConnectionId))
+
+// Must be a power of 2.
+#define WNBD_CONNECTION_NAME_BUCKETS 1024
+
+typedef struct _WNBD_CONNECTION_SLOT
+{
+    // Held by lookups while acquiring the device rundown protection,
+    // allowing the slot to be cleared safely.
+    EX_RUNDOWN_REF              Rundown;
+    PUSER_ENTRY volatile        Entry;
+} WNBD_CONNECTION_SLOT, *PWNBD_CONNECTION_SLOT;
+
+// Connections indexed by connection id, used on the IO path instead of
+// walking the connection list under the connection mutex. Lookups are
+// lock-free, slots being updated while holding the connection mutex.
+//
+// The table also holds a hash index of the instance names, used by
+// the control path (e.g. create, remove, stats).
+typedef struct _WNBD_CONNECTION_TABLE
+{
+    // Protected by the connection mutex.
+    ULONG                       Generation;
+    WNBD_CONNECTION_SLOT        Slots[WNBD_MAX_CONNECTIONS];
+    // Protected by the connection mutex.
+    LIST_ENTRY                  NameBuckets[WNBD_CONNECTION_NAME_BUCKETS];
+} WNBD_CONNECTION_TABLE, *PWNBD_CONNECTION_TABLE;
+
+NTSTATUS
+WnbdConnectionTableCreate(_Out_ PWNBD_CONNECTION_TABLE* PTable);
+
+VOID
+WnbdConnectionTableDelete(_In_ PWNBD_CONNECTION_TABLE Table);
+
+// Publishes the connection, setting its id. The entry must be fully
+// initialized. The connection mutex must be held.
+VOID
+WnbdConnectionTableInsert(_In_ PWNBD_CONNECTION_TABLE Table,
+                          _In_ ULONG Index,
+                          _In_ PUSER_ENTRY Entry);
+
+// Removes the connection, waiting for pending lookups. Lookups that
+// already acquired the device rundown protection aren't affected.
+// The connection mutex must be held.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdConnectionTableRemove(_In_ PWNBD_CONNECTION_TABLE Table,
+                          _In_ PUSER_ENTRY Entry);
+
+// Returns the connection with the device rundown protection acquired,
+// or NULL if the id is invalid or the device is being removed.
+PUSER_ENTRY
+WnbdConnectionTableAcquire(_In_ PWNBD_CONNECTION_TABLE Table,
+                           _In_ UINT64 ConnectionId);
+
+// Adds the entry to the instance name index. The connection mutex must
+// be held exclusively.
+VOID
+WnbdConnectionTableInsertName(_In_ PWNBD_CONNECTION_TABLE Table,
+                              _In_ PUSER_ENTRY Entry);
+
+// The connection mutex must be held exclusively.
+VOID
+WnbdConnectionTableRemoveName(_In_ PWNBD_CONNECTION_TABLE Table,
+                              _In_ PUSER_ENTRY Entry);
+
+// Returns the entry having the specified instance name or NULL.
+// The connection mutex must be held.
+PUSER_ENTRY
+WnbdConnectionTableFindName(_In_ PWNBD_CONNECTION_TABLE Table,
+                            _In_ PCHAR InstanceName);
+
+#endif
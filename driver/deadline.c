@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "deadline.h"
+#include "debug.h"
+#include "io_trace.h"
+#include "srb_helper.h"
+#include "userspace.h"
+#include "util.h"
+
+#define DeadlineMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'dDBN')
+
+_Use_decl_annotations_
+VOID
+WnbdDeadlineArm(PWNBD_DEADLINE_WHEEL Wheel,
+                PSRB_QUEUE_ELEMENT Element)
+{
+    if (!Wheel || Wheel->Stopped) {
+        return;
+    }
+
+    // The extra tick ensures that we're never failing requests early.
+    Element->DeadlineTick = Wheel->CurrentTick + Wheel->TimeoutTicks + 1;
+    InsertTailList(
+        &Wheel->Slots[Element->DeadlineTick & (WNBD_DEADLINE_WHEEL_SLOTS - 1)],
+        &Element->TimerLink);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdDeadlineDisarm(PSRB_QUEUE_ELEMENT Element)
+{
+    if (Element->TimerLink.Flink) {
+        RemoveEntryList(&Element->TimerLink);
+        Element->TimerLink.Flink = NULL;
+        Element->TimerLink.Blink = NULL;
+    }
+}
+
+// Completes the SRB with a CHECK CONDITION status. The reply list
+// lock is held by the caller.
+VOID
+WnbdDeadlineFailElement(_In_ PSRB_QUEUE_ELEMENT Element)
+{
+    WNBD_STATUS Status = { 0 };
+    Status.ScsiStatus = SCSISTAT_CHECK_CONDITION;
+    Status.SenseKey = SCSI_SENSE_ABORTED_COMMAND;
+    Status.ASC = WNBD_ADSENSE_COMMAND_TIMEOUT;
+    Status.ASCQ = WNBD_ADSENSE_QUAL_TIMEOUT_DURING_PROCESSING;
+
+    Element->Srb->DataTransferLength = 0;
+    Element->Srb->SrbStatus = SetSrbStatus(Element->Srb, &Status);
+
+    WNBD_LOG_WARN("Request %p 0x%llx timed out after %lu retries.",
+                  Element->Srb, Element->Tag, Element->RetryCount);
+    WNBD_IO_LOG_INFO(WnbdEvtSrbCompleted, Element->Srb, Element->Tag,
+                     Element->Srb->SrbStatus);
+    StorPortNotification(RequestComplete, Element->DeviceExtension,
+                         Element->Srb);
+}
+
+KDEFERRED_ROUTINE WnbdDeadlineWheelDpc;
+
+_Use_decl_annotations_
+VOID
+WnbdDeadlineWheelDpc(PKDPC Dpc,
+                     PVOID DeferredContext,
+                     PVOID SystemArgument1,
+                     PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    PWNBD_DEADLINE_WHEEL Wheel = (PWNBD_DEADLINE_WHEEL)DeferredContext;
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Wheel->DeviceInformation;
+    PLIST_ENTRY ItemLink, ItemNext;
+    LIST_ENTRY Retries;
+    LONG TimedOut = 0;
+
+    InitializeListHead(&Retries);
+
+    KeAcquireSpinLockAtDpcLevel(&DeviceInformation->ReplyListLock);
+    if (Wheel->Stopped) {
+        KeReleaseSpinLockFromDpcLevel(&DeviceInformation->ReplyListLock);
+        return;
+    }
+
+    UINT64 Tick = ++Wheel->CurrentTick;
+    PLIST_ENTRY Slot = &Wheel->Slots[Tick & (WNBD_DEADLINE_WHEEL_SLOTS - 1)];
+    LIST_FORALL_SAFE(Slot, ItemLink, ItemNext) {
+        PSRB_QUEUE_ELEMENT Element = CONTAINING_RECORD(
+            ItemLink, SRB_QUEUE_ELEMENT, TimerLink);
+        if (Element->DeadlineTick > Tick) {
+            continue;
+        }
+
+        WnbdDeadlineDisarm(Element);
+        if (Element->Aborted || Element->Completed) {
+            continue;
+        }
+
+        TimedOut++;
+        // Storport was either notified or the SRB was handed over to a
+        // new element, the late reply being discarded.
+        Element->Aborted = TRUE;
+
+        // Reads are idempotent, so they can safely be resubmitted while
+        // the original request is still pending.
+        PSRB_QUEUE_ELEMENT Retry = NULL;
+        if (Element->RetryCount < Wheel->MaxRetries && Element->Read) {
+            Retry = (PSRB_QUEUE_ELEMENT) DeadlineMalloc(sizeof(SRB_QUEUE_ELEMENT));
+        }
+        if (!Retry) {
+            WnbdDeadlineFailElement(Element);
+            continue;
+        }
+
+        RtlZeroMemory(Retry, sizeof(SRB_QUEUE_ELEMENT));
+        Retry->DeviceExtension = Element->DeviceExtension;
+        Retry->Srb = Element->Srb;
+        Retry->StartingLbn = Element->StartingLbn;
+        Retry->ReadLength = Element->ReadLength;
+        Retry->FUA = Element->FUA;
+        Retry->Read = Element->Read;
+        Retry->Priority = Element->Priority;
+        // The latency histograms cover the whole request, including the
+        // timed out attempts. The queue wait was already recorded when
+        // the original request was sent.
+        Retry->ReceiveTime = Element->ReceiveTime;
+        Retry->SendTime = Element->SendTime;
+        Retry->IoOp = Element->IoOp;
+        Retry->TraceId = Element->TraceId;
+        Retry->RetryCount = Element->RetryCount + 1;
+        InsertTailList(&Retries, &Retry->Link);
+
+        WNBD_LOG_INFO("Request %p 0x%llx timed out, retry: %lu.",
+                      Element->Srb, Element->Tag, Retry->RetryCount);
+    }
+    KeReleaseSpinLockFromDpcLevel(&DeviceInformation->ReplyListLock);
+
+    if (TimedOut) {
+        InterlockedAdd64(&DeviceInformation->Stats.TimedOutIORequests, TimedOut);
+    }
+
+    while (!IsListEmpty(&Retries)) {
+        PSRB_QUEUE_ELEMENT Retry = CONTAINING_RECORD(
+            RemoveHeadList(&Retries), SRB_QUEUE_ELEMENT, Link);
+
+        // The timed out element keeps its own reference until the late
+        // reply arrives.
+        InterlockedIncrement(&DeviceInformation->Device->OutstandingIoCount);
+        InterlockedIncrement64(&DeviceInformation->Stats.UnsubmittedIORequests);
+        InterlockedIncrement64(&DeviceInformation->Stats.RetriedIORequests);
+        ULONG64 Qpc;
+        Retry->QueueTime = KeQueryInterruptTimePrecise(&Qpc);
+        WnbdTraceRequest(DeviceInformation, Retry, WnbdTraceQueued);
+        // Picked up by the request thread or the userspace fetch routine.
+        // The new tag ensures that the late reply won't be mistaken for
+        // the retry reply.
+        ExInterlockedInsertHeadList(Retry->Priority ?
+                                        &DeviceInformation->PriorityRequestListHead :
+                                        &DeviceInformation->RequestListHead,
+                                    &Retry->Link,
+                                    &DeviceInformation->RequestListLock);
+        KeReleaseSemaphore(&DeviceInformation->DeviceEvent, 0, 1, FALSE);
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdDeadlineWheelCreate(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                        UINT32 TimeoutMs,
+                        UINT32 MaxRetries,
+                        PWNBD_DEADLINE_WHEEL* PWheel)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(DeviceInformation);
+    ASSERT(PWheel);
+
+    PWNBD_DEADLINE_WHEEL Wheel = (PWNBD_DEADLINE_WHEEL) DeadlineMalloc(
+        sizeof(WNBD_DEADLINE_WHEEL));
+    if (!Wheel) {
+        *PWheel = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Wheel, sizeof(WNBD_DEADLINE_WHEEL));
+
+    Wheel->DeviceInformation = DeviceInformation;
+    Wheel->TimeoutTicks = max(1,
+        (TimeoutMs + WNBD_DEADLINE_TICK_MS - 1) / WNBD_DEADLINE_TICK_MS);
+    Wheel->MaxRetries = MaxRetries;
+    // Not armed until the wheel gets started.
+    Wheel->Stopped = TRUE;
+    for (ULONG Index = 0; Index < WNBD_DEADLINE_WHEEL_SLOTS; Index++) {
+        InitializeListHead(&Wheel->Slots[Index]);
+    }
+    KeInitializeTimer(&Wheel->Timer);
+    KeInitializeDpc(&Wheel->Dpc, WnbdDeadlineWheelDpc, Wheel);
+
+    WNBD_LOG_INFO("Request timeout: %lu ms, max retries: %lu.",
+                  TimeoutMs, MaxRetries);
+    *PWheel = Wheel;
+
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdDeadlineWheelStart(PWNBD_DEADLINE_WHEEL Wheel)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Wheel);
+
+    LARGE_INTEGER DueTime;
+    DueTime.QuadPart = -1LL * WNBD_DEADLINE_TICK_MS * 10000;
+
+    Wheel->Stopped = FALSE;
+    KeSetTimerEx(&Wheel->Timer, DueTime, WNBD_DEADLINE_TICK_MS, &Wheel->Dpc);
+
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+VOID
+WnbdDeadlineWheelStop(PWNBD_DEADLINE_WHEEL Wheel)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Wheel);
+
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Wheel->DeviceInformation;
+    KIRQL Irql = { 0 };
+
+    KeCancelTimer(&Wheel->Timer);
+    KeFlushQueuedDpcs();
+
+    KeAcquireSpinLock(&DeviceInformation->ReplyListLock, &Irql);
+    Wheel->Stopped = TRUE;
+    for (ULONG Index = 0; Index < WNBD_DEADLINE_WHEEL_SLOTS; Index++) {
+        while (!IsListEmpty(&Wheel->Slots[Index])) {
+            PSRB_QUEUE_ELEMENT Element = CONTAINING_RECORD(
+                Wheel->Slots[Index].Flink, SRB_QUEUE_ELEMENT, TimerLink);
+            WnbdDeadlineDisarm(Element);
+        }
+    }
+    KeReleaseSpinLock(&DeviceInformation->ReplyListLock, Irql);
+
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+VOID
+WnbdDeadlineWheelDelete(PWNBD_DEADLINE_WHEEL Wheel)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Wheel) {
+        return;
+    }
+
+    WnbdDeadlineWheelStop(Wheel);
+    ExFreePool(Wheel);
+
+    WNBD_LOG_LOUD(": Exit");
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef DEADLINE_H
+#define DEADLINE_H 1
+
+#include "common.h"
+#include "userspace.h"
+#include "util.h"
+
+#define WNBD_DEADLINE_TICK_MS 100
+// Must be a power of two. Deadlines that exceed the wheel span stay in
+// their slot for multiple rounds.
+#define WNBD_DEADLINE_WHEEL_SLOTS 256
+
+// "COMMAND TIMEOUT DURING PROCESSING", reported along with the
+// ABORTED COMMAND sense key.
+#define WNBD_ADSENSE_COMMAND_TIMEOUT 0x2E
+#define WNBD_ADSENSE_QUAL_TIMEOUT_DURING_PROCESSING 0x02
+
+// Tracks the deadlines of the submitted requests using a hashed timer
+// wheel. The wheel is protected by the device reply list lock, armed
+// elements always being part of the reply list.
+//
+// Expired reads are resubmitted through the request list, up to
+// "MaxRetries" times. Other requests, as well as reads that ran out of
+// retries, are failed. In both cases, the original element is marked as
+// aborted and stays on the reply list until its late reply is received.
+typedef struct _WNBD_DEADLINE_WHEEL
+{
+    PSCSI_DEVICE_INFORMATION    DeviceInformation;
+    LIST_ENTRY                  Slots[WNBD_DEADLINE_WHEEL_SLOTS];
+    UINT64                      CurrentTick;
+    ULONG                       TimeoutTicks;
+    ULONG                       MaxRetries;
+    BOOLEAN                     Stopped;
+
+    KTIMER                      Timer;
+    KDPC                        Dpc;
+} WNBD_DEADLINE_WHEEL, *PWNBD_DEADLINE_WHEEL;
+
+NTSTATUS
+WnbdDeadlineWheelCreate(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                        _In_ UINT32 TimeoutMs,
+                        _In_ UINT32 MaxRetries,
+                        _Out_ PWNBD_DEADLINE_WHEEL* PWheel);
+
+VOID
+WnbdDeadlineWheelStart(_In_ PWNBD_DEADLINE_WHEEL Wheel);
+
+// Stops the timer and disarms all the elements. Must be called before
+// releasing the elements that are still part of the reply list.
+VOID
+WnbdDeadlineWheelStop(_In_ PWNBD_DEADLINE_WHEEL Wheel);
+
+VOID
+WnbdDeadlineWheelDelete(_In_ PWNBD_DEADLINE_WHEEL Wheel);
+
+// The caller must hold the reply list lock.
+VOID
+WnbdDeadlineArm(_In_opt_ PWNBD_DEADLINE_WHEEL Wheel,
+                _In_ PSRB_QUEUE_ELEMENT Element);
+
+// The caller must hold the reply list lock. Has no effect if the
+// element isn't armed.
+VOID
+WnbdDeadlineDisarm(_In_ PSRB_QUEUE_ELEMENT Element);
+
+#endif
@@ -14,8 +14,13 @@
 #define WNBD_DBG_DEFAULT     WNBD_DBG_INFO
 
 UINT32  WnbdLogLevel = WNBD_DBG_DEFAULT;
+volatile LONG WnbdLogMaxLevel = WNBD_DBG_DEFAULT;
 extern UINT32 GlobalLogLevel;
 
+const WNBD_LOG_EVENT_INFO WnbdLogEvents[] = {
+    WNBD_LOG_EVENTS(WNBD_LOG_EVENT_INFO_ENTRY)
+};
+
 _Use_decl_annotations_
 VOID
 WnbdSetLogLevel(UINT32 Level)
@@ -25,6 +30,15 @@ WnbdSetLogLevel(UINT32 Level)
     // to avoid info messages. If we set it to "1", all log messages become error messages.
     // If we set it to "3", all messages become INFO messages.
     GlobalLogLevel = Level;
+
+    // Precomputed so that the log macros may skip messages early.
+    if (!Level) {
+        InterlockedExchange(&WnbdLogMaxLevel, WnbdLogLevel);
+    } else if (Level - 1 <= WnbdLogLevel) {
+        InterlockedExchange(&WnbdLogMaxLevel, MAXLONG);
+    } else {
+        InterlockedExchange(&WnbdLogMaxLevel, -1);
+    }
 }
 
 _Use_decl_annotations_
@@ -10,12 +10,25 @@
 #include <ntdef.h>
 #include <wdm.h>
 
+#include "wnbd_log_events.h"
+
 #define WNBD_DBG_ERROR    DPFLTR_ERROR_LEVEL
 #define WNBD_DBG_WARN     DPFLTR_WARNING_LEVEL
 #define WNBD_DBG_TRACE    DPFLTR_TRACE_LEVEL
 #define WNBD_DBG_INFO     DPFLTR_INFO_LEVEL
 #define WNBD_DBG_LOUD     (DPFLTR_INFO_LEVEL + 1)
 
+// Messages above this level are skipped without calling WnbdLog,
+// -1 disabling logging. Derived from the log level by WnbdSetLogLevel.
+extern volatile LONG WnbdLogMaxLevel;
+// Same as above, used for the binary event log (see event_log.h).
+extern volatile LONG WnbdEventLogMaxLevel;
+
+// Per IO event formats, indexed by WnbdLogEventId.
+extern const WNBD_LOG_EVENT_INFO WnbdLogEvents[];
+
+#define WNBD_LOG_ENABLED(_level) ((LONG)(_level) <= WnbdLogMaxLevel)
+
 VOID
 WnbdSetLogLevel(_In_ UINT32 Level);
 
@@ -25,19 +38,64 @@ WnbdLog(_In_ UINT32 Level,
         _In_ UINT32 Line,
         _In_ PCHAR Format, ...);
 
+// Records a per IO event, expecting WnbdLogEvents[EventId].ArgCount
+// arguments. Each argument is retrieved as a 64 bit value.
+VOID
+WnbdEventLogWrite(_In_ UINT32 Level,
+                  _In_ UINT32 EventId, ...);
+
+#define WNBD_LOG(_level, _format, ...) \
+   do { \
+       if (WNBD_LOG_ENABLED(_level)) { \
+           WnbdLog(_level, __FUNCTION__, __LINE__, _format, __VA_ARGS__); \
+       } \
+   } while (0)
+
 #define WNBD_LOG_LOUD(_format, ...) \
-   WnbdLog(WNBD_DBG_LOUD, __FUNCTION__, __LINE__, _format,  __VA_ARGS__)
+   WNBD_LOG(WNBD_DBG_LOUD, _format, __VA_ARGS__)
 
 #define WNBD_LOG_INFO(_format, ...) \
-   WnbdLog(WNBD_DBG_INFO, __FUNCTION__, __LINE__, _format, __VA_ARGS__)
+   WNBD_LOG(WNBD_DBG_INFO, _format, __VA_ARGS__)
 
 #define WNBD_LOG_TRACE(_format, ...) \
-   WnbdLog(WNBD_DBG_TRACE, __FUNCTION__, __LINE__, _format, __VA_ARGS__)
+   WNBD_LOG(WNBD_DBG_TRACE, _format, __VA_ARGS__)
 
 #define WNBD_LOG_ERROR(_format, ...) \
-   WnbdLog(WNBD_DBG_ERROR, __FUNCTION__, __LINE__, _format, __VA_ARGS__)
+   WNBD_LOG(WNBD_DBG_ERROR, _format, __VA_ARGS__)
 
 #define WNBD_LOG_WARN(_format, ...) \
-   WnbdLog(WNBD_DBG_WARN, __FUNCTION__, __LINE__, _format, __VA_ARGS__)
+   WNBD_LOG(WNBD_DBG_WARN, _format, __VA_ARGS__)
+
+// Per IO messages, identified by a WnbdLogEventId. The text messages
+// are only compiled in for debug builds, release builds relying on
+// the binary event log, which is disabled by default.
+#ifndef WNBD_IO_TEXT_LOGGING
+#if DBG
+#define WNBD_IO_TEXT_LOGGING 1
+#else
+#define WNBD_IO_TEXT_LOGGING 0
+#endif
+#endif
+
+#if WNBD_IO_TEXT_LOGGING
+#define WNBD_IO_LOG_TEXT(_level, _event, ...) \
+   WNBD_LOG(_level, (PCHAR)WnbdLogEvents[_event].Format, __VA_ARGS__)
+#else
+#define WNBD_IO_LOG_TEXT(_level, _event, ...)
+#endif
+
+#define WNBD_IO_LOG(_level, _event, ...) \
+   do { \
+       WNBD_IO_LOG_TEXT(_level, _event, __VA_ARGS__); \
+       if ((LONG)(_level) <= WnbdEventLogMaxLevel) { \
+           WnbdEventLogWrite(_level, _event, __VA_ARGS__); \
+       } \
+   } while (0)
+
+#define WNBD_IO_LOG_LOUD(_event, ...) \
+   WNBD_IO_LOG(WNBD_DBG_LOUD, _event, __VA_ARGS__)
+
+#define WNBD_IO_LOG_INFO(_event, ...) \
+   WNBD_IO_LOG(WNBD_DBG_INFO, _event, __VA_ARGS__)
 
 #endif
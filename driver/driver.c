@@ -8,7 +8,9 @@
 #include "debug.h"
 #include "driver.h"
 #include "driver_extension.h"
+#include "event_log.h"
 #include "scsi_driver_extensions.h"
+#include "userspace.h"
 
 DRIVER_INITIALIZE DriverEntry;
 DRIVER_UNLOAD WnbdDriverUnload;
@@ -21,6 +23,22 @@ extern UNICODE_STRING GlobalRegistryPath = { 0, 0, GlobalRegistryPathBuffer};
 extern UINT32 GlobalLogLevel = 0;
 
 extern PGLOBAL_INFORMATION GlobalInformation;
+BOOLEAN ProcessNotifyRegistered = FALSE;
+
+// Registered user buffers remain locked until released, so we're
+// releasing them as soon as the owner process exits. The same applies
+// to the zero-copy mappings.
+VOID
+WnbdProcessNotify(_In_ HANDLE ParentId,
+                  _In_ HANDLE ProcessId,
+                  _In_ BOOLEAN Create)
+{
+    UNREFERENCED_PARAMETER(ParentId);
+
+    if (!Create && GlobalInformation) {
+        WnbdReleaseProcessBuffers(GlobalInformation, ProcessId);
+    }
+}
 
 _Use_decl_annotations_
 BOOLEAN
@@ -75,7 +93,7 @@ DriverEntry(PDRIVER_OBJECT DriverObject,
     NTSTATUS Status;
     VIRTUAL_HW_INITIALIZATION_DATA WnbdInitData = { 0 };
     WnbdInitData.HwInitializationDataSize = sizeof(VIRTUAL_HW_INITIALIZATION_DATA);
-    GlobalLogLevel = 0;
+    WnbdSetLogLevel(0);
 
     /*
      * Set our SCSI Driver Extensions
@@ -127,6 +145,7 @@ DriverEntry(PDRIVER_OBJECT DriverObject,
                 (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT), &Value)) {
             WnbdSetLogLevel(Value);
         }
+        WnbdEventLogReloadConfig();
     }
 
     /*
@@ -140,9 +159,19 @@ DriverEntry(PDRIVER_OBJECT DriverObject,
     if (!NT_SUCCESS(Status)) {
         WNBD_LOG_ERROR("DriverEntry failure in call to StorPortInitialize. Status: 0x%x", Status);
         ASSERT(FALSE);
+        WnbdEventLogCleanup();
         return Status;
     }
 
+    // Not fatal, registered buffers are also released when removing
+    // the disk. Zero-copy mode is unavailable without it though.
+    NTSTATUS NotifyStatus = PsSetCreateProcessNotifyRoutine(WnbdProcessNotify, FALSE);
+    ProcessNotifyRegistered = NT_SUCCESS(NotifyStatus);
+    if (!ProcessNotifyRegistered) {
+        WNBD_LOG_WARN("Could not register process notify routine. Status: 0x%x",
+                      NotifyStatus);
+    }
+
     /*
      * Set up PNP and Unload routines
      */
@@ -203,10 +232,14 @@ WnbdDriverUnload(PDRIVER_OBJECT DriverObject)
 {
     WNBD_LOG_LOUD(": Enter");
 
+    if (ProcessNotifyRegistered) {
+        PsSetCreateProcessNotifyRoutine(WnbdProcessNotify, TRUE);
+    }
     WnbdDeleteGlobalInformation(GlobalInformation);
     if (0 != StorPortDriverUnload) {
         StorPortDriverUnload(DriverObject);
     }
+    WnbdEventLogCleanup();
 
     WNBD_LOG_LOUD(": Exit");
 }
@@ -8,8 +8,10 @@
 #define DRIVER_H 1
 
 #define MAX_NUMBER_OF_SCSI_TARGETS       128
-#define MAX_NUMBER_OF_SCSI_LOGICAL_UNITS 1
+// Targets may hold multiple disks, see the "LunsPerTarget" registry key.
+#define MAX_NUMBER_OF_SCSI_LOGICAL_UNITS 32
 #define MAX_NUMBER_OF_SCSI_BUSES         1
+#define WNBD_DEFAULT_LUNS_PER_TARGET     1
 
 // TODO: replace those placeholders
 #define WNBD_INQUIRY_VENDOR_ID           "WNBD Disk"
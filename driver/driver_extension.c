@@ -5,9 +5,12 @@
  */
 
 #include <ksocket.h>
+#include "buffer_pool.h"
 #include "common.h"
+#include "connection_table.h"
 #include "debug.h"
 #include "driver_extension.h"
+#include "io_trace.h"
 #include "userspace.h"
 
 extern PGLOBAL_INFORMATION GlobalInformation = NULL;
@@ -34,11 +37,29 @@ WnbdInitializeGlobalInformation(PVOID Handle,
     Info->Handle = Handle;
 
     InitializeListHead(&Info->ConnectionList);
+    KeInitializeEvent(&Info->RemovalsIdleEvent, NotificationEvent, TRUE);
+    KeInitializeSpinLock(&Info->ChangeLock);
+    KeInitializeEvent(&Info->ChangeEvent, NotificationEvent, FALSE);
     if (!NT_SUCCESS(ExInitializeResourceLite(&Info->ConnectionMutex))) {
         WNBD_LOG_ERROR(": Error allocating Info->ConnectionMutex");
         ExFreePool(Info);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
+    if (!NT_SUCCESS(WnbdConnectionTableCreate(&Info->ConnectionTable))) {
+        WNBD_LOG_ERROR(": Error allocating Info->ConnectionTable");
+        ExDeleteResourceLite(&Info->ConnectionMutex);
+        WnbdConnectionTableDelete(Info->ConnectionTable);
+        ExFreePool(Info);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    if (!NT_SUCCESS(WnbdBufferPoolCreate(WnbdBufferPoolReadMaxBytes(),
+                                         &Info->BufferPool))) {
+        WNBD_LOG_ERROR(": Error allocating Info->BufferPool");
+        ExDeleteResourceLite(&Info->ConnectionMutex);
+        WnbdConnectionTableDelete(Info->ConnectionTable);
+        ExFreePool(Info);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
     *PPGlobalInformation = Info;
 
@@ -63,6 +84,9 @@ WnbdDeleteGlobalInformation(PVOID PGlobalInformation)
 
     if (Info) {
         ExDeleteResourceLite(&Info->ConnectionMutex);
+        WnbdConnectionTableDelete(Info->ConnectionTable);
+        WnbdBufferPoolDelete(Info->BufferPool);
+        WnbdTraceDelete(Info->Trace);
         ExFreePool(Info);
         KsInitialize();
         KsDestroy();
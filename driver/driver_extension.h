@@ -8,6 +8,17 @@
 #define DRIVER_EXTENSION_H 1
 
 #include "common.h"
+#include "wnbd_ioctl.h"
+
+// Removed connections remembered for IOCTL_WNBD_LIST_PAGED.
+#define WNBD_MAX_CONNECTION_TOMBSTONES 64
+
+typedef struct _WNBD_CONNECTION_TOMBSTONE
+{
+    WNBD_CONNECTION_ID      ConnectionId;
+    UINT64                  ChangeSequence;
+    CHAR                    InstanceName[WNBD_MAX_NAME_LENGTH];
+} WNBD_CONNECTION_TOMBSTONE, *PWNBD_CONNECTION_TOMBSTONE;
 
 typedef struct _PGLOBAL_INFORMATION
 {
@@ -16,6 +27,34 @@ typedef struct _PGLOBAL_INFORMATION
     LONG                    ConnectionCount;
     LIST_ENTRY              ConnectionList;
     ERESOURCE               ConnectionMutex;
+    // Used for connection id lookups, see connection_table.h.
+    struct _WNBD_CONNECTION_TABLE* ConnectionTable;
+    // Staging buffers used by the NBD connections, see buffer_pool.h.
+    struct _WNBD_BUFFER_POOL* BufferPool;
+    // Request lifecycle trace, allocated when tracing is first enabled.
+    // See io_trace.h.
+    struct _WNBD_TRACE*     Trace;
+    // Background removals in progress, protected by ConnectionMutex.
+    // The event is signaled when there are none left.
+    LONG                    PendingRemovals;
+    KEVENT                  RemovalsIdleEvent;
+    // Incremented when connections are created, start disconnecting
+    // or get removed, see IOCTL_WNBD_WAIT_CHANGE. Updated while holding
+    // both ConnectionMutex (exclusively) and ChangeLock, waiters only
+    // using the latter. ChangeEvent is set on every change.
+    UINT64                  ChangeSequence;
+    KSPIN_LOCK              ChangeLock;
+    KEVENT                  ChangeEvent;
+    // Assigned to new connections, ordering the connection list. Used
+    // as IOCTL_WNBD_LIST_PAGED cursor. Protected by ConnectionMutex.
+    UINT64                  NextListKey;
+    // Circular buffer of removed connections, protected by
+    // ConnectionMutex. "TombstoneFloor" is the change sequence number
+    // of the last tombstone that was overwritten.
+    WNBD_CONNECTION_TOMBSTONE Tombstones[WNBD_MAX_CONNECTION_TOMBSTONES];
+    ULONG                   TombstoneHead;
+    ULONG                   TombstoneCount;
+    UINT64                  TombstoneFloor;
 
 } GLOBAL_INFORMATION, *PGLOBAL_INFORMATION;
 
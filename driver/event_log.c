@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "debug.h"
+#include "driver.h"
+#include "event_log.h"
+
+#define EventLogMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'vDBN')
+
+extern UNICODE_STRING GlobalRegistryPath;
+
+volatile LONG WnbdEventLogMaxLevel = -1;
+PWNBD_EVENT_LOG WnbdEventLog = NULL;
+
+static VOID
+WnbdEventLogDelete(_In_ PWNBD_EVENT_LOG EventLog)
+{
+    if (!EventLog) {
+        return;
+    }
+
+    for (ULONG Idx = 0; Idx < EventLog->RingCount; Idx++) {
+        if (EventLog->Rings[Idx].Slots) {
+            ExFreePool(EventLog->Rings[Idx].Slots);
+        }
+    }
+    ExFreePool(EventLog->Rings);
+    ExFreePool(EventLog);
+}
+
+static NTSTATUS
+WnbdEventLogCreate(_In_ UINT32 RecordsPerCpu,
+                   _Out_ PWNBD_EVENT_LOG* PEventLog)
+{
+    *PEventLog = NULL;
+
+    PWNBD_EVENT_LOG EventLog = (PWNBD_EVENT_LOG) EventLogMalloc(
+        sizeof(WNBD_EVENT_LOG));
+    if (!EventLog) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(EventLog, sizeof(WNBD_EVENT_LOG));
+    KeInitializeSpinLock(&EventLog->ReadLock);
+
+    EventLog->RecordsPerCpu = RecordsPerCpu;
+    EventLog->RingCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    EventLog->Rings = (PWNBD_EVENT_LOG_RING) EventLogMalloc(
+        sizeof(WNBD_EVENT_LOG_RING) * EventLog->RingCount);
+    if (!EventLog->Rings) {
+        ExFreePool(EventLog);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(EventLog->Rings,
+                  sizeof(WNBD_EVENT_LOG_RING) * EventLog->RingCount);
+
+    for (ULONG Idx = 0; Idx < EventLog->RingCount; Idx++) {
+        PWNBD_EVENT_LOG_RING Ring = &EventLog->Rings[Idx];
+        Ring->Slots = (PWNBD_EVENT_LOG_SLOT) EventLogMalloc(
+            sizeof(WNBD_EVENT_LOG_SLOT) * RecordsPerCpu);
+        if (!Ring->Slots) {
+            WnbdEventLogDelete(EventLog);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlZeroMemory(Ring->Slots, sizeof(WNBD_EVENT_LOG_SLOT) * RecordsPerCpu);
+    }
+
+    *PEventLog = EventLog;
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdEventLogControl(UINT32 LogLevel,
+                    UINT32 RecordsPerCpu)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PWNBD_EVENT_LOG EventLog = WnbdEventLog;
+
+    if (!EventLog && LogLevel) {
+        if (!RecordsPerCpu) {
+            RecordsPerCpu = WNBD_DEFAULT_EVENT_LOG_RECORDS_PER_CPU;
+        }
+        if (RecordsPerCpu > WNBD_MAX_EVENT_LOG_RECORDS_PER_CPU) {
+            WNBD_LOG_ERROR("Invalid event log ring size: %u.", RecordsPerCpu);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        NTSTATUS Status = WnbdEventLogCreate(RecordsPerCpu, &EventLog);
+        if (!NT_SUCCESS(Status)) {
+            WNBD_LOG_ERROR("Could not allocate event log rings. Status: 0x%x.",
+                           Status);
+            return Status;
+        }
+        PWNBD_EVENT_LOG Existing = (PWNBD_EVENT_LOG)
+            InterlockedCompareExchangePointer(
+                (PVOID*)&WnbdEventLog, EventLog, NULL);
+        if (Existing) {
+            // Enabled concurrently.
+            WnbdEventLogDelete(EventLog);
+            EventLog = Existing;
+        }
+    }
+
+    InterlockedExchange(&WnbdEventLogMaxLevel,
+                        LogLevel ? (LONG)LogLevel - 1 : -1);
+    WNBD_LOG_INFO("Event log level: %u, records per CPU: %u.",
+                  LogLevel, EventLog ? EventLog->RecordsPerCpu : 0);
+
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+VOID
+WnbdEventLogReloadConfig()
+{
+    UINT32 LogLevel = 0;
+    if (WNBDReadRegistryValue(
+            &GlobalRegistryPath, L"EventLogLevel",
+            (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT), &LogLevel)) {
+        WnbdEventLogControl(LogLevel, 0);
+    }
+}
+
+VOID
+WnbdEventLogCleanup()
+{
+    InterlockedExchange(&WnbdEventLogMaxLevel, -1);
+    PWNBD_EVENT_LOG EventLog = (PWNBD_EVENT_LOG) InterlockedExchangePointer(
+        (PVOID*)&WnbdEventLog, NULL);
+    WnbdEventLogDelete(EventLog);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdEventLogWrite(UINT32 Level,
+                  UINT32 EventId,
+                  ...)
+{
+    PWNBD_EVENT_LOG EventLog = WnbdEventLog;
+    if (!EventLog || EventId >= WnbdEvtCount) {
+        return;
+    }
+
+    ULONG Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    PWNBD_EVENT_LOG_RING Ring = &EventLog->Rings[Cpu % EventLog->RingCount];
+    // The thread may be preempted by another writer of the same ring,
+    // so the slots are reserved atomically.
+    LONG64 Position = InterlockedIncrement64(&Ring->Head) - 1;
+    PWNBD_EVENT_LOG_SLOT Slot =
+        &Ring->Slots[Position % EventLog->RecordsPerCpu];
+    PWNBD_EVENT_LOG_RECORD Record = &Slot->Record;
+    UINT32 ArgCount = WnbdLogEvents[EventId].ArgCount;
+
+    InterlockedExchange64(&Slot->Sequence, 0);
+    ULONG64 Qpc;
+    Record->Timestamp = KeQueryInterruptTimePrecise(&Qpc);
+    Record->EventId = (UINT16)EventId;
+    Record->Level = (UINT8)Level;
+    Record->ArgCount = (UINT8)ArgCount;
+    Record->Cpu = (UINT16)Cpu;
+    Record->Reserved = 0;
+
+    // x64 variadic arguments use 64 bit slots, so smaller arguments
+    // may be retrieved this way as well.
+    va_list Args;
+    va_start(Args, EventId);
+    for (UINT32 Idx = 0; Idx < WNBD_EVENT_LOG_MAX_ARGS; Idx++) {
+        Record->Args[Idx] = Idx < ArgCount ? va_arg(Args, UINT64) : 0;
+    }
+    va_end(Args);
+    InterlockedExchange64(&Slot->Sequence, Position + 1);
+}
+
+_Use_decl_annotations_
+ULONG
+WnbdEventLogRead(PWNBD_EVENT_LOG_RECORD Records,
+                 ULONG MaxCount,
+                 PUINT64 LostRecords)
+{
+    PWNBD_EVENT_LOG EventLog = WnbdEventLog;
+    ULONG Count = 0;
+    KIRQL Irql = { 0 };
+
+    *LostRecords = 0;
+    if (!EventLog) {
+        return 0;
+    }
+
+    KeAcquireSpinLock(&EventLog->ReadLock, &Irql);
+    for (ULONG RingIdx = 0;
+            RingIdx < EventLog->RingCount && Count < MaxCount; RingIdx++) {
+        PWNBD_EVENT_LOG_RING Ring = &EventLog->Rings[RingIdx];
+        LONG64 Head = InterlockedOr64(&Ring->Head, 0);
+        if (Head - Ring->Tail > (LONG64)EventLog->RecordsPerCpu) {
+            EventLog->LostRecords +=
+                Head - Ring->Tail - EventLog->RecordsPerCpu;
+            Ring->Tail = Head - EventLog->RecordsPerCpu;
+        }
+
+        while (Ring->Tail < Head && Count < MaxCount) {
+            PWNBD_EVENT_LOG_SLOT Slot =
+                &Ring->Slots[Ring->Tail % EventLog->RecordsPerCpu];
+            LONG64 Sequence = InterlockedOr64(&Slot->Sequence, 0);
+            RtlCopyMemory(&Records[Count], &Slot->Record,
+                          sizeof(WNBD_EVENT_LOG_RECORD));
+            // The slot may be rewritten while copying it.
+            if (Sequence == Ring->Tail + 1 &&
+                    Sequence == InterlockedOr64(&Slot->Sequence, 0)) {
+                Count++;
+            } else if (Sequence < Ring->Tail + 1) {
+                // Still being written, we'll get it next time.
+                break;
+            } else {
+                EventLog->LostRecords++;
+            }
+            Ring->Tail++;
+        }
+    }
+    *LostRecords = EventLog->LostRecords;
+    EventLog->LostRecords = 0;
+    KeReleaseSpinLock(&EventLog->ReadLock, Irql);
+
+    return Count;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H 1
+
+#include "common.h"
+#include "wnbd_ioctl.h"
+
+typedef struct _WNBD_EVENT_LOG_SLOT
+{
+    // Ring position of the stored record plus one, 0 while the record
+    // is being written.
+    volatile LONG64             Sequence;
+    WNBD_EVENT_LOG_RECORD       Record;
+} WNBD_EVENT_LOG_SLOT, *PWNBD_EVENT_LOG_SLOT;
+
+typedef struct DECLSPEC_CACHEALIGN _WNBD_EVENT_LOG_RING
+{
+    // Next position to be written.
+    volatile LONG64             Head;
+    // Next position to be read, protected by the event log "ReadLock".
+    LONG64                      Tail;
+    PWNBD_EVENT_LOG_SLOT        Slots;
+} WNBD_EVENT_LOG_RING, *PWNBD_EVENT_LOG_RING;
+
+// Binary log used by the per IO log sites (WNBD_IO_LOG_*), storing
+// the event id and the raw arguments instead of formatting messages.
+// The records are decoded by the consumer using wnbd_log_events.h.
+//
+// Records are written to per CPU rings without locking, the oldest
+// records being overwritten if the rings aren't drained in time. The
+// rings are allocated when the event log is first enabled and kept
+// until the driver is unloaded.
+typedef struct _WNBD_EVENT_LOG
+{
+    ULONG                       RingCount;
+    ULONG                       RecordsPerCpu;
+
+    KSPIN_LOCK                  ReadLock;
+    // Protected by "ReadLock".
+    UINT64                      LostRecords;
+
+    PWNBD_EVENT_LOG_RING        Rings;
+} WNBD_EVENT_LOG, *PWNBD_EVENT_LOG;
+
+// Sets the event log level, using the "DebugLogLevel" convention.
+// Allocates the rings if needed.
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+WnbdEventLogControl(_In_ UINT32 LogLevel,
+                    _In_ UINT32 RecordsPerCpu);
+
+// Applies the "EventLogLevel" registry key, if set.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdEventLogReloadConfig();
+
+// Called when unloading the driver.
+VOID
+WnbdEventLogCleanup();
+
+// Moves up to "MaxCount" records to the specified buffer, returning
+// the record count.
+ULONG
+WnbdEventLogRead(_Out_writes_(MaxCount) PWNBD_EVENT_LOG_RECORD Records,
+                 _In_ ULONG MaxCount,
+                 _Out_ PUINT64 LostRecords);
+
+#endif
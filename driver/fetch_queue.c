@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "debug.h"
+#include "fetch_queue.h"
+#include "userspace.h"
+#include "wnbd_dispatch.h"
+
+#define FetchQueueMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'fDBN')
+
+#define CSQ_TO_FETCH_QUEUE(Csq) CONTAINING_RECORD(Csq, WNBD_FETCH_QUEUE, Csq)
+
+VOID
+WnbdFetchCsqInsertIrp(_In_ PIO_CSQ Csq,
+                      _In_ PIRP Irp)
+{
+    PWNBD_FETCH_QUEUE Queue = CSQ_TO_FETCH_QUEUE(Csq);
+    InsertTailList(&Queue->IrpList, &Irp->Tail.Overlay.ListEntry);
+    Queue->PendingCount++;
+}
+
+VOID
+WnbdFetchCsqRemoveIrp(_In_ PIO_CSQ Csq,
+                      _In_ PIRP Irp)
+{
+    PWNBD_FETCH_QUEUE Queue = CSQ_TO_FETCH_QUEUE(Csq);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    Queue->PendingCount--;
+}
+
+PIRP
+WnbdFetchCsqPeekNextIrp(_In_ PIO_CSQ Csq,
+                        _In_opt_ PIRP Irp,
+                        _In_opt_ PVOID PeekContext)
+{
+    UNREFERENCED_PARAMETER(PeekContext);
+
+    PWNBD_FETCH_QUEUE Queue = CSQ_TO_FETCH_QUEUE(Csq);
+    PLIST_ENTRY Next = Irp ?
+        Irp->Tail.Overlay.ListEntry.Flink : Queue->IrpList.Flink;
+    if (Next == &Queue->IrpList) {
+        return NULL;
+    }
+    return CONTAINING_RECORD(Next, IRP, Tail.Overlay.ListEntry);
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+VOID
+WnbdFetchCsqAcquireLock(_In_ PIO_CSQ Csq,
+                        _Out_ _At_(*Irql, _Post_ _IRQL_saves_) PKIRQL Irql)
+{
+    KeAcquireSpinLock(&CSQ_TO_FETCH_QUEUE(Csq)->Lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID
+WnbdFetchCsqReleaseLock(_In_ PIO_CSQ Csq,
+                        _In_ _IRQL_restores_ KIRQL Irql)
+{
+    KeReleaseSpinLock(&CSQ_TO_FETCH_QUEUE(Csq)->Lock, Irql);
+}
+
+VOID
+WnbdFetchCsqCompleteCanceledIrp(_In_ PIO_CSQ Csq,
+                                _In_ PIRP Irp)
+{
+    PWNBD_FETCH_QUEUE Queue = CSQ_TO_FETCH_QUEUE(Csq);
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    StorPortCompleteServiceIrp(
+        Queue->DeviceInformation->GlobalInformation->Handle, Irp);
+}
+
+VOID
+WnbdFetchQueueThread(_In_ PVOID Context)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Context);
+
+    PWNBD_FETCH_QUEUE Queue = (PWNBD_FETCH_QUEUE) Context;
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Queue->DeviceInformation;
+    PVOID WaitObjects[3];
+    WaitObjects[0] = &Queue->Event;
+    WaitObjects[1] = &DeviceInformation->TerminateEvent;
+    WaitObjects[2] = &DeviceInformation->DeviceEvent;
+
+    while (!Queue->Stopping) {
+        if (DeviceInformation->HardTerminateDevice) {
+            // The pending IRPs receive the disconnect request.
+            PIRP Irp = NULL;
+            while ((Irp = IoCsqRemoveNextIrp(&Queue->Csq, NULL))) {
+                WnbdCompletePendingFetch(DeviceInformation, Irp, TRUE);
+            }
+            KeWaitForSingleObject(&Queue->Event, Executive, KernelMode,
+                                  FALSE, NULL);
+            continue;
+        }
+
+        // Requests are only retrieved if there are pending IRPs.
+        // Acquiring the semaphore counts as retrieving a request.
+        ULONG WaitCount = Queue->PendingCount ? 3 : 2;
+        NTSTATUS WaitResult = KeWaitForMultipleObjects(
+            WaitCount, WaitObjects, WaitAny, Executive, KernelMode,
+            FALSE, NULL, Queue->WaitBlocks);
+        if (STATUS_WAIT_2 != WaitResult) {
+            continue;
+        }
+
+        // The request is dequeued while filling the IRP, so we're
+        // handing the semaphore count back.
+        KeReleaseSemaphore(&DeviceInformation->DeviceEvent, 0, 1, FALSE);
+        PIRP Irp = IoCsqRemoveNextIrp(&Queue->Csq, NULL);
+        if (!Irp) {
+            // The IRP got cancelled in the meantime.
+            continue;
+        }
+        if (!WnbdCompletePendingFetch(DeviceInformation, Irp, FALSE)) {
+            // Another thread retrieved the request first.
+            IoCsqInsertIrp(&Queue->Csq, Irp, NULL);
+        }
+    }
+
+    WNBD_LOG_INFO("Fetch queue thread stopped: %p", DeviceInformation);
+    (void)PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS
+WnbdFetchQueueCreate(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                     _Out_ PWNBD_FETCH_QUEUE* PQueue)
+{
+    WNBD_LOG_LOUD(": Enter");
+    HANDLE ThreadHandle = NULL;
+    *PQueue = NULL;
+
+    PWNBD_FETCH_QUEUE Queue = (PWNBD_FETCH_QUEUE) FetchQueueMalloc(
+        sizeof(WNBD_FETCH_QUEUE));
+    if (!Queue) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Queue, sizeof(WNBD_FETCH_QUEUE));
+
+    Queue->DeviceInformation = DeviceInformation;
+    InitializeListHead(&Queue->IrpList);
+    KeInitializeSpinLock(&Queue->Lock);
+    KeInitializeEvent(&Queue->Event, SynchronizationEvent, FALSE);
+    NTSTATUS Status = IoCsqInitialize(
+        &Queue->Csq,
+        WnbdFetchCsqInsertIrp,
+        WnbdFetchCsqRemoveIrp,
+        WnbdFetchCsqPeekNextIrp,
+        WnbdFetchCsqAcquireLock,
+        WnbdFetchCsqReleaseLock,
+        WnbdFetchCsqCompleteCanceledIrp);
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
+
+    Status = PsCreateSystemThread(&ThreadHandle, (ACCESS_MASK)0L, NULL,
+                                  NULL, NULL, WnbdFetchQueueThread, Queue);
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
+    Status = ObReferenceObjectByHandle(ThreadHandle, THREAD_ALL_ACCESS, NULL,
+                                       KernelMode, &Queue->Thread, NULL);
+    if (!NT_SUCCESS(Status)) {
+        // Unlikely, but we still have to wait for the thread.
+        Queue->Stopping = TRUE;
+        KeSetEvent(&Queue->Event, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(ThreadHandle, FALSE, NULL);
+        goto Exit;
+    }
+
+    *PQueue = Queue;
+
+Exit:
+    if (ThreadHandle) {
+        ZwClose(ThreadHandle);
+    }
+    if (!NT_SUCCESS(Status)) {
+        ExFreePool(Queue);
+    }
+    WNBD_LOG_LOUD(": Exit");
+    return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdFetchQueueInsert(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                     PIRP Irp)
+{
+    PWNBD_FETCH_QUEUE Queue = DeviceInformation->FetchQueue;
+    if (!Queue) {
+        NTSTATUS Status = WnbdFetchQueueCreate(DeviceInformation, &Queue);
+        if (!NT_SUCCESS(Status)) {
+            WNBD_LOG_ERROR("Could not create fetch queue. Status: 0x%x.",
+                           Status);
+            return Status;
+        }
+
+        PWNBD_FETCH_QUEUE Existing = (PWNBD_FETCH_QUEUE)
+            InterlockedCompareExchangePointer(
+                (PVOID*)&DeviceInformation->FetchQueue, Queue, NULL);
+        if (Existing) {
+            WnbdFetchQueueDelete(Queue);
+            Queue = Existing;
+        }
+    }
+
+    InterlockedIncrement64(&DeviceInformation->ExtendedStats.PendedFetchRequests);
+    IoCsqInsertIrp(&Queue->Csq, Irp, NULL);
+    KeSetEvent(&Queue->Event, IO_NO_INCREMENT, FALSE);
+    return STATUS_PENDING;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdFetchQueueStop(PWNBD_FETCH_QUEUE Queue)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Queue || !Queue->Thread) {
+        return;
+    }
+
+    Queue->Stopping = TRUE;
+    KeSetEvent(&Queue->Event, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(Queue->Thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(Queue->Thread);
+    Queue->Thread = NULL;
+
+    // IRPs that were pended while the thread was stopping.
+    PIRP Irp = NULL;
+    while ((Irp = IoCsqRemoveNextIrp(&Queue->Csq, NULL))) {
+        WnbdCompletePendingFetch(Queue->DeviceInformation, Irp, TRUE);
+    }
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+VOID
+WnbdFetchQueueDelete(PWNBD_FETCH_QUEUE Queue)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Queue) {
+        return;
+    }
+
+    WnbdFetchQueueStop(Queue);
+    ExFreePool(Queue);
+    WNBD_LOG_LOUD(": Exit");
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef FETCH_QUEUE_H
+#define FETCH_QUEUE_H 1
+
+#include "common.h"
+#include "userspace.h"
+
+// Asynchronous fetch IRPs (WNBD_FETCH_FLAG_ASYNC), pended until IO
+// requests become available. The IRPs are kept in a cancel-safe queue,
+// a dedicated thread completing them as requests arrive. The structure
+// is allocated when the first IRP gets pended and released along with
+// the device.
+typedef struct _WNBD_FETCH_QUEUE
+{
+    PSCSI_DEVICE_INFORMATION    DeviceInformation;
+
+    IO_CSQ                      Csq;
+    LIST_ENTRY                  IrpList;
+    KSPIN_LOCK                  Lock;
+    // Protected by "Lock".
+    volatile ULONG              PendingCount;
+
+    // Signaled when IRPs are queued or when stopping.
+    KEVENT                      Event;
+    PVOID                       Thread;
+    volatile BOOLEAN            Stopping;
+    KWAIT_BLOCK                 WaitBlocks[3];
+} WNBD_FETCH_QUEUE, *PWNBD_FETCH_QUEUE;
+
+// Pends the fetch IRP, returning STATUS_PENDING on success.
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+WnbdFetchQueueInsert(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                     _In_ PIRP Irp);
+
+// Stops the queue thread and completes the remaining IRPs. Must be
+// called after the device is hard terminated.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdFetchQueueStop(_In_ PWNBD_FETCH_QUEUE Queue);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdFetchQueueDelete(_In_ PWNBD_FETCH_QUEUE Queue);
+
+#endif
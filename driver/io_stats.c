@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "debug.h"
+#include "io_stats.h"
+#include "nbd_protocol.h"
+
+#define IoStatsMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'hDBN')
+
+static PWNBD_IO_COUNTERS_SHARD
+WnbdIoCountersGetShard(_In_ PWNBD_IO_COUNTERS Counters)
+{
+    ULONG Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    return &Counters->Shards[Cpu % Counters->ShardCount];
+}
+
+// Maps a latency (in microseconds) to its histogram bucket, see
+// WNBD_LATENCY_BUCKET_LOWER_US.
+static ULONG
+WnbdLatencyBucket(_In_ UINT64 LatencyUs)
+{
+    if (LatencyUs < WNBD_LATENCY_SUB_BUCKETS) {
+        return (ULONG)LatencyUs;
+    }
+
+    ULONG Exponent;
+    _BitScanReverse64(&Exponent, LatencyUs);
+    if (Exponent > WNBD_LATENCY_MAX_EXPONENT) {
+        return WNBD_LATENCY_BUCKET_COUNT - 1;
+    }
+    ULONG SubBucket = (ULONG)(LatencyUs >>
+        (Exponent - WNBD_LATENCY_SUB_BUCKET_BITS)) &
+        (WNBD_LATENCY_SUB_BUCKETS - 1);
+    return (Exponent - WNBD_LATENCY_SUB_BUCKET_BITS + 1) *
+        WNBD_LATENCY_SUB_BUCKETS + SubBucket;
+}
+
+static VOID
+WnbdIoCountersRecordLatency(_In_ PWNBD_IO_COUNTERS_SHARD Shard,
+                            _In_ WnbdLatencyType Type,
+                            _In_ UINT64 Latency)
+{
+    // 100ns units
+    UINT64 LatencyUs = Latency / 10;
+    InterlockedAdd64(&Shard->LatencySumUs[Type], LatencyUs);
+    InterlockedIncrement64(&Shard->Latency[Type][WnbdLatencyBucket(LatencyUs)]);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdIoCountersCreate(PWNBD_IO_COUNTERS* PCounters)
+{
+    ASSERT(PCounters);
+    *PCounters = NULL;
+
+    PWNBD_IO_COUNTERS Counters = (PWNBD_IO_COUNTERS) IoStatsMalloc(
+        sizeof(WNBD_IO_COUNTERS));
+    if (!Counters) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Counters, sizeof(WNBD_IO_COUNTERS));
+
+    Counters->ShardCount = min(
+        KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS),
+        WNBD_IO_COUNTERS_MAX_SHARDS);
+    Counters->Shards = (PWNBD_IO_COUNTERS_SHARD) IoStatsMalloc(
+        sizeof(WNBD_IO_COUNTERS_SHARD) * Counters->ShardCount);
+    if (!Counters->Shards) {
+        ExFreePool(Counters);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Counters->Shards,
+                  sizeof(WNBD_IO_COUNTERS_SHARD) * Counters->ShardCount);
+
+    *PCounters = Counters;
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdIoCountersDelete(PWNBD_IO_COUNTERS Counters)
+{
+    if (!Counters) {
+        return;
+    }
+
+    ExFreePool(Counters->Shards);
+    ExFreePool(Counters);
+}
+
+_Use_decl_annotations_
+UCHAR
+WnbdIoCountersGetOp(PSCSI_REQUEST_BLOCK Srb)
+{
+    PCDB Cdb = (PCDB)&Srb->Cdb;
+    switch (ScsiOpToNbdReqType(Cdb->AsByte[0])) {
+    case NBD_CMD_READ:
+        return WnbdIoOpRead;
+    case NBD_CMD_WRITE:
+        return WnbdIoOpWrite;
+    case NBD_CMD_FLUSH:
+        return WnbdIoOpFlush;
+    case NBD_CMD_TRIM:
+        return WnbdIoOpUnmap;
+    default:
+        return WnbdIoOpCount;
+    }
+}
+
+_Use_decl_annotations_
+VOID
+WnbdIoCountersRecordSend(PWNBD_IO_COUNTERS Counters,
+                         PSRB_QUEUE_ELEMENT Element)
+{
+    if (!Counters || Element->SendTime || Element->IoOp >= WnbdIoOpCount) {
+        return;
+    }
+
+    ULONG64 Qpc;
+    Element->SendTime = KeQueryInterruptTimePrecise(&Qpc);
+    WnbdIoCountersRecordLatency(
+        WnbdIoCountersGetShard(Counters), WnbdLatencyQueueWait,
+        Element->SendTime - Element->ReceiveTime);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdIoCountersRecordCompletion(PWNBD_IO_COUNTERS Counters,
+                               PSRB_QUEUE_ELEMENT Element)
+{
+    if (!Counters || Element->IoOp >= WnbdIoOpCount) {
+        return;
+    }
+
+    PWNBD_IO_COUNTERS_SHARD Shard = WnbdIoCountersGetShard(Counters);
+    UCHAR Op = Element->IoOp;
+    if (Element->Aborted ||
+            SRB_STATUS(Element->Srb->SrbStatus) != SRB_STATUS_SUCCESS) {
+        InterlockedIncrement64(&Shard->Errors[Op]);
+        if (Element->Aborted) {
+            return;
+        }
+    } else {
+        InterlockedIncrement64(&Shard->Requests[Op]);
+        if (Op == WnbdIoOpRead || Op == WnbdIoOpWrite) {
+            InterlockedAdd64(&Shard->Bytes[Op], Element->ReadLength);
+        } else if (Op == WnbdIoOpUnmap) {
+            InterlockedAdd64(&Shard->Bytes[Op], Element->UnmapLength);
+        }
+    }
+
+    ULONG64 Qpc;
+    UINT64 Now = KeQueryInterruptTimePrecise(&Qpc);
+    WnbdIoCountersRecordLatency(Shard, WnbdLatencyTotal,
+                                Now - Element->ReceiveTime);
+    if (Element->SendTime) {
+        WnbdIoCountersRecordLatency(Shard, WnbdLatencyWire,
+                                    Now - Element->SendTime);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+WnbdIoCountersGet(PWNBD_IO_COUNTERS Counters,
+                  PWNBD_IO_STATS Stats)
+{
+    RtlZeroMemory(Stats, sizeof(WNBD_IO_STATS));
+    Stats->Version = WNBD_IO_STATS_VERSION_1;
+    Stats->Size = sizeof(WNBD_IO_STATS);
+
+    for (ULONG ShardIdx = 0; ShardIdx < Counters->ShardCount; ShardIdx++) {
+        PWNBD_IO_COUNTERS_SHARD Shard = &Counters->Shards[ShardIdx];
+        for (ULONG Op = 0; Op < WnbdIoOpCount; Op++) {
+            Stats->Requests[Op] += Shard->Requests[Op];
+            Stats->Bytes[Op] += Shard->Bytes[Op];
+            Stats->Errors[Op] += Shard->Errors[Op];
+        }
+        for (ULONG Type = 0; Type < WnbdLatencyTypeCount; Type++) {
+            Stats->LatencySumUs[Type] += Shard->LatencySumUs[Type];
+            for (ULONG Bucket = 0; Bucket < WNBD_LATENCY_BUCKET_COUNT; Bucket++) {
+                Stats->Latency[Type][Bucket] += Shard->Latency[Type][Bucket];
+            }
+        }
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef IO_STATS_H
+#define IO_STATS_H 1
+
+#include "common.h"
+#include "userspace.h"
+#include "util.h"
+#include "wnbd_ioctl.h"
+
+// Devices with many CPUs share shards, limiting the memory footprint.
+#define WNBD_IO_COUNTERS_MAX_SHARDS 16
+
+typedef struct DECLSPEC_CACHEALIGN _WNBD_IO_COUNTERS_SHARD
+{
+    volatile LONG64             Requests[WnbdIoOpCount];
+    volatile LONG64             Bytes[WnbdIoOpCount];
+    volatile LONG64             Errors[WnbdIoOpCount];
+    volatile LONG64             LatencySumUs[WnbdLatencyTypeCount];
+    volatile LONG64             Latency[WnbdLatencyTypeCount]
+                                       [WNBD_LATENCY_BUCKET_COUNT];
+} WNBD_IO_COUNTERS_SHARD, *PWNBD_IO_COUNTERS_SHARD;
+
+// Per operation counters and latency histograms. Updates go to the
+// shard of the current CPU, the shards being merged when the stats
+// are retrieved.
+typedef struct _WNBD_IO_COUNTERS
+{
+    ULONG                       ShardCount;
+    PWNBD_IO_COUNTERS_SHARD     Shards;
+} WNBD_IO_COUNTERS, *PWNBD_IO_COUNTERS;
+
+NTSTATUS
+WnbdIoCountersCreate(_Out_ PWNBD_IO_COUNTERS* PCounters);
+
+VOID
+WnbdIoCountersDelete(_In_ PWNBD_IO_COUNTERS Counters);
+
+// Returns WnbdIoOpCount for operations that aren't tracked.
+UCHAR
+WnbdIoCountersGetOp(_In_ PSCSI_REQUEST_BLOCK Srb);
+
+// Called when the request is submitted to the NBD server or retrieved
+// by the userspace process, recording the queue wait time. Only the
+// first submission is accounted.
+VOID
+WnbdIoCountersRecordSend(_In_ PWNBD_IO_COUNTERS Counters,
+                         _In_ PSRB_QUEUE_ELEMENT Element);
+
+// Called before notifying Storport, after setting the SRB status.
+// Aborted requests are only counted as errors.
+VOID
+WnbdIoCountersRecordCompletion(_In_ PWNBD_IO_COUNTERS Counters,
+                               _In_ PSRB_QUEUE_ELEMENT Element);
+
+VOID
+WnbdIoCountersGet(_In_ PWNBD_IO_COUNTERS Counters,
+                  _Out_ PWNBD_IO_STATS Stats);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "debug.h"
+#include "io_trace.h"
+
+#define TraceMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'eDBN')
+
+static NTSTATUS
+WnbdTraceCreate(_In_ UINT32 RecordsPerCpu,
+                _Out_ PWNBD_TRACE* PTrace)
+{
+    *PTrace = NULL;
+
+    PWNBD_TRACE Trace = (PWNBD_TRACE) TraceMalloc(sizeof(WNBD_TRACE));
+    if (!Trace) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Trace, sizeof(WNBD_TRACE));
+    KeInitializeSpinLock(&Trace->ReadLock);
+
+    Trace->RecordsPerCpu = RecordsPerCpu;
+    Trace->RingCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Trace->Rings = (PWNBD_TRACE_RING) TraceMalloc(
+        sizeof(WNBD_TRACE_RING) * Trace->RingCount);
+    if (!Trace->Rings) {
+        ExFreePool(Trace);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Trace->Rings, sizeof(WNBD_TRACE_RING) * Trace->RingCount);
+
+    for (ULONG Idx = 0; Idx < Trace->RingCount; Idx++) {
+        PWNBD_TRACE_RING Ring = &Trace->Rings[Idx];
+        Ring->Slots = (PWNBD_TRACE_SLOT) TraceMalloc(
+            sizeof(WNBD_TRACE_SLOT) * RecordsPerCpu);
+        if (!Ring->Slots) {
+            WnbdTraceDelete(Trace);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlZeroMemory(Ring->Slots, sizeof(WNBD_TRACE_SLOT) * RecordsPerCpu);
+    }
+
+    *PTrace = Trace;
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdTraceDelete(PWNBD_TRACE Trace)
+{
+    if (!Trace) {
+        return;
+    }
+
+    for (ULONG Idx = 0; Idx < Trace->RingCount; Idx++) {
+        if (Trace->Rings[Idx].Slots) {
+            ExFreePool(Trace->Rings[Idx].Slots);
+        }
+    }
+    ExFreePool(Trace->Rings);
+    ExFreePool(Trace);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdTraceControl(PGLOBAL_INFORMATION GInfo,
+                 BOOLEAN Enable,
+                 UINT32 RecordsPerCpu)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PWNBD_TRACE Trace = GInfo->Trace;
+
+    if (!Trace && Enable) {
+        if (!RecordsPerCpu) {
+            RecordsPerCpu = WNBD_DEFAULT_TRACE_RECORDS_PER_CPU;
+        }
+        if (RecordsPerCpu > WNBD_MAX_TRACE_RECORDS_PER_CPU) {
+            WNBD_LOG_ERROR("Invalid trace ring size: %u.", RecordsPerCpu);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        NTSTATUS Status = WnbdTraceCreate(RecordsPerCpu, &Trace);
+        if (!NT_SUCCESS(Status)) {
+            WNBD_LOG_ERROR("Could not allocate trace rings. Status: 0x%x.",
+                           Status);
+            return Status;
+        }
+        PWNBD_TRACE Existing = (PWNBD_TRACE) InterlockedCompareExchangePointer(
+            (PVOID*)&GInfo->Trace, Trace, NULL);
+        if (Existing) {
+            // Enabled concurrently.
+            WnbdTraceDelete(Trace);
+            Trace = Existing;
+        }
+    }
+
+    if (Trace) {
+        InterlockedExchange(&Trace->Enabled, Enable);
+        WNBD_LOG_INFO("Request tracing %s, records per CPU: %u.",
+                      Enable ? "enabled" : "disabled",
+                      Trace->RecordsPerCpu);
+    }
+
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdTraceStartRequest(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                      PSRB_QUEUE_ELEMENT Element)
+{
+    PWNBD_TRACE Trace = DeviceInformation->GlobalInformation->Trace;
+    if (!Trace || !Trace->Enabled) {
+        return;
+    }
+
+    // Ids are allocated per CPU, avoiding a shared counter.
+    ULONG RingIdx = KeGetCurrentProcessorNumberEx(NULL) % Trace->RingCount;
+    Element->TraceId = InterlockedIncrement64(
+        &Trace->Rings[RingIdx].NextRequestId) * Trace->RingCount + RingIdx;
+    WnbdTraceLogElement(DeviceInformation, Element, WnbdTraceQueued);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdTraceInitRecord(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                    PSRB_QUEUE_ELEMENT Element,
+                    PWNBD_TRACE_RECORD Record)
+{
+    RtlZeroMemory(Record, sizeof(WNBD_TRACE_RECORD));
+    if (!Element->TraceId) {
+        return;
+    }
+
+    Record->RequestId = Element->TraceId;
+    Record->Tag = Element->Tag;
+    Record->ConnectionId = DeviceInformation->UserEntry->ConnectionId;
+    Record->Offset = Element->StartingLbn;
+    Record->Length = Element->ReadLength;
+    Record->Op = Element->IoOp;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdTraceLogRecord(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                   PWNBD_TRACE_RECORD Record,
+                   WnbdTraceEvent Event)
+{
+    PWNBD_TRACE Trace = DeviceInformation->GlobalInformation->Trace;
+    if (!Record->RequestId || !Trace || !Trace->Enabled) {
+        return;
+    }
+
+    ULONG Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    PWNBD_TRACE_RING Ring = &Trace->Rings[Cpu % Trace->RingCount];
+    // The thread may be preempted by another writer of the same ring,
+    // so the slots are reserved atomically.
+    LONG64 Position = InterlockedIncrement64(&Ring->Head) - 1;
+    PWNBD_TRACE_SLOT Slot = &Ring->Slots[Position % Trace->RecordsPerCpu];
+
+    InterlockedExchange64(&Slot->Sequence, 0);
+    RtlCopyMemory(&Slot->Record, Record, sizeof(WNBD_TRACE_RECORD));
+    ULONG64 Qpc;
+    Slot->Record.Timestamp = KeQueryInterruptTimePrecise(&Qpc);
+    Slot->Record.Event = (UINT8)Event;
+    Slot->Record.Cpu = (UINT16)Cpu;
+    InterlockedExchange64(&Slot->Sequence, Position + 1);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdTraceLogElement(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                    PSRB_QUEUE_ELEMENT Element,
+                    WnbdTraceEvent Event)
+{
+    WNBD_TRACE_RECORD Record;
+    WnbdTraceInitRecord(DeviceInformation, Element, &Record);
+    WnbdTraceLogRecord(DeviceInformation, &Record, Event);
+}
+
+_Use_decl_annotations_
+ULONG
+WnbdTraceRead(PWNBD_TRACE Trace,
+              PWNBD_TRACE_RECORD Records,
+              ULONG MaxCount,
+              PUINT64 LostRecords)
+{
+    ULONG Count = 0;
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&Trace->ReadLock, &Irql);
+    for (ULONG RingIdx = 0;
+            RingIdx < Trace->RingCount && Count < MaxCount; RingIdx++) {
+        PWNBD_TRACE_RING Ring = &Trace->Rings[RingIdx];
+        LONG64 Head = InterlockedOr64(&Ring->Head, 0);
+        if (Head - Ring->Tail > (LONG64)Trace->RecordsPerCpu) {
+            Trace->LostRecords += Head - Ring->Tail - Trace->RecordsPerCpu;
+            Ring->Tail = Head - Trace->RecordsPerCpu;
+        }
+
+        while (Ring->Tail < Head && Count < MaxCount) {
+            PWNBD_TRACE_SLOT Slot =
+                &Ring->Slots[Ring->Tail % Trace->RecordsPerCpu];
+            LONG64 Sequence = InterlockedOr64(&Slot->Sequence, 0);
+            RtlCopyMemory(&Records[Count], &Slot->Record,
+                          sizeof(WNBD_TRACE_RECORD));
+            // The slot may be rewritten while copying it.
+            if (Sequence == Ring->Tail + 1 &&
+                    Sequence == InterlockedOr64(&Slot->Sequence, 0)) {
+                Count++;
+            } else if (Sequence < Ring->Tail + 1) {
+                // Still being written, we'll get it next time.
+                break;
+            } else {
+                Trace->LostRecords++;
+            }
+            Ring->Tail++;
+        }
+    }
+    *LostRecords = Trace->LostRecords;
+    Trace->LostRecords = 0;
+    KeReleaseSpinLock(&Trace->ReadLock, Irql);
+
+    return Count;
+}
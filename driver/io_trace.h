@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef IO_TRACE_H
+#define IO_TRACE_H 1
+
+#include "common.h"
+#include "driver_extension.h"
+#include "userspace.h"
+#include "util.h"
+#include "wnbd_ioctl.h"
+
+typedef struct _WNBD_TRACE_SLOT
+{
+    // Ring position of the stored record plus one, 0 while the record
+    // is being written.
+    volatile LONG64             Sequence;
+    WNBD_TRACE_RECORD           Record;
+} WNBD_TRACE_SLOT, *PWNBD_TRACE_SLOT;
+
+typedef struct DECLSPEC_CACHEALIGN _WNBD_TRACE_RING
+{
+    // Next position to be written.
+    volatile LONG64             Head;
+    // Next position to be read, protected by the trace "ReadLock".
+    LONG64                      Tail;
+    volatile LONG64             NextRequestId;
+    PWNBD_TRACE_SLOT            Slots;
+} WNBD_TRACE_RING, *PWNBD_TRACE_RING;
+
+// Adapter wide request lifecycle trace. Records are written to per
+// CPU rings without locking, the oldest records being overwritten if
+// the rings aren't drained in time.
+//
+// Requests are only assigned a trace id while tracing is enabled, the
+// other ones skipping all the trace points. The rings are allocated
+// when tracing is first enabled and kept until the driver is unloaded,
+// so that trace points may race with disabling the trace.
+typedef struct _WNBD_TRACE
+{
+    volatile LONG               Enabled;
+    ULONG                       RingCount;
+    ULONG                       RecordsPerCpu;
+
+    KSPIN_LOCK                  ReadLock;
+    // Protected by "ReadLock".
+    UINT64                      LostRecords;
+
+    PWNBD_TRACE_RING            Rings;
+} WNBD_TRACE, *PWNBD_TRACE;
+
+// Logs a request event, has no effect for requests that were received
+// while tracing was disabled.
+#define WnbdTraceRequest(DeviceInformation, Element, Event)             \
+    do {                                                                \
+        if ((Element)->TraceId) {                                       \
+            WnbdTraceLogElement(DeviceInformation, Element, Event);     \
+        }                                                               \
+    } while (0)
+
+// Enables or disables tracing, allocating the rings if needed.
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+WnbdTraceControl(_In_ PGLOBAL_INFORMATION GInfo,
+                 _In_ BOOLEAN Enable,
+                 _In_ UINT32 RecordsPerCpu);
+
+VOID
+WnbdTraceDelete(_In_ PWNBD_TRACE Trace);
+
+// Assigns a trace id to newly received requests if tracing is enabled,
+// logging the WnbdTraceQueued event.
+VOID
+WnbdTraceStartRequest(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                      _In_ PSRB_QUEUE_ELEMENT Element);
+
+// Used by WnbdTraceRequest.
+VOID
+WnbdTraceLogElement(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                    _In_ PSRB_QUEUE_ELEMENT Element,
+                    _In_ WnbdTraceEvent Event);
+
+// Captures the request details, allowing events to be logged after
+// the element is handed over to another thread. The record is left
+// empty (and ignored by WnbdTraceLogRecord) if the request isn't traced.
+VOID
+WnbdTraceInitRecord(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                    _In_ PSRB_QUEUE_ELEMENT Element,
+                    _Out_ PWNBD_TRACE_RECORD Record);
+
+VOID
+WnbdTraceLogRecord(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                   _In_ PWNBD_TRACE_RECORD Record,
+                   _In_ WnbdTraceEvent Event);
+
+// Moves up to "MaxCount" records to the specified buffer, returning
+// the record count.
+ULONG
+WnbdTraceRead(_In_ PWNBD_TRACE Trace,
+              _Out_writes_(MaxCount) PWNBD_TRACE_RECORD Records,
+              _In_ ULONG MaxCount,
+              _Out_ PUINT64 LostRecords);
+
+#endif
@@ -0,0 +1,1143 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include <berkeley.h>
+#include "buffer_pool.h"
+#include "cbt.h"
+#include "common.h"
+#include "congestion.h"
+#include "deadline.h"
+#include "debug.h"
+#include "io_stats.h"
+#include "io_trace.h"
+#include "mirror.h"
+#include "nbd_protocol.h"
+#include "srb_helper.h"
+#include "userspace.h"
+#include "util.h"
+
+#define MirrorMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'rDBN')
+#define LEG_BIT(Leg) (1 << (Leg)->Index)
+// Held by the request thread while submitting an element, preventing it
+// from being released by the reply threads in the meantime.
+#define SUBMIT_BIT (1 << 30)
+
+static inline BOOLEAN
+IsMirrorWriteOp(int NbdReqType)
+{
+    return NBD_CMD_WRITE == NbdReqType || NBD_CMD_TRIM == NbdReqType;
+}
+
+static inline int
+ElementNbdReqType(_In_ PSRB_QUEUE_ELEMENT Element)
+{
+    PCDB Cdb = (PCDB)&Element->Srb->Cdb;
+    return ScsiOpToNbdReqType(Cdb->AsByte[0]);
+}
+
+// Marks the regions covered by the given range as dirty. If "ResyncOnly"
+// is set, the range is marked only if it overlaps the region that's being
+// resynced. The check is done under the dirty region lock, otherwise the
+// resync thread could miss the write.
+VOID
+WnbdMirrorMarkDirty(_In_ PWNBD_MIRROR Mirror,
+                    _In_ UINT64 Offset,
+                    _In_ UINT64 Length,
+                    _In_ BOOLEAN ResyncOnly)
+{
+    if (!Length) {
+        return;
+    }
+
+    ULONG FirstRegion = (ULONG)(Offset >> Mirror->RegionShift);
+    ULONG LastRegion = (ULONG)((Offset + Length - 1) >> Mirror->RegionShift);
+    LONG NewRegions = 0;
+    KIRQL Irql = { 0 };
+
+    LastRegion = min(LastRegion, Mirror->RegionCount - 1);
+
+    KeAcquireSpinLock(&Mirror->DirtyRegionsLock, &Irql);
+    if (ResyncOnly && (Mirror->ResyncRegion < FirstRegion ||
+                       Mirror->ResyncRegion > LastRegion)) {
+        KeReleaseSpinLock(&Mirror->DirtyRegionsLock, Irql);
+        return;
+    }
+    for (ULONG Region = FirstRegion; Region <= LastRegion; Region++) {
+        if (!RtlCheckBit(&Mirror->DirtyRegions, Region)) {
+            RtlSetBit(&Mirror->DirtyRegions, Region);
+            NewRegions++;
+        }
+    }
+    KeReleaseSpinLock(&Mirror->DirtyRegionsLock, Irql);
+
+    if (NewRegions) {
+        InterlockedAdd64(&Mirror->DeviceInformation->Stats.MirrorDirtyRegions,
+                         NewRegions);
+    }
+}
+
+VOID
+WnbdMirrorFailLeg(_In_ PWNBD_MIRROR_LEG Leg)
+{
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&Leg->SendLock, TRUE);
+    if (-1 != Leg->Socket) {
+        WNBD_LOG_WARN("Mirror leg %d failed, closing socket FD: %d",
+                      Leg->Index, Leg->Socket);
+        Disconnect(Leg->Socket);
+        Leg->SocketToClose = Leg->Socket;
+        Leg->Socket = -1;
+    }
+    if (WnbdMirrorLegOffline != InterlockedExchange(
+            &Leg->State, WnbdMirrorLegOffline)) {
+        InterlockedIncrement64(
+            &Leg->Mirror->DeviceInformation->Stats.MirrorLegFailures);
+    }
+    ExReleaseResourceLite(&Leg->SendLock);
+    KeLeaveCriticalRegion();
+}
+
+VOID
+WnbdMirrorCompleteSrb(_In_ PSCSI_REQUEST_BLOCK Srb,
+                      _In_ PVOID DeviceExtension)
+{
+    WNBD_IO_LOG_INFO(WnbdEvtSrbCompleted, Srb, (UINT64)0, Srb->SrbStatus);
+    StorPortNotification(RequestComplete, DeviceExtension, Srb);
+}
+
+VOID
+WnbdMirrorFreeElement(_In_ PWNBD_MIRROR Mirror,
+                      _In_ PSRB_QUEUE_ELEMENT Element)
+{
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Mirror->DeviceInformation;
+
+    InterlockedIncrement64(&DeviceInformation->Stats.TotalReceivedIOReplies);
+    InterlockedDecrement64(&DeviceInformation->Stats.PendingSubmittedIORequests);
+    if (Element->Aborted) {
+        InterlockedIncrement64(&DeviceInformation->Stats.CompletedAbortedIORequests);
+    }
+    WnbdCongestionRelease(DeviceInformation->Congestion, Element, TRUE);
+    InterlockedDecrement(&DeviceInformation->Device->OutstandingIoCount);
+    ExFreePool(Element);
+}
+
+// Clears one of the element pending bits. The element is completed as
+// soon as the write quorum is reached and released once all the legs
+// are done with it.
+VOID
+WnbdMirrorReleaseBit(_In_ PWNBD_MIRROR Mirror,
+                     _In_ PSRB_QUEUE_ELEMENT Element,
+                     _In_ LONG Bit,
+                     _In_ BOOLEAN Success)
+{
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Mirror->DeviceInformation;
+    PSCSI_REQUEST_BLOCK Srb = NULL;
+    PVOID DeviceExtension = NULL;
+    BOOLEAN Notify = FALSE;
+    BOOLEAN Release = FALSE;
+    BOOLEAN Degraded = FALSE;
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&DeviceInformation->ReplyListLock, &Irql);
+    if (!(Element->PendingLegMask & Bit)) {
+        // The read got requeued.
+        KeReleaseSpinLock(&DeviceInformation->ReplyListLock, Irql);
+        return;
+    }
+
+    Element->PendingLegMask &= ~Bit;
+    if (Success) {
+        Element->SucceededLegCount++;
+    }
+
+    if (!Element->Completed && !Element->Aborted) {
+        if (Element->SucceededLegCount >= Element->RequiredLegCount) {
+            Notify = TRUE;
+            Element->Srb->DataTransferLength = Element->ReadLength;
+            Element->Srb->SrbStatus = SRB_STATUS_SUCCESS;
+        } else if (!Element->PendingLegMask) {
+            Notify = TRUE;
+            if (Element->SucceededLegCount) {
+                // At least one leg holds the data, the others will
+                // get resynced.
+                Degraded = TRUE;
+                Element->Srb->DataTransferLength = Element->ReadLength;
+                Element->Srb->SrbStatus = SRB_STATUS_SUCCESS;
+            } else {
+                Element->Srb->DataTransferLength = 0;
+                Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
+            }
+        }
+        if (Notify) {
+            Element->Completed = TRUE;
+            Srb = Element->Srb;
+            DeviceExtension = Element->DeviceExtension;
+            // The element may be released by another leg once we drop
+            // the lock.
+            WnbdIoCountersRecordCompletion(DeviceInformation->IoCounters,
+                                           Element);
+            WnbdTraceRequest(DeviceInformation, Element, WnbdTraceCompleted);
+        }
+    }
+
+    if (!Element->PendingLegMask) {
+        RemoveEntryList(&Element->Link);
+        WnbdDeadlineDisarm(Element);
+        Release = TRUE;
+    }
+    KeReleaseSpinLock(&DeviceInformation->ReplyListLock, Irql);
+
+    if (Degraded) {
+        InterlockedIncrement64(&DeviceInformation->Stats.MirrorDegradedWrites);
+    }
+    if (Notify) {
+        WnbdMirrorCompleteSrb(Srb, DeviceExtension);
+    }
+    if (Release) {
+        WnbdMirrorFreeElement(Mirror, Element);
+    }
+}
+
+// Handles the reply (or the failure) of a given leg. Each leg bit has a
+// single owner: the leg reply thread or, if the leg has already been
+// drained, the request thread.
+VOID
+WnbdMirrorFinishLeg(_In_ PWNBD_MIRROR Mirror,
+                    _In_ PWNBD_MIRROR_LEG Leg,
+                    _In_ PSRB_QUEUE_ELEMENT Element,
+                    _In_ BOOLEAN Success)
+{
+    // The request may have reached the disk even if it failed, so we're
+    // recording it either way.
+    WnbdCbtTrackElement(Mirror->DeviceInformation->Cbt, Element);
+
+    if (IsMirrorWriteOp(ElementNbdReqType(Element))) {
+        if (!Success) {
+            // The leg may have missed this write.
+            Leg->Stale = TRUE;
+        }
+        // Writes that land while their region is being copied may not be
+        // picked up by the copy, in which case the region is resynced
+        // again.
+        WnbdMirrorMarkDirty(Mirror, Element->StartingLbn,
+                            Element->ReadLength, Success);
+    }
+
+    InterlockedDecrement(&Leg->OutstandingIoCount);
+    WnbdMirrorReleaseBit(Mirror, Element, LEG_BIT(Leg), Success);
+}
+
+// Moves a read back to the request list so that it can be served
+// by another leg.
+VOID
+WnbdMirrorRequeueRead(_In_ PWNBD_MIRROR Mirror,
+                      _In_ PWNBD_MIRROR_LEG Leg,
+                      _In_ PSRB_QUEUE_ELEMENT Element)
+{
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Mirror->DeviceInformation;
+    BOOLEAN Requeue = FALSE;
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&DeviceInformation->ReplyListLock, &Irql);
+    if (Element->PendingLegMask & LEG_BIT(Leg)) {
+        Element->PendingLegMask = 0;
+        RemoveEntryList(&Element->Link);
+        WnbdDeadlineDisarm(Element);
+        Requeue = TRUE;
+    }
+    KeReleaseSpinLock(&DeviceInformation->ReplyListLock, Irql);
+
+    if (!Requeue) {
+        return;
+    }
+
+    InterlockedDecrement(&Leg->OutstandingIoCount);
+    InterlockedDecrement64(&DeviceInformation->Stats.PendingSubmittedIORequests);
+    InterlockedIncrement64(&DeviceInformation->Stats.UnsubmittedIORequests);
+
+    WNBD_LOG_INFO("Requeuing read %p 0x%llx, mirror leg %d failed.",
+                  Element->Srb, Element->Tag, Leg->Index);
+    Element->SucceededLegCount = 0;
+    Element->RequiredLegCount = 0;
+    ExInterlockedInsertHeadList(&DeviceInformation->RequestListHead,
+                                &Element->Link,
+                                &DeviceInformation->RequestListLock);
+    KeReleaseSemaphore(&DeviceInformation->DeviceEvent, 0, 1, FALSE);
+}
+
+VOID
+WnbdMirrorFinishInternal(_In_ PWNBD_MIRROR Mirror,
+                         _In_ PWNBD_MIRROR_REQUEST Request,
+                         _In_ NTSTATUS Status)
+{
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&Mirror->InternalListLock, &Irql);
+    if (Request->Pending) {
+        Request->Pending = FALSE;
+        RemoveEntryList(&Request->Link);
+        Request->Status = Status;
+        // The request lives on the waiter stack, this must be the last
+        // access.
+        KeSetEvent(&Request->Event, IO_NO_INCREMENT, FALSE);
+    }
+    KeReleaseSpinLock(&Mirror->InternalListLock, Irql);
+}
+
+// Fails or requeues every request that's still waiting for a reply
+// from a disconnected leg. Only called by the leg reply thread.
+//
+// The send lock is held throughout, so that the request thread may
+// reliably tell if the leg was already drained, in which case it has to
+// handle its own send failures.
+VOID
+WnbdMirrorDrainLeg(_In_ PWNBD_MIRROR_LEG Leg)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PWNBD_MIRROR Mirror = Leg->Mirror;
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Mirror->DeviceInformation;
+    PLIST_ENTRY ItemLink, ItemNext;
+    KIRQL Irql = { 0 };
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&Leg->SendLock, TRUE);
+    if (-1 != Leg->SocketToClose) {
+        WNBD_LOG_INFO("Closing socket FD: %d", Leg->SocketToClose);
+        Close(Leg->SocketToClose);
+        Leg->SocketToClose = -1;
+    }
+
+    while (TRUE) {
+        PSRB_QUEUE_ELEMENT Element = NULL;
+
+        KeAcquireSpinLock(&DeviceInformation->ReplyListLock, &Irql);
+        LIST_FORALL_SAFE(&DeviceInformation->ReplyListHead, ItemLink, ItemNext) {
+            Element = CONTAINING_RECORD(ItemLink, SRB_QUEUE_ELEMENT, Link);
+            if (Element->PendingLegMask & LEG_BIT(Leg)) {
+                break;
+            }
+            Element = NULL;
+        }
+        KeReleaseSpinLock(&DeviceInformation->ReplyListLock, Irql);
+
+        if (!Element) {
+            break;
+        }
+
+        // The element can't go away while our leg bit is set.
+        if (!Element->Aborted && IsReadSrb(Element->Srb) && !Mirror->Terminate) {
+            WnbdMirrorRequeueRead(Mirror, Leg, Element);
+        } else {
+            WnbdMirrorFinishLeg(Mirror, Leg, Element, FALSE);
+        }
+    }
+
+    KeAcquireSpinLock(&Mirror->InternalListLock, &Irql);
+    LIST_FORALL_SAFE(&Mirror->InternalListHead, ItemLink, ItemNext) {
+        PWNBD_MIRROR_REQUEST Request = CONTAINING_RECORD(
+            ItemLink, WNBD_MIRROR_REQUEST, Link);
+        if (Request->LegIndex == Leg->Index) {
+            Request->Pending = FALSE;
+            RemoveEntryList(&Request->Link);
+            Request->Status = STATUS_CONNECTION_DISCONNECTED;
+            KeSetEvent(&Request->Event, IO_NO_INCREMENT, FALSE);
+        }
+    }
+    KeReleaseSpinLock(&Mirror->InternalListLock, Irql);
+
+    Leg->Drained = TRUE;
+    ExReleaseResourceLite(&Leg->SendLock);
+    KeLeaveCriticalRegion();
+
+    WNBD_LOG_LOUD(": Exit");
+}
+
+#define WnbdMirrorBufferPool(Mirror) \
+    ((Mirror)->DeviceInformation->GlobalInformation->BufferPool)
+
+VOID
+WnbdMirrorProcessInternalReply(_In_ PWNBD_MIRROR_LEG Leg,
+                               _In_ PNBD_REPLY Reply)
+{
+    PWNBD_MIRROR Mirror = Leg->Mirror;
+    PWNBD_MIRROR_REQUEST Request = NULL;
+    PLIST_ENTRY ItemLink, ItemNext;
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&Mirror->InternalListLock, &Irql);
+    LIST_FORALL_SAFE(&Mirror->InternalListHead, ItemLink, ItemNext) {
+        Request = CONTAINING_RECORD(ItemLink, WNBD_MIRROR_REQUEST, Link);
+        if (Request->Tag == Reply->Handle) {
+            break;
+        }
+        Request = NULL;
+    }
+    KeReleaseSpinLock(&Mirror->InternalListLock, Irql);
+
+    if (!Request) {
+        WNBD_LOG_ERROR("Received resync reply with no matching request tag: 0x%llx",
+                       Reply->Handle);
+        WnbdMirrorFailLeg(Leg);
+        return;
+    }
+
+    NTSTATUS Status = Reply->Error ? STATUS_UNEXPECTED_IO_ERROR : STATUS_SUCCESS;
+    if (!Reply->Error && Request->Read) {
+        // The resync buffer is owned by the waiting thread, so there's
+        // no need for a staging buffer.
+        if (-1 == NbdReadExact(Leg->Socket, Request->Buffer,
+                               Request->Length, &Status)) {
+            if (NT_SUCCESS(Status)) {
+                Status = STATUS_CONNECTION_DISCONNECTED;
+            }
+            WnbdMirrorFailLeg(Leg);
+        }
+    }
+
+    WnbdMirrorFinishInternal(Mirror, Request, Status);
+}
+
+VOID
+WnbdMirrorProcessLegReply(_In_ PWNBD_MIRROR_LEG Leg)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PWNBD_MIRROR Mirror = Leg->Mirror;
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Mirror->DeviceInformation;
+    PSRB_QUEUE_ELEMENT Element = NULL;
+    PLIST_ENTRY ItemLink, ItemNext;
+    NBD_REPLY Reply = { 0 };
+    KIRQL Irql = { 0 };
+
+    NTSTATUS Status = NbdReadReply(Leg->Socket, &Reply);
+    if (Status) {
+        WnbdMirrorFailLeg(Leg);
+        return;
+    }
+
+    if (Reply.Handle & WNBD_MIRROR_INTERNAL_TAG) {
+        WnbdMirrorProcessInternalReply(Leg, &Reply);
+        return;
+    }
+
+    KeAcquireSpinLock(&DeviceInformation->ReplyListLock, &Irql);
+    LIST_FORALL_SAFE(&DeviceInformation->ReplyListHead, ItemLink, ItemNext) {
+        Element = CONTAINING_RECORD(ItemLink, SRB_QUEUE_ELEMENT, Link);
+        if (Element->Tag == Reply.Handle &&
+                (Element->PendingLegMask & LEG_BIT(Leg))) {
+            break;
+        }
+        Element = NULL;
+    }
+    KeReleaseSpinLock(&DeviceInformation->ReplyListLock, Irql);
+
+    if (!Element) {
+        WNBD_LOG_ERROR("Received reply with no matching request tag: 0x%llx",
+                       Reply.Handle);
+        WnbdMirrorFailLeg(Leg);
+        return;
+    }
+
+    WNBD_IO_LOG_LOUD(WnbdEvtMirrorReplyHeader, Leg->Index,
+                     Element->Srb, Element->Tag);
+
+    if (!Element->Read) {
+        if (Reply.Error) {
+            WNBD_LOG_INFO("Mirror leg %d reply contains error: %llu",
+                          Leg->Index, Reply.Error);
+        }
+        WnbdMirrorFinishLeg(Mirror, Leg, Element, !Reply.Error);
+        return;
+    }
+
+    if (Reply.Error) {
+        // Let the other leg serve this read.
+        WNBD_LOG_INFO("Mirror leg %d read reply contains error: %llu",
+                      Leg->Index, Reply.Error);
+        WnbdMirrorFailLeg(Leg);
+        return;
+    }
+
+    BOOLEAN Success = TRUE;
+    PVOID SrbBuff = NULL;
+    if (!Element->Aborted && STOR_STATUS_SUCCESS != StorPortGetSystemAddress(
+            Element->DeviceExtension, Element->Srb, &SrbBuff)) {
+        // We still have to receive the payload.
+        WNBD_LOG_ERROR("Could not get SRB %p 0x%llx data buffer.",
+                       Element->Srb, Element->Tag);
+        SrbBuff = NULL;
+        Success = FALSE;
+    }
+
+    Status = WnbdReceivePayload(DeviceInformation, Leg->Socket,
+                                Leg->ReceiveBuffer, Element, SrbBuff);
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Failed receiving reply %p 0x%llx. Error: %d",
+                       Element->Srb, Element->Tag, Status);
+        WnbdMirrorFailLeg(Leg);
+        return;
+    }
+
+    WnbdMirrorFinishLeg(Mirror, Leg, Element, Success);
+    WNBD_LOG_LOUD(": Exit");
+}
+
+VOID
+WnbdMirrorLegReplyThread(_In_ PVOID Context)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Context);
+
+    PWNBD_MIRROR_LEG Leg = (PWNBD_MIRROR_LEG)Context;
+    PWNBD_MIRROR Mirror = Leg->Mirror;
+    PAGED_CODE();
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    while (!Mirror->Terminate) {
+        if (WnbdMirrorLegOffline == Leg->State) {
+            WnbdMirrorDrainLeg(Leg);
+            KeSetEvent(&Mirror->ResyncEvent, IO_NO_INCREMENT, FALSE);
+            KeWaitForSingleObject(&Leg->ConnectedEvent, Executive,
+                                  KernelMode, FALSE, NULL);
+            continue;
+        }
+
+        WnbdMirrorProcessLegReply(Leg);
+    }
+
+    WnbdMirrorFailLeg(Leg);
+    WnbdMirrorDrainLeg(Leg);
+
+    WNBD_LOG_INFO("Terminating mirror leg %d reply thread.", Leg->Index);
+    (void)PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+PWNBD_MIRROR_LEG
+WnbdMirrorPickReadLeg(_In_ PWNBD_MIRROR Mirror)
+{
+    PWNBD_MIRROR_LEG Selected = NULL;
+
+    for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+        PWNBD_MIRROR_LEG Leg = &Mirror->Legs[Index];
+        if (WnbdMirrorLegOnline != Leg->State) {
+            continue;
+        }
+        if (!Selected || Leg->OutstandingIoCount < Selected->OutstandingIoCount) {
+            Selected = Leg;
+        }
+    }
+
+    return Selected;
+}
+
+NTSTATUS
+WnbdMirrorSend(_In_ PWNBD_MIRROR_LEG Leg,
+               _In_ int NbdReqType,
+               _In_ DWORD NbdTransmissionFlags,
+               _In_ UINT64 Offset,
+               _In_ ULONG Length,
+               _In_ UINT64 Tag,
+               _In_opt_ PVOID Buffer,
+               // Required by writes, may be shared by the legs since
+               // the requests are sent one at a time.
+               _In_opt_ PVOID StagingBuffer,
+               _Out_ PBOOLEAN Drained)
+{
+    NTSTATUS Status = STATUS_CONNECTION_DISCONNECTED;
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&Leg->SendLock, TRUE);
+    *Drained = Leg->Drained;
+    if (WnbdMirrorLegOffline == Leg->State || -1 == Leg->Socket) {
+        goto Exit;
+    }
+
+    if (NBD_CMD_WRITE == NbdReqType) {
+        NbdWriteStat(Leg->Socket, Offset, Length, &Status, Buffer,
+                     StagingBuffer, Tag, NbdTransmissionFlags);
+    } else {
+        NbdRequest(Leg->Socket, Offset, Length, &Status, Tag,
+                   NbdReqType | NbdTransmissionFlags);
+    }
+
+    if (Status) {
+        WNBD_LOG_INFO("Mirror leg %d send failed with: %x. Tag: 0x%llx",
+                      Leg->Index, Status, Tag);
+        WnbdMirrorFailLeg(Leg);
+    }
+
+Exit:
+    ExReleaseResourceLite(&Leg->SendLock);
+    KeLeaveCriticalRegion();
+    return Status;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdMirrorSubmit(PWNBD_MIRROR Mirror,
+                 PSRB_QUEUE_ELEMENT Element,
+                 int NbdReqType,
+                 DWORD NbdTransmissionFlags)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Mirror->DeviceInformation;
+    PVOID SrbBuff = NULL, StagingBuffer = NULL;
+    LONG LegMask = 0;
+    LONG LegCount = 0;
+
+    if (NBD_CMD_READ == NbdReqType) {
+        PWNBD_MIRROR_LEG Leg = WnbdMirrorPickReadLeg(Mirror);
+        if (Leg) {
+            LegMask = LEG_BIT(Leg);
+            LegCount = 1;
+        }
+    } else {
+        for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+            PWNBD_MIRROR_LEG Leg = &Mirror->Legs[Index];
+            if (WnbdMirrorLegOffline != Leg->State) {
+                LegMask |= LEG_BIT(Leg);
+                LegCount++;
+            } else if (IsMirrorWriteOp(NbdReqType)) {
+                Leg->Stale = TRUE;
+            }
+        }
+        if (IsMirrorWriteOp(NbdReqType) && LegCount) {
+            BOOLEAN Degraded = LegCount < WNBD_MIRROR_LEG_COUNT;
+            if (Degraded) {
+                InterlockedIncrement64(&DeviceInformation->Stats.MirrorDegradedWrites);
+            }
+            WnbdMirrorMarkDirty(Mirror, Element->StartingLbn,
+                                Element->ReadLength, !Degraded);
+        }
+    }
+
+    if (NBD_CMD_WRITE == NbdReqType && LegCount) {
+        if (STOR_STATUS_SUCCESS != StorPortGetSystemAddress(
+                Element->DeviceExtension, Element->Srb, &SrbBuff)) {
+            LegCount = 0;
+        }
+    }
+
+    if (!LegCount) {
+        WNBD_LOG_WARN("No mirror leg available for %s request %p 0x%llx.",
+                      NbdRequestTypeStr(NbdReqType), Element->Srb, Element->Tag);
+        WnbdCompleteUnsubmittedElement(DeviceInformation, Element,
+                                       SRB_STATUS_ABORTED);
+        return;
+    }
+
+    if (NBD_CMD_WRITE == NbdReqType) {
+        // Acquired before inserting the element so that pool exhaustion
+        // doesn't affect the legs.
+        StagingBuffer = WnbdBufferPoolAcquire(
+            WnbdMirrorBufferPool(Mirror),
+            Element->ReadLength + sizeof(NBD_REQUEST));
+        if (!StagingBuffer) {
+            // Storport will retry the request later on.
+            WnbdCompleteUnsubmittedElement(DeviceInformation, Element,
+                                           SRB_STATUS_BUSY);
+            return;
+        }
+    }
+
+    Element->PendingLegMask = LegMask | SUBMIT_BIT;
+    Element->SucceededLegCount = 0;
+    Element->RequiredLegCount = min((LONG)Mirror->WriteQuorum, LegCount);
+    Element->Completed = FALSE;
+
+    for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+        if (LegMask & (1 << Index)) {
+            InterlockedIncrement(&Mirror->Legs[Index].OutstandingIoCount);
+        }
+    }
+
+    WnbdInsertReplyElement(DeviceInformation, Element);
+    InterlockedDecrement64(&DeviceInformation->Stats.UnsubmittedIORequests);
+    InterlockedIncrement64(&DeviceInformation->Stats.TotalSubmittedIORequests);
+    InterlockedIncrement64(&DeviceInformation->Stats.PendingSubmittedIORequests);
+
+    UINT64 Tag = Element->Tag;
+    UINT64 Offset = Element->StartingLbn;
+    ULONG Length = Element->ReadLength;
+    BOOLEAN Read = NBD_CMD_READ == NbdReqType;
+
+    WNBD_IO_LOG_LOUD(WnbdEvtMirrorSendingRequest, NbdReqType,
+                     Element->Srb, Tag, LegMask);
+
+    for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+        PWNBD_MIRROR_LEG Leg = &Mirror->Legs[Index];
+        if (!(LegMask & LEG_BIT(Leg))) {
+            continue;
+        }
+
+        BOOLEAN Drained = FALSE;
+        NTSTATUS Status = WnbdMirrorSend(
+            Leg, NbdReqType, NbdTransmissionFlags,
+            Offset, Length, Tag, SrbBuff, StagingBuffer, &Drained);
+        if (Status && Drained) {
+            // The reply thread drained this leg before we managed to
+            // insert the element, so it's up to us to handle the failure.
+            // Otherwise, the element will be picked up by the drain.
+            if (Read && !Element->Aborted) {
+                WnbdMirrorRequeueRead(Mirror, Leg, Element);
+            } else {
+                WnbdMirrorFinishLeg(Mirror, Leg, Element, FALSE);
+            }
+        }
+    }
+
+    if (StagingBuffer) {
+        WnbdBufferPoolRelease(WnbdMirrorBufferPool(Mirror), StagingBuffer);
+    }
+    WnbdMirrorReleaseBit(Mirror, Element, SUBMIT_BIT, FALSE);
+
+    WNBD_LOG_LOUD(": Exit");
+}
+
+NTSTATUS
+WnbdMirrorInternalRequest(_In_ PWNBD_MIRROR Mirror,
+                          _In_ PWNBD_MIRROR_LEG Leg,
+                          _In_ int NbdReqType,
+                          _In_ UINT64 Offset,
+                          _In_ ULONG Length,
+                          _In_ PVOID Buffer)
+{
+    WNBD_MIRROR_REQUEST Request = { 0 };
+    PVOID StagingBuffer = NULL;
+
+    if (NBD_CMD_WRITE == NbdReqType) {
+        // The region will be resynced again later on, there's no need
+        // to fail the leg.
+        StagingBuffer = WnbdBufferPoolAcquire(
+            WnbdMirrorBufferPool(Mirror), Length + sizeof(NBD_REQUEST));
+        if (!StagingBuffer) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    Request.Tag = (UINT64)InterlockedIncrement64(
+        (PLONG64)&Mirror->InternalTag) | WNBD_MIRROR_INTERNAL_TAG;
+    Request.LegIndex = Leg->Index;
+    Request.Read = NBD_CMD_READ == NbdReqType;
+    Request.Pending = TRUE;
+    Request.Buffer = Buffer;
+    Request.Length = Length;
+    KeInitializeEvent(&Request.Event, NotificationEvent, FALSE);
+
+    ExInterlockedInsertTailList(&Mirror->InternalListHead, &Request.Link,
+                                &Mirror->InternalListLock);
+
+    BOOLEAN Drained = FALSE;
+    NTSTATUS Status = WnbdMirrorSend(Leg, NbdReqType, 0, Offset, Length,
+                                     Request.Tag, Buffer, StagingBuffer,
+                                     &Drained);
+    if (StagingBuffer) {
+        WnbdBufferPoolRelease(WnbdMirrorBufferPool(Mirror), StagingBuffer);
+    }
+    if (Status && Drained) {
+        WnbdMirrorFinishInternal(Mirror, &Request, Status);
+    }
+
+    KeWaitForSingleObject(&Request.Event, Executive, KernelMode, FALSE, NULL);
+    return Request.Status;
+}
+
+BOOLEAN
+WnbdMirrorReconnectLeg(_In_ PWNBD_MIRROR Mirror,
+                       _In_ PWNBD_MIRROR_LEG Leg)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PWNBD_PROPERTIES Properties = &Mirror->DeviceInformation->UserEntry->Properties;
+    PNBD_CONNECTION_PROPERTIES NbdProperties = Leg->NbdProperties;
+
+    INT Sock = NbdOpenAndConnect(NbdProperties->Hostname,
+                                 NbdProperties->PortNumber);
+    if (-1 == Sock) {
+        return FALSE;
+    }
+
+    if (!NbdProperties->Flags.SkipNegotiation) {
+        UINT64 DiskSize = 0;
+        UINT16 NbdFlags = 0;
+        NTSTATUS Status = NbdNegotiate(&Sock, &DiskSize, &NbdFlags,
+                                       NbdProperties->ExportName, 1, 1);
+        if (!NT_SUCCESS(Status) ||
+                DiskSize < Properties->BlockCount * Properties->BlockSize) {
+            WNBD_LOG_WARN("Could not reconnect mirror leg %d. Status: %x, "
+                          "disk size: %llu.", Leg->Index, Status, DiskSize);
+            Close(Sock);
+            return FALSE;
+        }
+    }
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&Leg->SendLock, TRUE);
+    Leg->Socket = Sock;
+    Leg->SocketToClose = -1;
+    Leg->Drained = FALSE;
+    InterlockedExchange(&Leg->State, Leg->Stale ?
+        WnbdMirrorLegResyncing : WnbdMirrorLegOnline);
+    ExReleaseResourceLite(&Leg->SendLock);
+    KeLeaveCriticalRegion();
+
+    WNBD_LOG_INFO("Reconnected mirror leg %d. Socket FD: %d. Stale: %d.",
+                  Leg->Index, Sock, Leg->Stale);
+    KeSetEvent(&Leg->ConnectedEvent, IO_NO_INCREMENT, FALSE);
+
+    WNBD_LOG_LOUD(": Exit");
+    return TRUE;
+}
+
+// Copies the dirty regions from the source leg to the target leg.
+// Returns TRUE once the dirty region log is empty.
+BOOLEAN
+WnbdMirrorResyncLeg(_In_ PWNBD_MIRROR Mirror,
+                    _In_ PWNBD_MIRROR_LEG Source,
+                    _In_ PWNBD_MIRROR_LEG Target,
+                    _In_ PVOID Buffer,
+                    _In_ ULONG BufferLength)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Mirror->DeviceInformation;
+    PWNBD_PROPERTIES Properties = &DeviceInformation->UserEntry->Properties;
+    UINT64 DiskSize = Properties->BlockCount * Properties->BlockSize;
+    KIRQL Irql = { 0 };
+
+    while (!Mirror->Terminate &&
+           WnbdMirrorLegOnline == Source->State &&
+           WnbdMirrorLegResyncing == Target->State) {
+        KeAcquireSpinLock(&Mirror->DirtyRegionsLock, &Irql);
+        ULONG Region = RtlFindSetBits(&Mirror->DirtyRegions, 1, 0);
+        if (MAXULONG != Region) {
+            // Writes submitted or completed while this region is being
+            // copied will mark it as dirty again, so it'll get picked up
+            // by a subsequent iteration.
+            RtlClearBit(&Mirror->DirtyRegions, Region);
+            Mirror->ResyncRegion = Region;
+        }
+        KeReleaseSpinLock(&Mirror->DirtyRegionsLock, Irql);
+
+        if (MAXULONG == Region) {
+            WNBD_LOG_INFO("Mirror leg %d resync completed.", Target->Index);
+            return TRUE;
+        }
+
+        UINT64 Offset = (UINT64)Region << Mirror->RegionShift;
+        UINT64 End = min(Offset + (1ULL << Mirror->RegionShift), DiskSize);
+        NTSTATUS Status = STATUS_SUCCESS;
+
+        while (Offset < End && NT_SUCCESS(Status)) {
+            ULONG Length = (ULONG)min(End - Offset, BufferLength);
+
+            Status = WnbdMirrorInternalRequest(Mirror, Source, NBD_CMD_READ,
+                                               Offset, Length, Buffer);
+            if (NT_SUCCESS(Status)) {
+                Status = WnbdMirrorInternalRequest(Mirror, Target, NBD_CMD_WRITE,
+                                                   Offset, Length, Buffer);
+            }
+            if (!NT_SUCCESS(Status)) {
+                break;
+            }
+
+            InterlockedAdd64(&DeviceInformation->Stats.MirrorResyncedBytes, Length);
+            Offset += Length;
+
+            if (Mirror->ResyncBandwidth) {
+                // Throttle the resync so that it won't starve foreground IO.
+                LARGE_INTEGER Delay;
+                Delay.QuadPart = -(LONGLONG)(
+                    (UINT64)Length * 10000000ULL / Mirror->ResyncBandwidth);
+                KeDelayExecutionThread(KernelMode, FALSE, &Delay);
+            }
+        }
+
+        KeAcquireSpinLock(&Mirror->DirtyRegionsLock, &Irql);
+        Mirror->ResyncRegion = MAXULONG;
+        KeReleaseSpinLock(&Mirror->DirtyRegionsLock, Irql);
+        InterlockedDecrement64(&DeviceInformation->Stats.MirrorDirtyRegions);
+
+        if (!NT_SUCCESS(Status)) {
+            WNBD_LOG_WARN("Could not resync region %lu. Status: %x.",
+                          Region, Status);
+            WnbdMirrorMarkDirty(Mirror, (UINT64)Region << Mirror->RegionShift,
+                                1, FALSE);
+            return FALSE;
+        }
+    }
+
+    WNBD_LOG_LOUD(": Exit");
+    return FALSE;
+}
+
+VOID
+WnbdMirrorResyncThread(_In_ PVOID Context)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Context);
+
+    PWNBD_MIRROR Mirror = (PWNBD_MIRROR)Context;
+    ULONG BufferLength = min(1UL << Mirror->RegionShift,
+                             WNBD_DEFAULT_MAX_TRANSFER_LENGTH);
+    PVOID Buffer = MirrorMalloc(BufferLength);
+    LARGE_INTEGER Timeout;
+    Timeout.QuadPart = -(LONGLONG)WNBD_MIRROR_RESYNC_POLL_INTERVAL_MS * 10000;
+    PAGED_CODE();
+
+    if (!Buffer) {
+        WNBD_LOG_ERROR("Could not allocate mirror resync buffer.");
+    }
+
+    while (!Mirror->Terminate) {
+        KeWaitForSingleObject(&Mirror->ResyncEvent, Executive, KernelMode,
+                              FALSE, &Timeout);
+        if (Mirror->Terminate) {
+            break;
+        }
+
+        for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+            PWNBD_MIRROR_LEG Leg = &Mirror->Legs[Index];
+            if (WnbdMirrorLegOffline == Leg->State && Leg->Drained) {
+                WnbdMirrorReconnectLeg(Mirror, Leg);
+            }
+        }
+
+        for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT && Buffer; Index++) {
+            PWNBD_MIRROR_LEG Target = &Mirror->Legs[Index];
+            PWNBD_MIRROR_LEG Source = &Mirror->Legs[(Index + 1) % WNBD_MIRROR_LEG_COUNT];
+            if (WnbdMirrorLegResyncing != Target->State ||
+                    WnbdMirrorLegOnline != Source->State) {
+                continue;
+            }
+
+            if (WnbdMirrorResyncLeg(Mirror, Source, Target, Buffer, BufferLength)) {
+                Target->Stale = FALSE;
+                InterlockedCompareExchange(&Target->State, WnbdMirrorLegOnline,
+                                           WnbdMirrorLegResyncing);
+            }
+        }
+    }
+
+    if (Buffer) {
+        ExFreePool(Buffer);
+    }
+
+    WNBD_LOG_INFO("Terminating mirror resync thread.");
+    (void)PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdMirrorCreate(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                 INT PrimarySocket,
+                 INT SecondarySocket,
+                 PWNBD_MIRROR* PMirror)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(DeviceInformation);
+    ASSERT(PMirror);
+
+    NTSTATUS Status = STATUS_SUCCESS;
+    PWNBD_PROPERTIES Properties = &DeviceInformation->UserEntry->Properties;
+    PWNBD_MIRROR_PROPERTIES MirrorProperties =
+        &DeviceInformation->UserEntry->ExtendedProperties.MirrorProperties;
+    *PMirror = NULL;
+
+    PWNBD_MIRROR Mirror = (PWNBD_MIRROR) MirrorMalloc(sizeof(WNBD_MIRROR));
+    if (!Mirror) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Mirror, sizeof(WNBD_MIRROR));
+
+    Mirror->DeviceInformation = DeviceInformation;
+    Mirror->ResyncRegion = MAXULONG;
+    Mirror->ResyncBandwidth = MirrorProperties->ResyncBandwidth;
+    Mirror->WriteQuorum = MirrorProperties->WriteQuorum;
+    if (!Mirror->WriteQuorum || Mirror->WriteQuorum > WNBD_MIRROR_LEG_COUNT) {
+        Mirror->WriteQuorum = WNBD_MIRROR_LEG_COUNT;
+    }
+
+    UINT32 RegionSize = MirrorProperties->DirtyRegionSize;
+    if (!RegionSize || (RegionSize & (RegionSize - 1)) ||
+            RegionSize < Properties->BlockSize) {
+        RegionSize = WNBD_MIRROR_DEFAULT_REGION_SIZE;
+    }
+    while ((1UL << Mirror->RegionShift) < RegionSize) {
+        Mirror->RegionShift++;
+    }
+
+    UINT64 DiskSize = Properties->BlockCount * Properties->BlockSize;
+    while (((DiskSize - 1) >> Mirror->RegionShift) >= MAXULONG) {
+        Mirror->RegionShift++;
+    }
+    Mirror->RegionCount = (ULONG)(((DiskSize - 1) >> Mirror->RegionShift) + 1);
+    MirrorProperties->DirtyRegionSize = 1UL << Mirror->RegionShift;
+    MirrorProperties->WriteQuorum = Mirror->WriteQuorum;
+
+    Mirror->DirtyRegionsBuffer = (PULONG) MirrorMalloc(
+        ALIGN_UP_BY(Mirror->RegionCount, 32) / 8);
+    if (!Mirror->DirtyRegionsBuffer) {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlInitializeBitMap(&Mirror->DirtyRegions, Mirror->DirtyRegionsBuffer,
+                        Mirror->RegionCount);
+    RtlClearAllBits(&Mirror->DirtyRegions);
+    KeInitializeSpinLock(&Mirror->DirtyRegionsLock);
+
+    InitializeListHead(&Mirror->InternalListHead);
+    KeInitializeSpinLock(&Mirror->InternalListLock);
+    KeInitializeEvent(&Mirror->ResyncEvent, SynchronizationEvent, FALSE);
+
+    for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+        PWNBD_MIRROR_LEG Leg = &Mirror->Legs[Index];
+        Leg->Mirror = Mirror;
+        Leg->Index = Index;
+        Leg->Socket = -1;
+        Leg->SocketToClose = -1;
+        Leg->NbdProperties = Index ?
+            &MirrorProperties->NbdProperties : &Properties->NbdProperties;
+        KeInitializeEvent(&Leg->ConnectedEvent, SynchronizationEvent, FALSE);
+
+        Status = ExInitializeResourceLite(&Leg->SendLock);
+        if (!NT_SUCCESS(Status)) {
+            goto Exit;
+        }
+
+        Leg->ReceiveBuffer = MirrorMalloc(WNBD_RECEIVE_BUFFER_SIZE);
+        if (!Leg->ReceiveBuffer) {
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+    }
+
+    // The sockets are owned by the mirror from now on.
+    Mirror->Legs[0].Socket = PrimarySocket;
+    Mirror->Legs[0].State = WnbdMirrorLegOnline;
+    Mirror->Legs[1].Socket = SecondarySocket;
+    Mirror->Legs[1].State = WnbdMirrorLegOnline;
+
+    WNBD_LOG_INFO("Created mirror. Region size: %lu, region count: %lu, "
+                  "write quorum: %lu, resync bandwidth: %llu.",
+                  1UL << Mirror->RegionShift, Mirror->RegionCount,
+                  Mirror->WriteQuorum, Mirror->ResyncBandwidth);
+    *PMirror = Mirror;
+
+Exit:
+    if (!NT_SUCCESS(Status)) {
+        WnbdMirrorDelete(Mirror);
+    }
+    WNBD_LOG_LOUD(": Exit");
+    return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdMirrorStart(PWNBD_MIRROR Mirror)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Mirror);
+    NTSTATUS Status = STATUS_SUCCESS;
+    HANDLE ThreadHandle = NULL;
+
+    for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+        PWNBD_MIRROR_LEG Leg = &Mirror->Legs[Index];
+        Status = PsCreateSystemThread(&ThreadHandle, (ACCESS_MASK)0L, NULL,
+                                      NULL, NULL, WnbdMirrorLegReplyThread, Leg);
+        if (!NT_SUCCESS(Status)) {
+            goto Exit;
+        }
+        Status = ObReferenceObjectByHandle(ThreadHandle, THREAD_ALL_ACCESS, NULL,
+                                           KernelMode, &Leg->ReplyThread, NULL);
+        ZwClose(ThreadHandle);
+        if (!NT_SUCCESS(Status)) {
+            goto Exit;
+        }
+    }
+
+    Status = PsCreateSystemThread(&ThreadHandle, (ACCESS_MASK)0L, NULL,
+                                  NULL, NULL, WnbdMirrorResyncThread, Mirror);
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
+    Status = ObReferenceObjectByHandle(ThreadHandle, THREAD_ALL_ACCESS, NULL,
+                                       KernelMode, &Mirror->ResyncThread, NULL);
+    ZwClose(ThreadHandle);
+
+Exit:
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Could not start mirror threads. Status: %x.", Status);
+        WnbdMirrorStop(Mirror);
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    WNBD_LOG_LOUD(": Exit");
+    return Status;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdMirrorStop(PWNBD_MIRROR Mirror)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Mirror);
+
+    Mirror->Terminate = TRUE;
+    KeSetEvent(&Mirror->ResyncEvent, IO_NO_INCREMENT, FALSE);
+    for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+        WnbdMirrorFailLeg(&Mirror->Legs[Index]);
+        KeSetEvent(&Mirror->Legs[Index].ConnectedEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    // The resync thread may be waiting for replies, so the leg threads
+    // must be stopped first.
+    for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+        PWNBD_MIRROR_LEG Leg = &Mirror->Legs[Index];
+        if (Leg->ReplyThread) {
+            KeWaitForSingleObject(Leg->ReplyThread, Executive, KernelMode, FALSE, NULL);
+            ObDereferenceObject(Leg->ReplyThread);
+            Leg->ReplyThread = NULL;
+        }
+    }
+    if (Mirror->ResyncThread) {
+        KeWaitForSingleObject(Mirror->ResyncThread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(Mirror->ResyncThread);
+        Mirror->ResyncThread = NULL;
+    }
+
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+VOID
+WnbdMirrorDelete(PWNBD_MIRROR Mirror)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Mirror) {
+        return;
+    }
+
+    for (ULONG Index = 0; Index < WNBD_MIRROR_LEG_COUNT; Index++) {
+        PWNBD_MIRROR_LEG Leg = &Mirror->Legs[Index];
+        if (-1 != Leg->Socket) {
+            Close(Leg->Socket);
+        }
+        if (-1 != Leg->SocketToClose) {
+            Close(Leg->SocketToClose);
+        }
+        if (Leg->Mirror) {
+            ExDeleteResourceLite(&Leg->SendLock);
+        }
+        if (Leg->ReceiveBuffer) {
+            ExFreePool(Leg->ReceiveBuffer);
+        }
+    }
+
+    if (Mirror->DirtyRegionsBuffer) {
+        ExFreePool(Mirror->DirtyRegionsBuffer);
+    }
+    ExFreePool(Mirror);
+
+    WNBD_LOG_LOUD(": Exit");
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef MIRROR_H
+#define MIRROR_H 1
+
+#include "common.h"
+#include "userspace.h"
+#include "util.h"
+
+#define WNBD_MIRROR_LEG_COUNT 2
+#define WNBD_MIRROR_DEFAULT_REGION_SIZE (1024 * 1024)
+// Resync requests use the upper tag bit so that they can't collide
+// with the tags assigned by the request thread.
+#define WNBD_MIRROR_INTERNAL_TAG (1ULL << 63)
+#define WNBD_MIRROR_RESYNC_POLL_INTERVAL_MS 1000
+
+typedef enum
+{
+    WnbdMirrorLegOffline = 0,
+    WnbdMirrorLegOnline = 1,
+    // The leg is connected and receives writes but it may not be
+    // used for reads until the dirty regions are copied.
+    WnbdMirrorLegResyncing = 2
+} WnbdMirrorLegState;
+
+typedef struct _WNBD_MIRROR WNBD_MIRROR, *PWNBD_MIRROR;
+
+typedef struct _WNBD_MIRROR_LEG
+{
+    PWNBD_MIRROR                Mirror;
+    ULONG                       Index;
+    PNBD_CONNECTION_PROPERTIES  NbdProperties;
+
+    INT                         Socket;
+    INT                         SocketToClose;
+    // Serializes sends coming from the request thread and the
+    // resync thread.
+    ERESOURCE                   SendLock;
+    volatile LONG               State;
+    // Set when the leg missed writes, in which case it has to be
+    // resynced before serving reads.
+    BOOLEAN                     Stale;
+    LONG                        OutstandingIoCount;
+
+    PVOID                       ReplyThread;
+    // Set by the reply thread once the requests pending on a failed
+    // connection were handled, allowing the leg to be reconnected.
+    BOOLEAN                     Drained;
+    // Signaled when the leg gets reconnected.
+    KEVENT                      ConnectedEvent;
+    // Used by the reply thread when the staging buffer pool is exhausted.
+    PVOID                       ReceiveBuffer;
+} WNBD_MIRROR_LEG, *PWNBD_MIRROR_LEG;
+
+typedef struct _WNBD_MIRROR_REQUEST
+{
+    LIST_ENTRY                  Link;
+    UINT64                      Tag;
+    ULONG                       LegIndex;
+    BOOLEAN                     Read;
+    BOOLEAN                     Pending;
+    PVOID                       Buffer;
+    ULONG                       Length;
+    NTSTATUS                    Status;
+    KEVENT                      Event;
+} WNBD_MIRROR_REQUEST, *PWNBD_MIRROR_REQUEST;
+
+typedef struct _WNBD_MIRROR
+{
+    PSCSI_DEVICE_INFORMATION    DeviceInformation;
+    WNBD_MIRROR_LEG             Legs[WNBD_MIRROR_LEG_COUNT];
+
+    ULONG                       WriteQuorum;
+    UINT64                      ResyncBandwidth;
+
+    // Dirty region log. A set bit means that the legs may differ.
+    RTL_BITMAP                  DirtyRegions;
+    PULONG                      DirtyRegionsBuffer;
+    KSPIN_LOCK                  DirtyRegionsLock;
+    ULONG                       RegionShift;
+    ULONG                       RegionCount;
+    // Region currently being copied, MAXULONG if idle. Protected by
+    // DirtyRegionsLock.
+    ULONG                       ResyncRegion;
+
+    // Resync requests, kept separately from the SRB reply list.
+    LIST_ENTRY                  InternalListHead;
+    KSPIN_LOCK                  InternalListLock;
+    UINT64                      InternalTag;
+
+    PVOID                       ResyncThread;
+    KEVENT                      ResyncEvent;
+    BOOLEAN                     Terminate;
+} WNBD_MIRROR;
+
+NTSTATUS
+WnbdMirrorCreate(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                 _In_ INT PrimarySocket,
+                 _In_ INT SecondarySocket,
+                 _Out_ PWNBD_MIRROR* PMirror);
+
+NTSTATUS
+WnbdMirrorStart(_In_ PWNBD_MIRROR Mirror);
+
+VOID
+WnbdMirrorStop(_In_ PWNBD_MIRROR Mirror);
+
+VOID
+WnbdMirrorDelete(_In_ PWNBD_MIRROR Mirror);
+
+VOID
+WnbdMirrorSubmit(_In_ PWNBD_MIRROR Mirror,
+                 _In_ PSRB_QUEUE_ELEMENT Element,
+                 _In_ int NbdReqType,
+                 _In_ DWORD NbdTransmissionFlags);
+
+#endif
@@ -28,7 +28,7 @@ NbdReadExact(_In_ INT Fd,
     INT Result = 0;
     PUCHAR Temp = Data;
     while (0 < Length) {
-        WNBD_LOG_INFO("Size to read = %lu", Length);
+        WNBD_IO_LOG_INFO(WnbdEvtNbdReadChunk, Length);
         Result = Recv(Fd, Temp, Length, WSK_FLAG_WAITALL, error);
         if (Result > 0) {
             Length -= Result;
@@ -58,7 +58,7 @@ NbdWriteExact(_In_ INT Fd,
     INT Result = 0;
     PUCHAR Temp = Data;
     while (Length > 0) {
-        WNBD_LOG_INFO("Size to send = %lu", Length);
+        WNBD_IO_LOG_INFO(WnbdEvtNbdSendChunk, Length);
         Result = Send(Fd, Temp, Length, 0, error);
         if (Result <= 0) {
             WNBD_LOG_ERROR("Failed with : %d", Result);
@@ -436,15 +436,14 @@ NbdWriteStat(INT Fd,
              ULONG Length,
              PNTSTATUS IoStatus,
              PVOID SystemBuffer,
-             PVOID *PreallocatedBuffer,
-             PULONG PreallocatedLength,
+             PVOID StagingBuffer,
              UINT64 Handle,
              UINT32 NbdTransmissionFlags)
 {
     WNBD_LOG_LOUD(": Enter");
 
     NTSTATUS Status = STATUS_SUCCESS;
-    if (SystemBuffer == NULL) {
+    if (SystemBuffer == NULL || StagingBuffer == NULL) {
         Status = STATUS_INSUFFICIENT_RESOURCES;
         goto Exit;
     }
@@ -459,31 +458,17 @@ NbdWriteStat(INT Fd,
     Request.From = RtlUlonglongByteSwap(Offset);
     Request.Handle = Handle;
 
-    UINT Needed = Length + sizeof(NBD_REQUEST);
-    if (*PreallocatedLength < Needed) {
-        PCHAR Buf = NULL;
-        Buf = NbdMalloc(Needed);
-        if (NULL == Buf) {
-            WNBD_LOG_ERROR("Insufficient resources");
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            goto Exit;
-        }
-        ExFreePool(*PreallocatedBuffer);
-        *PreallocatedLength = Needed;
-        *PreallocatedBuffer = Buf;
-    }
-
     if (-1 == Fd) {
         WNBD_LOG_ERROR("Invalid socket");
         Status = STATUS_INVALID_SESSION;
         goto Exit;
     }
 #pragma warning(disable:6386)
-    RtlCopyMemory(*PreallocatedBuffer, &Request, sizeof(NBD_REQUEST));
+    RtlCopyMemory(StagingBuffer, &Request, sizeof(NBD_REQUEST));
 #pragma warning(default:6386)
-    RtlCopyMemory(((PCHAR)*PreallocatedBuffer + sizeof(NBD_REQUEST)), SystemBuffer, Length);
+    RtlCopyMemory(((PCHAR)StagingBuffer + sizeof(NBD_REQUEST)), SystemBuffer, Length);
 
-    if (-1 == NbdWriteExact(Fd, *PreallocatedBuffer, sizeof(NBD_REQUEST) + Length, &error)) {
+    if (-1 == NbdWriteExact(Fd, StagingBuffer, sizeof(NBD_REQUEST) + Length, &error)) {
         WNBD_LOG_ERROR("Could not send request for NBD_CMD_WRITE");
         Status = error;
         goto Exit;
@@ -123,8 +123,8 @@ NbdWriteStat(_In_ INT Fd,
              _In_ ULONG Length,
              _Out_ PNTSTATUS IoStatus,
              _In_ PVOID SystemBuffer,
-             _In_ PVOID *PreallocatedBuffer,
-             _In_ PULONG PreallocatedLength,
+             // At least "Length" + sizeof(NBD_REQUEST) bytes.
+             _In_ PVOID StagingBuffer,
              _In_ UINT64 Handle,
              _In_ UINT32 NbdTransmissionFlags);
 #pragma alloc_text (PAGE, NbdWriteStat)
@@ -0,0 +1,502 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include <ntifs.h>
+
+#include "cbt.h"
+#include "common.h"
+#include "debug.h"
+#include "io_stats.h"
+#include "io_trace.h"
+#include "nbd_protocol.h"
+#include "overlay.h"
+#include "srb_helper.h"
+#include "userspace.h"
+#include "util.h"
+
+#define OverlayMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'oDBN')
+
+RTL_GENERIC_COMPARE_RESULTS
+WnbdOverlayCompareExtents(_In_ PRTL_AVL_TABLE Table,
+                          _In_ PVOID FirstStruct,
+                          _In_ PVOID SecondStruct)
+{
+    UNREFERENCED_PARAMETER(Table);
+    PWNBD_OVERLAY_EXTENT First = (PWNBD_OVERLAY_EXTENT)FirstStruct;
+    PWNBD_OVERLAY_EXTENT Second = (PWNBD_OVERLAY_EXTENT)SecondStruct;
+
+    // Overlapping extents are considered equal, which allows looking
+    // up the extents that intersect a given range.
+    if (First->End <= Second->Start) {
+        return GenericLessThan;
+    }
+    if (First->Start >= Second->End) {
+        return GenericGreaterThan;
+    }
+    return GenericEqual;
+}
+
+PVOID
+WnbdOverlayAllocateEntry(_In_ PRTL_AVL_TABLE Table,
+                         _In_ CLONG ByteSize)
+{
+    UNREFERENCED_PARAMETER(Table);
+    return OverlayMalloc(ByteSize);
+}
+
+VOID
+WnbdOverlayFreeEntry(_In_ PRTL_AVL_TABLE Table,
+                     _In_ __drv_freesMem(Mem) _Post_invalid_ PVOID Buffer)
+{
+    UNREFERENCED_PARAMETER(Table);
+    ExFreePool(Buffer);
+}
+
+// Returns TRUE if the specified range was entirely written to the overlay.
+BOOLEAN
+WnbdOverlayIsMapped(_In_ PWNBD_OVERLAY Overlay,
+                    _In_ UINT64 Offset,
+                    _In_ ULONG Length)
+{
+    WNBD_OVERLAY_EXTENT Key = { Offset, Offset + Length };
+    PVOID RestartKey = NULL;
+    BOOLEAN Mapped = FALSE;
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceSharedLite(&Overlay->ExtentLock, TRUE);
+
+    // Adjacent extents are always merged, so a single one has to cover
+    // the whole range.
+    PWNBD_OVERLAY_EXTENT Extent = (PWNBD_OVERLAY_EXTENT)
+        RtlLookupFirstMatchingElementGenericTableAvl(
+            &Overlay->Extents, &Key, &RestartKey);
+    if (Extent) {
+        Mapped = Extent->Start <= Key.Start && Extent->End >= Key.End;
+    }
+
+    ExReleaseResourceLite(&Overlay->ExtentLock);
+    KeLeaveCriticalRegion();
+    return Mapped;
+}
+
+// Adds the specified range to the extent map, merging it with the
+// overlapping or adjacent extents. The caller must hold the extent lock.
+NTSTATUS
+WnbdOverlayMapRange(_In_ PWNBD_OVERLAY Overlay,
+                    _In_ UINT64 Start,
+                    _In_ UINT64 End)
+{
+    WNBD_OVERLAY_EXTENT Key = { Start ? Start - 1 : 0, End + 1 };
+    WNBD_OVERLAY_EXTENT Extent = { Start, End };
+    PVOID RestartKey = NULL;
+    BOOLEAN NewElement = FALSE;
+
+    PWNBD_OVERLAY_EXTENT First = (PWNBD_OVERLAY_EXTENT)
+        RtlLookupFirstMatchingElementGenericTableAvl(
+            &Overlay->Extents, &Key, &RestartKey);
+    if (!First) {
+        if (!RtlInsertElementGenericTableAvl(
+                &Overlay->Extents, &Extent, sizeof(Extent), &NewElement)) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        return STATUS_SUCCESS;
+    }
+
+    // The first matching extent gets extended, the following ones being
+    // absorbed. The order is preserved since the merged extent can't
+    // overlap any of the remaining ones.
+    WNBD_OVERLAY_EXTENT FirstCopy = *First;
+    Extent.Start = min(Extent.Start, FirstCopy.Start);
+    Extent.End = max(Extent.End, FirstCopy.End);
+
+    WNBD_OVERLAY_EXTENT Following = { FirstCopy.End, Key.End };
+    PWNBD_OVERLAY_EXTENT Next;
+    while (Following.Start < Following.End &&
+           (Next = (PWNBD_OVERLAY_EXTENT)
+                RtlLookupFirstMatchingElementGenericTableAvl(
+                    &Overlay->Extents, &Following, &RestartKey))) {
+        WNBD_OVERLAY_EXTENT NextCopy = *Next;
+        Extent.End = max(Extent.End, NextCopy.End);
+        RtlDeleteElementGenericTableAvl(&Overlay->Extents, &NextCopy);
+    }
+
+    First = (PWNBD_OVERLAY_EXTENT)RtlLookupElementGenericTableAvl(
+        &Overlay->Extents, &FirstCopy);
+    ASSERT(First);
+    First->Start = Extent.Start;
+    First->End = Extent.End;
+    return STATUS_SUCCESS;
+}
+
+// Removes the specified range from the extent map, splitting the
+// extents that are only partially covered. The caller must hold the
+// extent lock.
+NTSTATUS
+WnbdOverlayUnmapRange(_In_ PWNBD_OVERLAY Overlay,
+                      _In_ UINT64 Start,
+                      _In_ UINT64 End)
+{
+    WNBD_OVERLAY_EXTENT Key = { Start, End };
+    PVOID RestartKey = NULL;
+    PWNBD_OVERLAY_EXTENT Extent;
+    BOOLEAN NewElement = FALSE;
+
+    while ((Extent = (PWNBD_OVERLAY_EXTENT)
+                RtlLookupFirstMatchingElementGenericTableAvl(
+                    &Overlay->Extents, &Key, &RestartKey))) {
+        WNBD_OVERLAY_EXTENT Old = *Extent;
+        if (Old.Start < Start && Old.End > End) {
+            WNBD_OVERLAY_EXTENT Tail = { End, Old.End };
+            Extent->End = Start;
+            if (!RtlInsertElementGenericTableAvl(
+                    &Overlay->Extents, &Tail, sizeof(Tail), &NewElement)) {
+                Extent->End = Old.End;
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+        } else if (Old.Start < Start) {
+            Extent->End = Start;
+        } else if (Old.End > End) {
+            Extent->Start = End;
+        } else {
+            RtlDeleteElementGenericTableAvl(&Overlay->Extents, &Old);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WnbdOverlayReadFile(_In_ PWNBD_OVERLAY Overlay,
+                    _In_ UINT64 Offset,
+                    _In_ ULONG Length,
+                    _Out_writes_bytes_(Length) PVOID Buffer)
+{
+    IO_STATUS_BLOCK IoStatus = { 0 };
+    LARGE_INTEGER ByteOffset;
+    ByteOffset.QuadPart = Offset;
+
+    NTSTATUS Status = ZwReadFile(Overlay->FileHandle, NULL, NULL, NULL,
+                                 &IoStatus, Buffer, Length, &ByteOffset, NULL);
+    if (NT_SUCCESS(Status) && IoStatus.Information != Length) {
+        Status = STATUS_END_OF_FILE;
+    }
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Could not read overlay. Offset: %llu, length: %lu. "
+                       "Error: 0x%x.", Offset, Length, Status);
+    }
+    return Status;
+}
+
+NTSTATUS
+WnbdOverlayWrite(_In_ PWNBD_OVERLAY Overlay,
+                 _In_ UINT64 Offset,
+                 _In_ ULONG Length,
+                 _In_reads_bytes_(Length) PVOID Buffer,
+                 _In_ BOOLEAN FUA)
+{
+    IO_STATUS_BLOCK IoStatus = { 0 };
+    LARGE_INTEGER ByteOffset;
+    ByteOffset.QuadPart = Offset;
+
+    NTSTATUS Status = ZwWriteFile(Overlay->FileHandle, NULL, NULL, NULL,
+                                  &IoStatus, Buffer, Length, &ByteOffset, NULL);
+    if (NT_SUCCESS(Status) && FUA) {
+        Status = ZwFlushBuffersFile(Overlay->FileHandle, &IoStatus);
+    }
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Could not write overlay. Offset: %llu, length: %lu. "
+                       "Error: 0x%x.", Offset, Length, Status);
+        return Status;
+    }
+
+    // The extent map is updated only after the data reaches the file,
+    // so that concurrent reads never pick up stale overlay data.
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&Overlay->ExtentLock, TRUE);
+    Status = WnbdOverlayMapRange(Overlay, Offset, Offset + Length);
+    ExReleaseResourceLite(&Overlay->ExtentLock);
+    KeLeaveCriticalRegion();
+
+    return Status;
+}
+
+NTSTATUS
+WnbdOverlayTrim(_In_ PWNBD_OVERLAY Overlay,
+                _In_ UINT64 Offset,
+                _In_ ULONG Length)
+{
+    IO_STATUS_BLOCK IoStatus = { 0 };
+    FILE_ZERO_DATA_INFORMATION ZeroData = { 0 };
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&Overlay->ExtentLock, TRUE);
+    NTSTATUS Status = WnbdOverlayUnmapRange(Overlay, Offset, Offset + Length);
+    ExReleaseResourceLite(&Overlay->ExtentLock);
+    KeLeaveCriticalRegion();
+
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    // Trimmed ranges are served by the NBD export again, so we're only
+    // releasing the space used by the overlay file. This is best effort.
+    ZeroData.FileOffset.QuadPart = Offset;
+    ZeroData.BeyondFinalZero.QuadPart = Offset + Length;
+    NTSTATUS ZeroStatus = ZwFsControlFile(
+        Overlay->FileHandle, NULL, NULL, NULL, &IoStatus,
+        FSCTL_SET_ZERO_DATA, &ZeroData, sizeof(ZeroData), NULL, 0);
+    if (!NT_SUCCESS(ZeroStatus)) {
+        WNBD_LOG_WARN("Could not punch overlay hole. Offset: %llu, length: %lu. "
+                      "Error: 0x%x.", Offset, Length, ZeroStatus);
+    }
+
+    return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdOverlayMergeRead(PWNBD_OVERLAY Overlay,
+                     UINT64 Offset,
+                     ULONG Length,
+                     PVOID Buffer)
+{
+    WNBD_OVERLAY_EXTENT Key = { Offset, Offset + Length };
+    PVOID RestartKey = NULL;
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    // Holding the lock shared prevents trims from releasing the ranges
+    // that we're about to read.
+    KeEnterCriticalRegion();
+    ExAcquireResourceSharedLite(&Overlay->ExtentLock, TRUE);
+
+    for (PWNBD_OVERLAY_EXTENT Extent = (PWNBD_OVERLAY_EXTENT)
+            RtlLookupFirstMatchingElementGenericTableAvl(
+                &Overlay->Extents, &Key, &RestartKey);
+         Extent && Extent->Start < Key.End;
+         Extent = (PWNBD_OVERLAY_EXTENT)
+            RtlEnumerateGenericTableWithoutSplayingAvl(
+                &Overlay->Extents, &RestartKey)) {
+        UINT64 Start = max(Extent->Start, Key.Start);
+        UINT64 End = min(Extent->End, Key.End);
+        Status = WnbdOverlayReadFile(
+            Overlay, Start, (ULONG)(End - Start),
+            (PUCHAR)Buffer + (Start - Offset));
+        if (!NT_SUCCESS(Status)) {
+            break;
+        }
+    }
+
+    ExReleaseResourceLite(&Overlay->ExtentLock);
+    KeLeaveCriticalRegion();
+    return Status;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+WnbdOverlaySubmit(PWNBD_OVERLAY Overlay,
+                  PSRB_QUEUE_ELEMENT Element,
+                  int NbdReqType)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Overlay->DeviceInformation;
+    NTSTATUS Status = STATUS_SUCCESS;
+    PVOID SrbBuff = NULL;
+    UINT64 Offset = Element->StartingLbn;
+    ULONG Length = Element->ReadLength;
+
+    if (NBD_CMD_READ == NbdReqType &&
+            !WnbdOverlayIsMapped(Overlay, Offset, Length)) {
+        // Sent to the NBD server, the reply being merged with the
+        // overlay data.
+        return FALSE;
+    }
+
+    WNBD_IO_LOG_LOUD(WnbdEvtOverlayRequest, NbdReqType,
+                     Element->Srb, Element->Tag);
+
+    if (NBD_CMD_READ == NbdReqType || NBD_CMD_WRITE == NbdReqType) {
+        if (STOR_STATUS_SUCCESS != StorPortGetSystemAddress(
+                Element->DeviceExtension, Element->Srb, &SrbBuff)) {
+            WNBD_LOG_ERROR("Could not get SRB %p 0x%llx data buffer.",
+                           Element->Srb, Element->Tag);
+            Status = STATUS_INVALID_ADDRESS;
+            goto Exit;
+        }
+    }
+
+    switch (NbdReqType) {
+    case NBD_CMD_READ:
+        Status = WnbdOverlayReadFile(Overlay, Offset, Length, SrbBuff);
+        break;
+    case NBD_CMD_WRITE:
+        Status = WnbdOverlayWrite(Overlay, Offset, Length, SrbBuff,
+                                  Element->FUA);
+        if (NT_SUCCESS(Status)) {
+            InterlockedAdd64(&DeviceInformation->Stats.OverlayWrittenBytes,
+                             Length);
+        }
+        break;
+    case NBD_CMD_TRIM:
+        Status = WnbdOverlayTrim(Overlay, Offset, Length);
+        break;
+    case NBD_CMD_FLUSH:
+    {
+        IO_STATUS_BLOCK IoStatus = { 0 };
+        Status = ZwFlushBuffersFile(Overlay->FileHandle, &IoStatus);
+        break;
+    }
+    default:
+        Status = STATUS_NOT_SUPPORTED;
+        break;
+    }
+
+Exit:
+    WnbdCbtTrackElement(DeviceInformation->Cbt, Element);
+
+    if (NT_SUCCESS(Status)) {
+        Element->Srb->DataTransferLength = Element->ReadLength;
+        Element->Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    } else {
+        Element->Srb->DataTransferLength = 0;
+        Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
+    }
+
+    InterlockedDecrement64(&DeviceInformation->Stats.UnsubmittedIORequests);
+    InterlockedIncrement64(&DeviceInformation->Stats.OverlayCompletedIORequests);
+    WnbdIoCountersRecordCompletion(DeviceInformation->IoCounters, Element);
+    WnbdTraceRequest(DeviceInformation, Element, WnbdTraceCompleted);
+
+    WNBD_IO_LOG_INFO(WnbdEvtSrbCompleted, Element->Srb, Element->Tag,
+                     Element->Srb->SrbStatus);
+    StorPortNotification(RequestComplete, Element->DeviceExtension,
+                         Element->Srb);
+    InterlockedDecrement(&DeviceInformation->Device->OutstandingIoCount);
+    ExFreePool(Element);
+
+    WNBD_LOG_LOUD(": Exit");
+    return TRUE;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdOverlayCreate(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                  PWNBD_OVERLAY* POverlay)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(DeviceInformation);
+    ASSERT(POverlay);
+
+    NTSTATUS Status = STATUS_SUCCESS;
+    PWNBD_PROPERTIES Properties = &DeviceInformation->UserEntry->Properties;
+    PCHAR OverlayPath = DeviceInformation->UserEntry->ExtendedProperties.OverlayPath;
+    UNICODE_STRING Path = { 0 };
+    ANSI_STRING AnsiPath = { 0 };
+    OBJECT_ATTRIBUTES ObjectAttributes = { 0 };
+    IO_STATUS_BLOCK IoStatus = { 0 };
+    FILE_END_OF_FILE_INFORMATION EndOfFile = { 0 };
+    BOOLEAN Discard = !!Properties->Flags.DiscardOverlay;
+    *POverlay = NULL;
+
+    PWNBD_OVERLAY Overlay = (PWNBD_OVERLAY) OverlayMalloc(sizeof(WNBD_OVERLAY));
+    if (!Overlay) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Overlay, sizeof(WNBD_OVERLAY));
+    Overlay->DeviceInformation = DeviceInformation;
+    Overlay->DiskSize = Properties->BlockCount * Properties->BlockSize;
+    RtlInitializeGenericTableAvl(&Overlay->Extents,
+                                 WnbdOverlayCompareExtents,
+                                 WnbdOverlayAllocateEntry,
+                                 WnbdOverlayFreeEntry,
+                                 Overlay);
+
+    Status = ExInitializeResourceLite(&Overlay->ExtentLock);
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
+    Overlay->ExtentLockInitialized = TRUE;
+
+    RtlInitAnsiString(&AnsiPath, OverlayPath);
+    Status = RtlAnsiStringToUnicodeString(&Path, &AnsiPath, TRUE);
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
+
+    // The extent map isn't persisted, so any previous overlay content
+    // is discarded.
+    InitializeObjectAttributes(&ObjectAttributes, &Path,
+                               OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                               NULL, NULL);
+    Status = ZwCreateFile(
+        &Overlay->FileHandle,
+        GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE | (Discard ? DELETE : 0),
+        &ObjectAttributes, &IoStatus, NULL, FILE_ATTRIBUTE_NORMAL, 0,
+        FILE_OVERWRITE_IF,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT |
+            (Discard ? FILE_DELETE_ON_CLOSE : 0),
+        NULL, 0);
+    RtlFreeUnicodeString(&Path);
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Could not open overlay file: %s. Error: 0x%x.",
+                       OverlayPath, Status);
+        Overlay->FileHandle = NULL;
+        goto Exit;
+    }
+
+    // Not all filesystems support sparse files, in which case the
+    // overlay will be fully allocated.
+    Status = ZwFsControlFile(Overlay->FileHandle, NULL, NULL, NULL, &IoStatus,
+                             FSCTL_SET_SPARSE, NULL, 0, NULL, 0);
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_WARN("Could not mark overlay file as sparse. Error: 0x%x.",
+                      Status);
+    }
+
+    EndOfFile.EndOfFile.QuadPart = Overlay->DiskSize;
+    Status = ZwSetInformationFile(Overlay->FileHandle, &IoStatus, &EndOfFile,
+                                  sizeof(EndOfFile), FileEndOfFileInformation);
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Could not set overlay file size. Error: 0x%x.", Status);
+        goto Exit;
+    }
+
+    WNBD_LOG_INFO("Using overlay file: %s. Discard on removal: %d.",
+                  OverlayPath, Discard);
+    *POverlay = Overlay;
+
+Exit:
+    if (!NT_SUCCESS(Status)) {
+        WnbdOverlayDelete(Overlay);
+    }
+    WNBD_LOG_LOUD(": Exit");
+    return Status;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdOverlayDelete(PWNBD_OVERLAY Overlay)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Overlay) {
+        return;
+    }
+
+    PVOID Extent;
+    while ((Extent = RtlGetElementGenericTableAvl(&Overlay->Extents, 0))) {
+        WNBD_OVERLAY_EXTENT Copy = *(PWNBD_OVERLAY_EXTENT)Extent;
+        RtlDeleteElementGenericTableAvl(&Overlay->Extents, &Copy);
+    }
+    // Discarded overlays are removed when closing the handle.
+    if (Overlay->FileHandle) {
+        ZwClose(Overlay->FileHandle);
+    }
+    if (Overlay->ExtentLockInitialized) {
+        ExDeleteResourceLite(&Overlay->ExtentLock);
+    }
+    ExFreePool(Overlay);
+
+    WNBD_LOG_LOUD(": Exit");
+}
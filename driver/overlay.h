@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef OVERLAY_H
+#define OVERLAY_H 1
+
+#include "common.h"
+#include "userspace.h"
+#include "util.h"
+
+// A written range of the overlay file, in bytes. The extents kept
+// in the map never overlap or touch each other.
+typedef struct _WNBD_OVERLAY_EXTENT
+{
+    UINT64                      Start;
+    UINT64                      End;
+} WNBD_OVERLAY_EXTENT, *PWNBD_OVERLAY_EXTENT;
+
+// Local copy-on-write overlay. Writes go to a sparse file instead of
+// the NBD export, reads being served from the overlay for the ranges
+// that were written and from the NBD export otherwise.
+typedef struct _WNBD_OVERLAY
+{
+    PSCSI_DEVICE_INFORMATION    DeviceInformation;
+    HANDLE                      FileHandle;
+    UINT64                      DiskSize;
+
+    // Extent map, updated only by the request thread. The reply
+    // thread acquires the lock shared when merging overlay data into
+    // NBD read replies.
+    RTL_AVL_TABLE               Extents;
+    ERESOURCE                   ExtentLock;
+    BOOLEAN                     ExtentLockInitialized;
+} WNBD_OVERLAY, *PWNBD_OVERLAY;
+
+NTSTATUS
+WnbdOverlayCreate(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                  _Out_ PWNBD_OVERLAY* POverlay);
+
+VOID
+WnbdOverlayDelete(_In_ PWNBD_OVERLAY Overlay);
+
+// Handles write, trim and flush requests locally, as well as reads
+// that are entirely covered by the overlay. Returns FALSE if the
+// request has to be sent to the NBD server, in which case the reply
+// must go through WnbdOverlayMergeRead.
+BOOLEAN
+WnbdOverlaySubmit(_In_ PWNBD_OVERLAY Overlay,
+                  _In_ PSRB_QUEUE_ELEMENT Element,
+                  _In_ int NbdReqType);
+
+// Copies the ranges that were written to the overlay on top of the
+// data retrieved from the NBD server.
+NTSTATUS
+WnbdOverlayMergeRead(_In_ PWNBD_OVERLAY Overlay,
+                     _In_ UINT64 Offset,
+                     _In_ ULONG Length,
+                     _Inout_updates_bytes_(Length) PVOID Buffer);
+
+#endif
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "debug.h"
+#include "qos.h"
+#include "userspace.h"
+
+#define QosMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'sDBN')
+
+static inline PWNBD_QOS_BUCKET
+WnbdQosGetLimit(_In_ PWNBD_QOS_LIMITS Limits,
+                _In_ WnbdQosBucketType Type)
+{
+    switch (Type) {
+    case WnbdQosReadIops:
+        return &Limits->ReadIops;
+    case WnbdQosWriteIops:
+        return &Limits->WriteIops;
+    case WnbdQosReadBytes:
+        return &Limits->ReadBytes;
+    default:
+        return &Limits->WriteBytes;
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdQosValidateLimits(PWNBD_QOS_LIMITS Limits)
+{
+    for (int Type = 0; Type < WnbdQosBucketCount; Type++) {
+        PWNBD_QOS_BUCKET Limit = WnbdQosGetLimit(
+            Limits, (WnbdQosBucketType)Type);
+        if (Limit->Rate > WNBD_QOS_MAX_RATE ||
+                Limit->Burst > WNBD_QOS_MAX_RATE) {
+            WNBD_LOG_ERROR("QoS limit out of range: %llu, burst: %llu.",
+                           Limit->Rate, Limit->Burst);
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+WnbdQosLimitsSet(PWNBD_QOS_LIMITS Limits)
+{
+    return !!(Limits->ReadIops.Rate || Limits->WriteIops.Rate ||
+              Limits->ReadBytes.Rate || Limits->WriteBytes.Rate);
+}
+
+// The QoS lock is held by the caller.
+VOID
+WnbdQosRefill(_In_ PWNBD_QOS Qos,
+              _In_ UINT64 Now)
+{
+    INT64 Elapsed = (INT64)(Now - Qos->LastRefill);
+    Qos->LastRefill = Now;
+
+    for (int Type = 0; Type < WnbdQosBucketCount; Type++) {
+        PWNBD_QOS_TOKEN_BUCKET Bucket = &Qos->Buckets[Type];
+        if (!Bucket->Rate) {
+            continue;
+        }
+        // Avoid overflows when the device has been idle for a while.
+        if (Elapsed >= (Bucket->Capacity - Bucket->Tokens) / Bucket->Rate) {
+            Bucket->Tokens = Bucket->Capacity;
+        } else {
+            Bucket->Tokens += Elapsed * Bucket->Rate;
+        }
+    }
+}
+
+// Returns the time (100ns units) needed for the bucket to accommodate
+// the request. Requests that exceed the bucket size are allowed once
+// the bucket is full, leaving the bucket in debt.
+static inline INT64
+WnbdQosBucketDelay(_In_ PWNBD_QOS_TOKEN_BUCKET Bucket,
+                   _In_ INT64 Cost)
+{
+    if (!Bucket->Rate) {
+        return 0;
+    }
+
+    INT64 Needed = min(Cost * WNBD_QOS_TOKEN_SCALE, Bucket->Capacity);
+    if (Bucket->Tokens >= Needed) {
+        return 0;
+    }
+    return (Needed - Bucket->Tokens + Bucket->Rate - 1) / Bucket->Rate;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdQosSetLimits(PWNBD_QOS Qos,
+                 PWNBD_QOS_LIMITS Limits)
+{
+    KIRQL Irql = { 0 };
+    ULONG64 Qpc;
+
+    KeAcquireSpinLock(&Qos->Lock, &Irql);
+    WnbdQosRefill(Qos, KeQueryInterruptTimePrecise(&Qpc));
+    for (int Type = 0; Type < WnbdQosBucketCount; Type++) {
+        PWNBD_QOS_BUCKET Limit = WnbdQosGetLimit(
+            Limits, (WnbdQosBucketType)Type);
+        PWNBD_QOS_TOKEN_BUCKET Bucket = &Qos->Buckets[Type];
+
+        BOOLEAN WasLimited = !!Bucket->Rate;
+        UINT64 Burst = Limit->Burst ? Limit->Burst : Limit->Rate;
+        Bucket->Rate = (INT64)Limit->Rate;
+        Bucket->Capacity = max(1, (INT64)Burst) * WNBD_QOS_TOKEN_SCALE;
+        // New limits start with a full bucket, existing ones keep
+        // their tokens.
+        if (!WasLimited || Bucket->Tokens > Bucket->Capacity) {
+            Bucket->Tokens = Bucket->Capacity;
+        }
+    }
+    Qos->Enabled = WnbdQosLimitsSet(Limits);
+    KeReleaseSpinLock(&Qos->Lock, Irql);
+
+    WNBD_LOG_INFO("QoS limits. Read IOPS: %llu, write IOPS: %llu, "
+                  "read bytes/s: %llu, write bytes/s: %llu.",
+                  Limits->ReadIops.Rate, Limits->WriteIops.Rate,
+                  Limits->ReadBytes.Rate, Limits->WriteBytes.Rate);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdQosCreate(PSCSI_DEVICE_INFORMATION DeviceInformation,
+              PWNBD_QOS_LIMITS Limits,
+              PWNBD_QOS* PQos)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(DeviceInformation);
+    ASSERT(PQos);
+
+    PWNBD_QOS Qos = (PWNBD_QOS) QosMalloc(sizeof(WNBD_QOS));
+    if (!Qos) {
+        *PQos = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Qos, sizeof(WNBD_QOS));
+
+    Qos->DeviceInformation = DeviceInformation;
+    KeInitializeSpinLock(&Qos->Lock);
+    ULONG64 Qpc;
+    Qos->LastRefill = KeQueryInterruptTimePrecise(&Qpc);
+    WnbdQosSetLimits(Qos, Limits);
+    *PQos = Qos;
+
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdQosDelete(PWNBD_QOS Qos)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Qos) {
+        return;
+    }
+
+    ExFreePool(Qos);
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+BOOLEAN
+WnbdQosWait(PWNBD_QOS Qos,
+            BOOLEAN Write,
+            ULONG Length)
+{
+    if (!Qos->Enabled) {
+        return TRUE;
+    }
+
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Qos->DeviceInformation;
+    PWNBD_QOS_TOKEN_BUCKET Iops = &Qos->Buckets[
+        Write ? WnbdQosWriteIops : WnbdQosReadIops];
+    PWNBD_QOS_TOKEN_BUCKET Bytes = &Qos->Buckets[
+        Write ? WnbdQosWriteBytes : WnbdQosReadBytes];
+    UINT64 ThrottleStart = 0;
+    KIRQL Irql = { 0 };
+    ULONG64 Qpc;
+
+    while (TRUE) {
+        UINT64 Now = KeQueryInterruptTimePrecise(&Qpc);
+
+        KeAcquireSpinLock(&Qos->Lock, &Irql);
+        WnbdQosRefill(Qos, Now);
+        INT64 Delay = max(WnbdQosBucketDelay(Iops, 1),
+                          WnbdQosBucketDelay(Bytes, Length));
+        if (!Delay) {
+            if (Iops->Rate) {
+                Iops->Tokens -= WNBD_QOS_TOKEN_SCALE;
+            }
+            if (Bytes->Rate) {
+                Bytes->Tokens -= (INT64)Length * WNBD_QOS_TOKEN_SCALE;
+            }
+            KeReleaseSpinLock(&Qos->Lock, Irql);
+            break;
+        }
+        KeReleaseSpinLock(&Qos->Lock, Irql);
+
+        if (!ThrottleStart) {
+            ThrottleStart = Now;
+            InterlockedIncrement64(&DeviceInformation->Stats.QosThrottledIORequests);
+        }
+        if (DeviceInformation->HardTerminateDevice) {
+            return FALSE;
+        }
+
+        LARGE_INTEGER Interval;
+        Interval.QuadPart = -min(Delay, WNBD_QOS_MAX_WAIT_MS * 10000LL);
+        KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+    }
+
+    if (ThrottleStart) {
+        InterlockedAdd64(&DeviceInformation->Stats.QosThrottledTimeUs,
+                         (KeQueryInterruptTimePrecise(&Qpc) - ThrottleStart) / 10);
+    }
+    return TRUE;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef QOS_H
+#define QOS_H 1
+
+#include "common.h"
+#include "userspace.h"
+
+// Tokens are scaled so that a bucket gains "Rate" scaled tokens every
+// 100ns, which avoids rounding errors when refilling.
+#define WNBD_QOS_TOKEN_SCALE 10000000LL
+// Prevents the scaled token counters from overflowing.
+#define WNBD_QOS_MAX_RATE (1ULL << 38)
+// Throttled requests check the device state at least this often (ms).
+#define WNBD_QOS_MAX_WAIT_MS 100
+
+typedef enum
+{
+    WnbdQosReadIops = 0,
+    WnbdQosWriteIops,
+    WnbdQosReadBytes,
+    WnbdQosWriteBytes,
+    WnbdQosBucketCount
+} WnbdQosBucketType;
+
+typedef struct _WNBD_QOS_TOKEN_BUCKET
+{
+    // Scaled tokens gained every 100ns, 0 meaning unlimited.
+    INT64                       Rate;
+    INT64                       Capacity;
+    // May become negative for requests that exceed the bucket size.
+    INT64                       Tokens;
+} WNBD_QOS_TOKEN_BUCKET, *PWNBD_QOS_TOKEN_BUCKET;
+
+// Token bucket based IO limits. The structure is only allocated once
+// limits are set for a device and is released along with the device,
+// so that the IO path doesn't need any synchronization for accessing it.
+typedef struct _WNBD_QOS
+{
+    PSCSI_DEVICE_INFORMATION    DeviceInformation;
+    // Checked without acquiring the lock.
+    volatile BOOLEAN            Enabled;
+
+    KSPIN_LOCK                  Lock;
+    UINT64                      LastRefill;
+    WNBD_QOS_TOKEN_BUCKET       Buckets[WnbdQosBucketCount];
+} WNBD_QOS, *PWNBD_QOS;
+
+NTSTATUS
+WnbdQosValidateLimits(_In_ PWNBD_QOS_LIMITS Limits);
+
+BOOLEAN
+WnbdQosLimitsSet(_In_ PWNBD_QOS_LIMITS Limits);
+
+NTSTATUS
+WnbdQosCreate(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+              _In_ PWNBD_QOS_LIMITS Limits,
+              _Out_ PWNBD_QOS* PQos);
+
+VOID
+WnbdQosDelete(_In_ PWNBD_QOS Qos);
+
+VOID
+WnbdQosSetLimits(_In_ PWNBD_QOS Qos,
+                 _In_ PWNBD_QOS_LIMITS Limits);
+
+// Waits until the request fits the device limits. Returns FALSE if
+// the device gets hard removed in the meantime.
+_IRQL_requires_(PASSIVE_LEVEL)
+BOOLEAN
+WnbdQosWait(_In_ PWNBD_QOS Qos,
+            _In_ BOOLEAN Write,
+            _In_ ULONG Length);
+
+#endif
@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include <ntifs.h>
+
+#include "common.h"
+#include "debug.h"
+#include "ring.h"
+#include "userspace.h"
+#include "util.h"
+#include "wnbd_dispatch.h"
+
+#define RingMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'gDBN')
+#define RING_ALIGN(Value, Alignment) \
+    (((Value) + (Alignment) - 1) & ~((UINT64)(Alignment) - 1))
+
+static inline PVOID
+WnbdRingSlot(_In_ PWNBD_RING Ring,
+             _In_ UINT32 SlotIndex)
+{
+    return Ring->Data + (SIZE_T)SlotIndex * Ring->SlotSize;
+}
+
+// Returns FALSE if userspace provided invalid ring indices.
+BOOLEAN
+WnbdRingProcessResponses(_In_ PWNBD_RING Ring,
+                         _Inout_ PBOOLEAN Progress)
+{
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Ring->DeviceInformation;
+    UINT32 Mask = Ring->EntryCount - 1;
+    UINT32 Tail = Ring->Header->Responses.Tail;
+    KeMemoryBarrier();
+
+    if (Tail - Ring->ResponseHead > Ring->EntryCount) {
+        WNBD_LOG_ERROR("Invalid response ring tail: %u, head: %u.",
+                       Tail, Ring->ResponseHead);
+        return FALSE;
+    }
+
+    if (Tail == Ring->ResponseHead) {
+        return TRUE;
+    }
+
+    while (Ring->ResponseHead != Tail) {
+        // The entry is copied first since userspace may change it
+        // at any time.
+        WNBD_RING_RESPONSE Entry;
+        RtlCopyMemory(&Entry, &Ring->Responses[Ring->ResponseHead & Mask],
+                      sizeof(WNBD_RING_RESPONSE));
+        Ring->ResponseHead++;
+
+        UINT64 Handle = Entry.Response.RequestHandle;
+        UINT32 SlotIndex = (UINT32)(Handle & Mask);
+        if (!(Handle & WNBD_RING_HANDLE_FLAG) ||
+                Ring->SlotHandles[SlotIndex] != Handle) {
+            WNBD_LOG_WARN("Received ring response with invalid handle: 0x%llx.",
+                          Handle);
+            continue;
+        }
+
+        WnbdCompleteResponse(DeviceInformation, &Entry.Response,
+                             WnbdRingSlot(Ring, SlotIndex), Ring->SlotSize,
+                             FALSE);
+        Ring->SlotHandles[SlotIndex] = 0;
+        Ring->FreeSlots[Ring->FreeSlotCount++] = SlotIndex;
+    }
+
+    InterlockedExchange((PLONG)&Ring->Header->Responses.Head,
+                        (LONG)Ring->ResponseHead);
+    *Progress = TRUE;
+    return TRUE;
+}
+
+// "HasRequest" is set if the caller already acquired the device
+// semaphore.
+VOID
+WnbdRingPostRequests(_In_ PWNBD_RING Ring,
+                     _Inout_ PBOOLEAN HasRequest,
+                     _Inout_ PBOOLEAN Progress)
+{
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Ring->DeviceInformation;
+    UINT32 Mask = Ring->EntryCount - 1;
+    LARGE_INTEGER NoWait = { 0 };
+
+    // There's one data slot per ring entry, so the request ring
+    // can't be full as long as there are free slots.
+    while (Ring->FreeSlotCount && !DeviceInformation->HardTerminateDevice) {
+        if (!*HasRequest &&
+                STATUS_SUCCESS != KeWaitForSingleObject(
+                    &DeviceInformation->DeviceEvent, Executive,
+                    KernelMode, FALSE, &NoWait)) {
+            break;
+        }
+        *HasRequest = FALSE;
+
+        PLIST_ENTRY RequestEntry = WnbdDequeueRequest(DeviceInformation);
+        if (!RequestEntry) {
+            continue;
+        }
+
+        PSRB_QUEUE_ELEMENT Element = CONTAINING_RECORD(
+            RequestEntry, SRB_QUEUE_ELEMENT, Link);
+        UINT32 SlotIndex = Ring->FreeSlots[Ring->FreeSlotCount - 1];
+        // The slot index is encoded in the request handle.
+        UINT64 Handle = WNBD_RING_HANDLE_FLAG |
+            ((++Ring->Sequence * Ring->EntryCount + SlotIndex) &
+             ~WNBD_RING_HANDLE_FLAG);
+        PWNBD_RING_REQUEST Entry = &Ring->Requests[Ring->RequestTail & Mask];
+
+        NTSTATUS Status = WnbdPrepareRequest(
+            DeviceInformation, Element, &Entry->Request,
+            WnbdRingSlot(Ring, SlotIndex), Ring->SlotSize, Handle);
+        if (STATUS_CANCELLED == Status) {
+            break;
+        }
+        if (Status) {
+            // The request was completed with an error.
+            continue;
+        }
+
+        Ring->FreeSlotCount--;
+        Ring->SlotHandles[SlotIndex] = Handle;
+        Entry->SlotIndex = SlotIndex;
+        Ring->RequestTail++;
+
+        // Publishing each request separately, the next one may get
+        // throttled.
+        InterlockedExchange((PLONG)&Ring->Header->Requests.Tail,
+                            (LONG)Ring->RequestTail);
+        if (Ring->Header->Requests.ConsumerWaiting) {
+            KeSetEvent(Ring->RequestEvent, IO_NO_INCREMENT, FALSE);
+        }
+        *Progress = TRUE;
+    }
+}
+
+VOID
+WnbdRingThread(_In_ PVOID Context)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Context);
+
+    PWNBD_RING Ring = (PWNBD_RING) Context;
+    PSCSI_DEVICE_INFORMATION DeviceInformation = Ring->DeviceInformation;
+    PWNBD_RING_HEADER Header = Ring->Header;
+    BOOLEAN HasRequest = FALSE;
+    PVOID WaitObjects[4];
+    WaitObjects[0] = &DeviceInformation->TerminateEvent;
+    WaitObjects[1] = Ring->Process;
+    WaitObjects[2] = Ring->ResponseEvent;
+    WaitObjects[3] = &DeviceInformation->DeviceEvent;
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    while (!DeviceInformation->HardTerminateDevice && !Ring->Stopping) {
+        BOOLEAN Progress = FALSE;
+
+        if (!WnbdRingProcessResponses(Ring, &Progress)) {
+            WnbdSetDeviceMissing(DeviceInformation->Device, TRUE);
+            break;
+        }
+        WnbdRingPostRequests(Ring, &HasRequest, &Progress);
+        if (Progress) {
+            continue;
+        }
+
+        // Going idle, userspace signals the response event only after
+        // seeing this flag.
+        InterlockedExchange((PLONG)&Header->Responses.ConsumerWaiting, 1);
+        if (Header->Responses.Tail != Ring->ResponseHead) {
+            InterlockedExchange((PLONG)&Header->Responses.ConsumerWaiting, 0);
+            continue;
+        }
+
+        // New requests are only relevant if we have free data slots.
+        // Acquiring the semaphore counts as retrieving a request.
+        ULONG WaitCount = (Ring->FreeSlotCount && !HasRequest) ? 4 : 3;
+        NTSTATUS WaitResult = KeWaitForMultipleObjects(
+            WaitCount, WaitObjects, WaitAny, Executive, KernelMode,
+            FALSE, NULL, Ring->WaitBlocks);
+        InterlockedExchange((PLONG)&Header->Responses.ConsumerWaiting, 0);
+
+        if (STATUS_WAIT_0 == WaitResult) {
+            break;
+        }
+        if (STATUS_WAIT_1 == WaitResult) {
+            WNBD_LOG_INFO("The ring owner process exited, terminating.");
+            WnbdSetDeviceMissing(DeviceInformation->Device, TRUE);
+            break;
+        }
+        if (STATUS_WAIT_3 == WaitResult) {
+            HasRequest = TRUE;
+        }
+    }
+
+    // Userspace is expected to stop once it processes the remaining
+    // requests.
+    InterlockedExchange((PLONG)&Header->Disconnected, 1);
+    KeSetEvent(Ring->RequestEvent, IO_NO_INCREMENT, FALSE);
+
+    WNBD_LOG_INFO("Ring thread stopped: %p", DeviceInformation);
+    (void)PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+VOID
+WnbdRingFree(_In_ PWNBD_RING Ring)
+{
+    if (Ring->View) {
+        MmUnmapViewInSystemSpace(Ring->View);
+    }
+    if (Ring->SectionObject) {
+        ObDereferenceObject(Ring->SectionObject);
+    }
+    if (Ring->SectionHandle) {
+        ZwClose(Ring->SectionHandle);
+    }
+    if (Ring->RequestEvent) {
+        ObDereferenceObject(Ring->RequestEvent);
+    }
+    if (Ring->ResponseEvent) {
+        ObDereferenceObject(Ring->ResponseEvent);
+    }
+    if (Ring->Process) {
+        ObDereferenceObject(Ring->Process);
+    }
+    if (Ring->SlotHandles) {
+        ExFreePool(Ring->SlotHandles);
+    }
+    if (Ring->FreeSlots) {
+        ExFreePool(Ring->FreeSlots);
+    }
+    ExFreePool(Ring);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdRingCreate(PSCSI_DEVICE_INFORMATION DeviceInformation,
+               PWNBD_IOCTL_RING_SETUP_COMMAND Command,
+               PWNBD_RING_INFO RingInfo,
+               PWNBD_RING* PRing)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(DeviceInformation);
+    ASSERT(Command);
+    ASSERT(PRing);
+
+    NTSTATUS Status = STATUS_SUCCESS;
+    UINT32 EntryCount = Command->EntryCount;
+    UINT32 SlotSize = Command->SlotSize;
+    PVOID UserView = NULL;
+    HANDLE ThreadHandle = NULL;
+    *PRing = NULL;
+
+    if (!EntryCount || EntryCount > WNBD_RING_MAX_ENTRIES ||
+            (EntryCount & (EntryCount - 1)) || !SlotSize) {
+        WNBD_LOG_ERROR("Invalid ring parameters. Entries: %u, slot size: %u.",
+                       EntryCount, SlotSize);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    UINT64 RequestRingOffset = RING_ALIGN(sizeof(WNBD_RING_HEADER), 64);
+    UINT64 ResponseRingOffset = RING_ALIGN(
+        RequestRingOffset + sizeof(WNBD_RING_REQUEST) * EntryCount, 64);
+    UINT64 DataOffset = RING_ALIGN(
+        ResponseRingOffset + sizeof(WNBD_RING_RESPONSE) * EntryCount,
+        PAGE_SIZE);
+    UINT64 RingSize = DataOffset + (UINT64)SlotSize * EntryCount;
+    if (RingSize > WNBD_RING_MAX_SIZE) {
+        WNBD_LOG_ERROR("Ring size too large: %llu. Entries: %u, slot size: %u.",
+                       RingSize, EntryCount, SlotSize);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PWNBD_RING Ring = (PWNBD_RING) RingMalloc(sizeof(WNBD_RING));
+    if (!Ring) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Ring, sizeof(WNBD_RING));
+    Ring->DeviceInformation = DeviceInformation;
+    Ring->EntryCount = EntryCount;
+    Ring->SlotSize = SlotSize;
+
+    Ring->SlotHandles = (UINT64*) RingMalloc(sizeof(UINT64) * EntryCount);
+    Ring->FreeSlots = (UINT32*) RingMalloc(sizeof(UINT32) * EntryCount);
+    if (!Ring->SlotHandles || !Ring->FreeSlots) {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    RtlZeroMemory(Ring->SlotHandles, sizeof(UINT64) * EntryCount);
+    // Lower slots are used first.
+    for (UINT32 i = 0; i < EntryCount; i++) {
+        Ring->FreeSlots[i] = EntryCount - i - 1;
+    }
+    Ring->FreeSlotCount = EntryCount;
+
+    Status = ObReferenceObjectByHandle(
+        Command->RequestEvent, EVENT_MODIFY_STATE, *ExEventObjectType,
+        UserMode, (PVOID*)&Ring->RequestEvent, NULL);
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Invalid request event handle. Error: 0x%x.", Status);
+        goto Exit;
+    }
+    Status = ObReferenceObjectByHandle(
+        Command->ResponseEvent, SYNCHRONIZE, *ExEventObjectType,
+        UserMode, (PVOID*)&Ring->ResponseEvent, NULL);
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Invalid response event handle. Error: 0x%x.", Status);
+        goto Exit;
+    }
+    Ring->Process = PsGetCurrentProcess();
+    ObReferenceObject(Ring->Process);
+
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE,
+                               NULL, NULL);
+    LARGE_INTEGER MaximumSize;
+    MaximumSize.QuadPart = (LONGLONG)RingSize;
+    Status = ZwCreateSection(&Ring->SectionHandle, SECTION_ALL_ACCESS,
+                             &ObjectAttributes, &MaximumSize, PAGE_READWRITE,
+                             SEC_COMMIT, NULL);
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Could not create ring section. Size: %llu. "
+                       "Error: 0x%x.", RingSize, Status);
+        goto Exit;
+    }
+    Status = ObReferenceObjectByHandle(
+        Ring->SectionHandle, SECTION_MAP_READ | SECTION_MAP_WRITE, NULL,
+        KernelMode, &Ring->SectionObject, NULL);
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
+
+    SIZE_T ViewSize = 0;
+    Status = MmMapViewInSystemSpace(Ring->SectionObject, &Ring->View, &ViewSize);
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Could not map ring system view. Error: 0x%x.", Status);
+        goto Exit;
+    }
+
+    SIZE_T UserViewSize = 0;
+    Status = ZwMapViewOfSection(Ring->SectionHandle, ZwCurrentProcess(),
+                                &UserView, 0, 0, NULL, &UserViewSize,
+                                ViewUnmap, 0, PAGE_READWRITE);
+    if (!NT_SUCCESS(Status)) {
+        WNBD_LOG_ERROR("Could not map ring user view. Error: 0x%x.", Status);
+        goto Exit;
+    }
+
+    // Section pages are zeroed, so the indices start at 0.
+    Ring->Header = (PWNBD_RING_HEADER) Ring->View;
+    Ring->Requests = (PWNBD_RING_REQUEST)
+        ((PUCHAR)Ring->View + RequestRingOffset);
+    Ring->Responses = (PWNBD_RING_RESPONSE)
+        ((PUCHAR)Ring->View + ResponseRingOffset);
+    Ring->Data = (PUCHAR)Ring->View + DataOffset;
+    Ring->Header->EntryCount = EntryCount;
+    Ring->Header->SlotSize = SlotSize;
+    Ring->Header->RequestRingOffset = (UINT32)RequestRingOffset;
+    Ring->Header->ResponseRingOffset = (UINT32)ResponseRingOffset;
+    Ring->Header->DataOffset = DataOffset;
+
+    Status = PsCreateSystemThread(&ThreadHandle, (ACCESS_MASK)0L, NULL,
+                                  NULL, NULL, WnbdRingThread, Ring);
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
+    Status = ObReferenceObjectByHandle(ThreadHandle, THREAD_ALL_ACCESS, NULL,
+                                       KernelMode, &Ring->Thread, NULL);
+    if (!NT_SUCCESS(Status)) {
+        // Unlikely, but we still have to wait for the thread.
+        Ring->Stopping = TRUE;
+        KeSetEvent(Ring->ResponseEvent, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(ThreadHandle, FALSE, NULL);
+        goto Exit;
+    }
+
+    RtlZeroMemory(RingInfo, sizeof(WNBD_RING_INFO));
+    RingInfo->RingBuffer = UserView;
+    RingInfo->RingSize = RingSize;
+    *PRing = Ring;
+
+    WNBD_LOG_INFO("Ring created. Entries: %u, slot size: %u, size: %llu.",
+                  EntryCount, SlotSize, RingSize);
+
+Exit:
+    if (ThreadHandle) {
+        ZwClose(ThreadHandle);
+    }
+    if (!NT_SUCCESS(Status)) {
+        if (UserView) {
+            ZwUnmapViewOfSection(ZwCurrentProcess(), UserView);
+        }
+        WnbdRingFree(Ring);
+    }
+    WNBD_LOG_LOUD(": Exit");
+    return Status;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdRingStop(PWNBD_RING Ring)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Ring || !Ring->Thread) {
+        return;
+    }
+
+    Ring->Stopping = TRUE;
+    KeSetEvent(Ring->ResponseEvent, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(Ring->Thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(Ring->Thread);
+    Ring->Thread = NULL;
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+VOID
+WnbdRingDelete(PWNBD_RING Ring)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!Ring) {
+        return;
+    }
+
+    WnbdRingStop(Ring);
+    WnbdRingFree(Ring);
+    WNBD_LOG_LOUD(": Exit");
+}
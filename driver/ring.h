@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef RING_H
+#define RING_H 1
+
+#include "common.h"
+#include "userspace.h"
+
+// Shared memory request/response rings, see WNBD_RING_HEADER for the
+// protocol. The rings are backed by a pagefile section, mapped both in
+// system space and in the address space of the owner process. This
+// avoids locking user pages, the process view being released by the
+// memory manager if the process exits.
+//
+// A dedicated thread posts requests and processes responses. The ring
+// indices owned by the driver are kept in private copies, the shared
+// memory being modified by userspace at any time.
+typedef struct _WNBD_RING
+{
+    PSCSI_DEVICE_INFORMATION    DeviceInformation;
+
+    HANDLE                      SectionHandle;
+    PVOID                       SectionObject;
+    // System space view.
+    PVOID                       View;
+    PWNBD_RING_HEADER           Header;
+    PWNBD_RING_REQUEST          Requests;
+    PWNBD_RING_RESPONSE         Responses;
+    PUCHAR                      Data;
+    UINT32                      EntryCount;
+    UINT32                      SlotSize;
+
+    PKEVENT                     RequestEvent;
+    PKEVENT                     ResponseEvent;
+    // Used for detecting the owner process termination.
+    PEPROCESS                   Process;
+    PVOID                       Thread;
+    volatile BOOLEAN            Stopping;
+    KWAIT_BLOCK                 WaitBlocks[4];
+
+    // Only accessed by the ring thread.
+    UINT32                      RequestTail;
+    UINT32                      ResponseHead;
+    UINT64                      Sequence;
+    // Request handle using each data slot, 0 for free slots.
+    UINT64*                     SlotHandles;
+    UINT32*                     FreeSlots;
+    UINT32                      FreeSlotCount;
+} WNBD_RING, *PWNBD_RING;
+
+// Must be called in the context of the process that's going to
+// handle the requests.
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+WnbdRingCreate(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+               _In_ PWNBD_IOCTL_RING_SETUP_COMMAND Command,
+               _Out_ PWNBD_RING_INFO RingInfo,
+               _Out_ PWNBD_RING* PRing);
+
+// Stops the ring thread. The requests that were already posted remain
+// in the reply list.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdRingStop(_In_ PWNBD_RING Ring);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdRingDelete(_In_ PWNBD_RING Ring);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "debug.h"
+#include "scheduler.h"
+
+_Use_decl_annotations_
+VOID
+WnbdSchedulerAddDevice(PWNBD_EXTENSION Ext,
+                       PWNBD_SCSI_DEVICE Device,
+                       UINT32 Weight)
+{
+    ASSERT(Ext);
+    ASSERT(Device);
+
+    if (!Weight) {
+        Weight = WNBD_DEFAULT_SCHEDULER_WEIGHT;
+    }
+    Device->SchedulerWeight = min(Weight, WNBD_MAX_SCHEDULER_WEIGHT);
+
+    PSCSI_DEVICE_INFORMATION Info =
+        (PSCSI_DEVICE_INFORMATION)Device->ScsiDeviceExtension;
+    InterlockedExchange64(&Info->ExtendedStats.SchedulerWeight, Device->SchedulerWeight);
+
+    // The total weight is updated before the generation so that the IO
+    // path never caches a stale share.
+    InterlockedAdd64(&Ext->SchedulerTotalWeight, Device->SchedulerWeight);
+    InterlockedIncrement(&Ext->SchedulerGeneration);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdSchedulerRemoveDevice(PWNBD_EXTENSION Ext,
+                          PWNBD_SCSI_DEVICE Device)
+{
+    ASSERT(Ext);
+    ASSERT(Device);
+
+    if (!Device->SchedulerWeight) {
+        return;
+    }
+    InterlockedAdd64(&Ext->SchedulerTotalWeight,
+                     -(LONG64)Device->SchedulerWeight);
+    InterlockedIncrement(&Ext->SchedulerGeneration);
+    Device->SchedulerWeight = 0;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdSchedulerApply(PWNBD_EXTENSION Ext,
+                   PWNBD_SCSI_DEVICE Device)
+{
+    LONG Generation = Ext->SchedulerGeneration;
+    if (Generation == Device->SchedulerGeneration) {
+        return;
+    }
+    Device->SchedulerGeneration = Generation;
+
+    LONG64 TotalWeight = Ext->SchedulerTotalWeight;
+    if (!Device->SchedulerWeight || TotalWeight <= 0) {
+        return;
+    }
+
+    ULONG Depth = (ULONG)(WNBD_MAX_IN_FLIGHT_REQUESTS *
+        (LONG64)Device->SchedulerWeight / TotalWeight);
+    Depth = max(WNBD_SCHEDULER_MIN_DEPTH,
+                min(Depth, WNBD_MAX_IN_FLIGHT_REQUESTS));
+
+    PSCSI_DEVICE_INFORMATION Info =
+        (PSCSI_DEVICE_INFORMATION)Device->ScsiDeviceExtension;
+    if (!StorPortSetDeviceQueueDepth(Ext, (UCHAR)Device->PathId,
+                                     (UCHAR)Device->TargetId,
+                                     (UCHAR)Device->Lun, Depth)) {
+        WNBD_LOG_WARN("Could not set queue depth %d for %d:%d:%d.",
+                      Depth, Device->PathId, Device->TargetId, Device->Lun);
+        return;
+    }
+    InterlockedExchange64(&Info->ExtendedStats.SchedulerQueueDepth, Depth);
+    WNBD_LOG_INFO("Queue depth for %d:%d:%d: %d. Weight: %d, total weight: %lld.",
+                  Device->PathId, Device->TargetId, Device->Lun,
+                  Depth, Device->SchedulerWeight, TotalWeight);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdSchedulerAccountWait(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                         PSRB_QUEUE_ELEMENT Element)
+{
+    if (!Element->QueueTime) {
+        return;
+    }
+
+    ULONG64 Qpc;
+    UINT64 Wait = KeQueryInterruptTimePrecise(&Qpc) - Element->QueueTime;
+    // Requests may get requeued, we're only accounting the first submission.
+    Element->QueueTime = 0;
+    InterlockedAdd64(&DeviceInformation->ExtendedStats.QueueWaitTimeUs, Wait / 10);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H 1
+
+#include "common.h"
+#include "scsi_driver_extensions.h"
+#include "userspace.h"
+#include "util.h"
+
+// Lower bound for the per disk queue depth, preventing low weight
+// disks from being starved.
+#define WNBD_SCHEDULER_MIN_DEPTH 16
+
+// The adapter queue (WNBD_MAX_IN_FLIGHT_REQUESTS) is shared by all the
+// disks. In order to prevent a busy disk from using up the whole queue,
+// each disk gets a Storport queue depth proportional to its weight:
+//     Depth = MaxIO * Weight / TotalWeight
+//
+// The shares are recomputed when disks are added or removed, the new
+// queue depth being applied lazily by the IO path.
+VOID
+WnbdSchedulerAddDevice(_In_ PWNBD_EXTENSION Ext,
+                       _In_ PWNBD_SCSI_DEVICE Device,
+                       _In_ UINT32 Weight);
+
+VOID
+WnbdSchedulerRemoveDevice(_In_ PWNBD_EXTENSION Ext,
+                          _In_ PWNBD_SCSI_DEVICE Device);
+
+// Updates the Storport queue depth of the disk if the shares changed
+// since the last call. Expects the device list lock to be held.
+VOID
+WnbdSchedulerApply(_In_ PWNBD_EXTENSION Ext,
+                   _In_ PWNBD_SCSI_DEVICE Device);
+
+// Accounts the time spent by the request in the driver queues, called
+// when submitting the request.
+VOID
+WnbdSchedulerAccountWait(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                         _In_ PSRB_QUEUE_ELEMENT Element);
+
+#endif
@@ -130,10 +130,22 @@ WnbdHwFindAdapter(PVOID DeviceExtension,
     ConfigInfo->SynchronizationModel = StorSynchronizeFullDuplex;
     ConfigInfo->VirtualDevice = TRUE;
 
+    Ext->DeviceTable = (PWNBD_DEVICE_SLOT) ExAllocatePoolWithTag(
+        NonPagedPoolNx, sizeof(WNBD_DEVICE_SLOT) * WNBD_MAX_DEVICES, 'DBNs');
+    if (!Ext->DeviceTable) {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Clean;
+    }
+    RtlZeroMemory(Ext->DeviceTable,
+                  sizeof(WNBD_DEVICE_SLOT) * WNBD_MAX_DEVICES);
+    for (ULONG Index = 0; Index < WNBD_MAX_DEVICES; Index++) {
+        ExInitializeRundownProtection(&Ext->DeviceTable[Index].Rundown);
+    }
+
     Status = ExInitializeResourceLite(&Ext->DeviceResourceLock);
     if (!NT_SUCCESS(Status)) {
         Status = STATUS_INSUFFICIENT_RESOURCES;
-        goto Clean;
+        goto CleanTable;
     }
 
     /*
@@ -141,7 +153,8 @@ WnbdHwFindAdapter(PVOID DeviceExtension,
      */
 
     InitializeListHead(&Ext->DeviceList);       
-    KeInitializeSpinLock(&Ext->DeviceListLock);
+    Ext->SchedulerTotalWeight = 0;
+    Ext->SchedulerGeneration = 0;
     KeInitializeEvent(&Ext->DeviceCleanerEvent, SynchronizationEvent, FALSE);
 
     /*
@@ -187,6 +200,9 @@ CleanAdapter:
     KeSetEvent(&Ext->DeviceCleanerEvent, IO_NO_INCREMENT, TRUE);
 CleanLock:
     ExDeleteResourceLite(&Ext->DeviceResourceLock);
+CleanTable:
+    ExFreePool(Ext->DeviceTable);
+    Ext->DeviceTable = NULL;
 Clean:
     WNBD_LOG_ERROR(": Failing with SP_RETURN_NOT_FOUND");
     WNBD_LOG_LOUD(": Exit");
@@ -211,6 +227,10 @@ WnbdHwFreeAdapterResources(_In_ PVOID DeviceExtension)
     KeWaitForSingleObject(Ext->DeviceCleaner, Executive, KernelMode, FALSE, NULL);
     ObDereferenceObject(Ext->DeviceCleaner);
     ExDeleteResourceLite(&Ext->DeviceResourceLock);
+    if (Ext->DeviceTable) {
+        ExFreePool(Ext->DeviceTable);
+        Ext->DeviceTable = NULL;
+    }
 
     WNBD_LOG_LOUD(": Exit");
 }
@@ -435,8 +455,7 @@ WnbdHwStartIo(PVOID DeviceExtension,
     ASSERT(DeviceExtension);
     PWNBD_EXTENSION Ext = (PWNBD_EXTENSION)DeviceExtension;
 
-    WNBD_LOG_INFO("WnbdHwStartIo Processing SRB Function = 0x%x(%s)",
-                  Srb->Function, WnbdToStringSrbFunction(Srb->Function));
+    WNBD_IO_LOG_INFO(WnbdEvtStartIo, Srb->Function);
 
     switch (Srb->Function) {
     case SRB_FUNCTION_EXECUTE_SCSI:
@@ -484,10 +503,7 @@ WnbdHwStartIo(PVOID DeviceExtension,
      * If the operation is not pending notify the Storport of completion
      */
     if (Complete) {
-        WNBD_LOG_LOUD("RequestComplete of %s status: 0x%x(%s)",
-                      WnbdToStringSrbFunction(Srb->Function),
-                      SrbStatus,
-                      WnbdToStringSrbStatus(SrbStatus));
+        WNBD_IO_LOG_LOUD(WnbdEvtStartIoCompleted, Srb->Function, SrbStatus);
         Srb->SrbStatus = SrbStatus;
         StorPortNotification(RequestComplete, DeviceExtension, Srb);
     }
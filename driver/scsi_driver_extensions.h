@@ -8,9 +8,35 @@
 #define SCSI_DRIVER_EXTENSIONS_H 1
 
 #include "common.h"
+#include "driver.h"
 
 #define WNBD_CONTEXT_MAGIC  0xabcddcba
 
+// Matches the SCSI address bitmap, see WnbdInitScsiIds. The LUNs of a
+// target have consecutive indexes.
+#define WNBD_MAX_DEVICES (MAX_NUMBER_OF_SCSI_BUSES * \
+    MAX_NUMBER_OF_SCSI_TARGETS * MAX_NUMBER_OF_SCSI_LOGICAL_UNITS)
+#define WNBD_VALID_DEVICE_ADDRESS(PathId, TargetId, Lun) \
+    ((PathId) < MAX_NUMBER_OF_SCSI_BUSES && \
+     (TargetId) < MAX_NUMBER_OF_SCSI_TARGETS && \
+     (Lun) < MAX_NUMBER_OF_SCSI_LOGICAL_UNITS)
+#define WNBD_DEVICE_INDEX(PathId, TargetId, Lun) \
+    ((((PathId) * MAX_NUMBER_OF_SCSI_TARGETS) + (TargetId)) * \
+        MAX_NUMBER_OF_SCSI_LOGICAL_UNITS + (Lun))
+#define WNBD_DEVICE_INDEX_PATH_ID(Index) \
+    ((Index) / (MAX_NUMBER_OF_SCSI_TARGETS * MAX_NUMBER_OF_SCSI_LOGICAL_UNITS))
+#define WNBD_DEVICE_INDEX_TARGET_ID(Index) \
+    (((Index) / MAX_NUMBER_OF_SCSI_LOGICAL_UNITS) % MAX_NUMBER_OF_SCSI_TARGETS)
+#define WNBD_DEVICE_INDEX_LUN(Index) \
+    ((Index) % MAX_NUMBER_OF_SCSI_LOGICAL_UNITS)
+
+typedef struct _WNBD_DEVICE_SLOT {
+    // Held while the device is being accessed by the SRB path, allowing
+    // it to be removed without an adapter wide lock.
+    EX_RUNDOWN_REF                  Rundown;
+    struct _WNBD_SCSI_DEVICE* volatile Device;
+} WNBD_DEVICE_SLOT, *PWNBD_DEVICE_SLOT;
+
 typedef struct _WNBD_EXTENSION {
     PVOID							GlobalInformation;
 
@@ -18,12 +44,24 @@ typedef struct _WNBD_EXTENSION {
 
     UNICODE_STRING					DeviceInterface;
     LIST_ENTRY						DeviceList;
-    KSPIN_LOCK						DeviceListLock;
     ERESOURCE                       DeviceResourceLock;
+    // Devices indexed by SCSI address, see WNBD_DEVICE_INDEX. Slots are
+    // updated along with DeviceList. SCSI addresses are only reused
+    // after the device is deleted.
+    PWNBD_DEVICE_SLOT               DeviceTable;
 
     HANDLE							DeviceCleaner;
     KEVENT							DeviceCleanerEvent;
     BOOLEAN							StopDeviceCleaner;
+
+    // Sum of the attached disk weights, see scheduler.h.
+    volatile LONG64                 SchedulerTotalWeight;
+    // Incremented whenever the disk shares change.
+    volatile LONG                   SchedulerGeneration;
+
+    // Bus scan requests, see WnbdHandleTargetOperation.
+    volatile LONG64                 ReportLunsRequests;
+    volatile LONG64                 UnmappedLunRequests;
 } WNBD_EXTENSION, *PWNBD_EXTENSION;
 
 typedef struct _WNBD_SCSI_DEVICE {
@@ -41,6 +79,10 @@ typedef struct _WNBD_SCSI_DEVICE {
     BOOLEAN				Missing;
     BOOLEAN				ReportedMissing;
     LONG				OutstandingIoCount;
+
+    ULONG				SchedulerWeight;
+    // The scheduler generation used when the queue depth was last set.
+    LONG				SchedulerGeneration;
 } WNBD_SCSI_DEVICE, *PWNBD_SCSI_DEVICE;
 
 typedef struct _WNBD_LU_EXTENSION {
@@ -48,7 +90,9 @@ typedef struct _WNBD_LU_EXTENSION {
     ULONG					TargetId;
     ULONG					Lun;
     PVOID					PDriverGlobalExtension;
-    struct _WNBD_SCSI_DEVICE*	WnbdScsiDevice;
+    // Cached by WnbdAcquireDevice, cleared when the device is deleted.
+    // Only valid while holding the device slot rundown protection.
+    struct _WNBD_SCSI_DEVICE* volatile	WnbdScsiDevice;
 } WNBD_LU_EXTENSION, *PWNBD_LU_EXTENSION;
 
 SCSI_ADAPTER_CONTROL_STATUS
@@ -5,7 +5,10 @@
  */
 
 #include "common.h"
+#include "congestion.h"
+#include "deadline.h"
 #include "debug.h"
+#include "scheduler.h"
 #include "scsi_driver_extensions.h"
 #include "scsi_operation.h"
 #include "scsi_trace.h"
@@ -19,26 +22,36 @@ VOID DrainDeviceQueue(PWNBD_SCSI_DEVICE Device, PLIST_ENTRY ListHead,
 {
     WNBD_LOG_LOUD(": Enter");
 
-    PLIST_ENTRY Request;
     PSRB_QUEUE_ELEMENT Element;
+    KIRQL Irql = { 0 };
 
-    while ((Request = ExInterlockedRemoveHeadList(ListHead, ListLock)) != NULL) {
-        Element = CONTAINING_RECORD(Request, SRB_QUEUE_ELEMENT, Link);
-
-        Element->Srb->DataTransferLength = 0;
-        Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
-        Element->Aborted = 1;
+    KeAcquireSpinLock(ListLock, &Irql);
+    while (!IsListEmpty(ListHead)) {
+        Element = CONTAINING_RECORD(RemoveHeadList(ListHead), SRB_QUEUE_ELEMENT, Link);
+        // Only reply list elements can be armed, the deadline wheel
+        // being protected by the reply list lock.
+        WnbdDeadlineDisarm(Element);
+        // The device remains usable, so we have to give back the queue
+        // depth slots.
+        WnbdCongestionRelease(DeviceInformation->Congestion, Element, FALSE);
 
         InterlockedDecrement(&Device->OutstandingIoCount);
-        WNBD_LOG_INFO("Notifying StorPort of completion of %p 0x%llx status: 0x%x(%s)",
-            Element->Srb, Element->Tag, Element->Srb->SrbStatus,
-            WnbdToStringSrbStatus(Element->Srb->SrbStatus));
-        StorPortNotification(RequestComplete, Element->DeviceExtension,
-                             Element->Srb);
+        // Timed out requests were already completed.
+        if (!Element->Aborted && !Element->Completed) {
+            Element->Srb->DataTransferLength = 0;
+            Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
+            Element->Aborted = 1;
+
+            WNBD_IO_LOG_INFO(WnbdEvtSrbCompleted, Element->Srb, Element->Tag,
+                             Element->Srb->SrbStatus);
+            StorPortNotification(RequestComplete, Element->DeviceExtension,
+                                 Element->Srb);
+        }
         ExFreePool(Element);
 
         InterlockedIncrement64(&DeviceInformation->Stats.AbortedUnsubmittedIORequests);
     }
+    KeReleaseSpinLock(ListLock, Irql);
 }
 
 
@@ -55,15 +68,13 @@ VOID SendAbortFailedForQueue(PLIST_ENTRY ListHead, PKSPIN_LOCK ListLock,
     LIST_FORALL_SAFE(ListHead, ItemLink, ItemNext) {
         Element = CONTAINING_RECORD(ItemLink, SRB_QUEUE_ELEMENT, Link);
 
-        Element->Srb->DataTransferLength = 0;
-        Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
-
-        // If it's marked as aborted, it means that Storport was already notified.
-        // Double completion leads to a crash.
-        if(!Element->Aborted) {
-            WNBD_LOG_INFO("Notifying StorPort of completion of %p 0x%llx status: 0x%x(%s)",
-            Element->Srb, Element->Tag, Element->Srb->SrbStatus,
-            WnbdToStringSrbStatus(Element->Srb->SrbStatus));
+        // If it's marked as aborted or completed, it means that Storport was
+        // already notified. Double completion leads to a crash.
+        if(!Element->Aborted && !Element->Completed) {
+            Element->Srb->DataTransferLength = 0;
+            Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
+            WNBD_IO_LOG_INFO(WnbdEvtSrbCompleted, Element->Srb, Element->Tag,
+                             Element->Srb->SrbStatus);
             StorPortNotification(RequestComplete, Element->DeviceExtension,
                                  Element->Srb);
             Element->Aborted = 1;
@@ -83,18 +94,15 @@ UCHAR DrainDeviceQueues(PVOID DeviceExtension,
     ASSERT(DeviceExtension);
 
     UCHAR SrbStatus = SRB_STATUS_NO_DEVICE;
-    PWNBD_SCSI_DEVICE Device;
+    PWNBD_SCSI_DEVICE Device = NULL;
     PWNBD_LU_EXTENSION LuExtension;
     PWNBD_EXTENSION DevExtension = (PWNBD_EXTENSION)DeviceExtension;
-    KIRQL Irql;
-    KSPIN_LOCK DevLock = DevExtension->DeviceListLock;
-    KeAcquireSpinLock(&DevLock, &Irql);
 
     if (SrbGetCdb(Srb)) {
         BYTE CdbValue = SrbGetCdb(Srb)->AsByte[0];
 
-        WNBD_LOG_INFO(": Received %#02x command. SRB = 0x%p. CDB = 0x%x. PathId: %d TargetId: %d LUN: %d",
-            CdbValue, Srb, CdbValue, Srb->PathId, Srb->TargetId, Srb->Lun);
+        WNBD_IO_LOG_INFO(WnbdEvtSrbReceived, CdbValue, Srb,
+                         Srb->PathId, Srb->TargetId, Srb->Lun);
     }
 
     LuExtension = (PWNBD_LU_EXTENSION)
@@ -106,8 +114,9 @@ UCHAR DrainDeviceQueues(PVOID DeviceExtension,
         goto Exit;
     }
 
-    Device = WnbdFindDevice(LuExtension, DeviceExtension,
-                            Srb->PathId, Srb->TargetId, Srb->Lun);
+    // Prevents the device from being deleted while draining its queues.
+    Device = WnbdAcquireDevice(LuExtension, DevExtension,
+                               Srb->PathId, Srb->TargetId, Srb->Lun);
     if (NULL == Device) {
         WNBD_LOG_INFO("Could not find device PathId: %d TargetId: %d LUN: %d",
             Srb->PathId, Srb->TargetId, Srb->Lun);
@@ -124,12 +133,14 @@ UCHAR DrainDeviceQueues(PVOID DeviceExtension,
         WNBD_LOG_WARN("%p is marked for deletion. PathId = %d. TargetId = %d. LUN = %d",
             Device, Srb->PathId, Srb->TargetId, Srb->Lun);
         /// Drain the queue here because the device doesn't theoretically exist;
+        WnbdMergeRequestLists(Info);
         DrainDeviceQueue(Device, &Info->RequestListHead, &Info->RequestListLock, Info);
         DrainDeviceQueue(Device, &Info->ReplyListHead, &Info->ReplyListLock, Info);
         goto Exit;
     }
     PSCSI_DEVICE_INFORMATION Info = (PSCSI_DEVICE_INFORMATION)Device->ScsiDeviceExtension;
 
+    WnbdMergeRequestLists(Info);
     DrainDeviceQueue(Device, &Info->RequestListHead, &Info->RequestListLock, Info);
     // Should we set those in-flight requests to SRB_STATUS_ABORT_FAILED?
     // We can't set them to SRB_STATUS_ABORTED because those requests have been
@@ -139,7 +150,9 @@ UCHAR DrainDeviceQueues(PVOID DeviceExtension,
     SrbStatus = SRB_STATUS_SUCCESS;
 
 Exit:
-    KeReleaseSpinLock(&DevLock, Irql);
+    if (Device) {
+        WnbdReleaseDevice(DevExtension, Device);
+    }
 
     WNBD_LOG_LOUD(": Exit");
     return SrbStatus;
@@ -214,19 +227,16 @@ WnbdExecuteScsiFunction(PVOID DeviceExtension,
 
     NTSTATUS Status = STATUS_SUCCESS;
     UCHAR SrbStatus = SRB_STATUS_NO_DEVICE;
-    PWNBD_SCSI_DEVICE Device;
+    PWNBD_SCSI_DEVICE Device = NULL;
     PWNBD_LU_EXTENSION LuExtension;
     PWNBD_EXTENSION DevExtension = (PWNBD_EXTENSION)DeviceExtension;
-    KIRQL Irql;
-    KSPIN_LOCK DevLock = DevExtension->DeviceListLock;
-    KeAcquireSpinLock(&DevLock, &Irql);
     *Complete = TRUE;
 
     if (SrbGetCdb(Srb)) {
         BYTE CdbValue = SrbGetCdb(Srb)->AsByte[0];
 
-        WNBD_LOG_INFO(": Received %#02x command. SRB = 0x%p. CDB = 0x%x. PathId: %d TargetId: %d LUN: %d",
-            CdbValue, Srb, CdbValue, Srb->PathId, Srb->TargetId, Srb->Lun);
+        WNBD_IO_LOG_INFO(WnbdEvtSrbReceived, CdbValue, Srb,
+                         Srb->PathId, Srb->TargetId, Srb->Lun);
     }
     LuExtension = (PWNBD_LU_EXTENSION)
         StorPortGetLogicalUnit(DeviceExtension, Srb->PathId, Srb->TargetId, Srb->Lun );
@@ -237,11 +247,14 @@ WnbdExecuteScsiFunction(PVOID DeviceExtension,
         goto Exit;
     }
 
-    Device = WnbdFindDevice(LuExtension, DeviceExtension,
-                            Srb->PathId, Srb->TargetId, Srb->Lun);
+    // Per device reference, SRBs for different disks don't share any lock.
+    Device = WnbdAcquireDevice(LuExtension, DevExtension,
+                               Srb->PathId, Srb->TargetId, Srb->Lun);
     if (NULL == Device) {
         WNBD_LOG_INFO("Could not find device PathId: %d TargetId: %d LUN: %d",
                       Srb->PathId, Srb->TargetId, Srb->Lun);
+        // Bus scans address the remaining LUNs of multi-LUN targets.
+        SrbStatus = WnbdHandleTargetOperation(DeviceExtension, Srb);
         goto Exit;
     }
 
@@ -256,6 +269,7 @@ WnbdExecuteScsiFunction(PVOID DeviceExtension,
         goto Exit;
     }
 
+    WnbdSchedulerApply(DevExtension, Device);
     InterlockedIncrement(&Device->OutstandingIoCount);
     Status = WnbdHandleSrbOperation(DeviceExtension, Device->ScsiDeviceExtension, Srb);
 
@@ -268,7 +282,9 @@ WnbdExecuteScsiFunction(PVOID DeviceExtension,
     }
 
 Exit:
-    KeReleaseSpinLock(&DevLock, Irql);
+    if (Device) {
+        WnbdReleaseDevice(DevExtension, Device);
+    }
     WNBD_LOG_LOUD(": Exit");
 
     return SrbStatus;
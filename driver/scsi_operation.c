@@ -5,10 +5,12 @@
  */
 
 #include "common.h"
+#include "congestion.h"
 #include "debug.h"
+#include "io_stats.h"
+#include "io_trace.h"
 #include "scsi_operation.h"
 #include "scsi_function.h"
-#include "scsi_trace.h"
 #include "srb_helper.h"
 #include "userspace.h"
 #include "util.h"
@@ -159,6 +161,18 @@ WnbdSetVpdSerialNumber(_In_ PVOID Data,
     return SRB_STATUS_SUCCESS;
 }
 
+// NBD requests carry a single range, userspace devices may accept
+// multiple UNMAP descriptors per request.
+static inline UINT32
+WnbdGetMaxUnmapDescCount(_In_ PSCSI_DEVICE_INFORMATION Info)
+{
+    if (Info->UserEntry->Properties.Flags.UseNbd) {
+        return 1;
+    }
+    UINT32 Count = Info->UserEntry->Properties.MaxUnmapDescCount;
+    return max(1, min(Count, WNBD_MAX_UNMAP_DESC_COUNT));
+}
+
 VOID
 WnbdSetVpdBlockLimits(_In_ PVOID Data,
                       _In_ PSCSI_DEVICE_INFORMATION Info,
@@ -182,10 +196,12 @@ WnbdSetVpdBlockLimits(_In_ PVOID Data,
                     &MaximumTransferBlocks);
     if (Info->UserEntry->Properties.Flags.UnmapSupported)
     {
-        // To keep it simple, we'll have one UNMAP descriptor per SRB.
-        // TODO: allow passing multiple unmap descriptors.
-        UINT32 MaximumUnmapBlockDescCount = 1;
+        UINT32 MaximumUnmapBlockDescCount = WnbdGetMaxUnmapDescCount(Info);
         UINT32 MaximumUnmapLBACount = 0xffffffff;
+        // NBD trim requests use a 32 bit length.
+        if (Info->UserEntry->Properties.Flags.UseNbd) {
+            MaximumUnmapLBACount = MAXULONG / Info->UserEntry->Properties.BlockSize;
+        }
         REVERSE_BYTES_4(&BlockLimits->MaximumUnmapLBACount, &MaximumUnmapLBACount);
         REVERSE_BYTES_4(&BlockLimits->MaximumUnmapBlockDescriptorCount,
                         &MaximumUnmapBlockDescCount);
@@ -355,6 +371,52 @@ Exit:
     return SrbStatus;
 }
 
+// Lists the LUNs of the target, allowing Storport to discover them
+// without probing each address.
+UCHAR
+WnbdReportLuns(_In_ PWNBD_EXTENSION DeviceExtension,
+               _In_ PSCSI_REQUEST_BLOCK Srb,
+               _In_ PCDB Cdb)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Srb);
+    ASSERT(Cdb);
+
+    PVOID DataBuffer = SrbGetDataBuffer(Srb);
+    ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
+    UCHAR LunData[sizeof(LUN_LIST) + MAX_NUMBER_OF_SCSI_LOGICAL_UNITS * 8] = { 0 };
+    UCHAR Luns[MAX_NUMBER_OF_SCSI_LOGICAL_UNITS];
+    PLUN_LIST LunList = (PLUN_LIST)LunData;
+    ULONG AllocationLength = 0;
+    UCHAR SrbStatus = SRB_STATUS_SUCCESS;
+
+    InterlockedIncrement64(&DeviceExtension->ReportLunsRequests);
+
+    REVERSE_BYTES_4(&AllocationLength, Cdb->REPORT_LUNS.AllocationLength);
+    if (NULL == DataBuffer || AllocationLength < sizeof(LUN_LIST)) {
+        SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        goto Exit;
+    }
+
+    ULONG LunCount = WnbdDeviceTableGetLuns(
+        DeviceExtension, Srb->PathId, Srb->TargetId, Luns);
+    ULONG LunListLength = LunCount * 8;
+    REVERSE_BYTES_4(LunList->LunListLength, &LunListLength);
+    for (ULONG i = 0; i < LunCount; i++) {
+        // Peripheral device addressing, single level.
+        LunList->Lun[i][1] = Luns[i];
+    }
+
+    ULONG Length = min(sizeof(LUN_LIST) + LunListLength,
+                       min(AllocationLength, DataTransferLength));
+    RtlCopyMemory(DataBuffer, LunData, Length);
+    SrbSetDataTransferLength(Srb, Length);
+
+Exit:
+    WNBD_LOG_LOUD(": Exit");
+    return SrbStatus;
+}
+
 UCHAR
 WnbdSetModeSense(_In_ PVOID Data,
                  _In_ PCDB Cdb,
@@ -503,15 +565,38 @@ WnbdPendElement(_In_ PVOID DeviceExtension,
         Srb->SrbStatus = SRB_STATUS_ABORTED;
         goto Exit;
     }
-    WNBD_LOG_INFO("Queuing Element, SRB= %p", Srb);
+    WNBD_IO_LOG_INFO(WnbdEvtQueuingElement, Srb);
 
+    RtlZeroMemory(Element, sizeof(SRB_QUEUE_ELEMENT));
     Element->DeviceExtension = DeviceExtension;
     Element->Srb = Srb;
     Element->StartingLbn = StartingLbn;
-    Element->ReadLength = (ULONG)DataLength;
+    // Unmap requests may cover more than 4GB, see UnmapLength.
+    Element->ReadLength = (ULONG)min(DataLength, MAXULONG);
     Element->Aborted = 0;
     Element->FUA = FUA;
-    ExInterlockedInsertTailList(&ScsiInfo->RequestListHead, &Element->Link, &ScsiInfo->RequestListLock);
+    Element->Read = IsReadSrb(Srb);
+    Element->Priority = IsPrioritySrb(Srb, FUA, DataLength);
+    ULONG64 Qpc;
+    Element->QueueTime = KeQueryInterruptTimePrecise(&Qpc);
+    Element->ReceiveTime = Element->QueueTime;
+    Element->IoOp = WnbdIoCountersGetOp(Srb);
+    if (Element->IoOp == WnbdIoOpUnmap) {
+        Element->UnmapLength = DataLength;
+    }
+    WnbdTraceStartRequest(ScsiInfo, Element);
+    // The SRB may be completed as soon as it's queued.
+    if (ScsiInfo->Congestion) {
+        WnbdCongestionCheckBacklog(ScsiInfo->Congestion, DeviceExtension, Srb);
+    }
+    if (Element->Priority) {
+        InterlockedIncrement64(&ScsiInfo->ExtendedStats.PriorityIORequests);
+        ExInterlockedInsertTailList(&ScsiInfo->PriorityRequestListHead,
+                                    &Element->Link, &ScsiInfo->RequestListLock);
+    } else {
+        ExInterlockedInsertTailList(&ScsiInfo->RequestListHead,
+                                    &Element->Link, &ScsiInfo->RequestListLock);
+    }
     KeReleaseSemaphore(&ScsiInfo->DeviceEvent, 0, 1, FALSE);
     Status = STATUS_PENDING;
 
@@ -599,35 +684,47 @@ WnbdPendOperation(_In_ PVOID DeviceExtension,
         }
 
         UINT32 DescriptorCount = BlockDescLength / sizeof(UNMAP_BLOCK_DESCRIPTOR);
-        if (DescriptorCount != 1) {
+        if (DescriptorCount > WnbdGetMaxUnmapDescCount(ScsiInfo)) {
             // Storport should honor the VPD limits.
-            WNBD_LOG_ERROR("Cannot send multiple UNMAP descriptors at a time.");
+            WNBD_LOG_ERROR("Too many UNMAP descriptors: %u.", DescriptorCount);
             Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
             Status = STATUS_INVALID_PARAMETER;
             break;
         }
 
-        PUNMAP_BLOCK_DESCRIPTOR Src = &DataBuffer->Descriptors[0];
-        UINT64 BlockAddress;
-        UINT32 BlockCount;
-        REVERSE_BYTES_8(&BlockAddress, &Src->StartingLba);
-        REVERSE_BYTES_4(&BlockCount, &Src->LbaCount);
-        UINT64 LastBlockAddress = BlockAddress + BlockCount;
-
-        if (LastBlockAddress < BlockAddress ||
-            LastBlockAddress >= ScsiInfo->UserEntry->Properties.BlockCount)
-        {
-            WNBD_LOG_ERROR("Unmap overflow.");
-            Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-            Status = STATUS_INVALID_PARAMETER;
+        // The element starts at the lowest descriptor address, its length
+        // being the sum of the descriptor lengths. The descriptors are
+        // passed as is to userspace.
+        UINT64 FirstBlockAddress = MAXULONGLONG;
+        UINT64 UnmapBlockCount = 0;
+        for (UINT32 i = 0; i < DescriptorCount; i++) {
+            PUNMAP_BLOCK_DESCRIPTOR Src = &DataBuffer->Descriptors[i];
+            UINT64 BlockAddress;
+            UINT32 BlockCount;
+            REVERSE_BYTES_8(&BlockAddress, &Src->StartingLba);
+            REVERSE_BYTES_4(&BlockCount, &Src->LbaCount);
+            UINT64 LastBlockAddress = BlockAddress + BlockCount;
+
+            if (LastBlockAddress < BlockAddress ||
+                LastBlockAddress >= ScsiInfo->UserEntry->Properties.BlockCount)
+            {
+                WNBD_LOG_ERROR("Unmap overflow.");
+                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+                Status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+            FirstBlockAddress = min(FirstBlockAddress, BlockAddress);
+            UnmapBlockCount += BlockCount;
+        }
+        if (Status) {
             break;
         }
 
         // TODO: can FUA be requested for UNMAP requests? NBD specs suggest
         // that it can, storport.h and SCSI specs suggest otherwise.
         Status = WnbdPendElement(DeviceExtension, ScsiDeviceExtension, Srb,
-            BlockAddress * ScsiInfo->UserEntry->Properties.BlockSize,
-            (UINT64)BlockCount * ScsiInfo->UserEntry->Properties.BlockSize,
+            FirstBlockAddress * ScsiInfo->UserEntry->Properties.BlockSize,
+            UnmapBlockCount * ScsiInfo->UserEntry->Properties.BlockSize,
             FALSE);
         }
         break;
@@ -663,7 +760,7 @@ WnbdHandleSrbOperation(PVOID DeviceExtension,
     UINT64 BlockCount = Info->UserEntry->Properties.BlockCount;
 
 
-    WNBD_LOG_LOUD("Processing %#02x command", Cdb->AsByte[0]);
+    WNBD_IO_LOG_LOUD(WnbdEvtScsiOperation, Cdb->AsByte[0]);
 
     switch (Cdb->AsByte[0]) {
     case SCSIOP_READ6:
@@ -701,6 +798,11 @@ WnbdHandleSrbOperation(PVOID DeviceExtension,
         }
         break;
 
+    case SCSIOP_REPORT_LUNS:
+        Srb->SrbStatus = WnbdReportLuns(
+            (PWNBD_EXTENSION)DeviceExtension, Srb, Cdb);
+        break;
+
     case SCSIOP_VERIFY:
     case SCSIOP_TEST_UNIT_READY:
         Srb->SrbStatus = SRB_STATUS_SUCCESS;
@@ -714,3 +816,60 @@ WnbdHandleSrbOperation(PVOID DeviceExtension,
     WNBD_LOG_LOUD(": Exit");
     return status;
 }
+
+_Use_decl_annotations_
+UCHAR
+WnbdHandleTargetOperation(PVOID DeviceExtension,
+                          PSCSI_REQUEST_BLOCK Srb)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(DeviceExtension);
+    ASSERT(Srb);
+    PWNBD_EXTENSION Ext = (PWNBD_EXTENSION)DeviceExtension;
+    PCDB Cdb = (PCDB) &Srb->Cdb;
+    UCHAR SrbStatus = SRB_STATUS_INVALID_LUN;
+
+    InterlockedIncrement64(&Ext->UnmappedLunRequests);
+
+    if (!WnbdDeviceTableGetLuns(Ext, Srb->PathId, Srb->TargetId, NULL)) {
+        SrbStatus = SRB_STATUS_NO_DEVICE;
+        goto Exit;
+    }
+
+    switch (Cdb->AsByte[0]) {
+    case SCSIOP_REPORT_LUNS:
+        SrbStatus = WnbdReportLuns(Ext, Srb, Cdb);
+        break;
+    case SCSIOP_INQUIRY:
+    {
+        PVOID DataBuffer = SrbGetDataBuffer(Srb);
+        ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
+        if (NULL == DataBuffer || Cdb->CDB6INQUIRY3.EnableVitalProductData) {
+            SrbStatus = SRB_STATUS_INVALID_REQUEST;
+            break;
+        }
+
+        INQUIRYDATA InquiryData = { 0 };
+        InquiryData.DeviceType = LOGICAL_UNIT_NOT_PRESENT_DEVICE & 0x1F;
+        InquiryData.DeviceTypeQualifier = DEVICE_QUALIFIER_NOT_SUPPORTED;
+        InquiryData.Versions = 5;
+        InquiryData.ResponseDataFormat = 2;
+        InquiryData.AdditionalLength =
+            INQUIRYDATABUFFERSIZE - RTL_SIZEOF_THROUGH_FIELD(
+                INQUIRYDATA, AdditionalLength);
+
+        ULONG Length = min(DataTransferLength, INQUIRYDATABUFFERSIZE);
+        RtlZeroMemory(DataBuffer, DataTransferLength);
+        RtlCopyMemory(DataBuffer, &InquiryData, Length);
+        SrbSetDataTransferLength(Srb, Length);
+        SrbStatus = SRB_STATUS_SUCCESS;
+        break;
+    }
+    default:
+        break;
+    }
+
+Exit:
+    WNBD_LOG_LOUD(": Exit");
+    return SrbStatus;
+}
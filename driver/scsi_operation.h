@@ -13,4 +13,10 @@ NTSTATUS
 WnbdHandleSrbOperation(_In_ PVOID DeviceExtension,
                        _In_ PVOID ScsiDeviceExtension,
                        _In_ PSCSI_REQUEST_BLOCK Srb);
+
+// Handles the requests sent to LUNs without a disk. Targets that hold
+// other disks answer INQUIRY and REPORT LUNS, the rest is rejected.
+UCHAR
+WnbdHandleTargetOperation(_In_ PVOID DeviceExtension,
+                          _In_ PSCSI_REQUEST_BLOCK Srb);
 #endif
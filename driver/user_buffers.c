@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "common.h"
+#include "debug.h"
+#include "user_buffers.h"
+#include "userspace.h"
+#include "wnbd_dispatch.h"
+
+#define UserBuffersMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'bDBN')
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdUserBufferRegister(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                       PVOID Buffer,
+                       UINT32 BufferSize,
+                       PUINT32 BufferId)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(DeviceInformation);
+    ASSERT(BufferId);
+
+    NTSTATUS Status = STATUS_SUCCESS;
+    PVOID SystemAddress = NULL;
+    PMDL Mdl = NULL;
+    BOOLEAN Locked = FALSE;
+    KIRQL Irql = { 0 };
+    *BufferId = 0;
+
+    if (!Buffer || !BufferSize ||
+            BufferSize > WNBD_MAX_REGISTERED_BUFFER_SIZE) {
+        WNBD_LOG_ERROR("Invalid buffer: %p, size: %u.", Buffer, BufferSize);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PWNBD_USER_BUFFERS UserBuffers = DeviceInformation->UserBuffers;
+    if (!UserBuffers) {
+        UserBuffers = (PWNBD_USER_BUFFERS) UserBuffersMalloc(
+            sizeof(WNBD_USER_BUFFERS));
+        if (!UserBuffers) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlZeroMemory(UserBuffers, sizeof(WNBD_USER_BUFFERS));
+        KeInitializeSpinLock(&UserBuffers->Lock);
+
+        PWNBD_USER_BUFFERS Existing = (PWNBD_USER_BUFFERS)
+            InterlockedCompareExchangePointer(
+                (PVOID*)&DeviceInformation->UserBuffers, UserBuffers, NULL);
+        if (Existing) {
+            ExFreePool(UserBuffers);
+            UserBuffers = Existing;
+        }
+    }
+
+    // The buffer is going to receive write payloads.
+    Status = LockUsermodeBuffer(Buffer, BufferSize, TRUE,
+                                &SystemAddress, &Mdl, &Locked);
+    if (Status) {
+        goto Exit;
+    }
+
+    KeAcquireSpinLock(&UserBuffers->Lock, &Irql);
+    LONG Index = UserBuffers->Count;
+    if (Index < WNBD_MAX_REGISTERED_BUFFERS) {
+        PWNBD_USER_BUFFER Entry = &UserBuffers->Buffers[Index];
+        Entry->UserAddress = Buffer;
+        Entry->SystemAddress = SystemAddress;
+        Entry->Size = BufferSize;
+        Entry->Mdl = Mdl;
+        // Publishes the entry.
+        InterlockedIncrement(&UserBuffers->Count);
+        *BufferId = (UINT32)Index + 1;
+    } else {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    KeReleaseSpinLock(&UserBuffers->Lock, Irql);
+
+    if (Status) {
+        WNBD_LOG_ERROR("Registered buffer limit reached: %d.",
+                       WNBD_MAX_REGISTERED_BUFFERS);
+    } else {
+        WNBD_LOG_INFO("Registered buffer %u: %p, size: %u.",
+                      *BufferId, Buffer, BufferSize);
+    }
+
+Exit:
+    if (Status && Mdl) {
+        if (Locked) {
+            MmUnlockPages(Mdl);
+        }
+        IoFreeMdl(Mdl);
+    }
+    WNBD_LOG_LOUD(": Exit");
+    return Status;
+}
+
+_Use_decl_annotations_
+PVOID
+WnbdUserBufferGet(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                  UINT32 BufferId,
+                  PVOID UserAddress,
+                  UINT64 Length)
+{
+    PWNBD_USER_BUFFERS UserBuffers = DeviceInformation->UserBuffers;
+    if (!UserBuffers || !BufferId || BufferId > (UINT32)UserBuffers->Count) {
+        WNBD_LOG_ERROR("Invalid buffer id: %u.", BufferId);
+        return NULL;
+    }
+
+    PWNBD_USER_BUFFER Entry = &UserBuffers->Buffers[BufferId - 1];
+    ULONG_PTR Start = (ULONG_PTR)Entry->UserAddress;
+    ULONG_PTR Address = (ULONG_PTR)UserAddress;
+    if (Address < Start || Address - Start > Entry->Size ||
+            Length > Entry->Size - (Address - Start)) {
+        WNBD_LOG_ERROR("Buffer %p~0x%llx is not part of registered buffer %u.",
+                       UserAddress, Length, BufferId);
+        return NULL;
+    }
+    return (PUCHAR)Entry->SystemAddress + (Address - Start);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdUserBuffersRelease(PWNBD_USER_BUFFERS UserBuffers)
+{
+    KIRQL Irql = { 0 };
+    KeAcquireSpinLock(&UserBuffers->Lock, &Irql);
+    LONG Count = UserBuffers->Count;
+    UserBuffers->Count = 0;
+    KeReleaseSpinLock(&UserBuffers->Lock, Irql);
+
+    for (LONG i = 0; i < Count; i++) {
+        PWNBD_USER_BUFFER Entry = &UserBuffers->Buffers[i];
+        MmUnlockPages(Entry->Mdl);
+        IoFreeMdl(Entry->Mdl);
+        RtlZeroMemory(Entry, sizeof(WNBD_USER_BUFFER));
+    }
+    if (Count) {
+        WNBD_LOG_INFO("Released %d registered buffers.", Count);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+WnbdUserBuffersDelete(PWNBD_USER_BUFFERS UserBuffers)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!UserBuffers) {
+        return;
+    }
+
+    WnbdUserBuffersRelease(UserBuffers);
+    ExFreePool(UserBuffers);
+    WNBD_LOG_LOUD(": Exit");
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef USER_BUFFERS_H
+#define USER_BUFFERS_H 1
+
+#include "common.h"
+#include "userspace.h"
+
+typedef struct _WNBD_USER_BUFFER
+{
+    PVOID                       UserAddress;
+    PVOID                       SystemAddress;
+    UINT32                      Size;
+    PMDL                        Mdl;
+} WNBD_USER_BUFFER, *PWNBD_USER_BUFFER;
+
+// Buffers registered by the device owner process, kept locked and mapped
+// in system space until the process exits or the device is removed.
+// Buffers are only appended and are exclusively used by the owner
+// process, so lookups don't require locking.
+typedef struct _WNBD_USER_BUFFERS
+{
+    // Serializes registrations.
+    KSPIN_LOCK                  Lock;
+    volatile LONG               Count;
+    WNBD_USER_BUFFER            Buffers[WNBD_MAX_REGISTERED_BUFFERS];
+} WNBD_USER_BUFFERS, *PWNBD_USER_BUFFERS;
+
+// Must be called in the context of the owner process.
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+WnbdUserBufferRegister(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                       _In_ PVOID Buffer,
+                       _In_ UINT32 BufferSize,
+                       _Out_ PUINT32 BufferId);
+
+// Returns the system address of the specified user buffer range,
+// which must be part of the registered buffer. Returns NULL if the
+// buffer id or the range are invalid.
+PVOID
+WnbdUserBufferGet(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                  _In_ UINT32 BufferId,
+                  _In_ PVOID UserAddress,
+                  _In_ UINT64 Length);
+
+// Unlocks the registered buffers. The caller must ensure that they
+// aren't being used, for example because the owner process exited.
+VOID
+WnbdUserBuffersRelease(_In_ PWNBD_USER_BUFFERS UserBuffers);
+
+VOID
+WnbdUserBuffersDelete(_In_ PWNBD_USER_BUFFERS UserBuffers);
+
+#endif
@@ -9,16 +9,32 @@
 
 #include <berkeley.h>
 #include <ksocket.h>
+#include "buffer_pool.h"
+#include "cbt.h"
 #include "common.h"
+#include "congestion.h"
+#include "connection_table.h"
+#include "deadline.h"
 #include "debug.h"
 #include "driver_extension.h"
+#include "event_log.h"
+#include "fetch_queue.h"
+#include "io_stats.h"
+#include "io_trace.h"
+#include "mirror.h"
 #include "nbd_protocol.h"
+#include "overlay.h"
+#include "qos.h"
+#include "ring.h"
+#include "scheduler.h"
 #include "scsi_function.h"
+#include "user_buffers.h"
 #include "userspace.h"
 #include "wnbd_dispatch.h"
 #include "wnbd_ioctl.h"
 #include "util.h"
 #include "version.h"
+#include "zero_copy.h"
 
 #define CHECK_I_LOCATION(Io, Type) (Io->Parameters.DeviceIoControl.InputBufferLength < sizeof(Type))
 #define CHECK_O_LOCATION(Io, Type) (Io->Parameters.DeviceIoControl.OutputBufferLength < sizeof(Type))
@@ -27,13 +43,74 @@
 
 extern UNICODE_STRING GlobalRegistryPath;
 
+// Indexed by WNBD_DEVICE_INDEX.
 extern RTL_BITMAP ScsiBitMapHeader = { 0 };
-ULONG AssignedScsiIds[((SCSI_MAXIMUM_TARGETS_PER_BUS / 8) / sizeof(ULONG)) * MAX_NUMBER_OF_SCSI_TARGETS];
-static USHORT LunId = 0;
+ULONG AssignedScsiIds[WNBD_MAX_DEVICES / (8 * sizeof(ULONG))];
+static ULONG LunsPerTarget = WNBD_DEFAULT_LUNS_PER_TARGET;
 VOID WnbdInitScsiIds()
 {
     RtlZeroMemory(AssignedScsiIds, sizeof(AssignedScsiIds));
-    RtlInitializeBitMap(&ScsiBitMapHeader, AssignedScsiIds, SCSI_MAXIMUM_TARGETS_PER_BUS * MAX_NUMBER_OF_SCSI_TARGETS);
+    RtlInitializeBitMap(&ScsiBitMapHeader, AssignedScsiIds, WNBD_MAX_DEVICES);
+    WnbdReadLunsPerTarget();
+}
+
+VOID
+WnbdReadLunsPerTarget()
+{
+    UINT32 Value = 0;
+    if (WNBDReadRegistryValue(
+            &GlobalRegistryPath, L"LunsPerTarget",
+            (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT), &Value) &&
+            Value) {
+        LunsPerTarget = min(Value, MAX_NUMBER_OF_SCSI_LOGICAL_UNITS);
+    } else {
+        LunsPerTarget = WNBD_DEFAULT_LUNS_PER_TARGET;
+    }
+    WNBD_LOG_INFO("LUNs per target: %u.", LunsPerTarget);
+}
+
+// Returns the lowest free SCSI address index that uses one of the first
+// "LunLimit" LUNs of a target.
+ULONG
+WnbdFindScsiId(_In_ ULONG LunLimit)
+{
+    for (ULONG Target = 0;
+            Target < MAX_NUMBER_OF_SCSI_BUSES * MAX_NUMBER_OF_SCSI_TARGETS;
+            Target++) {
+        for (ULONG Lun = 0; Lun < LunLimit; Lun++) {
+            ULONG Index = Target * MAX_NUMBER_OF_SCSI_LOGICAL_UNITS + Lun;
+            if (!RtlCheckBit(&ScsiBitMapHeader, Index)) {
+                return Index;
+            }
+        }
+    }
+    return WNBD_INVALID_SCSI_ID;
+}
+
+// The first "LunsPerTarget" LUNs of each target are used before moving
+// to the next target. The remaining LUNs are only used once those are
+// exhausted. By default, each disk gets its own target while possible.
+_Use_decl_annotations_
+ULONG
+WnbdAllocateScsiId()
+{
+    ULONG Index = WnbdFindScsiId(LunsPerTarget);
+    if (WNBD_INVALID_SCSI_ID == Index) {
+        Index = WnbdFindScsiId(MAX_NUMBER_OF_SCSI_LOGICAL_UNITS);
+    }
+    if (WNBD_INVALID_SCSI_ID != Index) {
+        RtlSetBits(&ScsiBitMapHeader, Index, 1);
+    }
+    return Index;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdReleaseScsiId(ULONG PathId,
+                  ULONG TargetId,
+                  ULONG Lun)
+{
+    RtlClearBits(&ScsiBitMapHeader, WNBD_DEVICE_INDEX(PathId, TargetId, Lun), 1);
 }
 
 _Use_decl_annotations_
@@ -47,21 +124,11 @@ WnbdFindConnection(PGLOBAL_INFORMATION GInfo,
     ASSERT(InstanceName);
 
     // TODO: consider returning the "Entry" directly.
-    BOOLEAN Found = FALSE;
-    PUSER_ENTRY SearchEntry;
-
-    SearchEntry = (PUSER_ENTRY)GInfo->ConnectionList.Flink;
-
-    while (SearchEntry != (PUSER_ENTRY)&GInfo->ConnectionList.Flink) {
-        if (!strcmp((CONST CHAR*)&SearchEntry->Properties.InstanceName, InstanceName)) {
-            if (Entry) {
-                *Entry = SearchEntry;
-
-            }
-            Found = TRUE;
-            break;
-        }
-        SearchEntry = (PUSER_ENTRY)SearchEntry->ListEntry.Flink;
+    PUSER_ENTRY SearchEntry = WnbdConnectionTableFindName(
+        GInfo->ConnectionTable, InstanceName);
+    BOOLEAN Found = !!SearchEntry;
+    if (Found && Entry) {
+        *Entry = SearchEntry;
     }
 
     WNBD_LOG_LOUD(": Exit");
@@ -69,26 +136,35 @@ WnbdFindConnection(PGLOBAL_INFORMATION GInfo,
 }
 
 _Use_decl_annotations_
-PUSER_ENTRY
-WnbdFindConnectionEx(_In_ PGLOBAL_INFORMATION GInfo,
-                     _In_ UINT64 ConnectionId)
+VOID
+WnbdReleaseProcessBuffers(PGLOBAL_INFORMATION GInfo,
+                          HANDLE ProcessId)
 {
     WNBD_LOG_LOUD(": Enter");
     ASSERT(GInfo);
 
-    PUSER_ENTRY FoundEntry = NULL;
-    PUSER_ENTRY SearchEntry = (PUSER_ENTRY)GInfo->ConnectionList.Flink;
-
-    while (SearchEntry != (PUSER_ENTRY)&GInfo->ConnectionList.Flink) {
-        if (SearchEntry->ConnectionId == ConnectionId) {
-            FoundEntry = SearchEntry;
-            break;
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&GInfo->ConnectionMutex, TRUE);
+    PUSER_ENTRY Entry = (PUSER_ENTRY)GInfo->ConnectionList.Flink;
+    while (Entry != (PUSER_ENTRY)&GInfo->ConnectionList.Flink) {
+        // The locked pages and the user mappings must be released before
+        // the process address space gets torn down.
+        PSCSI_DEVICE_INFORMATION ScsiInfo = Entry->ScsiInformation;
+        if (ScsiInfo &&
+                (ULONG_PTR)Entry->Properties.Pid == (ULONG_PTR)ProcessId) {
+            if (ScsiInfo->UserBuffers) {
+                WnbdUserBuffersRelease(ScsiInfo->UserBuffers);
+            }
+            if (ScsiInfo->ZeroCopy) {
+                WnbdZeroCopyRelease(ScsiInfo->ZeroCopy);
+            }
         }
-        SearchEntry = (PUSER_ENTRY)SearchEntry->ListEntry.Flink;
+        Entry = (PUSER_ENTRY)Entry->ListEntry.Flink;
     }
+    ExReleaseResourceLite(&GInfo->ConnectionMutex);
+    KeLeaveCriticalRegion();
 
     WNBD_LOG_LOUD(": Exit");
-    return FoundEntry;
 }
 
 PVOID WnbdCreateScsiDevice(_In_ PVOID Extension,
@@ -170,8 +246,6 @@ WnbdSetInquiryData(_Inout_ PINQUIRYDATA InquiryData)
     WNBD_LOG_LOUD(": Exit");
 }
 
-#define MallocT(S) ExAllocatePoolWithTag(NonPagedPoolNx, S, 'pDBR')
-
 NTSTATUS
 WnbdInitializeNbdClient(_In_ PSCSI_DEVICE_INFORMATION ScsiInfo)
 {
@@ -180,18 +254,14 @@ WnbdInitializeNbdClient(_In_ PSCSI_DEVICE_INFORMATION ScsiInfo)
     HANDLE request_thread_handle = NULL, reply_thread_handle = NULL;
     NTSTATUS Status = STATUS_SUCCESS;
 
-    ScsiInfo->ReadPreallocatedBuffer = MallocT(((UINT)WNBD_PREALLOC_BUFF_SZ));
-    if (!ScsiInfo->ReadPreallocatedBuffer) {
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        goto SoftTerminate;
-    }
-    ScsiInfo->ReadPreallocatedBufferLength = WNBD_PREALLOC_BUFF_SZ;
-    ScsiInfo->WritePreallocatedBuffer = MallocT(((UINT)WNBD_PREALLOC_BUFF_SZ));
-    if (!ScsiInfo->WritePreallocatedBuffer) {
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        goto SoftTerminate;
+    if (!ScsiInfo->Mirror) {
+        // Mirror legs reserve their own receive buffers.
+        ScsiInfo->ReceiveBuffer = Malloc(WNBD_RECEIVE_BUFFER_SIZE);
+        if (!ScsiInfo->ReceiveBuffer) {
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto SoftTerminate;
+        }
     }
-    ScsiInfo->WritePreallocatedBufferLength = WNBD_PREALLOC_BUFF_SZ;
 
     Status = PsCreateSystemThread(&request_thread_handle, (ACCESS_MASK)0L, NULL,
                                   NULL, NULL, WnbdDeviceRequestThread, ScsiInfo);
@@ -208,6 +278,15 @@ WnbdInitializeNbdClient(_In_ PSCSI_DEVICE_INFORMATION ScsiInfo)
         goto SoftTerminate;
     }
 
+    if (ScsiInfo->Mirror) {
+        // Each mirror leg has its own reply thread.
+        Status = WnbdMirrorStart(ScsiInfo->Mirror);
+        if (!NT_SUCCESS(Status)) {
+            goto SoftTerminate;
+        }
+        return Status;
+    }
+
     Status = PsCreateSystemThread(&reply_thread_handle, (ACCESS_MASK)0L, NULL,
                                   NULL, NULL, WnbdDeviceReplyThread, ScsiInfo);
     if (!NT_SUCCESS(Status)) {
@@ -219,6 +298,7 @@ WnbdInitializeNbdClient(_In_ PSCSI_DEVICE_INFORMATION ScsiInfo)
         &ScsiInfo->DeviceReplyThread, NULL);
 
     RtlZeroMemory(&ScsiInfo->Stats, sizeof(WNBD_DRV_STATS));
+    RtlZeroMemory(&ScsiInfo->ExtendedStats, sizeof(WNBD_DRV_EXTENDED_STATS));
 
     if (!NT_SUCCESS(Status)) {
         Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -229,12 +309,6 @@ WnbdInitializeNbdClient(_In_ PSCSI_DEVICE_INFORMATION ScsiInfo)
 
 SoftTerminate:
     ExDeleteResourceLite(&ScsiInfo->SocketLock);
-    if (ScsiInfo->ReadPreallocatedBuffer) {
-        ExFreePool(ScsiInfo->ReadPreallocatedBuffer);
-    }
-    if (ScsiInfo->WritePreallocatedBuffer) {
-        ExFreePool(ScsiInfo->WritePreallocatedBuffer);
-    }
     if (request_thread_handle)
         ZwClose(request_thread_handle);
     if (reply_thread_handle)
@@ -254,6 +328,7 @@ WnbdInitializeScsiInfo(_In_ PSCSI_DEVICE_INFORMATION ScsiInfo, BOOLEAN UseNbd)
     NTSTATUS Status = STATUS_SUCCESS;
 
     InitializeListHead(&ScsiInfo->RequestListHead);
+    InitializeListHead(&ScsiInfo->PriorityRequestListHead);
     KeInitializeSpinLock(&ScsiInfo->RequestListLock);
     InitializeListHead(&ScsiInfo->ReplyListHead);
     KeInitializeSpinLock(&ScsiInfo->ReplyListLock);
@@ -272,6 +347,7 @@ WnbdInitializeScsiInfo(_In_ PSCSI_DEVICE_INFORMATION ScsiInfo, BOOLEAN UseNbd)
     ScsiInfo->SoftTerminateDevice = FALSE;
 
     RtlZeroMemory(&ScsiInfo->Stats, sizeof(WNBD_DRV_STATS));
+    RtlZeroMemory(&ScsiInfo->ExtendedStats, sizeof(WNBD_DRV_EXTENDED_STATS));
 
     if (UseNbd) {
         Status = WnbdInitializeNbdClient(ScsiInfo);
@@ -286,6 +362,7 @@ _Use_decl_annotations_
 NTSTATUS
 WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
                      PWNBD_PROPERTIES Properties,
+                     PWNBD_EXTENDED_PROPERTIES ExtendedProperties,
                      PWNBD_CONNECTION_INFO ConnectionInfo)
 {
     WNBD_LOG_LOUD(": Enter");
@@ -295,6 +372,8 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
     NTSTATUS Status = STATUS_SUCCESS;
     BOOLEAN Added = FALSE;
     INT Sock = -1;
+    INT MirrorSock = -1;
+    ULONG ScsiIndex = WNBD_INVALID_SCSI_ID;
 
     PUSER_ENTRY NewEntry = (PUSER_ENTRY)
         ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(USER_ENTRY), 'DBNu');
@@ -309,6 +388,68 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
         goto Exit;
     }
 
+    if (Properties->Flags.UseMirror) {
+        if (!Properties->Flags.UseNbd) {
+            WNBD_LOG_ERROR("Mirroring requires the \"UseNbd\" flag.");
+            Status = STATUS_INVALID_PARAMETER;
+            goto Exit;
+        }
+        if (!ExtendedProperties) {
+            WNBD_LOG_ERROR("The mirror properties must be passed through "
+                           "IOCTL_WNBD_CREATE_EX.");
+            Status = STATUS_INVALID_PARAMETER;
+            goto Exit;
+        }
+    }
+
+    if (Properties->Flags.ZeroCopy && Properties->Flags.UseNbd) {
+        WNBD_LOG_ERROR("Zero-copy mode can't be used along with the "
+                       "\"UseNbd\" flag.");
+        Status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    if (Properties->Flags.UseOverlay) {
+        if (!Properties->Flags.UseNbd || Properties->Flags.UseMirror) {
+            WNBD_LOG_ERROR("The overlay requires the \"UseNbd\" flag and "
+                           "can't be used along with mirroring.");
+            Status = STATUS_INVALID_PARAMETER;
+            goto Exit;
+        }
+        if (!ExtendedProperties) {
+            WNBD_LOG_ERROR("The overlay path must be passed through "
+                           "IOCTL_WNBD_CREATE_EX.");
+            Status = STATUS_INVALID_PARAMETER;
+            goto Exit;
+        }
+        size_t PathLength = strnlen(ExtendedProperties->OverlayPath,
+                                    WNBD_MAX_PATH_LENGTH);
+        if (!PathLength || PathLength == WNBD_MAX_PATH_LENGTH) {
+            WNBD_LOG_ERROR("Invalid overlay path.");
+            Status = STATUS_INVALID_PARAMETER;
+            goto Exit;
+        }
+    }
+
+    if ((Properties->Flags.AdaptiveQueueDepth || Properties->MaxQueueDepth) &&
+            !Properties->Flags.UseNbd) {
+        WNBD_LOG_ERROR("Queue depth limits require the \"UseNbd\" flag.");
+        Status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    Status = WnbdQosValidateLimits(&Properties->QosLimits);
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
+
+    if (Properties->SchedulerWeight > WNBD_MAX_SCHEDULER_WEIGHT) {
+        WNBD_LOG_ERROR("Invalid scheduler weight: %d. Maximum: %d.",
+                       Properties->SchedulerWeight, WNBD_MAX_SCHEDULER_WEIGHT);
+        Status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
     if (WnbdFindConnection(GInfo, Properties->InstanceName, NULL)) {
         Status = STATUS_OBJECT_NAME_COLLISION;
         goto Exit;
@@ -316,7 +457,13 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
 
     RtlZeroMemory(NewEntry,sizeof(USER_ENTRY));
     RtlCopyMemory(&NewEntry->Properties, Properties, sizeof(WNBD_PROPERTIES));
+    if (ExtendedProperties) {
+        RtlCopyMemory(&NewEntry->ExtendedProperties, ExtendedProperties,
+                      sizeof(WNBD_EXTENDED_PROPERTIES));
+    }
+    NewEntry->ListKey = ++GInfo->NextListKey;
     InsertTailList(&GInfo->ConnectionList, &NewEntry->ListEntry);
+    WnbdConnectionTableInsertName(GInfo->ConnectionTable, NewEntry);
     Added = TRUE;
 
     PINQUIRYDATA InquiryData = (PINQUIRYDATA) Malloc(sizeof(INQUIRYDATA));
@@ -337,9 +484,19 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
         }
     }
 
-    ULONG bitNumber = RtlFindClearBitsAndSet(&ScsiBitMapHeader, 1, 0);
+    if (Properties->Flags.UseMirror) {
+        MirrorSock = NbdOpenAndConnect(
+            ExtendedProperties->MirrorProperties.NbdProperties.Hostname,
+            ExtendedProperties->MirrorProperties.NbdProperties.PortNumber);
+        if (-1 == MirrorSock) {
+            Status = STATUS_CONNECTION_REFUSED;
+            goto ExitInquiryData;
+        }
+    }
 
-    if (0xFFFFFFFF == bitNumber) {
+    ScsiIndex = WnbdAllocateScsiId();
+    if (WNBD_INVALID_SCSI_ID == ScsiIndex) {
+        WNBD_LOG_ERROR("No SCSI address available.");
         Status = STATUS_INVALID_FIELD_IN_PARAMETER_LIST;
         goto ExitInquiryData;
     }
@@ -359,6 +516,32 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
         NewEntry->Properties.BlockCount = DiskSize / NewEntry->Properties.BlockSize;
     }
 
+    if (Properties->Flags.UseMirror &&
+            !ExtendedProperties->MirrorProperties.NbdProperties.Flags.SkipNegotiation) {
+        WNBD_LOG_INFO("Trying to negotiate handshake with mirror NBD Server");
+        UINT64 MirrorDiskSize = 0;
+        UINT16 MirrorNbdFlags = 0;
+        Status = NbdNegotiate(&MirrorSock, &MirrorDiskSize, &MirrorNbdFlags,
+                              ExtendedProperties->MirrorProperties.NbdProperties.ExportName,
+                              1, 1);
+        if (!NT_SUCCESS(Status)) {
+            goto ExitInquiryData;
+        }
+        WNBD_LOG_INFO("Negotiated mirror disk size: %llu", MirrorDiskSize);
+        if (!NewEntry->Properties.BlockSize) {
+            NewEntry->Properties.BlockSize = WNBD_DEFAULT_BLOCK_SIZE;
+        }
+        // Both legs are exposed as a single disk, so we're only using
+        // the common size and capabilities.
+        UINT64 MirrorBlockCount = MirrorDiskSize / NewEntry->Properties.BlockSize;
+        if (!NewEntry->Properties.BlockCount ||
+                MirrorBlockCount < NewEntry->Properties.BlockCount) {
+            NewEntry->Properties.BlockCount = MirrorBlockCount;
+        }
+        NewEntry->Properties.Flags.ReadOnly |= CHECK_NBD_READONLY(MirrorNbdFlags);
+        NbdFlags &= MirrorNbdFlags | NBD_FLAG_READ_ONLY;
+    }
+
     if (!NewEntry->Properties.BlockSize || !NewEntry->Properties.BlockCount ||
         NewEntry->Properties.BlockCount > ULLONG_MAX / NewEntry->Properties.BlockSize)
     {
@@ -370,13 +553,22 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
         goto ExitInquiryData;
     }
 
-    NewEntry->Properties.Flags.ReadOnly |= CHECK_NBD_READONLY(NbdFlags);
-    NewEntry->Properties.Flags.UnmapSupported |= CHECK_NBD_SEND_TRIM(NbdFlags);
-    NewEntry->Properties.Flags.FlushSupported |= CHECK_NBD_SEND_FLUSH(NbdFlags);
-    NewEntry->Properties.Flags.FUASupported |= CHECK_NBD_SEND_FUA(NbdFlags);
+    if (Properties->Flags.UseOverlay) {
+        // Writes, trims and flushes are handled by the overlay, the NBD
+        // export only being used for reads.
+        NewEntry->Properties.Flags.UnmapSupported = 1;
+        NewEntry->Properties.Flags.FlushSupported = 1;
+        NewEntry->Properties.Flags.FUASupported = 1;
+    } else {
+        NewEntry->Properties.Flags.ReadOnly |= CHECK_NBD_READONLY(NbdFlags);
+        NewEntry->Properties.Flags.UnmapSupported |= CHECK_NBD_SEND_TRIM(NbdFlags);
+        NewEntry->Properties.Flags.FlushSupported |= CHECK_NBD_SEND_FLUSH(NbdFlags);
+        NewEntry->Properties.Flags.FUASupported |= CHECK_NBD_SEND_FUA(NbdFlags);
+    }
 
-    USHORT TargetId = bitNumber % SCSI_MAXIMUM_TARGETS_PER_BUS;
-    USHORT BusId = (USHORT)(bitNumber / MAX_NUMBER_OF_SCSI_TARGETS);
+    USHORT BusId = (USHORT)WNBD_DEVICE_INDEX_PATH_ID(ScsiIndex);
+    USHORT TargetId = (USHORT)WNBD_DEVICE_INDEX_TARGET_ID(ScsiIndex);
+    USHORT LunId = (USHORT)WNBD_DEVICE_INDEX_LUN(ScsiIndex);
 
     WNBD_LOG_INFO("Retrieved NBD flags: %d. Read-only: %d, TRIM enabled: %d, "
                   "FLUSH enabled: %d, FUA enabled: %d.",
@@ -408,13 +600,88 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
     ScsiInfo->GlobalInformation = GInfo;
     ScsiInfo->InquiryData = InquiryData;
     ScsiInfo->Socket = Sock;
+    ScsiInfo->UserEntry = NewEntry;
 
-    Status = WnbdInitializeScsiInfo(ScsiInfo, !!Properties->Flags.UseNbd);
+    if (Properties->Flags.ChangeTracking) {
+        Status = WnbdCbtCreate(
+            NewEntry->Properties.BlockCount * NewEntry->Properties.BlockSize,
+            NewEntry->Properties.BlockSize,
+            &NewEntry->Properties.ChangeTrackingBlockSize,
+            &ScsiInfo->Cbt);
+        if (!NT_SUCCESS(Status)) {
+            goto ExitScsiInfo;
+        }
+    }
+
+    if (Properties->Flags.UseOverlay) {
+        Status = WnbdOverlayCreate(ScsiInfo, &ScsiInfo->Overlay);
+        if (!NT_SUCCESS(Status)) {
+            goto ExitScsiInfo;
+        }
+    }
+
+    if (Properties->Flags.UseMirror) {
+        Status = WnbdMirrorCreate(ScsiInfo, Sock, MirrorSock, &ScsiInfo->Mirror);
+        if (!NT_SUCCESS(Status)) {
+            goto ExitScsiInfo;
+        }
+        // The sockets are owned by the mirror from now on.
+        ScsiInfo->Socket = -1;
+        Sock = -1;
+        MirrorSock = -1;
+    }
+
+    if (Properties->RequestTimeoutMs) {
+        Status = WnbdDeadlineWheelCreate(
+            ScsiInfo, Properties->RequestTimeoutMs,
+            Properties->MaxRequestRetries, &ScsiInfo->DeadlineWheel);
+        if (!NT_SUCCESS(Status)) {
+            goto ExitScsiInfo;
+        }
+    }
+
+    if (Properties->Flags.AdaptiveQueueDepth || Properties->MaxQueueDepth) {
+        Status = WnbdCongestionCreate(
+            ScsiInfo, !!Properties->Flags.AdaptiveQueueDepth,
+            Properties->MaxQueueDepth, &ScsiInfo->Congestion);
+        if (!NT_SUCCESS(Status)) {
+            goto ExitScsiInfo;
+        }
+        NewEntry->Properties.MaxQueueDepth = ScsiInfo->Congestion->MaxDepth;
+    }
+
+    Status = WnbdIoCountersCreate(&ScsiInfo->IoCounters);
     if (!NT_SUCCESS(Status)) {
         goto ExitScsiInfo;
     }
 
-    ScsiInfo->UserEntry = NewEntry;
+    if (WnbdQosLimitsSet(&Properties->QosLimits)) {
+        Status = WnbdQosCreate(ScsiInfo, &Properties->QosLimits, &ScsiInfo->Qos);
+        if (!NT_SUCCESS(Status)) {
+            goto ExitScsiInfo;
+        }
+    }
+
+    if (Properties->Flags.ZeroCopy) {
+        Status = WnbdZeroCopyCreate(
+            ScsiInfo, &NewEntry->Properties.ZeroCopyThreshold,
+            &ScsiInfo->ZeroCopy);
+        if (!NT_SUCCESS(Status)) {
+            goto ExitScsiInfo;
+        }
+    }
+
+    if (!NewEntry->Properties.SchedulerWeight) {
+        NewEntry->Properties.SchedulerWeight = WNBD_DEFAULT_SCHEDULER_WEIGHT;
+    }
+
+    Status = WnbdInitializeScsiInfo(ScsiInfo, !!Properties->Flags.UseNbd);
+    if (!NT_SUCCESS(Status)) {
+        goto ExitScsiInfo;
+    }
+    if (ScsiInfo->DeadlineWheel) {
+        WnbdDeadlineWheelStart(ScsiInfo->DeadlineWheel);
+    }
 
     // The connection properties might be slightly different than the ones set
     // by the client (e.g. after NBD negotiation or setting default values).
@@ -422,21 +689,20 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
     ConnectionInfo->BusNumber = BusId;
     ConnectionInfo->TargetId = TargetId;
     ConnectionInfo->Lun = LunId;
-    ConnectionInfo->ConnectionId = WNBD_CONNECTION_ID_FROM_ADDR(BusId, TargetId, LunId);
-    WNBD_LOG_INFO("Bus: %d, target: %d, lun: %d, connection id: %llu.",
-                  BusId, TargetId, LunId, ConnectionInfo->ConnectionId);
 
     NewEntry->ScsiInformation = ScsiInfo;
     NewEntry->BusIndex = BusId;
     NewEntry->TargetIndex = TargetId;
     NewEntry->LunIndex = LunId;
-    NewEntry->ConnectionId = ConnectionInfo->ConnectionId;
 
     PWNBD_EXTENSION	Ext = (PWNBD_EXTENSION)GInfo->Handle;
     KeEnterCriticalRegion();
     ExAcquireResourceSharedLite(&Ext->DeviceResourceLock, TRUE);
 
     InsertTailList(&Ext->DeviceList, &ScsiInfo->Device->ListEntry);
+    WnbdDeviceTableInsert(Ext, ScsiInfo->Device);
+    WnbdSchedulerAddDevice(Ext, ScsiInfo->Device,
+                           NewEntry->Properties.SchedulerWeight);
 
     ExReleaseResourceLite(&Ext->DeviceResourceLock);
     KeLeaveCriticalRegion();
@@ -444,7 +710,17 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
     InterlockedIncrement(&GInfo->ConnectionCount);
     StorPortNotification(BusChangeDetected, GInfo->Handle, 0);
 
+    // The connection id becomes usable once the device is initialized.
+    WnbdConnectionTableInsert(GInfo->ConnectionTable, ScsiIndex, NewEntry);
+    ConnectionInfo->ConnectionId = NewEntry->ConnectionId;
+    ConnectionInfo->TargetLunCount = (USHORT)WnbdDeviceTableGetLuns(
+        Ext, BusId, TargetId, NULL);
+    WNBD_LOG_INFO("Bus: %d, target: %d, lun: %d, connection id: %llu.",
+                  BusId, TargetId, LunId, ConnectionInfo->ConnectionId);
+
     NewEntry->Connected = TRUE;
+    WnbdNotifyConnectionChange(GInfo, NewEntry);
+    ConnectionInfo->ChangeSequence = NewEntry->ChangeSequence;
     Status = STATUS_SUCCESS;
 
     WNBD_LOG_LOUD(": Exit");
@@ -453,6 +729,33 @@ WnbdCreateConnection(PGLOBAL_INFORMATION GInfo,
 
 ExitScsiInfo:
     if (ScsiInfo) {
+        if (ScsiInfo->Mirror) {
+            WnbdMirrorDelete(ScsiInfo->Mirror);
+        }
+        if (ScsiInfo->Cbt) {
+            WnbdCbtDelete(ScsiInfo->Cbt);
+        }
+        if (ScsiInfo->Overlay) {
+            WnbdOverlayDelete(ScsiInfo->Overlay);
+        }
+        if (ScsiInfo->DeadlineWheel) {
+            WnbdDeadlineWheelDelete(ScsiInfo->DeadlineWheel);
+        }
+        if (ScsiInfo->Congestion) {
+            WnbdCongestionDelete(ScsiInfo->Congestion);
+        }
+        if (ScsiInfo->IoCounters) {
+            WnbdIoCountersDelete(ScsiInfo->IoCounters);
+        }
+        if (ScsiInfo->Qos) {
+            WnbdQosDelete(ScsiInfo->Qos);
+        }
+        if (ScsiInfo->ZeroCopy) {
+            WnbdZeroCopyDelete(ScsiInfo->ZeroCopy);
+        }
+        if (ScsiInfo->ReceiveBuffer) {
+            ExFreePool(ScsiInfo->ReceiveBuffer);
+        }
         if (ScsiInfo->Device) {
             ExFreePool(ScsiInfo->Device);
         }
@@ -468,25 +771,77 @@ Exit:
         Close(Sock);
         Sock = -1;
     }
+    if (-1 != MirrorSock) {
+        WNBD_LOG_ERROR("Closing mirror socket FD: %d", MirrorSock);
+        Close(MirrorSock);
+        MirrorSock = -1;
+    }
     if (Added) {
-        WnbdDeleteConnectionEntry(NewEntry);
+        WnbdDeleteConnectionEntry(GInfo, NewEntry);
     }
     if (NewEntry) {
         ExFreePool(NewEntry);
     }
+    if (WNBD_INVALID_SCSI_ID != ScsiIndex) {
+        RtlClearBits(&ScsiBitMapHeader, ScsiIndex, 1);
+    }
 
     WNBD_LOG_LOUD(": Exit");
     return Status;
 }
 
+_Use_decl_annotations_
+VOID
+WnbdNotifyConnectionChange(PGLOBAL_INFORMATION GInfo,
+                           PUSER_ENTRY Entry)
+{
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&GInfo->ChangeLock, &Irql);
+    Entry->ChangeSequence = ++GInfo->ChangeSequence;
+    KeSetEvent(&GInfo->ChangeEvent, IO_NO_INCREMENT, FALSE);
+    KeReleaseSpinLock(&GInfo->ChangeLock, Irql);
+}
+
+// Remembers the removed connection for IOCTL_WNBD_LIST_PAGED, replacing
+// the oldest tombstone if needed. The connection mutex must be held
+// exclusively.
+VOID
+WnbdAddConnectionTombstone(_In_ PGLOBAL_INFORMATION GInfo,
+                           _In_ PUSER_ENTRY Entry)
+{
+    ULONG Index = (GInfo->TombstoneHead + GInfo->TombstoneCount) %
+        WNBD_MAX_CONNECTION_TOMBSTONES;
+    if (GInfo->TombstoneCount == WNBD_MAX_CONNECTION_TOMBSTONES) {
+        GInfo->TombstoneFloor = GInfo->Tombstones[Index].ChangeSequence;
+        GInfo->TombstoneHead = (Index + 1) % WNBD_MAX_CONNECTION_TOMBSTONES;
+    } else {
+        GInfo->TombstoneCount++;
+    }
+
+    PWNBD_CONNECTION_TOMBSTONE Tombstone = &GInfo->Tombstones[Index];
+    Tombstone->ConnectionId = Entry->ConnectionId;
+    Tombstone->ChangeSequence = Entry->ChangeSequence;
+    RtlCopyMemory(Tombstone->InstanceName, Entry->Properties.InstanceName,
+                  WNBD_MAX_NAME_LENGTH);
+}
+
 _Use_decl_annotations_
 NTSTATUS
-WnbdDeleteConnectionEntry(PUSER_ENTRY Entry)
+WnbdDeleteConnectionEntry(PGLOBAL_INFORMATION GInfo,
+                          PUSER_ENTRY Entry)
 {
     WNBD_LOG_LOUD(": Enter");
+    ASSERT(GInfo);
     ASSERT(Entry);
 
     RemoveEntryList(&Entry->ListEntry);
+    WnbdConnectionTableRemoveName(GInfo->ConnectionTable, Entry);
+    // Connections that failed to initialize were never listed.
+    if (Entry->Connected) {
+        WnbdNotifyConnectionChange(GInfo, Entry);
+        WnbdAddConnectionTombstone(GInfo, Entry);
+    }
 
     WNBD_LOG_LOUD(": Exit");
     return STATUS_SUCCESS;
@@ -526,6 +881,7 @@ WnbdDrainQueueOnClose(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation)
     KIRQL Irql = { 0 };
     PSRB_QUEUE_ELEMENT Element = NULL;
 
+    WnbdMergeRequestLists(DeviceInformation);
     KeAcquireSpinLock(&DeviceInformation->RequestListLock, &Irql);
     if (IsListEmpty(&DeviceInformation->RequestListHead))
         goto Reply;
@@ -552,7 +908,8 @@ Reply:
         Element = CONTAINING_RECORD(ItemLink, SRB_QUEUE_ELEMENT, Link);
         if (Element) {
             RemoveEntryList(&Element->Link);
-            if (!Element->Aborted) {
+            WnbdDeadlineDisarm(Element);
+            if (!Element->Aborted && !Element->Completed) {
                 Element->Srb->DataTransferLength = 0;
                 Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
                 StorPortNotification(RequestComplete, Element->DeviceExtension,
@@ -567,139 +924,496 @@ Exit:
     KeReleaseSpinLock(&DeviceInformation->ReplyListLock, Irql);
 }
 
+#define RemovalMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'mDBN')
+
 _Use_decl_annotations_
-NTSTATUS
-WnbdDeleteConnection(PGLOBAL_INFORMATION GInfo,
-                     PCHAR InstanceName)
+VOID
+WnbdDereferenceRemoval(PWNBD_REMOVAL Removal)
 {
-    WNBD_LOG_LOUD(": Enter");
-    ASSERT(GInfo);
-    ASSERT(InstanceName);
-    PUSER_ENTRY EntryMarked = NULL;
-    ULONG TargetIndex = 0;
-    ULONG BusIndex = 0;
-    if (!WnbdFindConnection(GInfo, InstanceName, &EntryMarked)) {
-        WNBD_LOG_ERROR("Could not find connection to delete");
-        return STATUS_OBJECT_NAME_NOT_FOUND;
+    if (!InterlockedDecrement(&Removal->RefCount)) {
+        ExFreePool(Removal);
     }
-    if (NULL == EntryMarked) {
-        return STATUS_OBJECT_NAME_NOT_FOUND;
-    }
-    PSCSI_DEVICE_INFORMATION ScsiInfo = EntryMarked->ScsiInformation;
-    NTSTATUS Status = STATUS_UNSUCCESSFUL;
-
-    TargetIndex = EntryMarked->TargetIndex;
-    BusIndex = EntryMarked->BusIndex;
+}
 
-    if (ScsiInfo) {
-        ScsiInfo->SoftTerminateDevice = TRUE;
-        // TODO: implement proper soft termination.
-        ScsiInfo->HardTerminateDevice = TRUE;
-        KeSetEvent(&ScsiInfo->TerminateEvent, IO_NO_INCREMENT, FALSE);
-        KeReleaseSemaphore(&ScsiInfo->DeviceEvent, 0, 1, FALSE);
-        LARGE_INTEGER Timeout;
-        // TODO: consider making this configurable, currently 120s.
-        Timeout.QuadPart = (-120 * 1000 * 10000);
-        CloseConnection(ScsiInfo);
-
-        // Ensure that the device isn't currently being accessed.
-        ExWaitForRundownProtectionRelease(&ScsiInfo->RundownProtection);
-
-        if (ScsiInfo->UserEntry->Properties.Flags.UseNbd) {
-            KeWaitForSingleObject(ScsiInfo->DeviceRequestThread, Executive, KernelMode, FALSE, NULL);
+// Second removal phase, may be called with or without holding the
+// connection mutex.
+VOID
+WnbdFinishRemoval(_In_ PWNBD_REMOVAL Removal)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PGLOBAL_INFORMATION GInfo = Removal->GlobalInformation;
+    PUSER_ENTRY Entry = Removal->Entry;
+    PSCSI_DEVICE_INFORMATION ScsiInfo = Entry->ScsiInformation;
+    NTSTATUS Status = STATUS_SUCCESS;
+    LARGE_INTEGER Timeout;
+    // TODO: consider making this configurable, currently 120s.
+    Timeout.QuadPart = (-120 * 1000 * 10000);
+
+    // Ensure that the device isn't currently being accessed.
+    ExWaitForRundownProtectionRelease(&ScsiInfo->RundownProtection);
+
+    if (Entry->Properties.Flags.UseNbd) {
+        KeWaitForSingleObject(ScsiInfo->DeviceRequestThread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(ScsiInfo->DeviceRequestThread);
+        if (ScsiInfo->Mirror) {
+            // Fails the pending requests and waits for the mirror threads.
+            WnbdMirrorStop(ScsiInfo->Mirror);
+        } else {
             KeWaitForSingleObject(ScsiInfo->DeviceReplyThread, Executive, KernelMode, FALSE, &Timeout);
-            ObDereferenceObject(ScsiInfo->DeviceRequestThread);
             ObDereferenceObject(ScsiInfo->DeviceReplyThread);
         }
-        WnbdDrainQueueOnClose(ScsiInfo);
-        DisconnectConnection(ScsiInfo);
+    }
+    // The ring thread must be stopped before draining the reply list.
+    WnbdRingStop(ScsiInfo->Ring);
+    // Completes the pended fetch IRPs.
+    WnbdFetchQueueStop(ScsiInfo->FetchQueue);
+    WnbdDrainQueueOnClose(ScsiInfo);
+    DisconnectConnection(ScsiInfo);
 
-        if (!WnbdSetDeviceMissing(ScsiInfo->Device,TRUE)) {
-            WNBD_LOG_WARN("Could not delete media because it is still in use.");
-            return STATUS_UNABLE_TO_UNLOAD_MEDIA;
-        }
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&GInfo->ConnectionMutex, TRUE);
+    // Once the entry is removed, the process notify routine can't
+    // release the mappings anymore.
+    WnbdZeroCopyDelete(ScsiInfo->ZeroCopy);
+    ScsiInfo->ZeroCopy = NULL;
+
+    if (WnbdSetDeviceMissing(ScsiInfo->Device, TRUE)) {
         StorPortNotification(BusChangeDetected, GInfo->Handle, 0);
+        WnbdDeleteConnectionEntry(GInfo, Entry);
+        InterlockedDecrement(&GInfo->ConnectionCount);
     } else {
-        WNBD_LOG_ERROR("Could not find device needed for deletion");
-        return STATUS_OBJECT_NAME_NOT_FOUND;
+        WNBD_LOG_WARN("Could not delete media because it is still in use.");
+        Status = STATUS_UNABLE_TO_UNLOAD_MEDIA;
     }
 
-    Status = WnbdDeleteConnectionEntry(EntryMarked);
-
-    RtlClearBits(&ScsiBitMapHeader, TargetIndex + (BusIndex * SCSI_MAXIMUM_TARGETS_PER_BUS), 1);
+    // The device may be deleted as soon as we release the mutex.
+    Removal->Status = Status;
+    if (Removal->Background && !--GInfo->PendingRemovals) {
+        KeSetEvent(&GInfo->RemovalsIdleEvent, IO_NO_INCREMENT, FALSE);
+    }
+    KeSetEvent(&Removal->CompletedEvent, IO_NO_INCREMENT, FALSE);
+    // The device may have been reported missing while being drained, in
+    // which case the device cleaner skipped it. WnbdReportMissingDevice
+    // only wakes the cleaner once per device, so we're doing it here,
+    // otherwise the device and its SCSI address would be leaked.
+    if (!Status) {
+        PWNBD_EXTENSION Ext = (PWNBD_EXTENSION)GInfo->Handle;
+        KeSetEvent(&Ext->DeviceCleanerEvent, IO_NO_INCREMENT, FALSE);
+    }
+    ExReleaseResourceLite(&GInfo->ConnectionMutex);
+    KeLeaveCriticalRegion();
 
-    InterlockedDecrement(&GInfo->ConnectionCount);
     WNBD_LOG_LOUD(": Exit");
+}
 
-    return Status;
+VOID
+WnbdRemovalThread(_In_ PVOID Context)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Context);
+    PWNBD_REMOVAL Removal = (PWNBD_REMOVAL)Context;
+
+    WnbdFinishRemoval(Removal);
+    WnbdDereferenceRemoval(Removal);
+
+    WNBD_LOG_LOUD(": Exit");
+    (void)PsTerminateSystemThread(STATUS_SUCCESS);
 }
 
 _Use_decl_annotations_
 NTSTATUS
-WnbdEnumerateActiveConnections(PGLOBAL_INFORMATION GInfo, PIRP Irp)
+WnbdStartRemoval(PGLOBAL_INFORMATION GInfo,
+                 PUSER_ENTRY Entry,
+                 BOOLEAN Background,
+                 PWNBD_REMOVAL* PRemoval)
 {
     WNBD_LOG_LOUD(": Enter");
     ASSERT(GInfo);
-    ASSERT(Irp);
-
-    PUSER_ENTRY CurrentEntry = (PUSER_ENTRY)GInfo->ConnectionList.Flink;
-    PIO_STACK_LOCATION IoLocation = IoGetCurrentIrpStackLocation(Irp);
-    PWNBD_CONNECTION_LIST OutList = (
-        PWNBD_CONNECTION_LIST) Irp->AssociatedIrp.SystemBuffer;
-    PWNBD_CONNECTION_INFO OutEntry = &OutList->Connections[0];
-
-    // If we propagate STATUS_BUFFER_OVERFLOW to the userspace, it won't
-    // receive the actual required buffer size.
-    NTSTATUS Status = STATUS_BUFFER_OVERFLOW;
-    ULONG Remaining = (
-        IoLocation->Parameters.DeviceIoControl.OutputBufferLength -
-            RTL_SIZEOF_THROUGH_FIELD(WNBD_CONNECTION_LIST, Count)
-        ) / sizeof(WNBD_CONNECTION_INFO);
-    OutList->Count = 0;
-    OutList->ElementSize = sizeof(WNBD_CONNECTION_INFO);
-
-    while ((CurrentEntry != (PUSER_ENTRY) &GInfo->ConnectionList.Flink) && Remaining) {
-        OutEntry = &OutList->Connections[OutList->Count];
-        RtlZeroMemory(OutEntry, sizeof(WNBD_CONNECTION_INFO));
-        RtlCopyMemory(OutEntry, &CurrentEntry->Properties, sizeof(WNBD_PROPERTIES));
+    ASSERT(Entry);
+    ASSERT(PRemoval);
+    PSCSI_DEVICE_INFORMATION ScsiInfo = Entry->ScsiInformation;
+    *PRemoval = NULL;
 
-        OutEntry->BusNumber = (USHORT)CurrentEntry->BusIndex;
-        OutEntry->TargetId = (USHORT)CurrentEntry->TargetIndex;
-        OutEntry->Lun = (USHORT)CurrentEntry->LunIndex;
+    if (!ScsiInfo) {
+        WNBD_LOG_ERROR("Could not find device needed for deletion");
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
 
-        OutList->Count++;
-        Remaining--;
+    if (Entry->Removal) {
+        WNBD_LOG_INFO("Connection %s is already being removed.",
+                      Entry->Properties.InstanceName);
+        InterlockedIncrement(&Entry->Removal->RefCount);
+        *PRemoval = Entry->Removal;
+        return STATUS_SUCCESS;
+    }
 
-        CurrentEntry = (PUSER_ENTRY)CurrentEntry->ListEntry.Flink;
+    PWNBD_REMOVAL Removal = (PWNBD_REMOVAL) RemovalMalloc(sizeof(WNBD_REMOVAL));
+    if (!Removal) {
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
+    RtlZeroMemory(Removal, sizeof(WNBD_REMOVAL));
+    Removal->GlobalInformation = GInfo;
+    Removal->Entry = Entry;
+    KeInitializeEvent(&Removal->CompletedEvent, NotificationEvent, FALSE);
+    // Held by the caller and by the connection entry.
+    Removal->RefCount = 2;
+    Entry->Removal = Removal;
+    // Listed as disconnecting from now on.
+    WnbdNotifyConnectionChange(GInfo, Entry);
+
+    // New IO dispatch calls will fail from now on.
+    WnbdConnectionTableRemove(GInfo->ConnectionTable, Entry);
+    ScsiInfo->SoftTerminateDevice = TRUE;
+    // TODO: implement proper soft termination.
+    ScsiInfo->HardTerminateDevice = TRUE;
+    KeSetEvent(&ScsiInfo->TerminateEvent, IO_NO_INCREMENT, FALSE);
+    KeReleaseSemaphore(&ScsiInfo->DeviceEvent, 0, 1, FALSE);
+    CloseConnection(ScsiInfo);
+
+    if (Background) {
+        HANDLE ThreadHandle = NULL;
+        InterlockedIncrement(&Removal->RefCount);
+        Removal->Background = TRUE;
+        if (!GInfo->PendingRemovals++) {
+            KeClearEvent(&GInfo->RemovalsIdleEvent);
+        }
 
-    if (CurrentEntry == (PUSER_ENTRY) &GInfo->ConnectionList.Flink) {
-        Status = STATUS_SUCCESS;
+        NTSTATUS Status = PsCreateSystemThread(&ThreadHandle, (ACCESS_MASK)0L, NULL,
+                                               NULL, NULL, WnbdRemovalThread, Removal);
+        if (NT_SUCCESS(Status)) {
+            ZwClose(ThreadHandle);
+        } else {
+            WNBD_LOG_WARN("Could not start removal thread, removing %s "
+                          "synchronously. Status: 0x%x.",
+                          Entry->Properties.InstanceName, Status);
+            InterlockedDecrement(&Removal->RefCount);
+            Removal->Background = FALSE;
+            if (!--GInfo->PendingRemovals) {
+                KeSetEvent(&GInfo->RemovalsIdleEvent, IO_NO_INCREMENT, FALSE);
+            }
+            Background = FALSE;
+        }
     }
 
-    Irp->IoStatus.Information = (OutList->Count * sizeof(WNBD_CONNECTION_INFO)) +
-        RTL_SIZEOF_THROUGH_FIELD(WNBD_CONNECTION_LIST, Count);
-    WNBD_LOG_LOUD(": Exit: %d. Element count: %d, element size: %d. Total size: %d.",
-                  Status, OutList->Count, OutList->ElementSize,
-                  Irp->IoStatus.Information);
+    if (!Background) {
+        // The connection mutex is acquired recursively.
+        WnbdFinishRemoval(Removal);
+    }
 
-    return Status;
+    *PRemoval = Removal;
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
 }
 
 _Use_decl_annotations_
 NTSTATUS
-WnbdParseUserIOCTL(PVOID GlobalHandle,
-                   PIRP Irp)
+WnbdWaitRemoval(PWNBD_REMOVAL Removal)
 {
-    WNBD_LOG_LOUD(": Enter");
-    ASSERT(Irp);
-    ASSERT(GlobalHandle);
+    KeWaitForSingleObject(&Removal->CompletedEvent, Executive,
+                          KernelMode, FALSE, NULL);
+    return Removal->Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdDeleteConnection(PGLOBAL_INFORMATION GInfo,
+                     PCHAR InstanceName)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(GInfo);
+    ASSERT(InstanceName);
+    PUSER_ENTRY EntryMarked = NULL;
+    if (!WnbdFindConnection(GInfo, InstanceName, &EntryMarked)) {
+        WNBD_LOG_ERROR("Could not find connection to delete");
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+    if (NULL == EntryMarked) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+    // We can't wait for background removals while holding the mutex.
+    if (EntryMarked->Removal &&
+            !KeReadStateEvent(&EntryMarked->Removal->CompletedEvent)) {
+        WNBD_LOG_INFO("Connection %s is being removed in the background.",
+                      InstanceName);
+        return STATUS_DELETE_PENDING;
+    }
+
+    PWNBD_REMOVAL Removal = NULL;
+    NTSTATUS Status = WnbdStartRemoval(GInfo, EntryMarked, FALSE, &Removal);
+    if (NT_SUCCESS(Status)) {
+        Status = Removal->Status;
+        WnbdDereferenceRemoval(Removal);
+    }
+
+    WNBD_LOG_LOUD(": Exit");
+    return Status;
+}
+
+VOID
+WnbdFillConnectionInfo(_In_ PGLOBAL_INFORMATION GInfo,
+                       _In_ PUSER_ENTRY Entry,
+                       _Out_ PWNBD_CONNECTION_INFO OutEntry)
+{
+    RtlZeroMemory(OutEntry, sizeof(WNBD_CONNECTION_INFO));
+    RtlCopyMemory(OutEntry, &Entry->Properties, sizeof(WNBD_PROPERTIES));
+
+    OutEntry->BusNumber = (USHORT)Entry->BusIndex;
+    OutEntry->TargetId = (USHORT)Entry->TargetIndex;
+    OutEntry->Lun = (USHORT)Entry->LunIndex;
+    OutEntry->TargetLunCount = (USHORT)WnbdDeviceTableGetLuns(
+        (PWNBD_EXTENSION)GInfo->Handle, Entry->BusIndex,
+        Entry->TargetIndex, NULL);
+    OutEntry->ConnectionFlags.Disconnecting = !!Entry->Removal;
+    OutEntry->ConnectionId = Entry->ConnectionId;
+    OutEntry->ChangeSequence = Entry->ChangeSequence;
+}
+
+VOID
+WnbdFillConnectionSummary(_In_ PGLOBAL_INFORMATION GInfo,
+                          _In_ PUSER_ENTRY Entry,
+                          _Out_ PWNBD_CONNECTION_SUMMARY OutEntry)
+{
+    PWNBD_PROPERTIES Properties = &Entry->Properties;
+
+    RtlZeroMemory(OutEntry, sizeof(WNBD_CONNECTION_SUMMARY));
+    RtlCopyMemory(OutEntry->InstanceName, Properties->InstanceName,
+                  WNBD_MAX_NAME_LENGTH);
+    RtlCopyMemory(OutEntry->SerialNumber, Properties->SerialNumber,
+                  WNBD_MAX_NAME_LENGTH);
+    RtlCopyMemory(OutEntry->Owner, Properties->Owner, WNBD_MAX_OWNER_LENGTH);
+    OutEntry->Flags = Properties->Flags;
+    OutEntry->Pid = Properties->Pid;
+    OutEntry->BlockCount = Properties->BlockCount;
+    OutEntry->BlockSize = Properties->BlockSize;
+
+    OutEntry->BusNumber = (USHORT)Entry->BusIndex;
+    OutEntry->TargetId = (USHORT)Entry->TargetIndex;
+    OutEntry->Lun = (USHORT)Entry->LunIndex;
+    OutEntry->TargetLunCount = (USHORT)WnbdDeviceTableGetLuns(
+        (PWNBD_EXTENSION)GInfo->Handle, Entry->BusIndex,
+        Entry->TargetIndex, NULL);
+    OutEntry->ConnectionFlags.Disconnecting = !!Entry->Removal;
+    OutEntry->ConnectionId = Entry->ConnectionId;
+    OutEntry->ChangeSequence = Entry->ChangeSequence;
+}
+
+VOID
+WnbdFillRemovedConnection(_In_ PWNBD_CONNECTION_TOMBSTONE Tombstone,
+                          _In_ BOOLEAN Summary,
+                          _Out_ PVOID Record)
+{
+    if (Summary) {
+        PWNBD_CONNECTION_SUMMARY OutEntry = (PWNBD_CONNECTION_SUMMARY) Record;
+        RtlZeroMemory(OutEntry, sizeof(WNBD_CONNECTION_SUMMARY));
+        RtlCopyMemory(OutEntry->InstanceName, Tombstone->InstanceName,
+                      WNBD_MAX_NAME_LENGTH);
+        OutEntry->ConnectionFlags.Removed = 1;
+        OutEntry->ConnectionId = Tombstone->ConnectionId;
+        OutEntry->ChangeSequence = Tombstone->ChangeSequence;
+    } else {
+        PWNBD_CONNECTION_INFO OutEntry = (PWNBD_CONNECTION_INFO) Record;
+        RtlZeroMemory(OutEntry, sizeof(WNBD_CONNECTION_INFO));
+        RtlCopyMemory(OutEntry->Properties.InstanceName,
+                      Tombstone->InstanceName, WNBD_MAX_NAME_LENGTH);
+        OutEntry->ConnectionFlags.Removed = 1;
+        OutEntry->ConnectionId = Tombstone->ConnectionId;
+        OutEntry->ChangeSequence = Tombstone->ChangeSequence;
+    }
+}
+
+// Set on cursors that point to the removed connections, the remaining
+// bits holding the change sequence number of the last listed tombstone.
+// Other cursors hold the list key of the last listed connection.
+#define WNBD_LIST_CURSOR_REMOVED (1ULL << 63)
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdListConnectionsPaged(PGLOBAL_INFORMATION GInfo,
+                         PWNBD_IOCTL_LIST_PAGED_COMMAND Command,
+                         PIRP Irp)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(GInfo);
+    ASSERT(Command);
+    ASSERT(Irp);
+
+    PIO_STACK_LOCATION IoLocation = IoGetCurrentIrpStackLocation(Irp);
+    PWNBD_CONNECTION_PAGE Page = (
+        PWNBD_CONNECTION_PAGE) Irp->AssociatedIrp.SystemBuffer;
+    BOOLEAN Summary = !!Command->Flags.Summary;
+    UINT64 Cursor = Command->Cursor;
+    UINT64 ChangedSince = Command->ChangedSince;
+    ULONG ElementSize = Summary ?
+        sizeof(WNBD_CONNECTION_SUMMARY) : sizeof(WNBD_CONNECTION_INFO);
+    // The caller ensures that at least one record fits.
+    ULONG Capacity = (
+        IoLocation->Parameters.DeviceIoControl.OutputBufferLength -
+            FIELD_OFFSET(WNBD_CONNECTION_PAGE, Connections)
+        ) / ElementSize;
+
+    RtlZeroMemory(Page, FIELD_OFFSET(WNBD_CONNECTION_PAGE, Connections));
+    Page->Sequence = GInfo->ChangeSequence;
+    Page->ElementSize = ElementSize;
+    Page->HistoryTruncated =
+        ChangedSince && ChangedSince < GInfo->TombstoneFloor;
+
+    if (!(Cursor & WNBD_LIST_CURSOR_REMOVED)) {
+        PUSER_ENTRY Entry = (PUSER_ENTRY)GInfo->ConnectionList.Flink;
+        for (; Entry != (PUSER_ENTRY) &GInfo->ConnectionList.Flink;
+                Entry = (PUSER_ENTRY)Entry->ListEntry.Flink) {
+            // The list is ordered by list key.
+            if (Entry->ListKey <= Cursor || !Entry->Connected ||
+                    Entry->ChangeSequence <= ChangedSince) {
+                continue;
+            }
+            if (Page->Count == Capacity) {
+                Page->NextCursor = Cursor;
+                goto Exit;
+            }
+
+            PVOID Record = WNBD_CONNECTION_PAGE_ENTRY(Page, Page->Count);
+            if (Summary) {
+                WnbdFillConnectionSummary(GInfo, Entry, Record);
+            } else {
+                WnbdFillConnectionInfo(GInfo, Entry, Record);
+            }
+            Page->Count++;
+            Cursor = Entry->ListKey;
+        }
+        Cursor = WNBD_LIST_CURSOR_REMOVED;
+    }
+
+    if (ChangedSince) {
+        UINT64 LastSequence = Cursor & ~WNBD_LIST_CURSOR_REMOVED;
+        for (ULONG Index = 0; Index < GInfo->TombstoneCount; Index++) {
+            // Ordered by change sequence number.
+            PWNBD_CONNECTION_TOMBSTONE Tombstone = &GInfo->Tombstones[
+                (GInfo->TombstoneHead + Index) % WNBD_MAX_CONNECTION_TOMBSTONES];
+            if (Tombstone->ChangeSequence <= ChangedSince ||
+                    Tombstone->ChangeSequence <= LastSequence) {
+                continue;
+            }
+            if (Page->Count == Capacity) {
+                Page->NextCursor = WNBD_LIST_CURSOR_REMOVED | LastSequence;
+                goto Exit;
+            }
+
+            WnbdFillRemovedConnection(
+                Tombstone, Summary,
+                WNBD_CONNECTION_PAGE_ENTRY(Page, Page->Count));
+            Page->Count++;
+            LastSequence = Tombstone->ChangeSequence;
+        }
+    }
+
+Exit:
+    Irp->IoStatus.Information = WNBD_CONNECTION_PAGE_SIZE(
+        ElementSize, Page->Count);
+    WNBD_LOG_LOUD(": Exit. Element count: %d, next cursor: %llx.",
+                  Page->Count, Page->NextCursor);
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdWaitConnectionChange(PGLOBAL_INFORMATION GInfo,
+                         UINT64 Sequence,
+                         UINT32 TimeoutMs,
+                         PUINT64 CurrentSequence)
+{
+    WNBD_LOG_LOUD(": Enter");
+    BOOLEAN Done = !TimeoutMs;
+    LARGE_INTEGER Timeout;
+    Timeout.QuadPart = -((LONGLONG)TimeoutMs * 10000);
+    KIRQL Irql = { 0 };
+
+    while (TRUE) {
+        KeAcquireSpinLock(&GInfo->ChangeLock, &Irql);
+        *CurrentSequence = GInfo->ChangeSequence;
+        // The event is set along with the sequence number, so it's only
+        // reset when there's no new change. Other waiters that were
+        // already woken up aren't affected.
+        if (*CurrentSequence == Sequence) {
+            KeResetEvent(&GInfo->ChangeEvent);
+        }
+        KeReleaseSpinLock(&GInfo->ChangeLock, Irql);
+
+        if (*CurrentSequence != Sequence || Done) {
+            break;
+        }
+
+        // Alertable wait, allowing the calling thread to exit. Timeouts
+        // and interrupted waits return the unchanged sequence number.
+        NTSTATUS Status = KeWaitForSingleObject(
+            &GInfo->ChangeEvent, Executive, UserMode, TRUE,
+            WNBD_WAIT_INFINITE == TimeoutMs ? NULL : &Timeout);
+        Done = STATUS_SUCCESS != Status;
+    }
+
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdEnumerateActiveConnections(PGLOBAL_INFORMATION GInfo, PIRP Irp)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(GInfo);
+    ASSERT(Irp);
+
+    PUSER_ENTRY CurrentEntry = (PUSER_ENTRY)GInfo->ConnectionList.Flink;
+    PIO_STACK_LOCATION IoLocation = IoGetCurrentIrpStackLocation(Irp);
+    PWNBD_CONNECTION_LIST OutList = (
+        PWNBD_CONNECTION_LIST) Irp->AssociatedIrp.SystemBuffer;
+    PWNBD_CONNECTION_INFO OutEntry = &OutList->Connections[0];
+
+    // If we propagate STATUS_BUFFER_OVERFLOW to the userspace, it won't
+    // receive the actual required buffer size.
+    NTSTATUS Status = STATUS_BUFFER_OVERFLOW;
+    ULONG Remaining = (
+        IoLocation->Parameters.DeviceIoControl.OutputBufferLength -
+            RTL_SIZEOF_THROUGH_FIELD(WNBD_CONNECTION_LIST, Count)
+        ) / sizeof(WNBD_CONNECTION_INFO);
+    OutList->Count = 0;
+    OutList->ElementSize = sizeof(WNBD_CONNECTION_INFO);
+
+    while ((CurrentEntry != (PUSER_ENTRY) &GInfo->ConnectionList.Flink) && Remaining) {
+        OutEntry = &OutList->Connections[OutList->Count];
+        WnbdFillConnectionInfo(GInfo, CurrentEntry, OutEntry);
+
+        OutList->Count++;
+        Remaining--;
+
+        CurrentEntry = (PUSER_ENTRY)CurrentEntry->ListEntry.Flink;
+    }
+
+    if (CurrentEntry == (PUSER_ENTRY) &GInfo->ConnectionList.Flink) {
+        Status = STATUS_SUCCESS;
+    }
+
+    Irp->IoStatus.Information = (OutList->Count * sizeof(WNBD_CONNECTION_INFO)) +
+        RTL_SIZEOF_THROUGH_FIELD(WNBD_CONNECTION_LIST, Count);
+    WNBD_LOG_LOUD(": Exit: %d. Element count: %d, element size: %d. Total size: %d.",
+                  Status, OutList->Count, OutList->ElementSize,
+                  Irp->IoStatus.Information);
+
+    return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdParseUserIOCTL(PVOID GlobalHandle,
+                   PIRP Irp)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(Irp);
+    ASSERT(GlobalHandle);
     PIO_STACK_LOCATION IoLocation = IoGetCurrentIrpStackLocation(Irp);
     NTSTATUS Status = STATUS_SUCCESS;
     PGLOBAL_INFORMATION	GInfo = (PGLOBAL_INFORMATION) GlobalHandle;
 
     PUSER_ENTRY Device = NULL;
-    BOOLEAN RPAcquired = FALSE;
 
     DWORD Ioctl = IoLocation->Parameters.DeviceIoControl.IoControlCode;
     WNBD_LOG_LOUD("DeviceIoControl = 0x%x.", Ioctl);
@@ -723,6 +1437,7 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
         break;
 
     case IOCTL_WNBD_CREATE:
+    case IOCTL_WNBD_CREATE_EX:
         WNBD_LOG_LOUD("IOCTL_WNBD_CREATE");
         PWNBD_IOCTL_CREATE_COMMAND Command = (
             PWNBD_IOCTL_CREATE_COMMAND) Irp->AssociatedIrp.SystemBuffer;
@@ -734,6 +1449,19 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
             Status = STATUS_INVALID_PARAMETER;
             break;
         }
+        // The extended properties are only used while creating the
+        // connection, after which the buffer holds the output.
+        PWNBD_EXTENDED_PROPERTIES ExProps = NULL;
+        if (IOCTL_WNBD_CREATE_EX == Cmd->IoControlCode) {
+            if (CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_CREATE_EX_COMMAND)) {
+                WNBD_LOG_ERROR("IOCTL_WNBD_CREATE_EX: Bad input buffer");
+                Status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+            ExProps = &((PWNBD_IOCTL_CREATE_EX_COMMAND) Command)->ExtendedProperties;
+            ExProps->MirrorProperties.NbdProperties.Hostname[WNBD_MAX_NAME_LENGTH - 1] = '\0';
+            ExProps->MirrorProperties.NbdProperties.ExportName[WNBD_MAX_NAME_LENGTH - 1] = '\0';
+        }
         WNBD_PROPERTIES Props = Command->Properties;
         Props.InstanceName[WNBD_MAX_NAME_LENGTH - 1] = '\0';
         Props.SerialNumber[WNBD_MAX_NAME_LENGTH - 1] = '\0';
@@ -786,7 +1514,7 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
         }
 
         WNBD_CONNECTION_INFO ConnectionInfo = { 0 };
-        Status = WnbdCreateConnection(GInfo, &Props, &ConnectionInfo);
+        Status = WnbdCreateConnection(GInfo, &Props, ExProps, &ConnectionInfo);
 
         PWNBD_CONNECTION_INFO OutHandle = (PWNBD_CONNECTION_INFO) Irp->AssociatedIrp.SystemBuffer;
         RtlCopyMemory(OutHandle, &ConnectionInfo, sizeof(WNBD_CONNECTION_INFO));
@@ -819,7 +1547,8 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
 
         KeEnterCriticalRegion();
         ExAcquireResourceExclusiveLite(&GInfo->ConnectionMutex, TRUE);
-        if (!WnbdFindConnection(GInfo, RmCmd->InstanceName, NULL)) {
+        PUSER_ENTRY RmEntry = NULL;
+        if (!WnbdFindConnection(GInfo, RmCmd->InstanceName, &RmEntry)) {
             ExReleaseResourceLite(&GInfo->ConnectionMutex);
             KeLeaveCriticalRegion();
             Status = STATUS_OBJECT_NAME_NOT_FOUND;
@@ -827,15 +1556,24 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
             break;
         }
         WNBD_LOG_LOUD("IOCTL_WNBDVM_UNMAP DeleteConnection");
-        Status = WnbdDeleteConnection(GInfo, RmCmd->InstanceName);
+        // The device is drained in the background, without holding the
+        // connection mutex.
+        PWNBD_REMOVAL Removal = NULL;
+        Status = WnbdStartRemoval(GInfo, RmEntry, TRUE, &Removal);
         ExReleaseResourceLite(&GInfo->ConnectionMutex);
         KeLeaveCriticalRegion();
+        if (NT_SUCCESS(Status)) {
+            if (!RmCmd->Flags.Async) {
+                Status = WnbdWaitRemoval(Removal);
+            }
+            WnbdDereferenceRemoval(Removal);
+        }
         break;
 
      case IOCTL_WNBD_LIST:
         WNBD_LOG_LOUD("IOCTL_WNBD_LIST");
         KeEnterCriticalRegion();
-        ExAcquireResourceExclusiveLite(&GInfo->ConnectionMutex, TRUE);
+        ExAcquireResourceSharedLite(&GInfo->ConnectionMutex, TRUE);
         DWORD RequiredBuffSize = (
             GInfo->ConnectionCount * sizeof(WNBD_CONNECTION_INFO))
             + sizeof(WNBD_CONNECTION_LIST);
@@ -854,6 +1592,63 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
         KeLeaveCriticalRegion();
         break;
 
+    case IOCTL_WNBD_LIST_PAGED:
+        WNBD_LOG_LOUD("IOCTL_WNBD_LIST_PAGED");
+        PWNBD_IOCTL_LIST_PAGED_COMMAND ListPagedCmd =
+            (PWNBD_IOCTL_LIST_PAGED_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!ListPagedCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_LIST_PAGED_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_LIST_PAGED: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        // The page overwrites the command, both using the system buffer.
+        WNBD_IOCTL_LIST_PAGED_COMMAND ListPagedParams = *ListPagedCmd;
+        if (CHECK_O_LOCATION_SZ(IoLocation, WNBD_CONNECTION_PAGE_SIZE(
+                ListPagedParams.Flags.Summary ?
+                    sizeof(WNBD_CONNECTION_SUMMARY) :
+                    sizeof(WNBD_CONNECTION_INFO), 1))) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_LIST_PAGED: Bad output buffer");
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        // Listings don't modify the connections, so they may run in
+        // parallel.
+        KeEnterCriticalRegion();
+        ExAcquireResourceSharedLite(&GInfo->ConnectionMutex, TRUE);
+        Status = WnbdListConnectionsPaged(GInfo, &ListPagedParams, Irp);
+        ExReleaseResourceLite(&GInfo->ConnectionMutex);
+        KeLeaveCriticalRegion();
+        break;
+
+    case IOCTL_WNBD_WAIT_CHANGE:
+        WNBD_LOG_LOUD("IOCTL_WNBD_WAIT_CHANGE");
+        PWNBD_IOCTL_WAIT_CHANGE_COMMAND WaitChangeCmd =
+            (PWNBD_IOCTL_WAIT_CHANGE_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!WaitChangeCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_WAIT_CHANGE_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_WAIT_CHANGE: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        if (CHECK_O_LOCATION(IoLocation, UINT64)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_WAIT_CHANGE: Bad output buffer");
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        // No lock is held while waiting.
+        UINT64 CurrentSequence = 0;
+        Status = WnbdWaitConnectionChange(
+            GInfo, WaitChangeCmd->Sequence, WaitChangeCmd->TimeoutMs,
+            &CurrentSequence);
+        if (NT_SUCCESS(Status)) {
+            *(PUINT64) Irp->AssociatedIrp.SystemBuffer = CurrentSequence;
+            Irp->IoStatus.Information = sizeof(UINT64);
+        }
+        break;
+
     case IOCTL_WNBD_RELOAD_CONFIG:
         WNBD_LOG_LOUD("IOCTL_WNBD_RELOAD_CONFIG");
         WCHAR* KeyName = L"DebugLogLevel";
@@ -864,6 +1659,10 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
         {
             WnbdSetLogLevel(U32Val);
         }
+        WnbdEventLogReloadConfig();
+        WnbdBufferPoolSetMaxBytes(GInfo->BufferPool,
+                                  WnbdBufferPoolReadMaxBytes());
+        WnbdReadLunsPerTarget();
         break;
 
     case IOCTL_WNBD_STATS:
@@ -916,6 +1715,172 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
         Status = STATUS_SUCCESS;
         break;
 
+    case IOCTL_WNBD_IO_STATS:
+        WNBD_LOG_LOUD("IOCTL_WNBD_IO_STATS");
+        PWNBD_IOCTL_IO_STATS_COMMAND IoStatsCmd =
+            (PWNBD_IOCTL_IO_STATS_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+
+        if (!IoStatsCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_IO_STATS_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_IO_STATS: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        IoStatsCmd->InstanceName[WNBD_MAX_NAME_LENGTH - 1] = '\0';
+        if (!strlen((PSTR) &IoStatsCmd->InstanceName) ||
+                !IoStatsCmd->Version) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_IO_STATS: Invalid instance name "
+                           "or version");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        // Newer clients are handed the latest version that we support.
+        if (IoStatsCmd->Version > WNBD_IO_STATS_VERSION) {
+            WNBD_LOG_INFO("IOCTL_WNBD_IO_STATS: requested version %u, "
+                          "using %u.", IoStatsCmd->Version,
+                          WNBD_IO_STATS_VERSION);
+        }
+        if (CHECK_O_LOCATION(IoLocation, WNBD_IO_STATS)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_IO_STATS: Bad output buffer");
+            Status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        KeEnterCriticalRegion();
+        ExAcquireResourceSharedLite(&GInfo->ConnectionMutex, TRUE);
+        DiskEntry = NULL;
+        if (!WnbdFindConnection(GInfo, IoStatsCmd->InstanceName, &DiskEntry)) {
+            ExReleaseResourceLite(&GInfo->ConnectionMutex);
+            KeLeaveCriticalRegion();
+            Status = STATUS_OBJECT_NAME_NOT_FOUND;
+            WNBD_LOG_ERROR("IOCTL_WNBD_IO_STATS: Connection does not exist");
+            break;
+        }
+
+        // The input and output buffers overlap, the command can't be
+        // used past this point.
+        PWNBD_IO_STATS OutIoStats =
+            (PWNBD_IO_STATS) Irp->AssociatedIrp.SystemBuffer;
+        WnbdIoCountersGet(DiskEntry->ScsiInformation->IoCounters, OutIoStats);
+        RtlCopyMemory(&OutIoStats->DeviceStats,
+                      &DiskEntry->ScsiInformation->ExtendedStats,
+                      sizeof(WNBD_DRV_EXTENDED_STATS));
+        ExReleaseResourceLite(&GInfo->ConnectionMutex);
+        KeLeaveCriticalRegion();
+
+        Irp->IoStatus.Information = sizeof(WNBD_IO_STATS);
+        Status = STATUS_SUCCESS;
+        break;
+
+    case IOCTL_WNBD_TRACE_CONTROL:
+        WNBD_LOG_LOUD("IOCTL_WNBD_TRACE_CONTROL");
+        PWNBD_IOCTL_TRACE_CONTROL_COMMAND TraceCtlCmd =
+            (PWNBD_IOCTL_TRACE_CONTROL_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!TraceCtlCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_TRACE_CONTROL_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_TRACE_CONTROL: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        Status = WnbdTraceControl(GInfo, !!TraceCtlCmd->Enable,
+                                  TraceCtlCmd->RecordsPerCpu);
+        break;
+
+    case IOCTL_WNBD_TRACE_READ:
+        WNBD_LOG_LOUD("IOCTL_WNBD_TRACE_READ");
+        PWNBD_IOCTL_TRACE_READ_COMMAND TraceReadCmd =
+            (PWNBD_IOCTL_TRACE_READ_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!TraceReadCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_TRACE_READ_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_TRACE_READ: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        if (CHECK_O_LOCATION(IoLocation, WNBD_TRACE_BUFFER)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_TRACE_READ: Bad output buffer");
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        PWNBD_TRACE Trace = GInfo->Trace;
+        if (!Trace) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_TRACE_READ: Tracing was never enabled");
+            Status = STATUS_INVALID_DEVICE_STATE;
+            break;
+        }
+
+        // The input and output buffers overlap.
+        PWNBD_TRACE_BUFFER TraceBuffer =
+            (PWNBD_TRACE_BUFFER) Irp->AssociatedIrp.SystemBuffer;
+        ULONG MaxRecords = (ULONG)(
+            (IoLocation->Parameters.DeviceIoControl.OutputBufferLength -
+             FIELD_OFFSET(WNBD_TRACE_BUFFER, Records)) /
+            sizeof(WNBD_TRACE_RECORD));
+        UINT64 LostRecords = 0;
+        ULONG RecordCount = WnbdTraceRead(
+            Trace, TraceBuffer->Records, MaxRecords, &LostRecords);
+
+        TraceBuffer->Count = RecordCount;
+        TraceBuffer->Reserved = 0;
+        TraceBuffer->LostRecords = LostRecords;
+        Irp->IoStatus.Information = max(
+            sizeof(WNBD_TRACE_BUFFER), WNBD_TRACE_BUFFER_SIZE(RecordCount));
+        Status = STATUS_SUCCESS;
+        break;
+
+    case IOCTL_WNBD_EVENT_LOG_CONTROL:
+        WNBD_LOG_LOUD("IOCTL_WNBD_EVENT_LOG_CONTROL");
+        PWNBD_IOCTL_EVENT_LOG_CONTROL_COMMAND EventLogCtlCmd =
+            (PWNBD_IOCTL_EVENT_LOG_CONTROL_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!EventLogCtlCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_EVENT_LOG_CONTROL_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_EVENT_LOG_CONTROL: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        Status = WnbdEventLogControl(EventLogCtlCmd->LogLevel,
+                                     EventLogCtlCmd->RecordsPerCpu);
+        break;
+
+    case IOCTL_WNBD_EVENT_LOG_READ:
+        WNBD_LOG_LOUD("IOCTL_WNBD_EVENT_LOG_READ");
+        PWNBD_IOCTL_EVENT_LOG_READ_COMMAND EventLogReadCmd =
+            (PWNBD_IOCTL_EVENT_LOG_READ_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!EventLogReadCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_EVENT_LOG_READ_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_EVENT_LOG_READ: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        if (CHECK_O_LOCATION(IoLocation, WNBD_EVENT_LOG_BUFFER)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_EVENT_LOG_READ: Bad output buffer");
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        // The input and output buffers overlap.
+        PWNBD_EVENT_LOG_BUFFER EventLogBuffer =
+            (PWNBD_EVENT_LOG_BUFFER) Irp->AssociatedIrp.SystemBuffer;
+        ULONG MaxEvents = (ULONG)(
+            (IoLocation->Parameters.DeviceIoControl.OutputBufferLength -
+             FIELD_OFFSET(WNBD_EVENT_LOG_BUFFER, Records)) /
+            sizeof(WNBD_EVENT_LOG_RECORD));
+        UINT64 LostEvents = 0;
+        ULONG EventCount = WnbdEventLogRead(
+            EventLogBuffer->Records, MaxEvents, &LostEvents);
+
+        EventLogBuffer->Count = EventCount;
+        EventLogBuffer->Reserved = 0;
+        EventLogBuffer->LostRecords = LostEvents;
+        Irp->IoStatus.Information = max(
+            sizeof(WNBD_EVENT_LOG_BUFFER),
+            WNBD_EVENT_LOG_BUFFER_SIZE(EventCount));
+        Status = STATUS_SUCCESS;
+        break;
+
     case IOCTL_WNBD_FETCH_REQ:
         // TODO: consider moving out individual command handling.
         WNBD_LOG_LOUD("IOCTL_WNBD_FETCH_REQ");
@@ -930,21 +1895,14 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
             break;
         }
 
-        KeEnterCriticalRegion();
-        ExAcquireResourceExclusiveLite(&GInfo->ConnectionMutex, TRUE);
-        Device = WnbdFindConnectionEx(GInfo, ReqCmd->ConnectionId);
-        // If we can't acquire the rundown protection, it means that the device
-        // is being deallocated. Acquiring it guarantees that it won't be deallocated
-        // while we're dispatching requests. This doesn't prevent other requests from
-        // acquiring it at the same time, which will increase its counter.
-        if (Device) {
-            RPAcquired = ExAcquireRundownProtection(
-                &Device->ScsiInformation->RundownProtection);
-        }
-        ExReleaseResourceLite(&GInfo->ConnectionMutex);
-        KeLeaveCriticalRegion();
-
-        if (!Device || !RPAcquired) {
+        // Lock-free lookup, acquiring the device rundown protection. If that
+        // fails, it means that the device is being deallocated. Acquiring it
+        // guarantees that it won't be deallocated while we're dispatching
+        // requests. This doesn't prevent other requests from acquiring it at
+        // the same time, which will increase its counter.
+        Device = WnbdConnectionTableAcquire(GInfo->ConnectionTable,
+                                            ReqCmd->ConnectionId);
+        if (!Device) {
             Status = STATUS_INVALID_HANDLE;
             WNBD_LOG_ERROR(
                 "IOCTL_WNBD_FETCH_REQ: Could not fetch request, invalid connection id: %d.",
@@ -962,31 +1920,197 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
         KeLeaveCriticalRegion();
         break;
 
-    case IOCTL_WNBD_SEND_RSP:
-        WNBD_LOG_LOUD("IOCTL_WNBD_SEND_RSP");
-        PWNBD_IOCTL_SEND_RSP_COMMAND RspCmd =
-            (PWNBD_IOCTL_SEND_RSP_COMMAND) Irp->AssociatedIrp.SystemBuffer;
-        if (!RspCmd || CHECK_I_LOCATION(IoLocation, PWNBD_IOCTL_FETCH_REQ_COMMAND)) {
-            WNBD_LOG_ERROR("IOCTL_WNBD_SEND_RSP: Bad input or output buffer");
+    case IOCTL_WNBD_FETCH_REQ_BATCH:
+        WNBD_LOG_LOUD("IOCTL_WNBD_FETCH_REQ_BATCH");
+        PWNBD_IOCTL_FETCH_REQ_BATCH_COMMAND BatchCmd =
+            (PWNBD_IOCTL_FETCH_REQ_BATCH_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!BatchCmd ||
+            CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_FETCH_REQ_BATCH_COMMAND) ||
+            !BatchCmd->RequestCount ||
+            BatchCmd->RequestCount > WNBD_MAX_FETCH_BATCH ||
+            CHECK_O_LOCATION_SZ(IoLocation,
+                WNBD_FETCH_REQ_BATCH_COMMAND_SIZE(BatchCmd->RequestCount)))
+        {
+            WNBD_LOG_ERROR("IOCTL_WNBD_FETCH_REQ_BATCH: Bad input or output buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        // See IOCTL_WNBD_FETCH_REQ.
+        Device = WnbdConnectionTableAcquire(GInfo->ConnectionTable,
+                                            BatchCmd->ConnectionId);
+        if (!Device) {
+            Status = STATUS_INVALID_HANDLE;
+            WNBD_LOG_ERROR(
+                "IOCTL_WNBD_FETCH_REQ_BATCH: Could not fetch requests, invalid connection id: %d.",
+                BatchCmd->ConnectionId);
+            break;
+        }
+
+        Status = WnbdDispatchRequestBatch(Irp, Device->ScsiInformation, BatchCmd);
+        // Pended IRPs may already be completed.
+        if (STATUS_PENDING != Status) {
+            Irp->IoStatus.Information = WNBD_FETCH_REQ_BATCH_COMMAND_SIZE(
+                BatchCmd->RequestCount);
+            WNBD_LOG_LOUD("Request dispatch status: %d. Request count: %d.",
+                          Status, BatchCmd->RequestCount);
+        }
+
+        KeEnterCriticalRegion();
+        ExReleaseRundownProtection(&Device->ScsiInformation->RundownProtection);
+        KeLeaveCriticalRegion();
+        break;
+
+    case IOCTL_WNBD_SEND_RSP_FETCH_REQ:
+        WNBD_LOG_LOUD("IOCTL_WNBD_SEND_RSP_FETCH_REQ");
+        PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND RspReqCmd =
+            (PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!RspReqCmd ||
+            CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND) ||
+            RspReqCmd->RequestCount > WNBD_MAX_FETCH_BATCH ||
+            RspReqCmd->ResponseCount > WNBD_MAX_FETCH_BATCH ||
+            IoLocation->Parameters.DeviceIoControl.InputBufferLength <
+                WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(
+                    RspReqCmd->RequestCount, RspReqCmd->ResponseCount) ||
+            CHECK_O_LOCATION_SZ(IoLocation,
+                WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(RspReqCmd->RequestCount, 0)))
+        {
+            WNBD_LOG_ERROR("IOCTL_WNBD_SEND_RSP_FETCH_REQ: Bad input or output buffer");
             Status = STATUS_INVALID_PARAMETER;
             break;
         }
 
+        // See IOCTL_WNBD_FETCH_REQ.
+        Device = WnbdConnectionTableAcquire(GInfo->ConnectionTable,
+                                            RspReqCmd->ConnectionId);
+        if (!Device) {
+            Status = STATUS_INVALID_HANDLE;
+            WNBD_LOG_ERROR(
+                "IOCTL_WNBD_SEND_RSP_FETCH_REQ: Invalid connection id: %d.",
+                RspReqCmd->ConnectionId);
+            break;
+        }
+
+        Status = WnbdHandleResponsesFetchRequests(
+            Irp, Device->ScsiInformation, RspReqCmd);
+        // See IOCTL_WNBD_FETCH_REQ_BATCH.
+        if (STATUS_PENDING != Status) {
+            Irp->IoStatus.Information = WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(
+                RspReqCmd->RequestCount, 0);
+            WNBD_LOG_LOUD("Dispatch status: %d. Request count: %d, "
+                          "failed responses: %d.",
+                          Status, RspReqCmd->RequestCount,
+                          RspReqCmd->FailedResponseCount);
+        }
+
+        KeEnterCriticalRegion();
+        ExReleaseRundownProtection(&Device->ScsiInformation->RundownProtection);
+        KeLeaveCriticalRegion();
+        break;
+
+    case IOCTL_WNBD_REGISTER_BUFFER:
+        WNBD_LOG_LOUD("IOCTL_WNBD_REGISTER_BUFFER");
+        PWNBD_IOCTL_REGISTER_BUFFER_COMMAND RegBufCmd =
+            (PWNBD_IOCTL_REGISTER_BUFFER_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!RegBufCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_REGISTER_BUFFER_COMMAND) ||
+                CHECK_O_LOCATION(IoLocation, WNBD_IOCTL_REGISTER_BUFFER_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_REGISTER_BUFFER: Bad input or output buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        // See IOCTL_WNBD_FETCH_REQ.
+        Device = WnbdConnectionTableAcquire(GInfo->ConnectionTable,
+                                            RegBufCmd->ConnectionId);
+        if (!Device) {
+            Status = STATUS_INVALID_HANDLE;
+            WNBD_LOG_ERROR(
+                "IOCTL_WNBD_REGISTER_BUFFER: Invalid connection id: %d.",
+                RegBufCmd->ConnectionId);
+            break;
+        }
+
+        Status = WnbdCheckRequestor(Irp, Device->ScsiInformation);
+        if (!Status) {
+            Status = WnbdUserBufferRegister(
+                Device->ScsiInformation, RegBufCmd->Buffer,
+                RegBufCmd->BufferSize, &RegBufCmd->BufferId);
+        }
+        if (!Status) {
+            Irp->IoStatus.Information = sizeof(WNBD_IOCTL_REGISTER_BUFFER_COMMAND);
+        }
+
+        KeEnterCriticalRegion();
+        ExReleaseRundownProtection(&Device->ScsiInformation->RundownProtection);
+        KeLeaveCriticalRegion();
+        break;
+
+    case IOCTL_WNBD_RING_SETUP:
+        WNBD_LOG_LOUD("IOCTL_WNBD_RING_SETUP");
+        PWNBD_IOCTL_RING_SETUP_COMMAND RingCmd =
+            (PWNBD_IOCTL_RING_SETUP_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!RingCmd || CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_RING_SETUP_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_RING_SETUP: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        if (CHECK_O_LOCATION(IoLocation, WNBD_RING_INFO)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_RING_SETUP: Bad output buffer");
+            Status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        // The input and output buffers overlap.
+        WNBD_IOCTL_RING_SETUP_COMMAND RingSetupCmd = *RingCmd;
+        // The connection mutex is held throughout the setup, preventing
+        // the device from being removed in the meantime.
         KeEnterCriticalRegion();
         ExAcquireResourceExclusiveLite(&GInfo->ConnectionMutex, TRUE);
-        Device = WnbdFindConnectionEx(GInfo, RspCmd->ConnectionId);
-        // If we can't acquire the rundown protection, it means that the device
-        // is being deallocated. Acquiring it guarantees that it won't be deallocated
-        // while we're dispatching requests. This doesn't prevent other requests from
-        // acquiring it at the same time, which will increase its counter.
+        Device = WnbdConnectionTableAcquire(GInfo->ConnectionTable,
+                                            RingSetupCmd.ConnectionId);
+        if (!Device) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_RING_SETUP: Invalid connection id: %d.",
+                           RingSetupCmd.ConnectionId);
+            Status = STATUS_INVALID_HANDLE;
+        } else if (Device->ScsiInformation->Ring ||
+                   Device->ScsiInformation->HardTerminateDevice) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_RING_SETUP: Ring already set up "
+                           "or device being removed.");
+            Status = STATUS_INVALID_DEVICE_STATE;
+        } else {
+            Status = WnbdCheckRequestor(Irp, Device->ScsiInformation);
+            if (!Status) {
+                Status = WnbdRingCreate(
+                    Device->ScsiInformation, &RingSetupCmd,
+                    (PWNBD_RING_INFO) Irp->AssociatedIrp.SystemBuffer,
+                    &Device->ScsiInformation->Ring);
+            }
+            if (NT_SUCCESS(Status)) {
+                Irp->IoStatus.Information = sizeof(WNBD_RING_INFO);
+            }
+        }
         if (Device) {
-            RPAcquired = ExAcquireRundownProtection(
-                &Device->ScsiInformation->RundownProtection);
+            ExReleaseRundownProtection(&Device->ScsiInformation->RundownProtection);
         }
         ExReleaseResourceLite(&GInfo->ConnectionMutex);
         KeLeaveCriticalRegion();
+        break;
+
+    case IOCTL_WNBD_SEND_RSP:
+        WNBD_LOG_LOUD("IOCTL_WNBD_SEND_RSP");
+        PWNBD_IOCTL_SEND_RSP_COMMAND RspCmd =
+            (PWNBD_IOCTL_SEND_RSP_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        if (!RspCmd || CHECK_I_LOCATION(IoLocation, PWNBD_IOCTL_FETCH_REQ_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_SEND_RSP: Bad input or output buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
 
-        if (!Device || !RPAcquired) {
+        // See IOCTL_WNBD_FETCH_REQ.
+        Device = WnbdConnectionTableAcquire(GInfo->ConnectionTable,
+                                            RspCmd->ConnectionId);
+        if (!Device) {
             Status = STATUS_INVALID_HANDLE;
             WNBD_LOG_ERROR(
                 "IOCTL_WNBD_SEND_RSP: Could not fetch request, invalid connection id: %d.",
@@ -1031,6 +2155,171 @@ WnbdParseUserIOCTL(PVOID GlobalHandle,
         Status = STATUS_SUCCESS;
         break;
 
+    case IOCTL_WNBD_ADAPTER_STATS:
+        WNBD_LOG_LOUD("IOCTL_WNBD_ADAPTER_STATS");
+        PWNBD_IOCTL_ADAPTER_STATS_COMMAND AdapterStatsCmd =
+            (PWNBD_IOCTL_ADAPTER_STATS_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+
+        if (!AdapterStatsCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_ADAPTER_STATS_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_ADAPTER_STATS: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        if (CHECK_O_LOCATION(IoLocation, WNBD_ADAPTER_STATS)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_ADAPTER_STATS: Bad output buffer");
+            Status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        PWNBD_ADAPTER_STATS AdapterStats =
+            (PWNBD_ADAPTER_STATS) Irp->AssociatedIrp.SystemBuffer;
+        PWNBD_EXTENSION AdapterExt = (PWNBD_EXTENSION) GInfo->Handle;
+        WnbdBufferPoolGetStats(GInfo->BufferPool, AdapterStats);
+        AdapterStats->ReportLunsRequests = AdapterExt->ReportLunsRequests;
+        AdapterStats->UnmappedLunRequests = AdapterExt->UnmappedLunRequests;
+        Irp->IoStatus.Information = sizeof(WNBD_ADAPTER_STATS);
+        Status = STATUS_SUCCESS;
+        break;
+
+    case IOCTL_WNBD_CBT_SNAPSHOT:
+        WNBD_LOG_LOUD("IOCTL_WNBD_CBT_SNAPSHOT");
+        PWNBD_IOCTL_CBT_SNAPSHOT_COMMAND CbtSnapshotCmd =
+            (PWNBD_IOCTL_CBT_SNAPSHOT_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+
+        if (!CbtSnapshotCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_CBT_SNAPSHOT_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_CBT_SNAPSHOT: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        if (CHECK_O_LOCATION(IoLocation, WNBD_CBT_SNAPSHOT_INFO)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_CBT_SNAPSHOT: Bad output buffer");
+            Status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        CbtSnapshotCmd->InstanceName[WNBD_MAX_NAME_LENGTH - 1] = '\0';
+        KeEnterCriticalRegion();
+        ExAcquireResourceExclusiveLite(&GInfo->ConnectionMutex, TRUE);
+        PUSER_ENTRY CbtEntry = NULL;
+        if (!WnbdFindConnection(GInfo, CbtSnapshotCmd->InstanceName, &CbtEntry)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_CBT_SNAPSHOT: Connection does not exist");
+            Status = STATUS_OBJECT_NAME_NOT_FOUND;
+        } else if (!CbtEntry->ScsiInformation->Cbt) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_CBT_SNAPSHOT: Change tracking disabled");
+            Status = STATUS_NOT_SUPPORTED;
+        } else {
+            // The input and output buffers overlap.
+            Status = WnbdCbtSnapshot(
+                CbtEntry->ScsiInformation->Cbt,
+                (PWNBD_CBT_SNAPSHOT_INFO) Irp->AssociatedIrp.SystemBuffer);
+            if (NT_SUCCESS(Status)) {
+                Irp->IoStatus.Information = sizeof(WNBD_CBT_SNAPSHOT_INFO);
+            }
+        }
+        ExReleaseResourceLite(&GInfo->ConnectionMutex);
+        KeLeaveCriticalRegion();
+        break;
+
+    case IOCTL_WNBD_CBT_FETCH:
+        WNBD_LOG_LOUD("IOCTL_WNBD_CBT_FETCH");
+        PWNBD_IOCTL_CBT_FETCH_COMMAND CbtFetchCmd =
+            (PWNBD_IOCTL_CBT_FETCH_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+
+        if (!CbtFetchCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_CBT_FETCH_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_CBT_FETCH: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        if (CHECK_O_LOCATION(IoLocation, WNBD_CBT_BITMAP)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_CBT_FETCH: Bad output buffer");
+            Status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        // The input and output buffers overlap, so we're retrieving the
+        // command parameters first.
+        UINT64 CbtSnapshotId = CbtFetchCmd->SnapshotId;
+        UINT64 CbtStartBlock = CbtFetchCmd->StartBlock;
+        CbtFetchCmd->InstanceName[WNBD_MAX_NAME_LENGTH - 1] = '\0';
+
+        KeEnterCriticalRegion();
+        ExAcquireResourceExclusiveLite(&GInfo->ConnectionMutex, TRUE);
+        CbtEntry = NULL;
+        if (!WnbdFindConnection(GInfo, CbtFetchCmd->InstanceName, &CbtEntry)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_CBT_FETCH: Connection does not exist");
+            Status = STATUS_OBJECT_NAME_NOT_FOUND;
+        } else if (!CbtEntry->ScsiInformation->Cbt) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_CBT_FETCH: Change tracking disabled");
+            Status = STATUS_NOT_SUPPORTED;
+        } else {
+            PWNBD_CBT_BITMAP CbtBitmap =
+                (PWNBD_CBT_BITMAP) Irp->AssociatedIrp.SystemBuffer;
+            ULONG CbtBitmapSize = IoLocation->Parameters.DeviceIoControl.OutputBufferLength -
+                FIELD_OFFSET(WNBD_CBT_BITMAP, Bitmap);
+            UINT64 CbtBlockCount = 0;
+
+            Status = WnbdCbtFetch(
+                CbtEntry->ScsiInformation->Cbt, CbtSnapshotId, CbtStartBlock,
+                CbtBitmap->Bitmap, CbtBitmapSize, &CbtBlockCount);
+            if (NT_SUCCESS(Status)) {
+                RtlZeroMemory(CbtBitmap, FIELD_OFFSET(WNBD_CBT_BITMAP, Bitmap));
+                CbtBitmap->SnapshotId = CbtSnapshotId;
+                CbtBitmap->StartBlock = CbtStartBlock;
+                CbtBitmap->BlockCount = CbtBlockCount;
+                Irp->IoStatus.Information = FIELD_OFFSET(WNBD_CBT_BITMAP, Bitmap) +
+                    (ULONG)((CbtBlockCount + 7) / 8);
+            }
+        }
+        ExReleaseResourceLite(&GInfo->ConnectionMutex);
+        KeLeaveCriticalRegion();
+        break;
+
+    case IOCTL_WNBD_SET_QOS:
+        WNBD_LOG_LOUD("IOCTL_WNBD_SET_QOS");
+        PWNBD_IOCTL_SET_QOS_COMMAND QosCmd =
+            (PWNBD_IOCTL_SET_QOS_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+
+        if (!QosCmd || CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_SET_QOS_COMMAND)) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_SET_QOS: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        Status = WnbdQosValidateLimits(&QosCmd->Limits);
+        if (!NT_SUCCESS(Status)) {
+            break;
+        }
+
+        QosCmd->InstanceName[WNBD_MAX_NAME_LENGTH - 1] = '\0';
+        KeEnterCriticalRegion();
+        ExAcquireResourceExclusiveLite(&GInfo->ConnectionMutex, TRUE);
+        PUSER_ENTRY QosEntry = NULL;
+        if (!WnbdFindConnection(GInfo, QosCmd->InstanceName, &QosEntry) ||
+                !QosEntry->ScsiInformation) {
+            WNBD_LOG_ERROR("IOCTL_WNBD_SET_QOS: Connection does not exist");
+            Status = STATUS_OBJECT_NAME_NOT_FOUND;
+        } else if (QosEntry->ScsiInformation->Qos) {
+            WnbdQosSetLimits(QosEntry->ScsiInformation->Qos, &QosCmd->Limits);
+            Status = STATUS_SUCCESS;
+        } else if (WnbdQosLimitsSet(&QosCmd->Limits)) {
+            PWNBD_QOS Qos = NULL;
+            Status = WnbdQosCreate(QosEntry->ScsiInformation, &QosCmd->Limits, &Qos);
+            if (NT_SUCCESS(Status)) {
+                // The IO path accesses the QoS limits without locking.
+                InterlockedExchangePointer(
+                    (PVOID*)&QosEntry->ScsiInformation->Qos, Qos);
+            }
+        }
+        if (NT_SUCCESS(Status) && QosEntry) {
+            RtlCopyMemory(&QosEntry->Properties.QosLimits, &QosCmd->Limits,
+                          sizeof(WNBD_QOS_LIMITS));
+        }
+        ExReleaseResourceLite(&GInfo->ConnectionMutex);
+        KeLeaveCriticalRegion();
+        break;
+
     default:
         WNBD_LOG_ERROR("Unsupported IOCTL command: %x");
         Status = STATUS_INVALID_DEVICE_REQUEST;
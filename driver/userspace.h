@@ -13,26 +13,50 @@
 #include "nbd_protocol.h"
 #include "wnbd_ioctl.h"
 
-// TODO: make this configurable. 1024 is the Storport default.
+// 1024 is the Storport default. Per device limits may be set through
+// WNBD_PROPERTIES.MaxQueueDepth.
 #define WNBD_MAX_IN_FLIGHT_REQUESTS 1024
 #define WNBD_PREALLOC_BUFF_SZ (WNBD_DEFAULT_MAX_TRANSFER_LENGTH + sizeof(NBD_REQUEST))
-
-// The connection id provided to the user is meant to be opaque. We're currently
-// using the disk address, but that might change.
-#define WNBD_CONNECTION_ID_FROM_ADDR(PathId, TargetId, Lun) \
-    ((1 << 24 | (PathId) << 16) | ((TargetId) << 8) | (Lun))
+#define WNBD_INVALID_SCSI_ID 0xFFFFFFFF
 
 typedef struct _USER_ENTRY {
     LIST_ENTRY                         ListEntry;
+    // Instance name index link, see connection_table.h.
+    LIST_ENTRY                         NameLink;
     struct _SCSI_DEVICE_INFORMATION*   ScsiInformation;
     USHORT                             BusIndex;
     USHORT                             TargetIndex;
     USHORT                             LunIndex;
     BOOLEAN                            Connected;
     WNBD_PROPERTIES                    Properties;
+    // Zeroed if the connection was created using IOCTL_WNBD_CREATE.
+    WNBD_EXTENDED_PROPERTIES           ExtendedProperties;
     WNBD_CONNECTION_ID                 ConnectionId;
+    // Set once the connection is being removed, protected by the
+    // connection mutex. Referenced until the entry is released.
+    struct _WNBD_REMOVAL*              Removal;
+    // See GLOBAL_INFORMATION, protected by the connection mutex.
+    UINT64                             ListKey;
+    UINT64                             ChangeSequence;
 } USER_ENTRY, *PUSER_ENTRY;
 
+// Connections are removed in two phases. The first one, performed
+// while holding the connection mutex, stops dispatching IO to the
+// device. The second one waits for the device threads and drains the
+// pending requests, normally using a dedicated thread so that the
+// connection mutex isn't held in the meantime. The mutex is only
+// reacquired for removing the connection entry.
+typedef struct _WNBD_REMOVAL
+{
+    PGLOBAL_INFORMATION         GlobalInformation;
+    PUSER_ENTRY                 Entry;
+    BOOLEAN                     Background;
+    // Signaled once the removal completes, "Status" being set.
+    KEVENT                      CompletedEvent;
+    NTSTATUS                    Status;
+    volatile LONG               RefCount;
+} WNBD_REMOVAL, *PWNBD_REMOVAL;
+
 typedef struct _SCSI_DEVICE_INFORMATION
 {
     PWNBD_SCSI_DEVICE           Device;
@@ -48,6 +72,11 @@ typedef struct _SCSI_DEVICE_INFORMATION
     // TODO: rename as PendingReqListHead
     LIST_ENTRY                  RequestListHead;
     KSPIN_LOCK                  RequestListLock;
+    // Flushes, FUA and small requests, served before the bulk requests.
+    // Protected by RequestListLock.
+    LIST_ENTRY                  PriorityRequestListHead;
+    // Priority requests dequeued since the last bulk request.
+    ULONG                       PriorityStreak;
 
     // TODO: rename as SubmittedReqListHead
     LIST_ENTRY                  ReplyListHead;
@@ -65,11 +94,40 @@ typedef struct _SCSI_DEVICE_INFORMATION
     EX_RUNDOWN_REF              RundownProtection;
 
 
+    // Set when the "UseMirror" flag is enabled, in which case the IO
+    // requests are dispatched to the mirror legs instead of "Socket".
+    struct _WNBD_MIRROR*        Mirror;
+    // Changed block tracking, set when the "ChangeTracking" flag is enabled.
+    struct _WNBD_CBT*           Cbt;
+    // Local write overlay, set when the "UseOverlay" flag is enabled.
+    struct _WNBD_OVERLAY*       Overlay;
+    // Request deadlines, set when "RequestTimeoutMs" is provided.
+    struct _WNBD_DEADLINE_WHEEL* DeadlineWheel;
+    // Queue depth limit, set when "AdaptiveQueueDepth" or "MaxQueueDepth"
+    // are provided.
+    struct _WNBD_CONGESTION*    Congestion;
+    // Per operation counters and latency histograms.
+    struct _WNBD_IO_COUNTERS*   IoCounters;
+    // IO limits, allocated when limits are first set and kept until the
+    // device is removed.
+    struct _WNBD_QOS*           Qos;
+    // Shared memory rings, set up using IOCTL_WNBD_RING_SETUP.
+    struct _WNBD_RING*          Ring;
+    // Buffers registered using IOCTL_WNBD_REGISTER_BUFFER.
+    struct _WNBD_USER_BUFFERS*  UserBuffers;
+    // Pended asynchronous fetch IRPs.
+    struct _WNBD_FETCH_QUEUE*   FetchQueue;
+    // User mappings of SRB data buffers, set when the "ZeroCopy" flag
+    // is enabled.
+    struct _WNBD_ZERO_COPY*     ZeroCopy;
+
+    // Used by the reply thread when the staging buffer pool is exhausted,
+    // see WnbdReceivePayload.
+    PVOID                       ReceiveBuffer;
+
     WNBD_DRV_STATS              Stats;
-    PVOID                       ReadPreallocatedBuffer;
-    ULONG                       ReadPreallocatedBufferLength;
-    PVOID                       WritePreallocatedBuffer;
-    ULONG                       WritePreallocatedBufferLength;
+    // Retrieved through IOCTL_WNBD_IO_STATS.
+    WNBD_DRV_EXTENDED_STATS     ExtendedStats;
 } SCSI_DEVICE_INFORMATION, *PSCSI_DEVICE_INFORMATION;
 
 NTSTATUS
@@ -81,29 +139,94 @@ WnbdFindConnection(_In_ PGLOBAL_INFORMATION GInfo,
                    _In_ PCHAR InstanceName,
                    _Maybenull_ PUSER_ENTRY* Entry);
 
-PUSER_ENTRY
-WnbdFindConnectionEx(_In_ PGLOBAL_INFORMATION GInfo,
-                     _In_ UINT64 ConnectionId);
-
 NTSTATUS
 WnbdCreateConnection(_In_ PGLOBAL_INFORMATION GInfo,
                      _In_ PWNBD_PROPERTIES Properties,
+                     _In_opt_ PWNBD_EXTENDED_PROPERTIES ExtendedProperties,
                      _In_ PWNBD_CONNECTION_INFO ConnectionInfo);
 
 NTSTATUS
-WnbdDeleteConnectionEntry(_In_ PUSER_ENTRY Entry);
+WnbdDeleteConnectionEntry(_In_ PGLOBAL_INFORMATION GInfo,
+                          _In_ PUSER_ENTRY Entry);
+
+// Bumps the change sequence number, waking up IOCTL_WNBD_WAIT_CHANGE
+// callers. The connection mutex must be held exclusively.
+VOID
+WnbdNotifyConnectionChange(_In_ PGLOBAL_INFORMATION GInfo,
+                           _In_ PUSER_ENTRY Entry);
+
+// The connection mutex must be held.
+NTSTATUS
+WnbdListConnectionsPaged(_In_ PGLOBAL_INFORMATION GInfo,
+                         _In_ PWNBD_IOCTL_LIST_PAGED_COMMAND Command,
+                         _In_ PIRP Irp);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+WnbdWaitConnectionChange(_In_ PGLOBAL_INFORMATION GInfo,
+                         _In_ UINT64 Sequence,
+                         _In_ UINT32 TimeoutMs,
+                         _Out_ PUINT64 CurrentSequence);
 
 NTSTATUS
 WnbdEnumerateActiveConnections(_In_ PGLOBAL_INFORMATION GInfo,
                                _In_ PIRP Irp);
 
+// Synchronously removes the connection, must be called while holding
+// the connection mutex.
 NTSTATUS
 WnbdDeleteConnection(_In_ PGLOBAL_INFORMATION GInfo,
                      _In_ PCHAR InstanceName);
 
+// Starts removing the connection, must be called while holding the
+// connection mutex. The second phase is performed by a separate thread
+// if "Background" is set, otherwise before returning. Connections that
+// are already being removed aren't affected. The returned removal must
+// be dereferenced using WnbdDereferenceRemoval.
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+WnbdStartRemoval(_In_ PGLOBAL_INFORMATION GInfo,
+                 _In_ PUSER_ENTRY Entry,
+                 _In_ BOOLEAN Background,
+                 _Out_ PWNBD_REMOVAL* PRemoval);
+
+// Waits for the removal to complete, returning its status. The
+// connection mutex must not be held.
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+WnbdWaitRemoval(_In_ PWNBD_REMOVAL Removal);
+
+VOID
+WnbdDereferenceRemoval(_In_ PWNBD_REMOVAL Removal);
+
+// Releases the buffers registered by the specified process,
+// called when the process exits.
+VOID
+WnbdReleaseProcessBuffers(_In_ PGLOBAL_INFORMATION GInfo,
+                          _In_ HANDLE ProcessId);
+
 VOID
 WnbdInitScsiIds();
 
+// Reads the "LunsPerTarget" registry key, used when allocating SCSI
+// addresses.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdReadLunsPerTarget();
+
+// Returns the SCSI address index (see WNBD_DEVICE_INDEX) or
+// WNBD_INVALID_SCSI_ID if there are no addresses left. The connection
+// mutex must be held exclusively.
+ULONG
+WnbdAllocateScsiId();
+
+// Releases the SCSI address once the device is deleted. The connection
+// mutex must be held exclusively.
+VOID
+WnbdReleaseScsiId(_In_ ULONG PathId,
+                  _In_ ULONG TargetId,
+                  _In_ ULONG Lun);
+
 BOOLEAN
 WnbdSetDeviceMissing(_In_ PVOID Handle,
                      _In_ BOOLEAN Force);
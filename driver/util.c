@@ -5,15 +5,28 @@
  */
 
 #include <berkeley.h>
+#include "buffer_pool.h"
+#include "cbt.h"
 #include "common.h"
+#include "congestion.h"
+#include "deadline.h"
 #include "debug.h"
+#include "fetch_queue.h"
+#include "io_stats.h"
+#include "io_trace.h"
+#include "mirror.h"
 #include "nbd_protocol.h"
+#include "overlay.h"
+#include "qos.h"
+#include "ring.h"
+#include "scheduler.h"
 #include "scsi_driver_extensions.h"
 #include "scsi_function.h"
-#include "scsi_trace.h"
 #include "srb_helper.h"
+#include "user_buffers.h"
 #include "userspace.h"
 #include "util.h"
+#include "zero_copy.h"
 
 VOID
 WnbdDeleteScsiInformation(_In_ PVOID ScsiInformation)
@@ -27,6 +40,12 @@ WnbdDeleteScsiInformation(_In_ PVOID ScsiInformation)
     PLIST_ENTRY Request;
     PSRB_QUEUE_ELEMENT Element;
 
+    // The elements can't be released while still being tracked.
+    if (ScsiInfo->DeadlineWheel) {
+        WnbdDeadlineWheelStop(ScsiInfo->DeadlineWheel);
+    }
+
+    WnbdMergeRequestLists(ScsiInfo);
     while ((Request = ExInterlockedRemoveHeadList(&ScsiInfo->RequestListHead, &ScsiInfo->RequestListLock)) != NULL) {
         Element = CONTAINING_RECORD(Request, SRB_QUEUE_ELEMENT, Link);
         Element->Srb->DataTransferLength = 0;
@@ -42,8 +61,8 @@ WnbdDeleteScsiInformation(_In_ PVOID ScsiInformation)
         Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
         PWNBD_SCSI_DEVICE Device = (PWNBD_SCSI_DEVICE)ScsiInfo->Device;
         InterlockedDecrement(&Device->OutstandingIoCount);
-        WNBD_LOG_INFO("Notifying StorPort of completion of %p status: 0x%x(%s)",
-            Element->Srb, Element->Srb->SrbStatus, WnbdToStringSrbStatus(Element->Srb->SrbStatus));
+        WNBD_IO_LOG_INFO(WnbdEvtSrbCompleted, Element->Srb, Element->Tag,
+                         Element->Srb->SrbStatus);
         StorPortNotification(RequestComplete, Element->DeviceExtension, Element->Srb);
         ExFreePool(Element);
     }
@@ -53,23 +72,76 @@ WnbdDeleteScsiInformation(_In_ PVOID ScsiInformation)
         ScsiInfo->InquiryData = NULL;
     }
 
+    if (ScsiInfo->ReceiveBuffer) {
+        ExFreePool(ScsiInfo->ReceiveBuffer);
+        ScsiInfo->ReceiveBuffer = NULL;
+    }
+
     DisconnectConnection(ScsiInfo);
 
-    ExDeleteResourceLite(&ScsiInfo->SocketLock);
+    if (ScsiInfo->Mirror) {
+        WnbdMirrorDelete(ScsiInfo->Mirror);
+        ScsiInfo->Mirror = NULL;
+    }
 
-    if(ScsiInfo->UserEntry) {
-        ExFreePool(ScsiInfo->UserEntry);
-        ScsiInfo->UserEntry = NULL;
+    if (ScsiInfo->Cbt) {
+        WnbdCbtDelete(ScsiInfo->Cbt);
+        ScsiInfo->Cbt = NULL;
+    }
+
+    if (ScsiInfo->Overlay) {
+        WnbdOverlayDelete(ScsiInfo->Overlay);
+        ScsiInfo->Overlay = NULL;
+    }
+
+    if (ScsiInfo->DeadlineWheel) {
+        WnbdDeadlineWheelDelete(ScsiInfo->DeadlineWheel);
+        ScsiInfo->DeadlineWheel = NULL;
+    }
+
+    if (ScsiInfo->Congestion) {
+        WnbdCongestionDelete(ScsiInfo->Congestion);
+        ScsiInfo->Congestion = NULL;
+    }
+
+    if (ScsiInfo->IoCounters) {
+        WnbdIoCountersDelete(ScsiInfo->IoCounters);
+        ScsiInfo->IoCounters = NULL;
+    }
+
+    if (ScsiInfo->Qos) {
+        WnbdQosDelete(ScsiInfo->Qos);
+        ScsiInfo->Qos = NULL;
+    }
+
+    if (ScsiInfo->Ring) {
+        WnbdRingDelete(ScsiInfo->Ring);
+        ScsiInfo->Ring = NULL;
+    }
+
+    if (ScsiInfo->FetchQueue) {
+        WnbdFetchQueueDelete(ScsiInfo->FetchQueue);
+        ScsiInfo->FetchQueue = NULL;
     }
 
-    if (ScsiInfo->ReadPreallocatedBuffer) {
-        ExFreePool(ScsiInfo->ReadPreallocatedBuffer);
-        ScsiInfo->ReadPreallocatedBuffer = NULL;
+    if (ScsiInfo->UserBuffers) {
+        WnbdUserBuffersDelete(ScsiInfo->UserBuffers);
+        ScsiInfo->UserBuffers = NULL;
     }
 
-    if (ScsiInfo->WritePreallocatedBuffer) {
-        ExFreePool(ScsiInfo->WritePreallocatedBuffer);
-        ScsiInfo->WritePreallocatedBuffer = NULL;
+    if (ScsiInfo->ZeroCopy) {
+        WnbdZeroCopyDelete(ScsiInfo->ZeroCopy);
+        ScsiInfo->ZeroCopy = NULL;
+    }
+
+    ExDeleteResourceLite(&ScsiInfo->SocketLock);
+
+    if(ScsiInfo->UserEntry) {
+        if (ScsiInfo->UserEntry->Removal) {
+            WnbdDereferenceRemoval(ScsiInfo->UserEntry->Removal);
+        }
+        ExFreePool(ScsiInfo->UserEntry);
+        ScsiInfo->UserEntry = NULL;
     }
 
     ExReleaseResourceLite(&ScsiInfo->GlobalInformation->ConnectionMutex);
@@ -92,19 +164,39 @@ WnbdDeleteDevices(_In_ PWNBD_EXTENSION Ext,
     if (NULL == Ext->GlobalInformation) {
         return;
     }
+    if (All) {
+        // Background removals reacquire the connection mutex before
+        // completing, so we can't wait for them while holding it.
+        KeWaitForSingleObject(
+            &((PGLOBAL_INFORMATION)Ext->GlobalInformation)->RemovalsIdleEvent,
+            Executive, KernelMode, FALSE, NULL);
+    }
     KeEnterCriticalRegion();
     ExAcquireResourceSharedLite(&Ext->DeviceResourceLock, TRUE);
     ExAcquireResourceExclusiveLite(&((PGLOBAL_INFORMATION)Ext->GlobalInformation)->ConnectionMutex, TRUE);
     LIST_FORALL_SAFE(&Ext->DeviceList, Link, Next) {
         Device = (PWNBD_SCSI_DEVICE)CONTAINING_RECORD(Link, WNBD_SCSI_DEVICE, ListEntry);
         if (Device->ReportedMissing || All) {
+            PSCSI_DEVICE_INFORMATION Info = (PSCSI_DEVICE_INFORMATION)Device->ScsiDeviceExtension;
+            PWNBD_REMOVAL Removal = Info->UserEntry->Removal;
+            if (Removal) {
+                // Already removed, unless it's still being drained. The
+                // cleaner is woken up again by WnbdFinishRemoval.
+                if (!KeReadStateEvent(&Removal->CompletedEvent)) {
+                    continue;
+                }
+            } else {
+                WnbdDeleteConnection((PGLOBAL_INFORMATION)Ext->GlobalInformation,
+                                     Info->UserEntry->Properties.InstanceName);
+            }
             WNBD_LOG_INFO("Deleting device %p with %d:%d:%d",
                 Device, Device->PathId, Device->TargetId, Device->Lun);
-            PSCSI_DEVICE_INFORMATION Info = (PSCSI_DEVICE_INFORMATION)Device->ScsiDeviceExtension;
-            WnbdDeleteConnection((PGLOBAL_INFORMATION)Ext->GlobalInformation,
-                                 Info->UserEntry->Properties.InstanceName);
+            WnbdSchedulerRemoveDevice(Ext, Device);
             RemoveEntryList(&Device->ListEntry);
+            WnbdDeviceTableRemove(Ext, Device);
             WnbdDeleteScsiInformation(Device->ScsiDeviceExtension);
+            // The SCSI address may be reused from now on.
+            WnbdReleaseScsiId(Device->PathId, Device->TargetId, Device->Lun);
             ExFreePool(Device);
             Device = NULL;
             if (FALSE == All) {
@@ -156,7 +248,10 @@ WnbdReportMissingDevice(_In_ PWNBD_EXTENSION DeviceExtension,
     ASSERT(LuExtension);
 
     if (!Device->Missing) {
-        LuExtension->WnbdScsiDevice = Device;
+        if (LuExtension->WnbdScsiDevice != Device) {
+            InterlockedExchangePointer(
+                (PVOID volatile*)&LuExtension->WnbdScsiDevice, Device);
+        }
     } else {
         if (!Device->ReportedMissing) {
             WNBD_LOG_INFO(": Scheduling %p to be deleted and waking DeviceCleaner",
@@ -170,110 +265,168 @@ WnbdReportMissingDevice(_In_ PWNBD_EXTENSION DeviceExtension,
     WNBD_LOG_LOUD(": Exit");
 }
 
-PWNBD_SCSI_DEVICE
-WnbdFindDevice(_In_ PWNBD_LU_EXTENSION LuExtension,
-               _In_ PWNBD_EXTENSION DeviceExtension,
-               _In_ UCHAR PathId,
-               _In_ UCHAR TargetId,
-               _In_ UCHAR Lun)
+VOID
+WnbdDeviceTableInsert(_In_ PWNBD_EXTENSION DeviceExtension,
+                      _In_ PWNBD_SCSI_DEVICE Device)
 {
-    WNBD_LOG_LOUD(": Entered");
-    ASSERT(LuExtension);
-    ASSERT(DeviceExtension);
-
-    PWNBD_SCSI_DEVICE Device = NULL;
+    ASSERT(WNBD_VALID_DEVICE_ADDRESS(Device->PathId, Device->TargetId,
+                                     Device->Lun));
+    PWNBD_DEVICE_SLOT Slot = &DeviceExtension->DeviceTable[
+        WNBD_DEVICE_INDEX(Device->PathId, Device->TargetId, Device->Lun)];
+    ASSERT(!Slot->Device);
+    InterlockedExchangePointer((PVOID volatile*)&Slot->Device, Device);
+}
 
-    for (PLIST_ENTRY Entry = DeviceExtension->DeviceList.Flink;
-        Entry != &DeviceExtension->DeviceList; Entry = Entry->Flink) {
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdDeviceTableRemove(_In_ PWNBD_EXTENSION DeviceExtension,
+                      _In_ PWNBD_SCSI_DEVICE Device)
+{
+    PWNBD_DEVICE_SLOT Slot = &DeviceExtension->DeviceTable[
+        WNBD_DEVICE_INDEX(Device->PathId, Device->TargetId, Device->Lun)];
+    InterlockedExchangePointer((PVOID volatile*)&Slot->Device, NULL);
+    // Waits for the SRBs that are currently accessing the device.
+    ExWaitForRundownProtectionRelease(&Slot->Rundown);
+
+    // SRBs might have cached the device in the meantime.
+    PWNBD_LU_EXTENSION LuExtension = (PWNBD_LU_EXTENSION)
+        StorPortGetLogicalUnit(DeviceExtension, (UCHAR)Device->PathId,
+                               (UCHAR)Device->TargetId, (UCHAR)Device->Lun);
+    if (LuExtension) {
+        InterlockedCompareExchangePointer(
+            (PVOID volatile*)&LuExtension->WnbdScsiDevice, NULL, Device);
+    }
+    ExReInitializeRundownProtection(&Slot->Rundown);
+}
 
-        Device = (PWNBD_SCSI_DEVICE) CONTAINING_RECORD(Entry, WNBD_SCSI_DEVICE, ListEntry);
+ULONG
+WnbdDeviceTableGetLuns(_In_ PWNBD_EXTENSION DeviceExtension,
+                       _In_ ULONG PathId,
+                       _In_ ULONG TargetId,
+                       _Out_writes_opt_(MAX_NUMBER_OF_SCSI_LOGICAL_UNITS) PUCHAR Luns)
+{
+    ULONG Count = 0;
+    if (!WNBD_VALID_DEVICE_ADDRESS(PathId, TargetId, 0)) {
+        return 0;
+    }
 
-        if (Device->PathId == PathId
-            && Device->TargetId == TargetId
-            && Device->Lun == Lun) {
-            WnbdReportMissingDevice(DeviceExtension, Device, LuExtension);
-            break;
+    PWNBD_DEVICE_SLOT Slots = &DeviceExtension->DeviceTable[
+        WNBD_DEVICE_INDEX(PathId, TargetId, 0)];
+    for (ULONG Lun = 0; Lun < MAX_NUMBER_OF_SCSI_LOGICAL_UNITS; Lun++) {
+        if (Slots[Lun].Device) {
+            if (Luns) {
+                Luns[Count] = (UCHAR)Lun;
+            }
+            Count++;
         }
-        Device = NULL;
     }
-
-    WNBD_LOG_LOUD(": Exit");
-
-    return Device;
+    return Count;
 }
 
 PWNBD_SCSI_DEVICE
-WnbdFindDeviceEx(
-    _In_ PWNBD_EXTENSION DeviceExtension,
-    _In_ UCHAR PathId,
-    _In_ UCHAR TargetId,
-    _In_ UCHAR Lun)
+WnbdAcquireDevice(_In_ PWNBD_LU_EXTENSION LuExtension,
+                  _In_ PWNBD_EXTENSION DeviceExtension,
+                  _In_ UCHAR PathId,
+                  _In_ UCHAR TargetId,
+                  _In_ UCHAR Lun)
 {
-    WNBD_LOG_LOUD(": Enter");
+    WNBD_LOG_LOUD(": Entered");
+    ASSERT(LuExtension);
     ASSERT(DeviceExtension);
 
-    PWNBD_SCSI_DEVICE Device = NULL;
-    PWNBD_LU_EXTENSION LuExtension;
-    KIRQL Irql;
-    KSPIN_LOCK DevLock = DeviceExtension->DeviceListLock;
-    KeAcquireSpinLock(&DevLock, &Irql);
-
-    LuExtension = (PWNBD_LU_EXTENSION)
-        StorPortGetLogicalUnit(DeviceExtension, PathId, TargetId, Lun);
-
-    if (!LuExtension) {
-        WNBD_LOG_ERROR(": Unable to get LUN extension for device PathId: %d TargetId: %d LUN: %d",
-            PathId, TargetId, Lun);
-        goto Exit;
+    if (!WNBD_VALID_DEVICE_ADDRESS(PathId, TargetId, Lun)) {
+        return NULL;
+    }
+    PWNBD_DEVICE_SLOT Slot = &DeviceExtension->DeviceTable[
+        WNBD_DEVICE_INDEX(PathId, TargetId, Lun)];
+    if (!ExAcquireRundownProtection(&Slot->Rundown)) {
+        // The device is being deleted.
+        return NULL;
     }
 
-    Device = WnbdFindDevice(LuExtension, DeviceExtension,
-                            PathId, TargetId, Lun);
+    // Cached by WnbdReportMissingDevice, avoiding the table lookup.
+    PWNBD_SCSI_DEVICE Device = (PWNBD_SCSI_DEVICE) ReadPointerAcquire(
+        (PVOID volatile*)&LuExtension->WnbdScsiDevice);
     if (!Device) {
-        WNBD_LOG_INFO("Could not find device PathId: %d TargetId: %d LUN: %d",
-            PathId, TargetId, Lun);
-        goto Exit;
+        Device = (PWNBD_SCSI_DEVICE) ReadPointerAcquire(
+            (PVOID volatile*)&Slot->Device);
     }
-
-    if (!Device->ScsiDeviceExtension) {
-        WNBD_LOG_ERROR("%p has no ScsiDeviceExtension. PathId = %d. TargetId = %d. LUN = %d",
-            Device, PathId, TargetId, Lun);
-        goto Exit;
+    if (Device) {
+        WnbdReportMissingDevice(DeviceExtension, Device, LuExtension);
+    } else {
+        ExReleaseRundownProtection(&Slot->Rundown);
     }
 
-Exit:
-    KeReleaseSpinLock(&DevLock, Irql);
+    WNBD_LOG_LOUD(": Exit");
+
     return Device;
 }
 
+VOID
+WnbdReleaseDevice(_In_ PWNBD_EXTENSION DeviceExtension,
+                  _In_ PWNBD_SCSI_DEVICE Device)
+{
+    ExReleaseRundownProtection(&DeviceExtension->DeviceTable[
+        WNBD_DEVICE_INDEX(Device->PathId, Device->TargetId, Device->Lun)].Rundown);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdCompleteUnsubmittedElement(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                               PSRB_QUEUE_ELEMENT Element,
+                               UCHAR SrbStatus)
+{
+    Element->Srb->DataTransferLength = 0;
+    Element->Srb->SrbStatus = SrbStatus;
+    WnbdIoCountersRecordCompletion(DeviceInformation->IoCounters, Element);
+    WnbdTraceRequest(DeviceInformation, Element, WnbdTraceCompleted);
+    StorPortNotification(RequestComplete, Element->DeviceExtension,
+                         Element->Srb);
+    WnbdCongestionRelease(DeviceInformation->Congestion, Element, FALSE);
+    InterlockedDecrement(&DeviceInformation->Device->OutstandingIoCount);
+    InterlockedDecrement64(&DeviceInformation->Stats.UnsubmittedIORequests);
+    ExFreePool(Element);
+}
+
+_Use_decl_annotations_
 NTSTATUS
-WnbdRequestWrite(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
-                 _In_ PSRB_QUEUE_ELEMENT Element,
-                 _In_ DWORD NbdTransmissionFlags)
+WnbdReceivePayload(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                   INT Fd,
+                   PVOID ReceiveBuffer,
+                   PSRB_QUEUE_ELEMENT Element,
+                   PVOID SrbBuff)
 {
-    WNBD_LOG_LOUD(": Enter");
-    ASSERT(DeviceInformation);
-    ASSERT(Element);
-    ULONG StorResult;
-    PVOID Buffer;
+    PWNBD_BUFFER_POOL Pool = DeviceInformation->GlobalInformation->BufferPool;
     NTSTATUS Status = STATUS_SUCCESS;
+    ULONG ChunkLength = WNBD_RECEIVE_BUFFER_SIZE;
+
+    // Reply threads mustn't wait for other transfers, so we'll fall back
+    // to the dedicated receive buffer if the pool is exhausted.
+    PVOID TempBuff = WnbdBufferPoolTryAcquire(Pool, Element->ReadLength);
+    PVOID Chunk = ReceiveBuffer;
+    if (TempBuff) {
+        Chunk = TempBuff;
+        ChunkLength = Element->ReadLength;
+    }
 
-    StorResult = StorPortGetSystemAddress(Element->DeviceExtension, Element->Srb, &Buffer);
-    if (STOR_STATUS_SUCCESS != StorResult) {
-        Status = SRB_STATUS_INTERNAL_ERROR;
-    } else {
-        NbdWriteStat(DeviceInformation->Socket,
-                     Element->StartingLbn,
-                     Element->ReadLength,
-                     &Status,
-                     Buffer,
-                     &DeviceInformation->WritePreallocatedBuffer,
-                     &DeviceInformation->WritePreallocatedBufferLength,
-                     Element->Tag,
-                     NbdTransmissionFlags);
+    ULONG Length = 0;
+    for (ULONG Offset = 0; Offset < Element->ReadLength; Offset += Length) {
+        Length = min(ChunkLength, Element->ReadLength - Offset);
+        if (-1 == NbdReadExact(Fd, Chunk, Length, &Status)) {
+            if (NT_SUCCESS(Status)) {
+                Status = STATUS_CONNECTION_DISCONNECTED;
+            }
+            break;
+        }
+        // The request may get aborted while we're receiving the data.
+        if (SrbBuff && !Element->Aborted) {
+            RtlCopyMemory((PUCHAR)SrbBuff + Offset, Chunk, Length);
+        }
     }
 
-    WNBD_LOG_LOUD(": Exit");
+    if (TempBuff) {
+        WnbdBufferPoolRelease(Pool, TempBuff);
+    }
     return Status;
 }
 
@@ -329,16 +482,15 @@ WnbdProcessDeviceThreadRequests(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation)
     NTSTATUS Status = STATUS_SUCCESS;
     static UINT64 RequestTag = 0;
 
-    while ((Request = ExInterlockedRemoveHeadList(
-            &DeviceInformation->RequestListHead,
-            &DeviceInformation->RequestListLock)) != NULL) {
+    while ((Request = WnbdDequeueRequest(DeviceInformation)) != NULL) {
         RequestTag += 1;
         Element = CONTAINING_RECORD(Request, SRB_QUEUE_ELEMENT, Link);
         Element->Tag = RequestTag;
         Element->Srb->DataTransferLength = 0;
+        WnbdTraceRequest(DeviceInformation, Element, WnbdTraceDequeued);
         PCDB Cdb = (PCDB)&Element->Srb->Cdb;
-        WNBD_LOG_INFO("Processing request. Address: %p Tag: 0x%llx",
-                      Status, Element->Srb, Element->Tag);
+        WNBD_IO_LOG_INFO(WnbdEvtNbdProcessingRequest,
+                         Element->Srb, Element->Tag);
         int NbdReqType = ScsiOpToNbdReqType(Cdb->AsByte[0]);
 
         if(!ValidateScsiRequest(DeviceInformation, Element)) {
@@ -366,16 +518,85 @@ WnbdProcessDeviceThreadRequests(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation)
                     DeviceInformation->HardTerminateDevice) {
                 return;
             }
-            ExInterlockedInsertTailList(
-                &DeviceInformation->ReplyListHead,
-                &Element->Link, &DeviceInformation->ReplyListLock);
-            WNBD_LOG_LOUD("Sending %s request. Address: %p Tag: 0x%llx. FUA: %d",
-                          NbdRequestTypeStr(NbdReqType), Element->Srb, Element->Tag,
-                          Element->FUA);
+            if (DeviceInformation->Qos && NBD_CMD_FLUSH != NbdReqType &&
+                    !WnbdQosWait(DeviceInformation->Qos,
+                                 NBD_CMD_READ != NbdReqType,
+                                 NBD_CMD_TRIM != NbdReqType ? Element->ReadLength : 0)) {
+                ExInterlockedInsertHeadList(
+                    &DeviceInformation->RequestListHead,
+                    &Element->Link, &DeviceInformation->RequestListLock);
+                return;
+            }
+            if (DeviceInformation->Overlay &&
+                    WnbdOverlaySubmit(DeviceInformation->Overlay, Element,
+                                      NbdReqType)) {
+                Status = STATUS_SUCCESS;
+                break;
+            }
+            if (DeviceInformation->Congestion &&
+                    !WnbdCongestionAcquire(DeviceInformation->Congestion,
+                                           Element)) {
+                // The device is being removed, we'll leave the request
+                // to the cleanup routines.
+                ExInterlockedInsertHeadList(
+                    &DeviceInformation->RequestListHead,
+                    &Element->Link, &DeviceInformation->RequestListLock);
+                return;
+            }
+            WnbdSchedulerAccountWait(DeviceInformation, Element);
+            WnbdIoCountersRecordSend(DeviceInformation->IoCounters, Element);
+            if (DeviceInformation->Mirror) {
+                Status = STATUS_SUCCESS;
+                WnbdTraceRequest(DeviceInformation, Element, WnbdTraceSent);
+                WnbdMirrorSubmit(DeviceInformation->Mirror, Element,
+                                 NbdReqType, NbdTransmissionFlags);
+                break;
+            }
+            PVOID SrbBuff = NULL, StagingBuffer = NULL;
+            if (NBD_CMD_WRITE == NbdReqType) {
+                // Both buffers are retrieved before inserting the element
+                // so that we can still complete the request ourselves.
+                if (STOR_STATUS_SUCCESS != StorPortGetSystemAddress(
+                        Element->DeviceExtension, Element->Srb, &SrbBuff)) {
+                    WNBD_LOG_ERROR("Could not get SRB %p 0x%llx data buffer.",
+                                   Element->Srb, Element->Tag);
+                    WnbdCompleteUnsubmittedElement(
+                        DeviceInformation, Element, SRB_STATUS_INTERNAL_ERROR);
+                    Status = STATUS_SUCCESS;
+                    break;
+                }
+                StagingBuffer = WnbdBufferPoolAcquire(
+                    DeviceInformation->GlobalInformation->BufferPool,
+                    Element->ReadLength + sizeof(NBD_REQUEST));
+                if (!StagingBuffer) {
+                    // The pool is exhausted, Storport will retry the
+                    // request later on.
+                    WnbdCompleteUnsubmittedElement(
+                        DeviceInformation, Element, SRB_STATUS_BUSY);
+                    Status = STATUS_SUCCESS;
+                    break;
+                }
+            }
+
+            // The element may be completed as soon as it's sent.
+            WNBD_TRACE_RECORD TraceRecord;
+            WnbdTraceInitRecord(DeviceInformation, Element, &TraceRecord);
+            WNBD_IO_LOG_LOUD(WnbdEvtNbdSendingRequest, NbdReqType,
+                             Element->Srb, Element->Tag, Element->FUA);
+            WnbdInsertReplyElement(DeviceInformation, Element);
 
             if(NbdReqType == NBD_CMD_WRITE){
-                Status = WnbdRequestWrite(DeviceInformation, Element,
-                                          NbdTransmissionFlags);
+                NbdWriteStat(DeviceInformation->Socket,
+                             Element->StartingLbn,
+                             Element->ReadLength,
+                             &Status,
+                             SrbBuff,
+                             StagingBuffer,
+                             Element->Tag,
+                             NbdTransmissionFlags);
+                WnbdBufferPoolRelease(
+                    DeviceInformation->GlobalInformation->BufferPool,
+                    StagingBuffer);
             } else {
                 NbdRequest(
                     DeviceInformation->Socket,
@@ -385,6 +606,7 @@ WnbdProcessDeviceThreadRequests(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation)
                     Element->Tag,
                     NbdReqType | NbdTransmissionFlags);
             }
+            WnbdTraceLogRecord(DeviceInformation, &TraceRecord, WnbdTraceSent);
 
             InterlockedDecrement64(&DeviceInformation->Stats.UnsubmittedIORequests);
             InterlockedIncrement64(&DeviceInformation->Stats.TotalSubmittedIORequests);
@@ -484,6 +706,81 @@ IsReadSrb(PSCSI_REQUEST_BLOCK Srb)
     }
 }
 
+_Use_decl_annotations_
+BOOLEAN
+IsPrioritySrb(PSCSI_REQUEST_BLOCK Srb,
+              BOOLEAN FUA,
+              UINT64 Length)
+{
+    PCDB Cdb = SrbGetCdb(Srb);
+    if (!Cdb) {
+        return FALSE;
+    }
+
+    IO_PRIORITY_HINT Hint = IoPriorityNormal;
+    if (SRB_FUNCTION_STORAGE_REQUEST_BLOCK == Srb->Function) {
+        Hint = (IO_PRIORITY_HINT)((PSTORAGE_REQUEST_BLOCK)Srb)->RequestPriority;
+    } else if ((Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) &&
+               SRB_HEAD_OF_QUEUE_TAG_REQUEST == Srb->QueueAction) {
+        Hint = IoPriorityHigh;
+    }
+    if (Hint >= IoPriorityHigh) {
+        return TRUE;
+    }
+    // Background IO (e.g. backups) is never prioritized.
+    if (Hint <= IoPriorityLow) {
+        return FALSE;
+    }
+
+    switch (Cdb->AsByte[0]) {
+    case SCSIOP_SYNCHRONIZE_CACHE:
+    case SCSIOP_SYNCHRONIZE_CACHE16:
+        return TRUE;
+    case SCSIOP_UNMAP:
+        return FALSE;
+    default:
+        return FUA || Length <= WNBD_PRIORITY_MAX_LENGTH;
+    }
+}
+
+_Use_decl_annotations_
+PLIST_ENTRY
+WnbdDequeueRequest(PSCSI_DEVICE_INFORMATION DeviceInformation)
+{
+    PLIST_ENTRY Request = NULL;
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&DeviceInformation->RequestListLock, &Irql);
+    BOOLEAN HasPriority = !IsListEmpty(&DeviceInformation->PriorityRequestListHead);
+    BOOLEAN HasBulk = !IsListEmpty(&DeviceInformation->RequestListHead);
+    if (HasPriority &&
+            (!HasBulk || DeviceInformation->PriorityStreak < WNBD_PRIORITY_MAX_STREAK)) {
+        Request = RemoveHeadList(&DeviceInformation->PriorityRequestListHead);
+        DeviceInformation->PriorityStreak++;
+    } else if (HasBulk) {
+        Request = RemoveHeadList(&DeviceInformation->RequestListHead);
+        DeviceInformation->PriorityStreak = 0;
+    }
+    KeReleaseSpinLock(&DeviceInformation->RequestListLock, Irql);
+
+    return Request;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdMergeRequestLists(PSCSI_DEVICE_INFORMATION DeviceInformation)
+{
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&DeviceInformation->RequestListLock, &Irql);
+    while (!IsListEmpty(&DeviceInformation->PriorityRequestListHead)) {
+        PLIST_ENTRY Request = RemoveTailList(
+            &DeviceInformation->PriorityRequestListHead);
+        InsertHeadList(&DeviceInformation->RequestListHead, Request);
+    }
+    KeReleaseSpinLock(&DeviceInformation->RequestListLock, Irql);
+}
+
 _Use_decl_annotations_
 inline int
 ScsiOpToNbdReqType(int ScsiOp)
@@ -518,7 +815,7 @@ WnbdProcessDeviceThreadReplies(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation)
     PSRB_QUEUE_ELEMENT Element = NULL;
     NTSTATUS Status = STATUS_SUCCESS;
     NBD_REPLY Reply = { 0 };
-    PVOID SrbBuff = NULL, TempBuff = NULL;
+    PVOID SrbBuff = NULL;
     NTSTATUS error = STATUS_SUCCESS;
 
     Status = NbdReadReply(DeviceInformation->Socket, &Reply);
@@ -539,6 +836,7 @@ WnbdProcessDeviceThreadReplies(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation)
         if (Element->Tag == Reply.Handle) {
             /* Remove the element from the list once found*/
             RemoveEntryList(&Element->Link);
+            WnbdDeadlineDisarm(Element);
             break;
         }
         Element = NULL;
@@ -550,14 +848,19 @@ WnbdProcessDeviceThreadReplies(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation)
         CloseConnection(DeviceInformation);
         goto Exit;
     }
+    WnbdTraceRequest(DeviceInformation, Element, WnbdTraceReplied);
+
+    // The request may have reached the disk even if it failed or got
+    // aborted, so we're recording it either way.
+    WnbdCbtTrackElement(DeviceInformation->Cbt, Element);
 
     ULONG StorResult;
     if(!Element->Aborted) {
         // We need to avoid accessing aborted or already completed SRBs.
         PCDB Cdb = (PCDB)&Element->Srb->Cdb;
         int NbdReqType = ScsiOpToNbdReqType(Cdb->AsByte[0]);
-        WNBD_LOG_LOUD("Received reply header for %s %p 0x%llx.",
-                      NbdRequestTypeStr(NbdReqType), Element->Srb, Element->Tag);
+        WNBD_IO_LOG_LOUD(WnbdEvtNbdReplyHeader, NbdReqType,
+                         Element->Srb, Element->Tag);
 
         if(IsReadSrb(Element->Srb)) {
             StorResult = StorPortGetSystemAddress(Element->DeviceExtension, Element->Srb, &SrbBuff);
@@ -574,48 +877,54 @@ WnbdProcessDeviceThreadReplies(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation)
                       Element->Srb, Element->Tag);
     }
 
-    if(!Reply.Error && IsReadSrb(Element->Srb)) {
-        if (Element->ReadLength > DeviceInformation->ReadPreallocatedBufferLength) {
-            TempBuff = NbdMalloc(Element->ReadLength);
-            if (!TempBuff) {
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                CloseConnection(DeviceInformation);
-                goto Exit;
-            }
-            DeviceInformation->ReadPreallocatedBufferLength = Element->ReadLength;
-            ExFreePool(DeviceInformation->ReadPreallocatedBuffer);
-            DeviceInformation->ReadPreallocatedBuffer = TempBuff;
-        } else {
-            TempBuff = DeviceInformation->ReadPreallocatedBuffer;
-        }
-
-        if (-1 == NbdReadExact(DeviceInformation->Socket, TempBuff, Element->ReadLength, &error)) {
+    // The SRB of an aborted request may no longer be valid, so we're
+    // relying on the cached request type.
+    if(!Reply.Error && Element->Read) {
+        Status = WnbdReceivePayload(DeviceInformation, DeviceInformation->Socket,
+                                    DeviceInformation->ReceiveBuffer, Element,
+                                    SrbBuff);
+        if (!NT_SUCCESS(Status)) {
             WNBD_LOG_ERROR("Failed receiving reply %p 0x%llx. Error: %d",
-                           Element->Srb, Element->Tag, error);
-            Element->Srb->DataTransferLength = 0;
-            Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
+                           Element->Srb, Element->Tag, Status);
+            if (!Element->Aborted) {
+                Element->Srb->DataTransferLength = 0;
+                Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
+            }
             CloseConnection(DeviceInformation);
             goto Exit;
-        } else {
-            if(!Element->Aborted) {
-                // SrbBuff can't be NULL
+        }
+        if (!Element->Aborted && DeviceInformation->Overlay) {
+            // Locally written ranges take precedence over the
+            // NBD export.
+            // SrbBuff can't be NULL
 #pragma warning(push)
 #pragma warning(disable:6387)
-                RtlCopyMemory(SrbBuff, TempBuff, Element->ReadLength);
+            Status = WnbdOverlayMergeRead(
+                DeviceInformation->Overlay, Element->StartingLbn,
+                Element->ReadLength, SrbBuff);
 #pragma warning(pop)
-            }
         }
     }
-    if (Reply.Error) {
-        // TODO: do we care about the actual error?
-        WNBD_LOG_INFO("NBD reply contains error: %llu", Reply.Error);
-        Element->Srb->DataTransferLength = 0;
-        Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
-    }
-    else {
-        // TODO: rename ReadLength to DataLength
-        Element->Srb->DataTransferLength = Element->ReadLength;
-        Element->Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    // Aborted SRBs were either completed already or handed over to a
+    // retry, so we mustn't touch them.
+    if (!Element->Aborted) {
+        if (Reply.Error) {
+            // TODO: do we care about the actual error?
+            WNBD_LOG_INFO("NBD reply contains error: %llu", Reply.Error);
+            Element->Srb->DataTransferLength = 0;
+            Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
+        }
+        else if (!NT_SUCCESS(Status)) {
+            WNBD_LOG_ERROR("Could not merge overlay data into %p 0x%llx. "
+                           "Error: 0x%x.", Element->Srb, Element->Tag, Status);
+            Element->Srb->DataTransferLength = 0;
+            Element->Srb->SrbStatus = SRB_STATUS_ABORTED;
+        }
+        else {
+            // TODO: rename ReadLength to DataLength
+            Element->Srb->DataTransferLength = Element->ReadLength;
+            Element->Srb->SrbStatus = SRB_STATUS_SUCCESS;
+        }
     }
 
     InterlockedIncrement64(&DeviceInformation->Stats.TotalReceivedIOReplies);
@@ -625,17 +934,18 @@ WnbdProcessDeviceThreadReplies(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation)
         InterlockedIncrement64(&DeviceInformation->Stats.CompletedAbortedIORequests);
     }
     else {
-        WNBD_LOG_LOUD("Successfully completed request %p 0x%llx.",
-                      Element->Srb, Element->Tag);
+        WNBD_IO_LOG_LOUD(WnbdEvtRequestSucceeded, Element->Srb, Element->Tag);
     }
 
 Exit:
     InterlockedDecrement(&DeviceInformation->Device->OutstandingIoCount);
     if (Element) {
+        WnbdCongestionRelease(DeviceInformation->Congestion, Element, TRUE);
+        WnbdIoCountersRecordCompletion(DeviceInformation->IoCounters, Element);
+        WnbdTraceRequest(DeviceInformation, Element, WnbdTraceCompleted);
         if(!Element->Aborted) {
-            WNBD_LOG_INFO("Notifying StorPort of completion of %p status: 0x%x(%s)",
-                Element->Srb, Element->Srb->SrbStatus,
-                WnbdToStringSrbStatus(Element->Srb->SrbStatus));
+            WNBD_IO_LOG_INFO(WnbdEvtSrbCompleted, Element->Srb, Element->Tag,
+                             Element->Srb->SrbStatus);
             StorPortNotification(RequestComplete, Element->DeviceExtension,
                                  Element->Srb);
         }
@@ -643,6 +953,18 @@ Exit:
     }
 }
 
+_Use_decl_annotations_
+VOID
+WnbdInsertReplyElement(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                       PSRB_QUEUE_ELEMENT Element)
+{
+    KIRQL Irql = { 0 };
+    KeAcquireSpinLock(&DeviceInformation->ReplyListLock, &Irql);
+    InsertTailList(&DeviceInformation->ReplyListHead, &Element->Link);
+    WnbdDeadlineArm(DeviceInformation->DeadlineWheel, Element);
+    KeReleaseSpinLock(&DeviceInformation->ReplyListLock, Irql);
+}
+
 BOOLEAN
 ValidateScsiRequest(
     _In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
@@ -11,35 +11,92 @@
 #include "userspace.h"
 #include "nbd_protocol.h"
 
+// Priority requests dequeued in a row while bulk requests are waiting.
+#define WNBD_PRIORITY_MAX_STREAK 8
+// Transfers up to this size (bytes) are considered latency sensitive.
+#define WNBD_PRIORITY_MAX_LENGTH (16 * 1024)
+// Per connection buffer used for receiving replies when the staging buffer
+// pool is exhausted.
+#define WNBD_RECEIVE_BUFFER_SIZE (64 * 1024)
+
 VOID
 WnbdDeviceCleanerThread(_In_ PVOID Context);
 
 VOID
 WnbdDeleteScsiInformation(_In_ PVOID ScsiInformation);
 
-PWNBD_SCSI_DEVICE
-WnbdFindDevice(_In_ PWNBD_LU_EXTENSION LuExtension,
-               _In_ PWNBD_EXTENSION DeviceExtension,
-               _In_ UCHAR PathId,
-               _In_ UCHAR TargetId,
-               _In_ UCHAR Lun);
+// Publishes the device, making it visible to WnbdAcquireDevice.
+VOID
+WnbdDeviceTableInsert(_In_ PWNBD_EXTENSION DeviceExtension,
+                      _In_ PWNBD_SCSI_DEVICE Device);
 
+// Clears the device table slot and the cached LU extension device,
+// waiting for the SRBs that are accessing the device.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdDeviceTableRemove(_In_ PWNBD_EXTENSION DeviceExtension,
+                      _In_ PWNBD_SCSI_DEVICE Device);
+
+// Returns the number of LUNs currently used by the target, optionally
+// retrieving them in ascending order.
+ULONG
+WnbdDeviceTableGetLuns(_In_ PWNBD_EXTENSION DeviceExtension,
+                       _In_ ULONG PathId,
+                       _In_ ULONG TargetId,
+                       _Out_writes_opt_(MAX_NUMBER_OF_SCSI_LOGICAL_UNITS) PUCHAR Luns);
+
+// Returns the device with its slot rundown protection acquired, which
+// must be released using WnbdReleaseDevice. Devices that were marked
+// missing are returned as well.
 PWNBD_SCSI_DEVICE
-WnbdFindDeviceEx(
-    _In_ PWNBD_EXTENSION DeviceExtension,
-    _In_ UCHAR PathId,
-    _In_ UCHAR TargetId,
-    _In_ UCHAR Lun);
+WnbdAcquireDevice(_In_ PWNBD_LU_EXTENSION LuExtension,
+                  _In_ PWNBD_EXTENSION DeviceExtension,
+                  _In_ UCHAR PathId,
+                  _In_ UCHAR TargetId,
+                  _In_ UCHAR Lun);
+
+VOID
+WnbdReleaseDevice(_In_ PWNBD_EXTENSION DeviceExtension,
+                  _In_ PWNBD_SCSI_DEVICE Device);
 
 typedef struct _SRB_QUEUE_ELEMENT {
     LIST_ENTRY Link;
     PSCSI_REQUEST_BLOCK Srb;
     UINT64 StartingLbn;
     ULONG ReadLength;
+    // The sum of the UNMAP descriptor lengths, which may not fit in
+    // "ReadLength". Only set for unmap requests.
+    UINT64 UnmapLength;
     BOOLEAN FUA;
+    // Cached so that replies can be handled without accessing the SRB.
+    BOOLEAN Read;
+    // Served from the priority request list.
+    BOOLEAN Priority;
+    // Set when the request is queued, see WnbdSchedulerAccountWait.
+    UINT64 QueueTime;
+    // Set while holding a queue depth slot, see WnbdCongestionAcquire.
+    UINT64 SubmitTime;
+    // Used by the IO stats, see io_stats.h.
+    UINT64 ReceiveTime;
+    UINT64 SendTime;
+    UCHAR IoOp;
+    // Set when the request is traced, see io_trace.h.
+    UINT64 TraceId;
     PVOID DeviceExtension;
     UINT64 Tag;
     BOOLEAN Aborted;
+    // Set when Storport was notified before all the mirror legs replied.
+    BOOLEAN Completed;
+    // Mirror legs that haven't replied yet.
+    LONG PendingLegMask;
+    LONG SucceededLegCount;
+    LONG RequiredLegCount;
+    // Deadline tracking, see deadline.h.
+    LIST_ENTRY TimerLink;
+    UINT64 DeadlineTick;
+    ULONG RetryCount;
+    // The data buffer is mapped in the userspace process, see zero_copy.h.
+    BOOLEAN ZeroCopy;
 } SRB_QUEUE_ELEMENT, * PSRB_QUEUE_ELEMENT;
 
 VOID
@@ -50,6 +107,10 @@ WnbdDeviceReplyThread(_In_ PVOID Context);
 #pragma alloc_text (PAGE, WnbdDeviceReplyThread)
 BOOLEAN
 IsReadSrb(_In_ PSCSI_REQUEST_BLOCK Srb);
+BOOLEAN
+IsPrioritySrb(_In_ PSCSI_REQUEST_BLOCK Srb,
+              _In_ BOOLEAN FUA,
+              _In_ UINT64 Length);
 VOID
 WnbdProcessDeviceThreadReplies(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation);
 VOID CloseConnection(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation);
@@ -58,6 +119,35 @@ int ScsiOpToNbdReqType(_In_ int ScsiOp);
 BOOLEAN ValidateScsiRequest(
     _In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
     _In_ PSRB_QUEUE_ELEMENT Element);
+// Adds a submitted request to the reply list, arming its deadline.
+VOID WnbdInsertReplyElement(
+    _In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+    _In_ PSRB_QUEUE_ELEMENT Element);
+// Completes a request that wasn't submitted yet, releasing the resources
+// acquired by the request thread.
+VOID WnbdCompleteUnsubmittedElement(
+    _In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+    _In_ PSRB_QUEUE_ELEMENT Element,
+    _In_ UCHAR SrbStatus);
+// Receives the read reply payload, copying it to the SRB buffer unless
+// the request gets aborted. Staging buffers are never waited for, the
+// payload being received in chunks through the "ReceiveBuffer" reserved
+// by the caller (WNBD_RECEIVE_BUFFER_SIZE bytes) if the pool is exhausted.
+NTSTATUS WnbdReceivePayload(
+    _In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+    _In_ INT Fd,
+    _In_ PVOID ReceiveBuffer,
+    _In_ PSRB_QUEUE_ELEMENT Element,
+    _In_opt_ PVOID SrbBuff);
+// Picks the next request to be submitted, preferring priority requests.
+// Bulk requests get served at least once every WNBD_PRIORITY_MAX_STREAK
+// priority requests.
+PLIST_ENTRY WnbdDequeueRequest(
+    _In_ PSCSI_DEVICE_INFORMATION DeviceInformation);
+// Moves the pending priority requests to the head of the request list,
+// used before draining it.
+VOID WnbdMergeRequestLists(
+    _In_ PSCSI_DEVICE_INFORMATION DeviceInformation);
 
 
 #define LIST_FORALL_SAFE(_headPtr, _itemPtr, _nextPtr)                \
@@ -1,11 +1,19 @@
 #include <ntifs.h>
 
 #include "wnbd_dispatch.h"
+#include "cbt.h"
+#include "deadline.h"
+#include "fetch_queue.h"
+#include "io_stats.h"
+#include "io_trace.h"
 #include "util.h"
 #include "srb_helper.h"
+#include "user_buffers.h"
 #include "debug.h"
+#include "qos.h"
+#include "scheduler.h"
 #include "scsi_function.h"
-#include "scsi_trace.h"
+#include "zero_copy.h"
 
 inline int
 ScsiOpToWnbdReqType(int ScsiOp)
@@ -81,19 +89,10 @@ NTSTATUS LockUsermodeBuffer(
     return Status;
 }
 
-NTSTATUS WnbdDispatchRequest(
+NTSTATUS WnbdCheckRequestor(
     PIRP Irp,
-    PSCSI_DEVICE_INFORMATION DeviceInfo,
-    PWNBD_IOCTL_FETCH_REQ_COMMAND Command)
+    PSCSI_DEVICE_INFORMATION DeviceInfo)
 {
-    // TODO: reject request when using NBD.
-    // TODO: check the associated PID.
-    PVOID Buffer;
-    NTSTATUS Status = 0;
-    PWNBD_IO_REQUEST Request = &Command->Request;
-    PMDL Mdl = NULL;
-    BOOLEAN BufferLocked = FALSE;
-
     if ((ULONG)DeviceInfo->UserEntry->Properties.Pid != IoGetRequestorProcessId(Irp)) {
         WNBD_LOG_LOUD("Invalid pid: %d != %u.",
             DeviceInfo->UserEntry->Properties.Pid, IoGetRequestorProcessId(Irp));
@@ -103,25 +102,243 @@ NTSTATUS WnbdDispatchRequest(
         WNBD_LOG_LOUD("Direct IO is not allowed using NBD devices.");
         return STATUS_ACCESS_DENIED;
     }
+    return STATUS_SUCCESS;
+}
 
-    Status = LockUsermodeBuffer(
-        Command->DataBuffer, Command->DataBufferSize, TRUE,
-        &Buffer, &Mdl, &BufferLocked);
-    if (Status)
-        goto Exit;
+// Converts the SCSI UNMAP block descriptors (big endian), which were
+// validated when the request was queued.
+NTSTATUS WnbdCopyUnmapDescriptors(
+    PSRB_QUEUE_ELEMENT Element,
+    PWNBD_IO_REQUEST Request,
+    PVOID Buffer,
+    UINT32 BufferSize)
+{
+    NTSTATUS Status = 0;
+    PUNMAP_LIST_HEADER List;
+    if (StorPortGetSystemAddress(Element->DeviceExtension,
+                                 Element->Srb, (PVOID*)&List)) {
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    UINT16 BlockDescLength =
+        ((UINT16)List->BlockDescrDataLength[0] << 8) |
+        List->BlockDescrDataLength[1];
+    UINT32 Count = BlockDescLength / sizeof(UNMAP_BLOCK_DESCRIPTOR);
+    if (Count * sizeof(WNBD_UNMAP_DESCRIPTOR) > BufferSize) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    PWNBD_UNMAP_DESCRIPTOR Descriptors = (PWNBD_UNMAP_DESCRIPTOR) Buffer;
+    __try {
+        for (UINT32 i = 0; i < Count; i++) {
+            WNBD_UNMAP_DESCRIPTOR Descriptor = { 0 };
+            REVERSE_BYTES_8(&Descriptor.BlockAddress,
+                            &List->Descriptors[i].StartingLba);
+            REVERSE_BYTES_4(&Descriptor.BlockCount,
+                            &List->Descriptors[i].LbaCount);
+            Descriptors[i] = Descriptor;
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        Status = GetExceptionCode();
+    }
+    if (Status) {
+        WNBD_LOG_ERROR("Could not copy unmap descriptors to %p. "
+                       "Exception: %d.", Buffer, Status);
+        return STATUS_INVALID_USER_BUFFER;
+    }
+
+    Request->Cmd.Unmap.Count = Count;
+    Request->Cmd.Unmap.Anchor = ((PCDB)&Element->Srb->Cdb)->UNMAP.Anchor;
+    return STATUS_SUCCESS;
+}
+
+// Prepares the request to be passed to userspace, copying the write
+// payload or the unmap descriptors to the specified buffer. If
+// "RequestHandle" is 0, a new request handle is allocated.
+//
+// On success, the element is moved to the reply list. Otherwise, the
+// element is either completed with an error or, if STATUS_CANCELLED is
+// returned, put back in the request list (hard removal).
+NTSTATUS WnbdPrepareRequest(
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PSRB_QUEUE_ELEMENT Element,
+    PWNBD_IO_REQUEST Request,
+    PVOID Buffer,
+    UINT32 BufferSize,
+    UINT64 RequestHandle)
+{
+    static UINT64 LastRequestHandle = 0;
+    NTSTATUS Status = 0;
+
+    Element->Tag = RequestHandle ?
+        RequestHandle : InterlockedIncrement64(&(LONG64)LastRequestHandle);
+    Element->Srb->DataTransferLength = 0;
+    // Retried requests get a new mapping, if any.
+    Element->ZeroCopy = FALSE;
+    PCDB Cdb = (PCDB)&Element->Srb->Cdb;
+
+    RtlZeroMemory(Request, sizeof(WNBD_IO_REQUEST));
+    WnbdRequestType RequestType = ScsiOpToWnbdReqType(Cdb->AsByte[0]);
+    WNBD_IO_LOG_LOUD(WnbdEvtUserProcessingRequest,
+                     Element->Srb, Element->Tag, RequestType);
+    // TODO: check if the device supports the requested operation
+    switch(RequestType) {
+    case WnbdReqTypeRead:
+    case WnbdReqTypeWrite:
+    case WnbdReqTypeFlush:
+    case WnbdReqTypeUnmap:
+        Request->RequestType = RequestType;
+        Request->RequestHandle = Element->Tag;
+        break;
+    default:
+        Element->Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        Status = STATUS_NOT_SUPPORTED;
+        goto Fail;
+    }
+
+    // Unmap requests carry block descriptors instead of data, the
+    // element length covering the unmapped range.
+    if ((RequestType == WnbdReqTypeRead || RequestType == WnbdReqTypeWrite) &&
+            Element->ReadLength > BufferSize) {
+        // The user buffer must be at least as large as
+        // the specified maximum transfer length.
+        Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
+        Status = STATUS_BUFFER_TOO_SMALL;
+        goto Fail;
+    }
+
+    // Unmap requests don't carry a payload, so only the request rate
+    // limits apply.
+    if (DeviceInfo->Qos && RequestType != WnbdReqTypeFlush &&
+            !WnbdQosWait(DeviceInfo->Qos, RequestType == WnbdReqTypeWrite,
+                         RequestType != WnbdReqTypeUnmap ? Element->ReadLength : 0)) {
+        // Hard removal, leaving the request to the cleanup routines.
+        ExInterlockedInsertHeadList(
+            &DeviceInfo->RequestListHead,
+            &Element->Link, &DeviceInfo->RequestListLock);
+        return STATUS_CANCELLED;
+    }
+    WnbdSchedulerAccountWait(DeviceInfo, Element);
+    WnbdIoCountersRecordSend(DeviceInfo->IoCounters, Element);
+    WnbdTraceRequest(DeviceInfo, Element, WnbdTraceDequeued);
+
+    PWNBD_PROPERTIES DevProps = &DeviceInfo->UserEntry->Properties;
+
+    // Large requests may be mapped directly into the caller process,
+    // in which case the payload isn't copied.
+    if (DeviceInfo->ZeroCopy &&
+            (RequestType == WnbdReqTypeRead || RequestType == WnbdReqTypeWrite)) {
+        PVOID DataAddress = WnbdZeroCopyMap(DeviceInfo->ZeroCopy, Element);
+        if (DataAddress) {
+            Element->ZeroCopy = TRUE;
+            Request->DataAddress = (UINT64)DataAddress;
+        }
+    }
+
+    switch(RequestType) {
+    case WnbdReqTypeRead:
+        Request->Cmd.Read.BlockAddress =
+            Element->StartingLbn / DevProps->BlockSize;;
+        Request->Cmd.Read.BlockCount =
+            Element->ReadLength / DevProps->BlockSize;
+        break;
+    case WnbdReqTypeWrite:
+        Request->Cmd.Write.BlockAddress =
+            Element->StartingLbn / DevProps->BlockSize;
+        Request->Cmd.Write.BlockCount =
+            Element->ReadLength / DevProps->BlockSize;
+        if (Element->ZeroCopy) {
+            break;
+        }
 
-    static UINT64 RequestHandle = 0;
+        PVOID SrbBuffer;
+        if (StorPortGetSystemAddress(Element->DeviceExtension,
+                                     Element->Srb, &SrbBuffer)) {
+            Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
+            Status = STATUS_INTERNAL_ERROR;
+            goto Fail;
+        }
+
+        __try {
+            RtlCopyMemory(Buffer, SrbBuffer, Element->ReadLength);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            Status = GetExceptionCode();
+        }
+        if (Status) {
+            WNBD_LOG_ERROR("Could not copy write payload to %p. "
+                           "Exception: %d.", Buffer, Status);
+            Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
+            Status = STATUS_INVALID_USER_BUFFER;
+            goto Fail;
+        }
+        InterlockedAdd64(&DeviceInfo->ExtendedStats.CopiedBytes, Element->ReadLength);
+        break;
+    case WnbdReqTypeFlush:
+        Request->Cmd.Flush.BlockAddress =
+            Element->StartingLbn / DevProps->BlockSize;
+        Request->Cmd.Flush.BlockCount =
+            Element->ReadLength / DevProps->BlockSize;
+        break;
+    case WnbdReqTypeUnmap:
+        Status = WnbdCopyUnmapDescriptors(Element, Request, Buffer, BufferSize);
+        if (Status) {
+            Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
+            goto Fail;
+        }
+        break;
+    }
+
+    WnbdTraceRequest(DeviceInfo, Element, WnbdTraceSent);
+    WnbdInsertReplyElement(DeviceInfo, Element);
+    InterlockedIncrement64(&DeviceInfo->Stats.PendingSubmittedIORequests);
+    InterlockedDecrement64(&DeviceInfo->Stats.UnsubmittedIORequests);
+    return STATUS_SUCCESS;
+
+Fail:
+    StorPortNotification(RequestComplete,
+                         Element->DeviceExtension,
+                         Element->Srb);
+    ExFreePool(Element);
+    InterlockedDecrement64(&DeviceInfo->Stats.UnsubmittedIORequests);
+    return Status;
+}
+
+// Fetches up to "MaxRequests" requests. If "Wait" is set, we're waiting
+// until at least one request is available. Request "i" uses the buffer
+// slot at "DataBuffer + i * SlotSize", which must be accessible from the
+// current context.
+NTSTATUS WnbdFetchRequests(
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IO_REQUEST Requests,
+    UINT32 MaxRequests,
+    PVOID DataBuffer,
+    UINT32 SlotSize,
+    BOOLEAN Wait,
+    PUINT32 RequestCount)
+{
+    NTSTATUS Status = 0;
+    UINT32 Count = 0;
+    LARGE_INTEGER NoWait = { 0 };
+
+    // We're looping through the requests until we manage to dispatch at
+    // least one. Unsupported requests as well as most errors will be hidden
+    // from the caller.
+    while (!DeviceInfo->HardTerminateDevice && Count < MaxRequests) {
+        // Throttled requests may block, in which case we're returning the
+        // requests that we already have.
+        if (Count && DeviceInfo->Qos && DeviceInfo->Qos->Enabled) {
+            break;
+        }
 
-    // We're looping through the requests until we manage to dispatch one.
-    // Unsupported requests as well as most errors will be hidden from the caller.
-    while (!DeviceInfo->HardTerminateDevice) {
         PVOID WaitObjects[2];
         WaitObjects[0] = &DeviceInfo->DeviceEvent;
         WaitObjects[1] = &DeviceInfo->TerminateEvent;
         NTSTATUS WaitResult = KeWaitForMultipleObjects(
             2, WaitObjects, WaitAny, Executive, KernelMode,
-            TRUE, NULL, NULL);
-        if (STATUS_WAIT_1  == WaitResult)
+            TRUE, (Count || !Wait) ? &NoWait : NULL, NULL);
+        if (STATUS_WAIT_1  == WaitResult || STATUS_TIMEOUT == WaitResult)
             break;
 
         if (STATUS_ALERTED == WaitResult) {
@@ -132,9 +349,7 @@ NTSTATUS WnbdDispatchRequest(
             break;
         }
 
-        PLIST_ENTRY RequestEntry = ExInterlockedRemoveHeadList(
-            &DeviceInfo->RequestListHead,
-            &DeviceInfo->RequestListLock);
+        PLIST_ENTRY RequestEntry = WnbdDequeueRequest(DeviceInfo);
 
         if (DeviceInfo->HardTerminateDevice) {
             break;
@@ -143,128 +358,211 @@ NTSTATUS WnbdDispatchRequest(
             continue;
         }
 
-        // TODO: consider moving this part to a helper function.
         PSRB_QUEUE_ELEMENT Element = CONTAINING_RECORD(RequestEntry, SRB_QUEUE_ELEMENT, Link);
-        Element->Tag = InterlockedIncrement64(&(LONG64)RequestHandle);
-        Element->Srb->DataTransferLength = 0;
-        PCDB Cdb = (PCDB)&Element->Srb->Cdb;
-
-        RtlZeroMemory(Request, sizeof(WNBD_IO_REQUEST));
-        WnbdRequestType RequestType = ScsiOpToWnbdReqType(Cdb->AsByte[0]);
-        WNBD_LOG_LOUD("Processing request. Address: %p Tag: 0x%llx Type: %d",
-                      Element->Srb, Element->Tag, RequestType);
-        // TODO: check if the device supports the requested operation
-        switch(RequestType) {
-        case WnbdReqTypeRead:
-        case WnbdReqTypeWrite:
-            Request->RequestType = RequestType;
-            Request->RequestHandle = Element->Tag;
+        PVOID Buffer = (PUCHAR)DataBuffer + (SIZE_T)Count * SlotSize;
+        Status = WnbdPrepareRequest(DeviceInfo, Element, &Requests[Count],
+                                    Buffer, SlotSize, 0);
+        if (STATUS_CANCELLED == Status) {
+            Status = 0;
             break;
-        // TODO: flush/unmap
-        default:
-            Element->Srb->DataTransferLength = 0;
-            Element->Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-            StorPortNotification(RequestComplete,
-                                 Element->DeviceExtension,
-                                 Element->Srb);
-            ExFreePool(Element);
-            InterlockedDecrement64(&DeviceInfo->Stats.UnsubmittedIORequests);
+        }
+        // Invalid user buffers are reported to the caller.
+        if (STATUS_BUFFER_TOO_SMALL == Status ||
+                STATUS_INVALID_USER_BUFFER == Status) {
+            goto Exit;
+        }
+        if (Status) {
+            Status = 0;
             continue;
         }
 
-        PWNBD_PROPERTIES DevProps = &DeviceInfo->UserEntry->Properties;
-
-        switch(RequestType) {
-        case WnbdReqTypeRead:
-            Request->Cmd.Read.BlockAddress =
-                Element->StartingLbn / DevProps->BlockSize;;
-            Request->Cmd.Read.BlockCount =
-                Element->ReadLength / DevProps->BlockSize;
-            break;
-        case WnbdReqTypeWrite:
-            Request->Cmd.Write.BlockAddress =
-                Element->StartingLbn / DevProps->BlockSize;
-            Request->Cmd.Write.BlockCount =
-                Element->ReadLength / DevProps->BlockSize;
-            if (Element->ReadLength > Command->DataBufferSize) {
-                // The user buffer must be at least as large as
-                // the specified maximum transfer length.
-                Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
-                StorPortNotification(
-                    RequestComplete,
-                    Element->DeviceExtension,
-                    Element->Srb);
-                ExFreePool(Element);
-                InterlockedDecrement64(&DeviceInfo->Stats.UnsubmittedIORequests);
-                Status = STATUS_BUFFER_TOO_SMALL;
-                goto Exit;
-            }
+        // We managed to find a supported request, we'll pass it forward
+        // along with any other request that's immediately available.
+        Count++;
+    }
 
-            PVOID SrbBuffer;
-            if (StorPortGetSystemAddress(Element->DeviceExtension,
-                                         Element->Srb, &SrbBuffer)) {
-                // TODO: consider moving this part to a helper function.
-                Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
-                StorPortNotification(
-                    RequestComplete,
-                    Element->DeviceExtension,
-                    Element->Srb);
-                ExFreePool(Element);
-                InterlockedDecrement64(&DeviceInfo->Stats.UnsubmittedIORequests);
-                continue;
-            }
+Exit:
+    // The requests that were already dispatched can't be dropped.
+    if (Count) {
+        Status = 0;
+    }
 
-            RtlCopyMemory(Buffer, SrbBuffer, Element->ReadLength);
-            break;
+    if (DeviceInfo->HardTerminateDevice) {
+        if (Count == MaxRequests) {
+            Count--;
         }
+        RtlZeroMemory(&Requests[Count], sizeof(WNBD_IO_REQUEST));
+        Requests[Count].RequestType = WnbdReqTypeDisconnect;
+        Count++;
+        Status = 0;
+    }
 
-        ExInterlockedInsertTailList(
-            &DeviceInfo->ReplyListHead,
-            &Element->Link, &DeviceInfo->ReplyListLock);
-        InterlockedIncrement64(&DeviceInfo->Stats.PendingSubmittedIORequests);
-        InterlockedDecrement64(&DeviceInfo->Stats.UnsubmittedIORequests);
-        // We managed to find a supported request, we can now exit the loop
-        // and pass it forward.
-        break;
+    *RequestCount = Count;
+    return Status;
+}
+
+// Fetches up to "MaxRequests" requests, waiting until at least one
+// request is available. Request "i" uses the user buffer slot at
+// "DataBuffer + i * SlotSize". "BufferId" optionally specifies the
+// registered buffer that contains the slots.
+//
+// Asynchronous fetches (WNBD_FETCH_FLAG_ASYNC) that can't be served
+// immediately are pended, in which case STATUS_PENDING is returned.
+NTSTATUS WnbdDispatchRequests(
+    PIRP Irp,
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IO_REQUEST Requests,
+    UINT32 MaxRequests,
+    PVOID DataBuffer,
+    UINT32 SlotSize,
+    UINT32 BufferId,
+    UINT32 Flags,
+    PUINT32 RequestCount)
+{
+    // TODO: check the associated PID.
+    NTSTATUS Status = 0;
+    BOOLEAN Async = !!(Flags & WNBD_FETCH_FLAG_ASYNC);
+
+    *RequestCount = 0;
+    Status = WnbdCheckRequestor(Irp, DeviceInfo);
+    if (Status) {
+        return Status;
     }
 
-Exit:
-    if (Mdl) {
-        if (BufferLocked) {
-            MmUnlockPages(Mdl);
+    if (BufferId) {
+        // Registered buffers are already locked and mapped.
+        DataBuffer = WnbdUserBufferGet(DeviceInfo, BufferId, DataBuffer,
+                                       (UINT64)SlotSize * MaxRequests);
+        if (!DataBuffer) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    } else if (Async) {
+        // Pended IRPs may be completed from any thread context.
+        WNBD_LOG_ERROR("Asynchronous fetches require a registered buffer.");
+        return STATUS_INVALID_PARAMETER;
+    } else {
+        // We're running in the context of the calling process, so the write
+        // payloads are copied straight to the user buffer instead of locking
+        // it for every call.
+        __try {
+            ProbeForWrite(DataBuffer, (SIZE_T)SlotSize * MaxRequests, 1);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            Status = GetExceptionCode();
+            WNBD_LOG_ERROR("Invalid user buffer: %p, slot size: %d, slots: %d. "
+                           "Exception: %d.", DataBuffer, SlotSize, MaxRequests, Status);
+            return Status;
         }
-        IoFreeMdl(Mdl);
     }
 
-    if (DeviceInfo->HardTerminateDevice) {
-        Request->RequestType = WnbdReqTypeDisconnect;
-        Status = 0;
+    Status = WnbdFetchRequests(DeviceInfo, Requests, MaxRequests,
+                               DataBuffer, SlotSize, !Async, RequestCount);
+    if (Async && !Status && !*RequestCount) {
+        // The slot count is needed when completing the IRP. Note that
+        // the IRP may be completed before WnbdFetchQueueInsert returns.
+        *RequestCount = MaxRequests;
+        Status = WnbdFetchQueueInsert(DeviceInfo, Irp);
+        if (STATUS_PENDING != Status) {
+            *RequestCount = 0;
+        }
     }
-
     return Status;
 }
 
-NTSTATUS WnbdHandleResponse(
+BOOLEAN WnbdCompletePendingFetch(
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PIRP Irp,
+    BOOLEAN Force)
+{
+    NTSTATUS Status = 0;
+    PWNBD_IO_REQUEST Requests = NULL;
+    PUINT32 RequestCount = NULL;
+    PVOID DataBuffer = NULL;
+    UINT32 SlotSize = 0;
+    UINT32 BufferId = 0;
+    UINT32 Count = 0;
+
+    // The IOCTL code is the first field of every command.
+    PVOID Command = Irp->AssociatedIrp.SystemBuffer;
+    if (IOCTL_WNBD_FETCH_REQ_BATCH == *(PULONG)Command) {
+        PWNBD_IOCTL_FETCH_REQ_BATCH_COMMAND BatchCmd =
+            (PWNBD_IOCTL_FETCH_REQ_BATCH_COMMAND) Command;
+        Requests = BatchCmd->Requests;
+        RequestCount = &BatchCmd->RequestCount;
+        DataBuffer = BatchCmd->DataBuffer;
+        SlotSize = BatchCmd->SlotSize;
+        BufferId = BatchCmd->BufferId;
+    } else {
+        PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND RspReqCmd =
+            (PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND) Command;
+        Requests = RspReqCmd->Requests;
+        RequestCount = &RspReqCmd->RequestCount;
+        DataBuffer = RspReqCmd->DataBuffer;
+        SlotSize = RspReqCmd->SlotSize;
+        BufferId = RspReqCmd->BufferId;
+    }
+
+    // The buffer was validated when pending the IRP but it may have
+    // been released since.
+    PVOID SystemBuffer = WnbdUserBufferGet(
+        DeviceInfo, BufferId, DataBuffer, (UINT64)SlotSize * *RequestCount);
+    if (SystemBuffer) {
+        Status = WnbdFetchRequests(DeviceInfo, Requests, *RequestCount,
+                                   SystemBuffer, SlotSize, FALSE, &Count);
+    } else {
+        Status = STATUS_INVALID_PARAMETER;
+    }
+
+    if (!Status && !Count && !Force) {
+        return FALSE;
+    }
+
+    *RequestCount = Count;
+    Irp->IoStatus.Status = Status;
+    if (IOCTL_WNBD_FETCH_REQ_BATCH == *(PULONG)Command) {
+        Irp->IoStatus.Information = WNBD_FETCH_REQ_BATCH_COMMAND_SIZE(Count);
+    } else {
+        Irp->IoStatus.Information = WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(Count, 0);
+    }
+    StorPortCompleteServiceIrp(DeviceInfo->GlobalInformation->Handle, Irp);
+    return TRUE;
+}
+
+NTSTATUS WnbdDispatchRequest(
     PIRP Irp,
     PSCSI_DEVICE_INFORMATION DeviceInfo,
-    PWNBD_IOCTL_SEND_RSP_COMMAND Command)
+    PWNBD_IOCTL_FETCH_REQ_COMMAND Command)
+{
+    UINT32 RequestCount = 0;
+    return WnbdDispatchRequests(
+        Irp, DeviceInfo, &Command->Request, 1,
+        Command->DataBuffer, Command->DataBufferSize,
+        Command->BufferId, 0, &RequestCount);
+}
+
+NTSTATUS WnbdDispatchRequestBatch(
+    PIRP Irp,
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IOCTL_FETCH_REQ_BATCH_COMMAND Command)
+{
+    return WnbdDispatchRequests(
+        Irp, DeviceInfo, Command->Requests, Command->RequestCount,
+        Command->DataBuffer, Command->SlotSize,
+        Command->BufferId, Command->Flags, &Command->RequestCount);
+}
+
+NTSTATUS WnbdCompleteResponse(
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    BOOLEAN UserBuffer)
 {
     PSRB_QUEUE_ELEMENT Element = NULL;
     NTSTATUS Status = STATUS_SUCCESS;
     PVOID SrbBuff = NULL, LockedUserBuff = NULL;
     PMDL Mdl = NULL;
     BOOLEAN BufferLocked = FALSE;
-    PWNBD_IO_RESPONSE Response = &Command->Response;
-
-    if ((ULONG)DeviceInfo->UserEntry->Properties.Pid != IoGetRequestorProcessId(Irp)) {
-        WNBD_LOG_LOUD("Invalid pid: %d != %u.",
-            DeviceInfo->UserEntry->Properties.Pid, IoGetRequestorProcessId(Irp));
-        return STATUS_ACCESS_DENIED;
-    }
-    if ((ULONG)DeviceInfo->UserEntry->Properties.Flags.UseNbd) {
-        WNBD_LOG_LOUD("Direct IO is not allowed using NBD devices.");
-        return STATUS_ACCESS_DENIED;
-    }
 
     PLIST_ENTRY ItemLink, ItemNext;
     KIRQL Irql = { 0 };
@@ -273,27 +571,38 @@ NTSTATUS WnbdHandleResponse(
         Element = CONTAINING_RECORD(ItemLink, SRB_QUEUE_ELEMENT, Link);
         if (Element->Tag == Response->RequestHandle) {
             RemoveEntryList(&Element->Link);
+            WnbdDeadlineDisarm(Element);
             break;
         }
         Element = NULL;
     }
     KeReleaseSpinLock(&DeviceInfo->ReplyListLock, Irql);
+    // The mapping has to be removed before completing the SRB. Aborted
+    // requests may still have their mapping around.
+    if (DeviceInfo->ZeroCopy && (!Element || Element->ZeroCopy)) {
+        WnbdZeroCopyUnmap(DeviceInfo->ZeroCopy, Response->RequestHandle);
+    }
     if (!Element) {
         WNBD_LOG_ERROR("Received reply with no matching request tag: 0x%llx",
             Response->RequestHandle);
         Status = STATUS_NOT_FOUND;
         goto Exit;
     }
+    WnbdTraceRequest(DeviceInfo, Element, WnbdTraceReplied);
+
+    // The request may have reached the disk even if it failed or got
+    // aborted, so we're recording it either way.
+    WnbdCbtTrackElement(DeviceInfo->Cbt, Element);
 
     ULONG StorResult;
     if (!Element->Aborted) {
         // We need to avoid accessing aborted or already completed SRBs.
         PCDB Cdb = (PCDB)&Element->Srb->Cdb;
         WnbdRequestType RequestType = ScsiOpToWnbdReqType(Cdb->AsByte[0]);
-        WNBD_LOG_LOUD("Received reply header for %d %p 0x%llx.",
-                      RequestType, Element->Srb, Element->Tag);
+        WNBD_IO_LOG_LOUD(WnbdEvtUserReplyHeader, RequestType,
+                         Element->Srb, Element->Tag);
 
-        if (IsReadSrb(Element->Srb)) {
+        if (IsReadSrb(Element->Srb) && !Element->ZeroCopy) {
             StorResult = StorPortGetSystemAddress(Element->DeviceExtension, Element->Srb, &SrbBuff);
             if (STOR_STATUS_SUCCESS != StorResult) {
                 WNBD_LOG_ERROR("Could not get SRB %p 0x%llx data buffer. Error: %d.",
@@ -308,30 +617,52 @@ NTSTATUS WnbdHandleResponse(
                       Element->Srb, Element->Tag);
     }
 
-    if (!Response->Status.ScsiStatus && IsReadSrb(Element->Srb)) {
-        Status = LockUsermodeBuffer(
-            Command->DataBuffer, Command->DataBufferSize, FALSE,
-            &LockedUserBuff, &Mdl, &BufferLocked);
-        if (Status)
+    if (!Response->Status.ScsiStatus && Element->Read && !Element->ZeroCopy) {
+        if (DataBufferSize < Element->ReadLength) {
+            WNBD_LOG_ERROR("Read buffer too small: %d < %d. Tag: 0x%llx.",
+                           DataBufferSize, Element->ReadLength, Element->Tag);
+            if (!Element->Aborted) {
+                Element->Srb->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
+            }
+            Status = STATUS_BUFFER_TOO_SMALL;
             goto Exit;
+        }
+
+        if (UserBuffer) {
+            Status = LockUsermodeBuffer(
+                DataBuffer, DataBufferSize, FALSE,
+                &LockedUserBuff, &Mdl, &BufferLocked);
+            if (Status)
+                goto Exit;
+        } else {
+            LockedUserBuff = DataBuffer;
+        }
 
-        // TODO: compare data buffer size with the read length
         if (!Element->Aborted) {
             // SrbBuff can't be NULL
 #pragma warning(push)
 #pragma warning(disable:6387)
             RtlCopyMemory(SrbBuff, LockedUserBuff, Element->ReadLength);
 #pragma warning(pop)
+            InterlockedAdd64(&DeviceInfo->ExtendedStats.CopiedBytes,
+                             Element->ReadLength);
         }
     }
-    if (Response->Status.ScsiStatus) {
-        Element->Srb->DataTransferLength = 0;
-        Element->Srb->SrbStatus = SetSrbStatus(Element->Srb, &Response->Status);
-    }
-    else {
-        // TODO: rename ReadLength to DataLength
-        Element->Srb->DataTransferLength = Element->ReadLength;
-        Element->Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    // Aborted SRBs were either completed already or handed over to a
+    // retry, so we mustn't touch them.
+    if (!Element->Aborted) {
+        if (Response->Status.ScsiStatus) {
+            Element->Srb->DataTransferLength = 0;
+            Element->Srb->SrbStatus = SetSrbStatus(Element->Srb, &Response->Status);
+        }
+        else {
+            // Unmap requests keep the parameter list length.
+            if (Element->IoOp != WnbdIoOpUnmap) {
+                // TODO: rename ReadLength to DataLength
+                Element->Srb->DataTransferLength = Element->ReadLength;
+            }
+            Element->Srb->SrbStatus = SRB_STATUS_SUCCESS;
+        }
     }
 
     InterlockedIncrement64(&DeviceInfo->Stats.TotalReceivedIOReplies);
@@ -352,11 +683,11 @@ Exit:
     }
 
     if (Element) {
+        WnbdIoCountersRecordCompletion(DeviceInfo->IoCounters, Element);
+        WnbdTraceRequest(DeviceInfo, Element, WnbdTraceCompleted);
         if (!Element->Aborted) {
-            WNBD_LOG_LOUD(
-                "Notifying StorPort of completion of %p status: 0x%x(%s)",
-                Element->Srb, Element->Srb->SrbStatus,
-                WnbdToStringSrbStatus(Element->Srb->SrbStatus));
+            WNBD_IO_LOG_LOUD(WnbdEvtSrbCompleted, Element->Srb, Element->Tag,
+                             Element->Srb->SrbStatus);
             StorPortNotification(RequestComplete, Element->DeviceExtension,
                                  Element->Srb);
         }
@@ -365,3 +696,76 @@ Exit:
 
     return Status;
 }
+
+// Completes a response received from userspace, using the registered
+// buffer if "BufferId" is set.
+NTSTATUS WnbdCompleteUserResponse(
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    UINT32 BufferId)
+{
+    if (!BufferId || !DataBuffer) {
+        return WnbdCompleteResponse(DeviceInfo, Response, DataBuffer,
+                                    DataBufferSize, TRUE);
+    }
+
+    PVOID SystemBuffer = WnbdUserBufferGet(DeviceInfo, BufferId,
+                                           DataBuffer, DataBufferSize);
+    if (!SystemBuffer) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    return WnbdCompleteResponse(DeviceInfo, Response, SystemBuffer,
+                                DataBufferSize, FALSE);
+}
+
+NTSTATUS WnbdHandleResponse(
+    PIRP Irp,
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IOCTL_SEND_RSP_COMMAND Command)
+{
+    NTSTATUS Status = WnbdCheckRequestor(Irp, DeviceInfo);
+    if (Status) {
+        return Status;
+    }
+
+    return WnbdCompleteUserResponse(
+        DeviceInfo, &Command->Response, Command->DataBuffer,
+        Command->DataBufferSize, Command->BufferId);
+}
+
+NTSTATUS WnbdHandleResponsesFetchRequests(
+    PIRP Irp,
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND Command)
+{
+    NTSTATUS Status = WnbdCheckRequestor(Irp, DeviceInfo);
+    if (Status) {
+        return Status;
+    }
+
+    // The responses are handled first, allowing the caller to reuse the
+    // read buffers as request slots.
+    PWNBD_IO_RESPONSE_ENTRY Responses =
+        WNBD_SEND_RSP_FETCH_REQ_RESPONSES(Command);
+    Command->FailedResponseCount = 0;
+    for (UINT32 i = 0; i < Command->ResponseCount; i++) {
+        // The other responses as well as the request fetching are not
+        // affected, the caller being informed through the failure count.
+        if (WnbdCompleteUserResponse(DeviceInfo, &Responses[i].Response,
+                                     Responses[i].DataBuffer,
+                                     Responses[i].DataBufferSize,
+                                     Responses[i].BufferId)) {
+            Command->FailedResponseCount++;
+        }
+    }
+
+    if (!Command->RequestCount) {
+        return STATUS_SUCCESS;
+    }
+    return WnbdDispatchRequests(
+        Irp, DeviceInfo, Command->Requests, Command->RequestCount,
+        Command->DataBuffer, Command->SlotSize,
+        Command->BufferId, Command->Flags, &Command->RequestCount);
+}
@@ -3,20 +3,64 @@
 
 #include "common.h"
 #include "userspace.h"
+#include "util.h"
 
 // TODO: consider moving this to util.h
 NTSTATUS LockUsermodeBuffer(
     PVOID Buffer, UINT32 BufferSize, BOOLEAN Writeable,
     PVOID* OutBuffer, PMDL* OutMdl, BOOLEAN* Locked);
 
+NTSTATUS WnbdCheckRequestor(
+    PIRP Irp,
+    PSCSI_DEVICE_INFORMATION DeviceInfo);
+
+NTSTATUS WnbdPrepareRequest(
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PSRB_QUEUE_ELEMENT Element,
+    PWNBD_IO_REQUEST Request,
+    PVOID Buffer,
+    UINT32 BufferSize,
+    UINT64 RequestHandle);
+
 NTSTATUS WnbdDispatchRequest(
     PIRP Irp,
     PSCSI_DEVICE_INFORMATION DeviceInfo,
     PWNBD_IOCTL_FETCH_REQ_COMMAND Command);
 
+// Asynchronous fetches may return STATUS_PENDING, in which case the
+// IRP must not be accessed anymore.
+NTSTATUS WnbdDispatchRequestBatch(
+    PIRP Irp,
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IOCTL_FETCH_REQ_BATCH_COMMAND Command);
+
+// "UserBuffer" must be set if the read payload buffer belongs to
+// the calling process.
+NTSTATUS WnbdCompleteResponse(
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    BOOLEAN UserBuffer);
+
 NTSTATUS WnbdHandleResponse(
     PIRP Irp,
     PSCSI_DEVICE_INFORMATION DeviceInfo,
     PWNBD_IOCTL_SEND_RSP_COMMAND Command);
 
+// See WnbdDispatchRequestBatch.
+NTSTATUS WnbdHandleResponsesFetchRequests(
+    PIRP Irp,
+    PSCSI_DEVICE_INFORMATION DeviceInfo,
+    PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND Command);
+
+// Completes a pended fetch IRP using the requests that are immediately
+// available. Returns FALSE if there aren't any, in which case the IRP
+// is left untouched. If "Force" is set, the IRP is completed regardless.
+_IRQL_requires_(PASSIVE_LEVEL)
+BOOLEAN WnbdCompletePendingFetch(
+    _In_ PSCSI_DEVICE_INFORMATION DeviceInfo,
+    _In_ PIRP Irp,
+    _In_ BOOLEAN Force);
+
 #endif // WNBD_DISPATCH_H
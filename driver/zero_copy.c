@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include <ntifs.h>
+
+#include "common.h"
+#include "debug.h"
+#include "userspace.h"
+#include "zero_copy.h"
+
+#define ZeroCopyMalloc(S) ExAllocatePoolWithTag(NonPagedPoolNx, (S), 'zDBN')
+
+extern BOOLEAN ProcessNotifyRegistered;
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdZeroCopyCreate(PSCSI_DEVICE_INFORMATION DeviceInformation,
+                   PUINT32 Threshold,
+                   PWNBD_ZERO_COPY* PZeroCopy)
+{
+    WNBD_LOG_LOUD(": Enter");
+    ASSERT(DeviceInformation);
+    ASSERT(Threshold);
+    ASSERT(PZeroCopy);
+    *PZeroCopy = NULL;
+
+    // Without the process notify routine, we wouldn't be able to remove
+    // the mappings of aborted requests before the process exits.
+    if (!ProcessNotifyRegistered) {
+        WNBD_LOG_ERROR("Zero-copy mode unavailable, the process notify "
+                       "routine isn't registered.");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    PWNBD_ZERO_COPY ZeroCopy = (PWNBD_ZERO_COPY) ZeroCopyMalloc(
+        sizeof(WNBD_ZERO_COPY));
+    if (!ZeroCopy) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(ZeroCopy, sizeof(WNBD_ZERO_COPY));
+
+    if (!*Threshold) {
+        *Threshold = WNBD_DEFAULT_ZERO_COPY_THRESHOLD;
+    }
+    ZeroCopy->DeviceInformation = DeviceInformation;
+    ZeroCopy->Threshold = *Threshold;
+    KeInitializeSpinLock(&ZeroCopy->Lock);
+    InitializeListHead(&ZeroCopy->MappingList);
+    *PZeroCopy = ZeroCopy;
+
+    WNBD_LOG_INFO("Zero-copy threshold: %u.", *Threshold);
+    WNBD_LOG_LOUD(": Exit");
+    return STATUS_SUCCESS;
+}
+
+// Must be called in the context of the process that owns the mapping.
+VOID
+WnbdZeroCopyFreeMapping(_In_ PWNBD_ZERO_COPY_MAPPING Mapping)
+{
+    MmUnmapLockedPages(Mapping->UserAddress, Mapping->Mdl);
+    MmUnlockPages(Mapping->Mdl);
+    IoFreeMdl(Mapping->Mdl);
+    ObDereferenceObject(Mapping->Process);
+    ExFreePool(Mapping);
+}
+
+_Use_decl_annotations_
+PVOID
+WnbdZeroCopyMap(PWNBD_ZERO_COPY ZeroCopy,
+                PSRB_QUEUE_ELEMENT Element)
+{
+    PSCSI_DEVICE_INFORMATION DeviceInformation = ZeroCopy->DeviceInformation;
+    NTSTATUS Status = STATUS_SUCCESS;
+    PMDL Mdl = NULL;
+    BOOLEAN Locked = FALSE;
+    PVOID UserAddress = NULL;
+    KIRQL Irql = { 0 };
+
+    // The mappings are released by the process notify routine, which
+    // only handles the owner process.
+    if (Element->ReadLength < ZeroCopy->Threshold ||
+            IoIsSystemThread(PsGetCurrentThread()) ||
+            (ULONG_PTR)DeviceInformation->UserEntry->Properties.Pid !=
+                (ULONG_PTR)PsGetCurrentProcessId()) {
+        return NULL;
+    }
+
+    PWNBD_ZERO_COPY_MAPPING Mapping = (PWNBD_ZERO_COPY_MAPPING)
+        ZeroCopyMalloc(sizeof(WNBD_ZERO_COPY_MAPPING));
+    if (!Mapping) {
+        return NULL;
+    }
+
+    PVOID SrbBuffer;
+    if (StorPortGetSystemAddress(Element->DeviceExtension,
+                                 Element->Srb, &SrbBuffer)) {
+        Status = STATUS_INTERNAL_ERROR;
+        goto Exit;
+    }
+
+    Mdl = IoAllocateMdl(SrbBuffer, Element->ReadLength, FALSE, FALSE, NULL);
+    if (!Mdl) {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    __try {
+        // Read requests have their payload written by the backend.
+        MmProbeAndLockPages(Mdl, KernelMode,
+                            Element->Read ? IoWriteAccess : IoReadAccess);
+        Locked = TRUE;
+        // User mode mappings raise an exception on failure.
+        UserAddress = MmMapLockedPagesSpecifyCache(
+            Mdl, UserMode, MmCached, NULL, FALSE,
+            NormalPagePriority | MdlMappingNoExecute);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        Status = GetExceptionCode();
+    }
+    if (Status) {
+        goto Exit;
+    }
+
+    Mapping->Tag = Element->Tag;
+    Mapping->Mdl = Mdl;
+    Mapping->UserAddress = UserAddress;
+    Mapping->Process = PsGetCurrentProcess();
+    ObReferenceObject(Mapping->Process);
+
+    KeAcquireSpinLock(&ZeroCopy->Lock, &Irql);
+    InsertTailList(&ZeroCopy->MappingList, &Mapping->Link);
+    KeReleaseSpinLock(&ZeroCopy->Lock, Irql);
+
+    InterlockedAdd64(&DeviceInformation->ExtendedStats.ZeroCopyBytes,
+                     Element->ReadLength);
+
+Exit:
+    if (Status) {
+        WNBD_LOG_WARN("Could not map request 0x%llx, falling back to "
+                      "copying the payload. Status: 0x%x.",
+                      Element->Tag, Status);
+        if (Locked) {
+            MmUnlockPages(Mdl);
+        }
+        if (Mdl) {
+            IoFreeMdl(Mdl);
+        }
+        ExFreePool(Mapping);
+        return NULL;
+    }
+    return UserAddress;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdZeroCopyUnmap(PWNBD_ZERO_COPY ZeroCopy,
+                  UINT64 Tag)
+{
+    PWNBD_ZERO_COPY_MAPPING Mapping = NULL;
+    PLIST_ENTRY ItemLink, ItemNext;
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&ZeroCopy->Lock, &Irql);
+    LIST_FORALL_SAFE(&ZeroCopy->MappingList, ItemLink, ItemNext) {
+        PWNBD_ZERO_COPY_MAPPING Entry = CONTAINING_RECORD(
+            ItemLink, WNBD_ZERO_COPY_MAPPING, Link);
+        if (Entry->Tag == Tag && Entry->Process == PsGetCurrentProcess()) {
+            RemoveEntryList(&Entry->Link);
+            Mapping = Entry;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&ZeroCopy->Lock, Irql);
+
+    if (Mapping) {
+        WnbdZeroCopyFreeMapping(Mapping);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+WnbdZeroCopyRelease(PWNBD_ZERO_COPY ZeroCopy)
+{
+    WNBD_LOG_LOUD(": Enter");
+    PLIST_ENTRY ItemLink, ItemNext;
+    LIST_ENTRY Mappings;
+    KIRQL Irql = { 0 };
+
+    InitializeListHead(&Mappings);
+    KeAcquireSpinLock(&ZeroCopy->Lock, &Irql);
+    LIST_FORALL_SAFE(&ZeroCopy->MappingList, ItemLink, ItemNext) {
+        PWNBD_ZERO_COPY_MAPPING Entry = CONTAINING_RECORD(
+            ItemLink, WNBD_ZERO_COPY_MAPPING, Link);
+        if (Entry->Process == PsGetCurrentProcess()) {
+            RemoveEntryList(&Entry->Link);
+            InsertTailList(&Mappings, &Entry->Link);
+        }
+    }
+    KeReleaseSpinLock(&ZeroCopy->Lock, Irql);
+
+    while (!IsListEmpty(&Mappings)) {
+        WnbdZeroCopyFreeMapping(CONTAINING_RECORD(
+            RemoveHeadList(&Mappings), WNBD_ZERO_COPY_MAPPING, Link));
+    }
+    WNBD_LOG_LOUD(": Exit");
+}
+
+_Use_decl_annotations_
+VOID
+WnbdZeroCopyDelete(PWNBD_ZERO_COPY ZeroCopy)
+{
+    WNBD_LOG_LOUD(": Enter");
+    if (!ZeroCopy) {
+        return;
+    }
+
+    // The remaining mappings belong to a process that's still running.
+    // The caller holds the connection mutex, which serializes this with
+    // the process notify routine, so the address space is still there.
+    while (!IsListEmpty(&ZeroCopy->MappingList)) {
+        PWNBD_ZERO_COPY_MAPPING Mapping = CONTAINING_RECORD(
+            RemoveHeadList(&ZeroCopy->MappingList),
+            WNBD_ZERO_COPY_MAPPING, Link);
+        // Keeps the process alive until we detach.
+        PEPROCESS Process = Mapping->Process;
+        ObReferenceObject(Process);
+
+        KAPC_STATE ApcState;
+        KeStackAttachProcess(Process, &ApcState);
+        WnbdZeroCopyFreeMapping(Mapping);
+        KeUnstackDetachProcess(&ApcState);
+        ObDereferenceObject(Process);
+    }
+
+    ExFreePool(ZeroCopy);
+    WNBD_LOG_LOUD(": Exit");
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2019 SUSE LLC
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef ZERO_COPY_H
+#define ZERO_COPY_H 1
+
+#include "common.h"
+#include "userspace.h"
+#include "util.h"
+
+typedef struct _WNBD_ZERO_COPY_MAPPING
+{
+    LIST_ENTRY                  Link;
+    // Request handle.
+    UINT64                      Tag;
+    // Describes the SRB data buffer, the pages being locked by us so
+    // that they outlive the SRB if it gets completed early (e.g. aborted).
+    PMDL                        Mdl;
+    PVOID                       UserAddress;
+    // Referenced.
+    PEPROCESS                   Process;
+} WNBD_ZERO_COPY_MAPPING, *PWNBD_ZERO_COPY_MAPPING;
+
+// Maps large SRB data buffers directly into the owner process address
+// space, avoiding the payload copies (the "ZeroCopy" flag). Only
+// requests fetched synchronously by the owner process are mapped, the
+// requests retrieved through rings or pended fetch IRPs being copied.
+//
+// User mappings must be removed from the owner process context before
+// the process exits. This happens when the response is received or,
+// for requests that were aborted in the meantime, when the process
+// exits or the device is removed.
+typedef struct _WNBD_ZERO_COPY
+{
+    PSCSI_DEVICE_INFORMATION    DeviceInformation;
+    UINT32                      Threshold;
+
+    KSPIN_LOCK                  Lock;
+    // Protected by "Lock".
+    LIST_ENTRY                  MappingList;
+} WNBD_ZERO_COPY, *PWNBD_ZERO_COPY;
+
+// Requires the process notify routine, used for releasing the mappings.
+NTSTATUS
+WnbdZeroCopyCreate(_In_ PSCSI_DEVICE_INFORMATION DeviceInformation,
+                   _Inout_ PUINT32 Threshold,
+                   _Out_ PWNBD_ZERO_COPY* PZeroCopy);
+
+// Maps the request data buffer into the current process, returning the
+// user address. Returns NULL if the request doesn't qualify or can't be
+// mapped, in which case the payload gets copied.
+_IRQL_requires_(PASSIVE_LEVEL)
+PVOID
+WnbdZeroCopyMap(_In_ PWNBD_ZERO_COPY ZeroCopy,
+                _In_ PSRB_QUEUE_ELEMENT Element);
+
+// Removes the mapping used by the specified request. Must be called
+// before completing the SRB. Mappings that belong to other processes
+// are left in place.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdZeroCopyUnmap(_In_ PWNBD_ZERO_COPY ZeroCopy,
+                  _In_ UINT64 Tag);
+
+// Removes all the mappings, must be called in the context of the owner
+// process when it exits.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdZeroCopyRelease(_In_ PWNBD_ZERO_COPY ZeroCopy);
+
+// Must be called while holding the connection mutex, before the device
+// is removed from the connection list.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+WnbdZeroCopyDelete(_In_ PWNBD_ZERO_COPY ZeroCopy);
+
+#endif
@@ -9,6 +9,10 @@ extern "C" {
 
 #define WNBD_MIN_DISPATCHER_THREAD_COUNT 1
 #define WNBD_MAX_DISPATCHER_THREAD_COUNT 255
+// Number of requests retrieved at once by each dispatcher thread.
+#define WNBD_DISPATCHER_BATCH_SIZE 8
+// Maximum number of outstanding fetches used by the asynchronous dispatcher.
+#define WNBD_MAX_ASYNC_FETCH_COUNT 128
 #define WNBD_LOG_MESSAGE_MAX_SIZE 4096
 
 typedef enum
@@ -57,6 +61,10 @@ typedef struct _WNBD_DEVICE
     HANDLE* DispatcherThreads;
     UINT32 DispatcherThreadsCount;
     WNBD_USR_STATS Stats;
+    // Set when using the shared memory rings.
+    struct _WNBD_RING_CONTEXT* Ring;
+    // Set when using the asynchronous dispatcher.
+    struct _WNBD_ASYNC_DISPATCHER* AsyncDispatcher;
 } WNBD_DEVICE, *PWNBD_DEVICE;
 
 typedef VOID (*ReadFunc)(
@@ -114,6 +122,10 @@ DWORD WnbdCreate(
 // the driver IO requests are completed unless the "HardRemove" flag is set.
 DWORD WnbdRemove(PWNBD_DEVICE Device, BOOLEAN HardRemove);
 DWORD WnbdRemoveEx(const char* InstanceName, BOOLEAN HardRemove);
+// Start removing the disk without waiting for it to be drained, allowing
+// multiple disks to be removed in parallel. WnbdList may be used to
+// check the removal progress.
+DWORD WnbdRemoveAsync(const char* InstanceName, BOOLEAN HardRemove);
 // Cleanup the PWNBD_DEVICE structure. This should be called after stopping
 // the IO dispatchers.
 VOID WnbdClose(PWNBD_DEVICE Device);
@@ -122,6 +134,22 @@ DWORD WnbdList(
     PWNBD_CONNECTION_LIST ConnectionList,
     // Connection list buffer size.
     PDWORD BufferSize);
+// Retrieves a page of connections, see WNBD_IOCTL_LIST_PAGED_COMMAND.
+// The buffer must fit at least one record. "Cursor" must be 0 for the
+// first page, "Page->NextCursor" being used for the subsequent ones.
+DWORD WnbdListPaged(
+    PWNBD_LIST_PAGED_FLAGS Flags,
+    UINT64 Cursor,
+    UINT64 ChangedSince,
+    PWNBD_CONNECTION_PAGE Page,
+    DWORD BufferSize);
+// Waits for the connection change sequence number to differ from
+// "Sequence", returning the current one. Returns immediately if
+// "TimeoutMs" is 0.
+DWORD WnbdWaitChange(
+    UINT64 Sequence,
+    UINT32 TimeoutMs,
+    PUINT64 CurrentSequence);
 // Userspace counters
 DWORD WnbdGetUserspaceStats(
     PWNBD_DEVICE Device,
@@ -130,15 +158,42 @@ DWORD WnbdGetUserspaceStats(
 DWORD WnbdGetDriverStats(
     const char* InstanceName,
     PWNBD_DRV_STATS Stats);
+// Per operation counters and latency histograms
+DWORD WnbdGetDriverIoStats(
+    const char* InstanceName,
+    PWNBD_IO_STATS Stats);
 DWORD WnbdGetConnectionInfo(
     PWNBD_DEVICE Device,
     PWNBD_CONNECTION_INFO ConnectionInfo);
 
+// Changed block tracking, requires the "ChangeTracking" flag. Taking a
+// snapshot resets the tracked blocks, the snapshot bitmap being available
+// until the next snapshot.
+DWORD WnbdCbtSnapshot(
+    const char* InstanceName,
+    PWNBD_CBT_SNAPSHOT_INFO SnapshotInfo);
+// Retrieves a snapshot bitmap chunk, its size depending on the provided
+// buffer size. "StartBlock" must be a multiple of 8.
+DWORD WnbdCbtFetch(
+    const char* InstanceName,
+    UINT64 SnapshotId,
+    UINT64 StartBlock,
+    PWNBD_CBT_BITMAP Bitmap,
+    DWORD BitmapBufferSize);
+
+// Updates the device IO limits at runtime. Zeroed limits disable
+// throttling.
+DWORD WnbdSetQos(
+    const char* InstanceName,
+    PWNBD_QOS_LIMITS Limits);
+
 DWORD WnbdRaiseLogLevel(USHORT LogLevel);
 
 // Get libwnbd version.
 DWORD WnbdGetLibVersion(PWNBD_VERSION Version);
 DWORD WnbdGetDriverVersion(PWNBD_VERSION Version);
+// Adapter wide stats, such as the staging buffer pool usage.
+DWORD WnbdGetAdapterStats(PWNBD_ADAPTER_STATS Stats);
 
 // Setting the SCSI SENSE data provides detailed information about
 // the status of a request.
@@ -150,6 +205,24 @@ void WnbdSetSenseEx(
 void WnbdSetSense(PWNBD_STATUS Status, UINT8 SenseKey, UINT8 Asc);
 
 DWORD WnbdStartDispatcher(PWNBD_DEVICE Device, DWORD ThreadCount);
+// Uses the shared memory rings instead of the IOCTL based interface,
+// see WNBD_RING_HEADER. The ring has "EntryCount" entries (power of 2,
+// up to WNBD_RING_MAX_ENTRIES), each with a data slot as large as the
+// maximum transfer length. WnbdWaitDispatcher may be used as well.
+DWORD WnbdStartRingDispatcher(
+    PWNBD_DEVICE Device,
+    DWORD ThreadCount,
+    UINT32 EntryCount);
+// Uses asynchronous fetches, keeping "FetchCount" (up to
+// WNBD_MAX_ASYNC_FETCH_COUNT) fetch requests outstanding. The requests are
+// handled by "ThreadCount" threads using a completion port instead of
+// having each thread blocked in the driver. Each outstanding fetch has a
+// request slot as large as the maximum transfer length.
+// WnbdWaitDispatcher may be used as well.
+DWORD WnbdStartAsyncDispatcher(
+    PWNBD_DEVICE Device,
+    DWORD ThreadCount,
+    DWORD FetchCount);
 DWORD WnbdWaitDispatcher(PWNBD_DEVICE Device);
 // Must be called after an IO request completes, notifying the driver about
 // the result. Storport will timeout requests that don't complete in a timely
@@ -168,19 +241,86 @@ DWORD WnbdIoctlCreate(
     PWNBD_PROPERTIES Properties,
     // The resulting connecting info.
     PWNBD_CONNECTION_INFO ConnectionInfo);
+// Required by disks that use extended properties (e.g. overlays, mirrors).
+DWORD WnbdIoctlCreateEx(
+    HANDLE Device,
+    PWNBD_PROPERTIES Properties,
+    PWNBD_EXTENDED_PROPERTIES ExtendedProperties,
+    PWNBD_CONNECTION_INFO ConnectionInfo);
 DWORD WnbdIoctlRemove(HANDLE Device, const char* InstanceName, BOOLEAN HardRemove);
+DWORD WnbdIoctlRemoveEx(
+    HANDLE Device,
+    const char* InstanceName,
+    PWNBD_REMOVE_COMMAND_FLAGS Flags);
 DWORD WnbdIoctlList(
     HANDLE Device,
     PWNBD_CONNECTION_LIST ConnectionList,
     // Connection list buffer size.
     PDWORD BufferSize);
+DWORD WnbdIoctlListPaged(
+    HANDLE Device,
+    PWNBD_LIST_PAGED_FLAGS Flags,
+    UINT64 Cursor,
+    UINT64 ChangedSince,
+    PWNBD_CONNECTION_PAGE Page,
+    // Page buffer size.
+    DWORD BufferSize);
+DWORD WnbdIoctlWaitChange(
+    HANDLE Device,
+    UINT64 Sequence,
+    UINT32 TimeoutMs,
+    PUINT64 CurrentSequence);
 DWORD WnbdIoctlStats(
     HANDLE Device,
     const char* InstanceName,
     PWNBD_DRV_STATS Stats);
+// Retrieves WNBD_IO_STATS_VERSION stats, or the latest version supported
+// by the driver if it's older.
+DWORD WnbdIoctlIoStats(
+    HANDLE Device,
+    const char* InstanceName,
+    PWNBD_IO_STATS Stats);
 // Reload the persistent settings provided through registry keys.
 DWORD WnbdIoctlReloadConfig(HANDLE Device);
 DWORD WnbdIoctlVersion(HANDLE Device, PWNBD_VERSION Version);
+DWORD WnbdIoctlAdapterStats(HANDLE Device, PWNBD_ADAPTER_STATS Stats);
+// Enables or disables the request lifecycle trace.
+DWORD WnbdIoctlTraceControl(
+    HANDLE Device,
+    BOOLEAN Enable,
+    UINT32 RecordsPerCpu);
+// Retrieves and removes trace records, as many as fit in the buffer.
+DWORD WnbdIoctlTraceRead(
+    HANDLE Device,
+    PWNBD_TRACE_BUFFER Buffer,
+    DWORD BufferSize);
+// Sets the binary per IO event log level, using the "DebugLogLevel"
+// convention (0 disables the event log).
+DWORD WnbdIoctlEventLogControl(
+    HANDLE Device,
+    UINT32 LogLevel,
+    UINT32 RecordsPerCpu);
+// Retrieves and removes event log records, as many as fit in the buffer.
+// The records are decoded using wnbd_log_events.h.
+DWORD WnbdIoctlEventLogRead(
+    HANDLE Device,
+    PWNBD_EVENT_LOG_BUFFER Buffer,
+    DWORD BufferSize);
+DWORD WnbdIoctlCbtSnapshot(
+    HANDLE Device,
+    const char* InstanceName,
+    PWNBD_CBT_SNAPSHOT_INFO SnapshotInfo);
+DWORD WnbdIoctlCbtFetch(
+    HANDLE Device,
+    const char* InstanceName,
+    UINT64 SnapshotId,
+    UINT64 StartBlock,
+    PWNBD_CBT_BITMAP Bitmap,
+    DWORD BitmapBufferSize);
+DWORD WnbdIoctlSetQos(
+    HANDLE Device,
+    const char* InstanceName,
+    PWNBD_QOS_LIMITS Limits);
 
 // The connection id should be handled carefully in order to avoid delayed replies
 // from being submitted to other disks after being remapped.
@@ -190,12 +330,69 @@ DWORD WnbdIoctlFetchRequest(
     PWNBD_IO_REQUEST Request,
     PVOID DataBuffer,
     UINT32 DataBufferSize);
+// Retrieves up to "*RequestCount" requests (at most WNBD_MAX_FETCH_BATCH),
+// waiting until at least one is available. The data buffer is split into
+// slots of "SlotSize" bytes, Requests[i] using the slot at i * SlotSize.
+// "RequestCount" receives the number of returned requests.
+DWORD WnbdIoctlFetchRequests(
+    HANDLE Device,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IO_REQUEST Requests,
+    PUINT32 RequestCount,
+    PVOID DataBuffer,
+    UINT32 SlotSize);
 DWORD WnbdIoctlSendResponse(
     HANDLE Device,
     WNBD_CONNECTION_ID ConnectionId,
     PWNBD_IO_RESPONSE Response,
     PVOID DataBuffer,
     UINT32 DataBufferSize);
+// Sends up to WNBD_MAX_FETCH_BATCH responses and then fetches the next
+// requests (see WnbdIoctlFetchRequests) using a single call. If
+// "*RequestCount" is 0, the responses are sent without waiting for
+// requests. "FailedResponseCount" receives the number of responses
+// rejected by the driver. "BufferId" optionally specifies the registered
+// buffer containing "DataBuffer", see WnbdIoctlRegisterBuffer.
+DWORD WnbdIoctlSendResponsesFetchRequests(
+    HANDLE Device,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IO_RESPONSE_ENTRY Responses,
+    UINT32 ResponseCount,
+    PUINT32 FailedResponseCount,
+    PWNBD_IO_REQUEST Requests,
+    PUINT32 RequestCount,
+    PVOID DataBuffer,
+    UINT32 SlotSize,
+    UINT32 BufferId);
+// Overlapped version of WnbdIoctlSendResponsesFetchRequests, using an
+// asynchronous fetch (WNBD_FETCH_FLAG_ASYNC). The caller prepares the
+// command, which must remain valid until the operation completes. The
+// "Device" handle must be opened using FILE_FLAG_OVERLAPPED. Returns
+// ERROR_IO_PENDING if the request was pended.
+DWORD WnbdIoctlSendResponsesFetchRequestsAsync(
+    HANDLE Device,
+    PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND Command,
+    LPOVERLAPPED Overlapped);
+// Sets up the shared memory rings of a device. On success, "RingInfo"
+// receives the region mapped in the address space of the calling process.
+DWORD WnbdIoctlRingSetup(
+    HANDLE Device,
+    WNBD_CONNECTION_ID ConnectionId,
+    UINT32 EntryCount,
+    UINT32 SlotSize,
+    // Auto-reset events, see WNBD_IOCTL_RING_SETUP_COMMAND.
+    HANDLE RequestEvent,
+    HANDLE ResponseEvent,
+    PWNBD_RING_INFO RingInfo);
+// Registers a buffer that remains locked by the driver until the disk
+// is removed or the calling process exits. Requests and responses may
+// then reference it by "BufferId", avoiding per call locking.
+DWORD WnbdIoctlRegisterBuffer(
+    HANDLE Device,
+    WNBD_CONNECTION_ID ConnectionId,
+    PVOID Buffer,
+    UINT32 BufferSize,
+    PUINT32 BufferId);
 
 HRESULT WnbdCoInitializeBasic();
 // Requires COM. For convenience, WnbdCoInitializeBasic may be used.
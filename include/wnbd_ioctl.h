@@ -12,6 +12,22 @@
 #define IOCTL_WNBD_STATS 7
 #define IOCTL_WNBD_RELOAD_CONFIG 8
 #define IOCTL_WNBD_VERSION 9
+#define IOCTL_WNBD_CBT_SNAPSHOT 10
+#define IOCTL_WNBD_CBT_FETCH 11
+#define IOCTL_WNBD_SET_QOS 12
+#define IOCTL_WNBD_FETCH_REQ_BATCH 13
+#define IOCTL_WNBD_SEND_RSP_FETCH_REQ 14
+#define IOCTL_WNBD_RING_SETUP 15
+#define IOCTL_WNBD_REGISTER_BUFFER 16
+#define IOCTL_WNBD_ADAPTER_STATS 17
+#define IOCTL_WNBD_LIST_PAGED 18
+#define IOCTL_WNBD_WAIT_CHANGE 19
+#define IOCTL_WNBD_IO_STATS 20
+#define IOCTL_WNBD_TRACE_CONTROL 21
+#define IOCTL_WNBD_TRACE_READ 22
+#define IOCTL_WNBD_EVENT_LOG_CONTROL 23
+#define IOCTL_WNBD_EVENT_LOG_READ 24
+#define IOCTL_WNBD_CREATE_EX 25
 
 static const GUID WNBD_GUID = {
     0x949dd17c,
@@ -23,12 +39,25 @@ static const GUID WNBD_GUID = {
 #define WNBD_MAX_NAME_LENGTH 256
 #define WNBD_MAX_OWNER_LENGTH 16
 #define WNBD_MAX_VERSION_STR_LENGTH 128
+#define WNBD_MAX_PATH_LENGTH 260
 // For transfers larger than 16MB, Storport sends 0 sized buffers.
 #define WNBD_DEFAULT_MAX_TRANSFER_LENGTH 2 * 1024 * 1024
 
 // Only used for NBD connections, in which case the block size is optional.
 #define WNBD_DEFAULT_BLOCK_SIZE 512
 
+// The UNMAP parameter list length is a 16 bit field, each block
+// descriptor taking 16 bytes.
+#define WNBD_MAX_UNMAP_DESC_COUNT 4095
+
+// Disk scheduler weights, see WNBD_PROPERTIES.SchedulerWeight.
+#define WNBD_DEFAULT_SCHEDULER_WEIGHT 100
+#define WNBD_MAX_SCHEDULER_WEIGHT 10000
+
+// Minimum request size mapped in zero-copy mode, see
+// WNBD_PROPERTIES.ZeroCopyThreshold.
+#define WNBD_DEFAULT_ZERO_COPY_THRESHOLD 128 * 1024
+
 typedef enum
 {
     WnbdReqTypeUnknown = 0,
@@ -39,6 +68,17 @@ typedef enum
     WnbdReqTypeDisconnect = 5
 } WnbdRequestType;
 
+// Queue depth controller state, see WNBD_DRV_STATS.QueueDepthState.
+typedef enum
+{
+    WnbdQueueDepthFixed = 0,
+    WnbdQueueDepthSlowStart = 1,
+    WnbdQueueDepthIncrease = 2,
+    // The queue depth isn't the limiting factor.
+    WnbdQueueDepthHold = 3,
+    WnbdQueueDepthBackoff = 4
+} WnbdQueueDepthState;
+
 typedef UINT64 WNBD_CONNECTION_ID;
 typedef WNBD_CONNECTION_ID *PWNBD_CONNECTION_ID;
 
@@ -85,9 +125,66 @@ typedef struct
     // be submitted through the IOCTL_WNBD_FETCH_REQ/IOCTL_WNBD_SEND_RSP
     // DeviceIoControl commands.
     UINT32 UseNbd:1;
-    UINT32 Reserved: 26;
+    // Mirror IO across two NBD exports (RAID-1). Requires "UseNbd" and
+    // IOCTL_WNBD_CREATE_EX, the second export being described by
+    // WNBD_EXTENDED_PROPERTIES.MirrorProperties.
+    UINT32 UseMirror:1;
+    // Track the blocks changed by write and unmap requests, allowing
+    // incremental backups. See IOCTL_WNBD_CBT_SNAPSHOT.
+    UINT32 ChangeTracking:1;
+    // Redirect writes to a local overlay file, leaving the NBD export
+    // untouched. Requires "UseNbd" and IOCTL_WNBD_CREATE_EX, see
+    // WNBD_EXTENDED_PROPERTIES.OverlayPath.
+    UINT32 UseOverlay:1;
+    // Remove the overlay file when the disk is unmapped.
+    UINT32 DiscardOverlay:1;
+    // Adjust the number of in-flight NBD requests based on the observed
+    // latency. Requires "UseNbd". See WNBD_PROPERTIES.MaxQueueDepth.
+    UINT32 AdaptiveQueueDepth:1;
+    // Map large read and write buffers directly into the userspace
+    // process instead of copying the payload, see
+    // WNBD_IO_REQUEST.DataAddress. Can't be used along with "UseNbd".
+    UINT32 ZeroCopy:1;
+    UINT32 Reserved: 20;
 } WNBD_FLAGS, *PWNBD_FLAGS;
 
+typedef struct
+{
+    // Sustained rate per second, 0 meaning unlimited.
+    UINT64 Rate;
+    // Bucket size, allowing short bursts above the sustained rate.
+    // Defaults to one second worth of tokens.
+    UINT64 Burst;
+} WNBD_QOS_BUCKET, *PWNBD_QOS_BUCKET;
+
+// Per device IO limits, applied before the requests are submitted to
+// the NBD server or fetched by the userspace process. Unmap requests
+// count as write operations, flush requests aren't throttled.
+typedef struct
+{
+    WNBD_QOS_BUCKET ReadIops;
+    WNBD_QOS_BUCKET WriteIops;
+    WNBD_QOS_BUCKET ReadBytes;
+    WNBD_QOS_BUCKET WriteBytes;
+    UINT64 Reserved[4];
+} WNBD_QOS_LIMITS, *PWNBD_QOS_LIMITS;
+
+typedef struct
+{
+    // NBD server details of the second mirror leg.
+    NBD_CONNECTION_PROPERTIES NbdProperties;
+    // Number of legs that must acknowledge a write before it gets
+    // completed. Defaults to 2 (both legs). Writes are still sent to
+    // all the available legs.
+    UINT32 WriteQuorum;
+    // Size in bytes of a dirty region log entry. Must be a power of
+    // two, multiple of the block size. Defaults to 1MB.
+    UINT32 DirtyRegionSize;
+    // Maximum resync throughput in bytes per second. 0 means unlimited.
+    UINT64 ResyncBandwidth;
+    UINT64 Reserved[4];
+} WNBD_MIRROR_PROPERTIES, *PWNBD_MIRROR_PROPERTIES;
+
 typedef struct
 {
     // Unique disk identifier
@@ -101,7 +198,8 @@ typedef struct
     WNBD_FLAGS Flags;
     UINT64 BlockCount;
     UINT32 BlockSize;
-    // Optional, defaults to 1.
+    // Optional, defaults to 1. Capped at WNBD_MAX_UNMAP_DESC_COUNT.
+    // NBD connections always use one descriptor per request.
     UINT32 MaxUnmapDescCount;
     // The userspace process associated with this device. If not
     // specified, the caller PID will be used.
@@ -109,13 +207,56 @@ typedef struct
     // NBD server details must be provided when the "UseNbd" flag
     // is set.
     NBD_CONNECTION_PROPERTIES NbdProperties;
-    UINT64 Reserved[32];
+    // Changed block tracking granularity in bytes, only used when the
+    // "ChangeTracking" flag is set. Must be a power of two, larger than
+    // the block size. Defaults to 64KB, may be increased for large disks.
+    UINT32 ChangeTrackingBlockSize;
+    // Submitted requests that don't get a reply within this interval
+    // are retried (reads only) or failed. 0 disables request timeouts,
+    // leaving it up to Storport.
+    UINT32 RequestTimeoutMs;
+    // Number of times a timed out read gets resubmitted before failing.
+    // Mirrored disks will use the other leg, if available.
+    UINT32 MaxRequestRetries;
+    // Maximum number of in-flight NBD requests, capped to (and defaulting
+    // to) the Storport limit. Unless "AdaptiveQueueDepth" is set, this is
+    // used as a fixed limit.
+    UINT32 MaxQueueDepth;
+    // IO limits, may be changed at runtime using IOCTL_WNBD_SET_QOS.
+    WNBD_QOS_LIMITS QosLimits;
+    // Relative share of the adapter queue depth, used when multiple
+    // disks are attached. Defaults to WNBD_DEFAULT_SCHEDULER_WEIGHT.
+    UINT32 SchedulerWeight;
+    // Requests of at least this size (in bytes) are mapped when the
+    // "ZeroCopy" flag is set. Defaults to WNBD_DEFAULT_ZERO_COPY_THRESHOLD.
+    UINT32 ZeroCopyThreshold;
+    UINT64 Reserved[17];
 } WNBD_PROPERTIES, *PWNBD_PROPERTIES;
+// Used by IOCTL_WNBD_CREATE and IOCTL_WNBD_LIST, new fields must be carved
+// out of the reserved space or added to WNBD_EXTENDED_PROPERTIES.
+C_ASSERT(sizeof(WNBD_PROPERTIES) == 1368);
+
+// Properties that don't fit in WNBD_PROPERTIES, passed through
+// IOCTL_WNBD_CREATE_EX.
+typedef struct
+{
+    // NT path of the overlay file (e.g. \??\C:\overlay.img), only used
+    // when the "UseOverlay" flag is set. The file is created as a sparse
+    // file, existing files being overwritten.
+    CHAR OverlayPath[WNBD_MAX_PATH_LENGTH];
+    UINT32 Reserved0;
+    // Only used when the "UseMirror" flag is set.
+    WNBD_MIRROR_PROPERTIES MirrorProperties;
+    UINT64 Reserved[53];
+} WNBD_EXTENDED_PROPERTIES, *PWNBD_EXTENDED_PROPERTIES;
 
 typedef struct
 {
     UINT32 Disconnecting:1;
-    UINT32 Reserved:31;
+    // Only used by IOCTL_WNBD_LIST_PAGED, for connections removed after
+    // the requested sequence number.
+    UINT32 Removed:1;
+    UINT32 Reserved:30;
 } WNBD_CONNECTION_INFO_FLAGS, PWNBD_CONNECTION_INFO_FLAGS;
 
 typedef struct
@@ -125,9 +266,15 @@ typedef struct
     USHORT BusNumber;
     USHORT TargetId;
     USHORT Lun;
+    // Disks exposed through the same target, including this one.
+    USHORT TargetLunCount;
     WNBD_CONNECTION_ID ConnectionId;
-    UINT64 Reserved[16];
+    // Change sequence number of the last update (e.g. creation or
+    // removal), see IOCTL_WNBD_WAIT_CHANGE.
+    UINT64 ChangeSequence;
+    UINT64 Reserved[15];
 } WNBD_CONNECTION_INFO, *PWNBD_CONNECTION_INFO;
+C_ASSERT(sizeof(WNBD_CONNECTION_INFO) == 1520);
 
 typedef struct
 {
@@ -136,6 +283,54 @@ typedef struct
     WNBD_CONNECTION_INFO Connections[1];
 } WNBD_CONNECTION_LIST, *PWNBD_CONNECTION_LIST;
 
+// Compact connection record, returned by IOCTL_WNBD_LIST_PAGED when
+// the "Summary" flag is set. Removed connections only have the instance
+// name, connection id and change sequence number set.
+typedef struct
+{
+    CHAR InstanceName[WNBD_MAX_NAME_LENGTH];
+    CHAR SerialNumber[WNBD_MAX_NAME_LENGTH];
+    CHAR Owner[WNBD_MAX_OWNER_LENGTH];
+    WNBD_FLAGS Flags;
+    INT Pid;
+    UINT64 BlockCount;
+    UINT32 BlockSize;
+    PWNBD_CONNECTION_INFO_FLAGS ConnectionFlags;
+    USHORT BusNumber;
+    USHORT TargetId;
+    USHORT Lun;
+    USHORT TargetLunCount;
+    WNBD_CONNECTION_ID ConnectionId;
+    UINT64 ChangeSequence;
+    UINT64 Reserved[4];
+} WNBD_CONNECTION_SUMMARY, *PWNBD_CONNECTION_SUMMARY;
+
+// Output of IOCTL_WNBD_LIST_PAGED. The number of records depends on
+// the output buffer size, which must fit at least one record.
+typedef struct
+{
+    // Change sequence number at the time of the listing.
+    UINT64 Sequence;
+    // Passed to the next IOCTL_WNBD_LIST_PAGED call, 0 once all the
+    // connections were listed.
+    UINT64 NextCursor;
+    UINT32 ElementSize;
+    UINT32 Count;
+    // Set when the removal history doesn't go back to the requested
+    // sequence number, in which case a full listing is needed.
+    UINT32 HistoryTruncated:1;
+    UINT32 ReservedFlags:31;
+    UINT32 Reserved0;
+    UINT64 Reserved[2];
+    // WNBD_CONNECTION_SUMMARY or WNBD_CONNECTION_INFO records.
+    BYTE Connections[1];
+} WNBD_CONNECTION_PAGE, *PWNBD_CONNECTION_PAGE;
+
+#define WNBD_CONNECTION_PAGE_SIZE(ElementSize, Count) \
+    (FIELD_OFFSET(WNBD_CONNECTION_PAGE, Connections) + (ElementSize) * (Count))
+#define WNBD_CONNECTION_PAGE_ENTRY(Page, Index) \
+    ((PVOID)&(Page)->Connections[(SIZE_T)(Page)->ElementSize * (Index)])
+
 typedef struct
 {
     INT64 TotalReceivedIORequests;
@@ -146,8 +341,119 @@ typedef struct
     INT64 AbortedSubmittedIORequests;
     INT64 AbortedUnsubmittedIORequests;
     INT64 CompletedAbortedIORequests;
-    INT64 Reserved[16];
+    // Mirror counters, only used when the "UseMirror" flag is set.
+    INT64 MirrorDegradedWrites;
+    INT64 MirrorDirtyRegions;
+    INT64 MirrorResyncedBytes;
+    INT64 MirrorLegFailures;
+    // Overlay counters, only used when the "UseOverlay" flag is set.
+    INT64 OverlayCompletedIORequests;
+    INT64 OverlayWrittenBytes;
+    // Requests that missed their deadline and the resubmitted reads.
+    INT64 TimedOutIORequests;
+    INT64 RetriedIORequests;
+    // Queue depth controller, only used when the "AdaptiveQueueDepth"
+    // flag or "MaxQueueDepth" are set.
+    INT64 QueueDepth;
+    INT64 QueueDepthState;
+    INT64 QueueBaseLatencyUs;
+    INT64 QueueAverageLatencyUs;
+    INT64 QueueDeviceBusyEvents;
+    // Requests delayed by the QoS limits and the total time (in
+    // microseconds) spent waiting for tokens.
+    INT64 QosThrottledIORequests;
+    INT64 QosThrottledTimeUs;
+    INT64 Reserved[1];
 } WNBD_DRV_STATS, *PWNBD_DRV_STATS;
+// IOCTL_WNBD_STATS relies on a fixed size, new counters must be added to
+// WNBD_DRV_EXTENDED_STATS instead.
+C_ASSERT(sizeof(WNBD_DRV_STATS) == 24 * sizeof(INT64));
+
+// Device counters that don't fit in WNBD_DRV_STATS, retrieved through
+// IOCTL_WNBD_IO_STATS.
+typedef struct
+{
+    // The Storport queue depth allotted to this disk based on its
+    // weight and the total time (in microseconds) that submitted
+    // requests have spent queued by the driver.
+    INT64 SchedulerWeight;
+    INT64 SchedulerQueueDepth;
+    INT64 QueueWaitTimeUs;
+    // Flushes, FUA and small requests served through the priority queue.
+    INT64 PriorityIORequests;
+    // Asynchronous fetch IRPs that had to be pended.
+    INT64 PendedFetchRequests;
+    // Payload bytes copied between the SRBs and the userspace buffers
+    // and the bytes passed through zero-copy mappings instead.
+    INT64 CopiedBytes;
+    INT64 ZeroCopyBytes;
+} WNBD_DRV_EXTENDED_STATS, *PWNBD_DRV_EXTENDED_STATS;
+
+// Operations tracked by WNBD_IO_STATS.
+typedef enum
+{
+    WnbdIoOpRead = 0,
+    WnbdIoOpWrite = 1,
+    WnbdIoOpFlush = 2,
+    WnbdIoOpUnmap = 3,
+    WnbdIoOpCount = 4
+} WnbdIoOp;
+
+// Request latencies tracked by WNBD_IO_STATS.
+typedef enum
+{
+    // From the moment the driver receives the request until it gets
+    // completed.
+    WnbdLatencyTotal = 0,
+    // Time spent in the driver queues before being submitted to the
+    // NBD server or retrieved by the userspace process.
+    WnbdLatencyQueueWait = 1,
+    // From submission until the reply is received.
+    WnbdLatencyWire = 2,
+    WnbdLatencyTypeCount = 3
+} WnbdLatencyType;
+
+// Log-linear latency histograms, using microseconds. Values lower than
+// WNBD_LATENCY_SUB_BUCKETS get their own bucket, each subsequent power
+// of two being split in WNBD_LATENCY_SUB_BUCKETS buckets. The last
+// bucket also holds the values above 2^(WNBD_LATENCY_MAX_EXPONENT + 1).
+#define WNBD_LATENCY_SUB_BUCKET_BITS 2
+#define WNBD_LATENCY_SUB_BUCKETS (1 << WNBD_LATENCY_SUB_BUCKET_BITS)
+#define WNBD_LATENCY_MAX_EXPONENT 27
+#define WNBD_LATENCY_BUCKET_COUNT \
+    ((WNBD_LATENCY_MAX_EXPONENT - WNBD_LATENCY_SUB_BUCKET_BITS + 2) * \
+     WNBD_LATENCY_SUB_BUCKETS)
+// The lowest value (in microseconds) covered by a given bucket.
+#define WNBD_LATENCY_BUCKET_LOWER_US(Index) \
+    ((Index) < WNBD_LATENCY_SUB_BUCKETS ? (UINT64)(Index) : \
+     (UINT64)(WNBD_LATENCY_SUB_BUCKETS + (Index) % WNBD_LATENCY_SUB_BUCKETS) << \
+        ((Index) / WNBD_LATENCY_SUB_BUCKETS - 1))
+
+#define WNBD_IO_STATS_VERSION_1 1
+#define WNBD_IO_STATS_VERSION WNBD_IO_STATS_VERSION_1
+
+// Output of IOCTL_WNBD_IO_STATS. Future versions will only append fields.
+typedef struct
+{
+    // The returned version, which may be lower than the requested one.
+    UINT32 Version;
+    // The size of the returned structure.
+    UINT32 Size;
+    // Successfully completed requests and their payload size (or the
+    // unmapped bytes), indexed by WnbdIoOp. Requests that fail or get
+    // aborted are counted separately.
+    UINT64 Requests[WnbdIoOpCount];
+    UINT64 Bytes[WnbdIoOpCount];
+    UINT64 Errors[WnbdIoOpCount];
+    // Histograms and latency sums (in microseconds) of the completed
+    // requests, indexed by WnbdLatencyType. Requests that weren't
+    // submitted (e.g. served by the overlay) don't have queue wait and
+    // wire latency samples.
+    UINT64 LatencySumUs[WnbdLatencyTypeCount];
+    UINT64 Latency[WnbdLatencyTypeCount][WNBD_LATENCY_BUCKET_COUNT];
+    WNBD_DRV_EXTENDED_STATS DeviceStats;
+    UINT64 Reserved[1];
+} WNBD_IO_STATS, *PWNBD_IO_STATS;
 
 typedef struct
 {
@@ -189,7 +495,12 @@ typedef struct
             UINT32 Reserved:31;
         } Unmap;
     } Cmd;
-    UINT64 Reserved[4];
+    // Set for zero-copy read and write requests. The SRB data buffer is
+    // mapped at this address, to be used instead of the request data
+    // buffer. The mapping is removed when the response is sent, in
+    // which case the response data buffer is ignored.
+    UINT64 DataAddress;
+    UINT64 Reserved[3];
 } WNBD_IO_REQUEST, *PWNBD_IO_REQUEST;
 
 typedef struct
@@ -217,6 +528,9 @@ typedef PWNBD_IOCTL_BASE_COMMAND PWNBD_IOCTL_RELOAD_CONFIG_COMMAND;
 typedef WNBD_IOCTL_BASE_COMMAND WNBD_IOCTL_VERSION_COMMAND;
 typedef PWNBD_IOCTL_BASE_COMMAND PWNBD_IOCTL_VERSION_COMMAND;
 
+typedef WNBD_IOCTL_BASE_COMMAND WNBD_IOCTL_ADAPTER_STATS_COMMAND;
+typedef PWNBD_IOCTL_BASE_COMMAND PWNBD_IOCTL_ADAPTER_STATS_COMMAND;
+
 typedef struct
 {
     ULONG IoControlCode;
@@ -224,10 +538,69 @@ typedef struct
     UINT64 Reserved[4];
 } WNBD_IOCTL_CREATE_COMMAND, *PWNBD_IOCTL_CREATE_COMMAND;
 
+// Same as IOCTL_WNBD_CREATE, also accepting the extended properties.
 typedef struct
 {
-    UINT32 HardRemove:1;
+    ULONG IoControlCode;
+    WNBD_PROPERTIES Properties;
+    WNBD_EXTENDED_PROPERTIES ExtendedProperties;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_CREATE_EX_COMMAND, *PWNBD_IOCTL_CREATE_EX_COMMAND;
+
+typedef struct
+{
+    // Return WNBD_CONNECTION_SUMMARY records instead of
+    // WNBD_CONNECTION_INFO.
+    UINT32 Summary:1;
     UINT32 Reserved:31;
+} WNBD_LIST_PAGED_FLAGS, *PWNBD_LIST_PAGED_FLAGS;
+
+// Connections are listed in creation order, followed by the removed ones
+// when "ChangedSince" is set. Unlike IOCTL_WNBD_LIST, connections that
+// are still being created aren't listed.
+//
+// Monitoring agents are expected to perform a full listing, followed by
+// IOCTL_WNBD_WAIT_CHANGE calls using the returned sequence number. Once
+// the sequence number changes, listing the connections changed since the
+// previous sequence number retrieves the created, disconnecting and
+// removed connections.
+typedef struct
+{
+    ULONG IoControlCode;
+    WNBD_LIST_PAGED_FLAGS Flags;
+    // 0 for the first page, "NextCursor" for the subsequent ones.
+    UINT64 Cursor;
+    // Only return the connections changed after this sequence number,
+    // including the removed ones. 0 returns all the connections.
+    UINT64 ChangedSince;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_LIST_PAGED_COMMAND, *PWNBD_IOCTL_LIST_PAGED_COMMAND;
+
+#define WNBD_WAIT_INFINITE 0xFFFFFFFF
+
+// Returns the current change sequence number (UINT64) as soon as it
+// differs from "Sequence" or when the timeout expires. The sequence
+// number changes when connections are created, start disconnecting or
+// get removed.
+typedef struct
+{
+    ULONG IoControlCode;
+    UINT64 Sequence;
+    // 0 returns immediately. WNBD_WAIT_INFINITE waits until a change
+    // occurs or the calling thread exits.
+    UINT32 TimeoutMs;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_WAIT_CHANGE_COMMAND, *PWNBD_IOCTL_WAIT_CHANGE_COMMAND;
+
+typedef struct
+{
+    UINT32 HardRemove:1;
+    // Return as soon as the device stops accepting IO, without waiting
+    // for it to be drained. Connections that are being removed have the
+    // "Disconnecting" flag set until the removal completes, after which
+    // they're no longer listed.
+    UINT32 Async:1;
+    UINT32 Reserved:30;
 } WNBD_REMOVE_COMMAND_FLAGS, *PWNBD_REMOVE_COMMAND_FLAGS;
 
 typedef struct
@@ -253,9 +626,51 @@ typedef struct
     WNBD_CONNECTION_ID ConnectionId;
     PVOID DataBuffer;
     UINT32 DataBufferSize;
+    // Optional, the registered buffer containing "DataBuffer".
+    UINT32 BufferId;
     UINT64 Reserved[4];
 } WNBD_IOCTL_FETCH_REQ_COMMAND, *PWNBD_IOCTL_FETCH_REQ_COMMAND;
 
+// Maximum number of requests returned by IOCTL_WNBD_FETCH_REQ_BATCH.
+#define WNBD_MAX_FETCH_BATCH 64
+
+// Fetch flags.
+//
+// Instead of blocking the calling thread until a request arrives, the
+// driver pends the IRP, completing it asynchronously once requests become
+// available. The device handle must be opened using FILE_FLAG_OVERLAPPED
+// and an OVERLAPPED structure must be passed, allowing multiple fetches
+// to be outstanding. Requires a registered buffer, the IRP being
+// completed from an arbitrary thread context. Pending IRPs may be
+// cancelled using CancelIoEx.
+#define WNBD_FETCH_FLAG_ASYNC 1
+
+// Variable size structure, used both as input and output buffer.
+typedef struct
+{
+    ULONG IoControlCode;
+    WNBD_CONNECTION_ID ConnectionId;
+    // Caller allocated buffer, split in "RequestCount" slots of "SlotSize"
+    // bytes. The payload of Requests[i] uses the slot at offset i * SlotSize.
+    // The slot size must be at least as large as the maximum transfer length.
+    PVOID DataBuffer;
+    UINT32 SlotSize;
+    // In: the number of request slots, up to WNBD_MAX_FETCH_BATCH.
+    // Out: the number of returned requests. The driver waits until
+    // at least one request is available.
+    UINT32 RequestCount;
+    // Optional, the registered buffer containing "DataBuffer".
+    UINT32 BufferId;
+    // WNBD_FETCH_FLAG_* values.
+    UINT32 Flags;
+    UINT64 Reserved[4];
+    WNBD_IO_REQUEST Requests[1];
+} WNBD_IOCTL_FETCH_REQ_BATCH_COMMAND, *PWNBD_IOCTL_FETCH_REQ_BATCH_COMMAND;
+
+#define WNBD_FETCH_REQ_BATCH_COMMAND_SIZE(RequestCount) \
+    (FIELD_OFFSET(WNBD_IOCTL_FETCH_REQ_BATCH_COMMAND, Requests) + \
+     sizeof(WNBD_IO_REQUEST) * (RequestCount))
+
 typedef struct
 {
     ULONG IoControlCode;
@@ -263,9 +678,245 @@ typedef struct
     WNBD_CONNECTION_ID ConnectionId;
     PVOID DataBuffer;
     UINT32 DataBufferSize;
+    // Optional, the registered buffer containing "DataBuffer".
+    UINT32 BufferId;
     UINT64 Reserved[4];
 } WNBD_IOCTL_SEND_RSP_COMMAND, *PWNBD_IOCTL_SEND_RSP_COMMAND;
 
+typedef struct
+{
+    WNBD_IO_RESPONSE Response;
+    // Read payload, ignored for other request types.
+    PVOID DataBuffer;
+    UINT32 DataBufferSize;
+    // Optional, the registered buffer containing "DataBuffer".
+    UINT32 BufferId;
+} WNBD_IO_RESPONSE_ENTRY, *PWNBD_IO_RESPONSE_ENTRY;
+
+// Sends the specified responses and then fetches the next requests,
+// saving a kernel transition for each request. Variable size structure,
+// "ResponseCount" response entries being placed after the request array.
+typedef struct
+{
+    ULONG IoControlCode;
+    WNBD_CONNECTION_ID ConnectionId;
+    // Same as WNBD_IOCTL_FETCH_REQ_BATCH_COMMAND. If "RequestCount" is 0,
+    // the responses are sent without fetching any requests.
+    PVOID DataBuffer;
+    UINT32 SlotSize;
+    UINT32 RequestCount;
+    // Up to WNBD_MAX_FETCH_BATCH.
+    UINT32 ResponseCount;
+    // Out: the number of responses that couldn't be processed, for example
+    // because of unknown request handles.
+    UINT32 FailedResponseCount;
+    // Optional, the registered buffer containing "DataBuffer".
+    UINT32 BufferId;
+    // WNBD_FETCH_FLAG_* values, applying to the request fetching. The
+    // responses are always processed synchronously.
+    UINT32 Flags;
+    UINT64 Reserved[4];
+    WNBD_IO_REQUEST Requests[1];
+} WNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND, *PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND;
+
+#define WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(RequestCount, ResponseCount) \
+    (FIELD_OFFSET(WNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND, Requests) + \
+     sizeof(WNBD_IO_REQUEST) * (RequestCount) + \
+     sizeof(WNBD_IO_RESPONSE_ENTRY) * (ResponseCount))
+#define WNBD_SEND_RSP_FETCH_REQ_RESPONSES(Command) \
+    ((PWNBD_IO_RESPONSE_ENTRY)&(Command)->Requests[(Command)->RequestCount])
+
+typedef struct
+{
+    ULONG IoControlCode;
+    CHAR InstanceName[WNBD_MAX_NAME_LENGTH];
+    // The WNBD_IO_STATS version expected by the caller, usually
+    // WNBD_IO_STATS_VERSION.
+    UINT32 Version;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_IO_STATS_COMMAND, *PWNBD_IOCTL_IO_STATS_COMMAND;
+
+typedef struct
+{
+    ULONG IoControlCode;
+    CHAR InstanceName[WNBD_MAX_NAME_LENGTH];
+    UINT64 Reserved[4];
+} WNBD_IOCTL_CBT_SNAPSHOT_COMMAND, *PWNBD_IOCTL_CBT_SNAPSHOT_COMMAND;
+
+typedef struct
+{
+    // Used when fetching the snapshot bitmap.
+    UINT64 SnapshotId;
+    // Tracking granularity in bytes.
+    UINT32 BlockSize;
+    UINT32 Reserved0;
+    // Number of tracked blocks (bitmap size in bits).
+    UINT64 BlockCount;
+    // Blocks changed since the previous snapshot.
+    UINT64 ChangedBlockCount;
+    UINT64 Reserved[4];
+} WNBD_CBT_SNAPSHOT_INFO, *PWNBD_CBT_SNAPSHOT_INFO;
+
+typedef struct
+{
+    ULONG IoControlCode;
+    CHAR InstanceName[WNBD_MAX_NAME_LENGTH];
+    UINT64 SnapshotId;
+    // Must be a multiple of 8.
+    UINT64 StartBlock;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_CBT_FETCH_COMMAND, *PWNBD_IOCTL_CBT_FETCH_COMMAND;
+
+// Output of IOCTL_WNBD_CBT_FETCH. The bitmap size depends on the
+// output buffer size. Bit "n" of the bitmap corresponds to block
+// "StartBlock + n", a set bit meaning that the block has changed.
+typedef struct
+{
+    UINT64 SnapshotId;
+    UINT64 StartBlock;
+    // Number of valid bits.
+    UINT64 BlockCount;
+    UINT64 Reserved[2];
+    BYTE Bitmap[1];
+} WNBD_CBT_BITMAP, *PWNBD_CBT_BITMAP;
+
+typedef struct
+{
+    ULONG IoControlCode;
+    CHAR InstanceName[WNBD_MAX_NAME_LENGTH];
+    // Zeroed limits disable throttling.
+    WNBD_QOS_LIMITS Limits;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_SET_QOS_COMMAND, *PWNBD_IOCTL_SET_QOS_COMMAND;
+
+// Registered buffers are kept locked and mapped by the driver, avoiding
+// the cost of locking user buffers for every request. The buffers are
+// released when the device is removed or when the owner process exits.
+// Commands may refer to a registered buffer through its id, in which case
+// the data buffer must be part of the registered buffer.
+#define WNBD_MAX_REGISTERED_BUFFERS 256
+#define WNBD_MAX_REGISTERED_BUFFER_SIZE (64 * 1024 * 1024)
+
+typedef struct
+{
+    ULONG IoControlCode;
+    WNBD_CONNECTION_ID ConnectionId;
+    PVOID Buffer;
+    UINT32 BufferSize;
+    // Out: the buffer id, starting from 1. 0 means no registered buffer.
+    UINT32 BufferId;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_REGISTER_BUFFER_COMMAND, *PWNBD_IOCTL_REGISTER_BUFFER_COMMAND;
+
+// Shared memory rings, set up using IOCTL_WNBD_RING_SETUP.
+//
+// The driver maps a single region into the calling process, containing
+// a header, a request (submission) ring, a response (completion) ring
+// and "EntryCount" data slots of "SlotSize" bytes each:
+//
+// * the driver posts requests to the request ring, each request having
+//   its own data slot, which contains the write payload and receives the
+//   read payload
+// * userspace posts responses to the response ring. The data slot remains
+//   owned by userspace until the response is posted.
+//
+// Each ring has a single producer and a single consumer. The indices are
+// free running counters, the ring entry being "Index & (EntryCount - 1)".
+// The producer fills the entry before advancing "Tail" while the consumer
+// copies the entry before advancing "Head", using memory barriers.
+// Each side only updates its own index.
+//
+// Since there are as many data slots as ring entries, the rings can't
+// overflow.
+//
+// Events are only signaled when the consumer is idle: before waiting,
+// the consumer sets "ConsumerWaiting", issues a full barrier and checks
+// the ring once more. The producer signals the event after publishing
+// entries, only if "ConsumerWaiting" is set. Both events are auto-reset
+// events provided by userspace.
+//
+// The request handle encodes the data slot: the slot index is
+// "RequestHandle & (EntryCount - 1)". Responses using a stale or unknown
+// request handle are dropped.
+//
+// Once the device gets disconnected, the driver sets "Disconnected" and
+// signals the request event. There's no disconnect request in this case.
+// The region remains valid until it's unmapped by the process, even if the
+// device is removed in the meantime.
+#define WNBD_RING_MAX_ENTRIES 1024
+// Upper limit of the whole region size.
+#define WNBD_RING_MAX_SIZE (1024ULL * 1024 * 1024)
+// Ring request handles always have this bit set.
+#define WNBD_RING_HANDLE_FLAG (1ULL << 63)
+
+typedef struct
+{
+    volatile UINT32 Head;
+    volatile UINT32 Tail;
+    volatile UINT32 ConsumerWaiting;
+    // Avoids sharing cache lines between the rings.
+    UINT32 Reserved[13];
+} WNBD_RING_INDICES, *PWNBD_RING_INDICES;
+
+typedef struct
+{
+    UINT32 EntryCount;
+    UINT32 SlotSize;
+    // Offsets relative to the beginning of the region.
+    UINT32 RequestRingOffset;
+    UINT32 ResponseRingOffset;
+    // Page aligned.
+    UINT64 DataOffset;
+    volatile UINT32 Disconnected;
+    UINT32 Reserved[9];
+    // Driver -> userspace.
+    WNBD_RING_INDICES Requests;
+    // Userspace -> driver.
+    WNBD_RING_INDICES Responses;
+} WNBD_RING_HEADER, *PWNBD_RING_HEADER;
+
+typedef struct
+{
+    WNBD_IO_REQUEST Request;
+    // The data slot offset is "DataOffset + SlotIndex * SlotSize".
+    UINT32 SlotIndex;
+    UINT32 Reserved[3];
+} WNBD_RING_REQUEST, *PWNBD_RING_REQUEST;
+
+typedef struct
+{
+    // The read payload is expected in the request data slot.
+    WNBD_IO_RESPONSE Response;
+    UINT64 Reserved[2];
+} WNBD_RING_RESPONSE, *PWNBD_RING_RESPONSE;
+
+typedef struct
+{
+    ULONG IoControlCode;
+    WNBD_CONNECTION_ID ConnectionId;
+    // Power of 2, up to WNBD_RING_MAX_ENTRIES.
+    UINT32 EntryCount;
+    // Should be at least as large as the maximum transfer length,
+    // larger requests are rejected.
+    UINT32 SlotSize;
+    // Auto-reset events. The driver signals "RequestEvent" when posting
+    // requests while "ResponseEvent" is signaled by userspace.
+    HANDLE RequestEvent;
+    HANDLE ResponseEvent;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_RING_SETUP_COMMAND, *PWNBD_IOCTL_RING_SETUP_COMMAND;
+
+// Output of IOCTL_WNBD_RING_SETUP.
+typedef struct
+{
+    // Mapped in the address space of the calling process, starting
+    // with a WNBD_RING_HEADER structure. Should be released using
+    // UnmapViewOfFile.
+    PVOID RingBuffer;
+    UINT64 RingSize;
+    UINT64 Reserved[4];
+} WNBD_RING_INFO, *PWNBD_RING_INFO;
+
 static inline const CHAR* WnbdRequestTypeToStr(WnbdRequestType RequestType) {
     switch(RequestType)
     {
@@ -292,4 +943,155 @@ typedef struct {
     BYTE Reserved[256];
 } WNBD_VERSION, *PWNBD_VERSION;
 
+// Output of IOCTL_WNBD_ADAPTER_STATS.
+typedef struct
+{
+    // Staging buffers shared by the NBD connections. The allocated size
+    // includes the idle buffers kept for reuse and is limited by
+    // "BufferPoolMaxBytes" (the "BufferPoolMaxSizeMB" registry key).
+    INT64 BufferPoolMaxBytes;
+    INT64 BufferPoolAllocatedBytes;
+    INT64 BufferPoolAllocatedHighWaterBytes;
+    INT64 BufferPoolInUseBytes;
+    INT64 BufferPoolInUseHighWaterBytes;
+    // Buffers reused from the caches and newly allocated ones.
+    INT64 BufferPoolCacheHits;
+    INT64 BufferPoolAllocations;
+    // Borrowers that had to wait for the pool to go below its limit
+    // and the ones that eventually failed.
+    INT64 BufferPoolWaits;
+    INT64 BufferPoolFailures;
+    // Bus scan requests: REPORT LUNS commands and requests addressed to
+    // LUNs without a disk.
+    INT64 ReportLunsRequests;
+    INT64 UnmappedLunRequests;
+    INT64 Reserved[21];
+} WNBD_ADAPTER_STATS, *PWNBD_ADAPTER_STATS;
+
+// Request lifecycle events, see WNBD_TRACE_RECORD.
+typedef enum
+{
+    // Received from Storport and added to the request list. Also logged
+    // when a timed out read gets resubmitted, using the same request id.
+    WnbdTraceQueued = 0,
+    // Retrieved from the request list by the NBD request thread or by
+    // the userspace process.
+    WnbdTraceDequeued = 1,
+    // Sent to the NBD server or handed over to the userspace process.
+    WnbdTraceSent = 2,
+    // The NBD reply header or the userspace response was received.
+    WnbdTraceReplied = 3,
+    // About to be completed, the payload being copied.
+    WnbdTraceCompleted = 4,
+    WnbdTraceEventCount = 5
+} WnbdTraceEvent;
+
+typedef struct
+{
+    // Interrupt time, using 100ns units.
+    UINT64 Timestamp;
+    // Assigned when the request is received, identifies all the events
+    // that belong to a given request.
+    UINT64 RequestId;
+    // NBD or userspace request handle, 0 until dequeued.
+    UINT64 Tag;
+    UINT64 ConnectionId;
+    // Byte offset.
+    UINT64 Offset;
+    UINT32 Length;
+    // WnbdIoOp
+    UINT8 Op;
+    // WnbdTraceEvent
+    UINT8 Event;
+    UINT16 Cpu;
+} WNBD_TRACE_RECORD, *PWNBD_TRACE_RECORD;
+
+#define WNBD_DEFAULT_TRACE_RECORDS_PER_CPU 8192
+#define WNBD_MAX_TRACE_RECORDS_PER_CPU (1024 * 1024)
+
+typedef struct
+{
+    ULONG IoControlCode;
+    BOOLEAN Enable;
+    // Ring size, only used when tracing is first enabled. Defaults to
+    // WNBD_DEFAULT_TRACE_RECORDS_PER_CPU.
+    UINT32 RecordsPerCpu;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_TRACE_CONTROL_COMMAND, *PWNBD_IOCTL_TRACE_CONTROL_COMMAND;
+
+typedef struct
+{
+    ULONG IoControlCode;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_TRACE_READ_COMMAND, *PWNBD_IOCTL_TRACE_READ_COMMAND;
+
+// Output of IOCTL_WNBD_TRACE_READ. The returned records are removed
+// from the trace rings, the record count depending on the output
+// buffer size. Records are ordered per CPU, not globally.
+typedef struct
+{
+    UINT32 Count;
+    UINT32 Reserved;
+    // Records overwritten before being retrieved, since the previous call.
+    UINT64 LostRecords;
+    WNBD_TRACE_RECORD Records[1];
+} WNBD_TRACE_BUFFER, *PWNBD_TRACE_BUFFER;
+
+#define WNBD_TRACE_BUFFER_SIZE(Count) \
+    (FIELD_OFFSET(WNBD_TRACE_BUFFER, Records) + \
+     sizeof(WNBD_TRACE_RECORD) * (Count))
+
+// Binary per IO event log record. The event ids and formats are
+// defined in wnbd_log_events.h.
+#define WNBD_EVENT_LOG_MAX_ARGS 6
+
+typedef struct
+{
+    // Interrupt time, using 100ns units.
+    UINT64 Timestamp;
+    // WnbdLogEventId
+    UINT16 EventId;
+    UINT8 Level;
+    UINT8 ArgCount;
+    UINT16 Cpu;
+    UINT16 Reserved;
+    // Raw event arguments, 32 bit arguments having undefined upper bits.
+    UINT64 Args[WNBD_EVENT_LOG_MAX_ARGS];
+} WNBD_EVENT_LOG_RECORD, *PWNBD_EVENT_LOG_RECORD;
+
+#define WNBD_DEFAULT_EVENT_LOG_RECORDS_PER_CPU 8192
+#define WNBD_MAX_EVENT_LOG_RECORDS_PER_CPU (1024 * 1024)
+
+typedef struct
+{
+    ULONG IoControlCode;
+    // Uses the "DebugLogLevel" convention: 0 disables the event log,
+    // otherwise events up to "LogLevel - 1" are recorded.
+    UINT32 LogLevel;
+    // Ring size, only used when the event log is first enabled.
+    // Defaults to WNBD_DEFAULT_EVENT_LOG_RECORDS_PER_CPU.
+    UINT32 RecordsPerCpu;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_EVENT_LOG_CONTROL_COMMAND, *PWNBD_IOCTL_EVENT_LOG_CONTROL_COMMAND;
+
+typedef struct
+{
+    ULONG IoControlCode;
+    UINT64 Reserved[4];
+} WNBD_IOCTL_EVENT_LOG_READ_COMMAND, *PWNBD_IOCTL_EVENT_LOG_READ_COMMAND;
+
+// Output of IOCTL_WNBD_EVENT_LOG_READ, see WNBD_TRACE_BUFFER.
+typedef struct
+{
+    UINT32 Count;
+    UINT32 Reserved;
+    // Records overwritten before being retrieved, since the previous call.
+    UINT64 LostRecords;
+    WNBD_EVENT_LOG_RECORD Records[1];
+} WNBD_EVENT_LOG_BUFFER, *PWNBD_EVENT_LOG_BUFFER;
+
+#define WNBD_EVENT_LOG_BUFFER_SIZE(Count) \
+    (FIELD_OFFSET(WNBD_EVENT_LOG_BUFFER, Records) + \
+     sizeof(WNBD_EVENT_LOG_RECORD) * (Count))
+
 #endif // WNBD_IOCTL_H
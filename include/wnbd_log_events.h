@@ -0,0 +1,63 @@
+#ifndef WNBD_LOG_EVENTS_H
+#define WNBD_LOG_EVENTS_H
+
+// Per IO log messages. When binary event logging is enabled, the driver
+// only records the event id along with the raw arguments, which are
+// formatted by the consumer (e.g. "wnbd-client event-log").
+//
+// Each argument is stored as a 64 bit value, 32 bit arguments having
+// undefined upper bits. The formats may only use integer and pointer
+// conversions matching the argument sizes, at most
+// WNBD_EVENT_LOG_MAX_ARGS arguments being allowed. Ids may not be
+// reused, new events being appended.
+#define WNBD_LOG_EVENTS(X) \
+    X(WnbdEvtSrbReceived, 5, \
+      "Received %#02x command. SRB: %p. PathId: %d TargetId: %d LUN: %d") \
+    X(WnbdEvtStartIo, 1, "Processing SRB function 0x%x.") \
+    X(WnbdEvtStartIoCompleted, 2, \
+      "Completing SRB function 0x%x, status: 0x%x.") \
+    X(WnbdEvtScsiOperation, 1, "Processing %#02x command.") \
+    X(WnbdEvtQueuingElement, 1, "Queuing element. SRB: %p.") \
+    X(WnbdEvtNbdProcessingRequest, 2, \
+      "Processing request. SRB: %p Tag: 0x%llx.") \
+    X(WnbdEvtNbdSendingRequest, 4, \
+      "Sending NBD request type %d. SRB: %p Tag: 0x%llx FUA: %d.") \
+    X(WnbdEvtNbdReplyHeader, 3, \
+      "Received reply header for NBD request type %d. SRB: %p Tag: 0x%llx.") \
+    X(WnbdEvtNbdReadChunk, 1, "Size to read: %llu.") \
+    X(WnbdEvtNbdSendChunk, 1, "Size to send: %llu.") \
+    X(WnbdEvtRequestSucceeded, 2, \
+      "Successfully completed request. SRB: %p Tag: 0x%llx.") \
+    X(WnbdEvtSrbCompleted, 3, \
+      "Notifying StorPort of completion. SRB: %p Tag: 0x%llx Status: 0x%x.") \
+    X(WnbdEvtUserProcessingRequest, 3, \
+      "Processing request. SRB: %p Tag: 0x%llx Type: %d.") \
+    X(WnbdEvtUserReplyHeader, 3, \
+      "Received reply header for request type %d. SRB: %p Tag: 0x%llx.") \
+    X(WnbdEvtMirrorSendingRequest, 4, \
+      "Sending NBD request type %d. SRB: %p Tag: 0x%llx Legs: 0x%x.") \
+    X(WnbdEvtMirrorReplyHeader, 3, \
+      "Received mirror leg %d reply header. SRB: %p Tag: 0x%llx.") \
+    X(WnbdEvtOverlayRequest, 3, \
+      "Handling NBD request type %d locally. SRB: %p Tag: 0x%llx.")
+
+#define WNBD_LOG_EVENT_ID(Id, ArgCount, Format) Id,
+typedef enum
+{
+    WNBD_LOG_EVENTS(WNBD_LOG_EVENT_ID)
+    WnbdEvtCount
+} WnbdLogEventId;
+#undef WNBD_LOG_EVENT_ID
+
+typedef struct
+{
+    UINT32 ArgCount;
+    const char* Format;
+} WNBD_LOG_EVENT_INFO, *PWNBD_LOG_EVENT_INFO;
+
+// Used for defining the event table:
+// const WNBD_LOG_EVENT_INFO Events[] = {
+//     WNBD_LOG_EVENTS(WNBD_LOG_EVENT_INFO_ENTRY) };
+#define WNBD_LOG_EVENT_INFO_ENTRY(Id, ArgCount, Format) { ArgCount, Format },
+
+#endif // WNBD_LOG_EVENTS_H
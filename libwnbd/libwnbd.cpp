@@ -11,6 +11,66 @@
 
 #define STRING_OVERFLOWS(Str, MaxLen) (strlen(Str + 1) > MaxLen)
 
+// Responses sent synchronously by the dispatcher threads are deferred
+// and submitted along with the next fetch, using a single
+// IOCTL_WNBD_SEND_RSP_FETCH_REQ call.
+typedef struct _WNBD_DISPATCHER_CONTEXT
+{
+    PWNBD_DEVICE Device;
+    PBYTE Buffer;
+    SIZE_T BufferSize;
+    // Registered dispatcher buffer, 0 if the registration failed.
+    UINT32 BufferId;
+    UINT32 ResponseCount;
+    WNBD_IO_RESPONSE_ENTRY Responses[WNBD_DISPATCHER_BATCH_SIZE];
+} WNBD_DISPATCHER_CONTEXT, *PWNBD_DISPATCHER_CONTEXT;
+
+static thread_local PWNBD_DISPATCHER_CONTEXT DispatcherContext = NULL;
+
+// Userspace side of the shared memory rings, see WNBD_RING_HEADER.
+// Multiple dispatcher threads may consume the request ring, while the
+// responses may be sent by any thread.
+typedef struct _WNBD_RING_CONTEXT
+{
+    PVOID Buffer;
+    PWNBD_RING_HEADER Header;
+    PWNBD_RING_REQUEST Requests;
+    PWNBD_RING_RESPONSE Responses;
+    PBYTE Data;
+    UINT32 EntryCount;
+    UINT32 SlotSize;
+    HANDLE RequestEvent;
+    HANDLE ResponseEvent;
+    // Serializes the response ring producers.
+    SRWLOCK ResponseLock;
+} WNBD_RING_CONTEXT, *PWNBD_RING_CONTEXT;
+
+// Outstanding asynchronous fetch, owning a single request slot. The
+// responses sent while handling the request are submitted along with
+// the next fetch.
+typedef struct _WNBD_ASYNC_FETCH
+{
+    OVERLAPPED Overlapped;
+    WNBD_DISPATCHER_CONTEXT Context;
+    // Number of responses submitted along with the current fetch.
+    UINT32 PostedResponseCount;
+    PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND Command;
+} WNBD_ASYNC_FETCH, *PWNBD_ASYNC_FETCH;
+
+// The asynchronous dispatcher uses a separate device handle, associated
+// with a completion port.
+typedef struct _WNBD_ASYNC_DISPATCHER
+{
+    HANDLE Handle;
+    HANDLE Port;
+    PWNBD_ASYNC_FETCH Fetches;
+    DWORD FetchCount;
+    // Fetches that are expected to generate completion packets.
+    volatile LONG PendingFetches;
+} WNBD_ASYNC_DISPATCHER, *PWNBD_ASYNC_DISPATCHER;
+
+#define WNBD_ASYNC_FETCH_COMMAND_SIZE \
+    WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(1, WNBD_DISPATCHER_BATCH_SIZE)
 
 VOID LogMessage(PWNBD_DEVICE Device, WnbdLogLevel LogLevel,
                 const char* FileName, UINT32 Line, const char* FunctionName,
@@ -105,6 +165,39 @@ DWORD WnbdCreate(
                  Properties->NbdProperties.ExportName,
                  Properties->NbdProperties.Flags.SkipNegotiation);
     }
+    if (Properties->Flags.ChangeTracking) {
+        LogDebug(Device, "Change tracking enabled. BlockSize=%u.",
+                 Properties->ChangeTrackingBlockSize);
+    }
+    if (Properties->RequestTimeoutMs) {
+        LogDebug(Device, "Request deadlines: TimeoutMs=%u, MaxRetries=%u.",
+                 Properties->RequestTimeoutMs,
+                 Properties->MaxRequestRetries);
+    }
+    if (Properties->Flags.AdaptiveQueueDepth || Properties->MaxQueueDepth) {
+        LogDebug(Device, "Queue depth: Max=%u, Adaptive=%u.",
+                 Properties->MaxQueueDepth,
+                 Properties->Flags.AdaptiveQueueDepth);
+    }
+    if (Properties->QosLimits.ReadIops.Rate ||
+            Properties->QosLimits.WriteIops.Rate ||
+            Properties->QosLimits.ReadBytes.Rate ||
+            Properties->QosLimits.WriteBytes.Rate) {
+        LogDebug(Device, "QoS limits: ReadIops=%llu, WriteIops=%llu, "
+                 "ReadBytes=%llu, WriteBytes=%llu.",
+                 Properties->QosLimits.ReadIops.Rate,
+                 Properties->QosLimits.WriteIops.Rate,
+                 Properties->QosLimits.ReadBytes.Rate,
+                 Properties->QosLimits.WriteBytes.Rate);
+    }
+    if (Properties->SchedulerWeight) {
+        LogDebug(Device, "Scheduler weight: %u.",
+                 Properties->SchedulerWeight);
+    }
+    if (Properties->Flags.ZeroCopy) {
+        LogDebug(Device, "Zero-copy enabled. Threshold=%u.",
+                 Properties->ZeroCopyThreshold);
+    }
 
     if (ErrorCode) {
         LogError(Device,
@@ -170,6 +263,23 @@ DWORD WnbdRemoveEx(const char* InstanceName, BOOLEAN HardRemove)
     return Status;
 }
 
+DWORD WnbdRemoveAsync(const char* InstanceName, BOOLEAN HardRemove)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    WNBD_REMOVE_COMMAND_FLAGS Flags = { 0 };
+    Flags.HardRemove = !!HardRemove;
+    Flags.Async = 1;
+    Status = WnbdIoctlRemoveEx(Handle, InstanceName, &Flags);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
 DWORD WnbdList(
     PWNBD_CONNECTION_LIST ConnectionList,
     PDWORD BufferSize)
@@ -186,6 +296,43 @@ DWORD WnbdList(
     return Status;
 }
 
+DWORD WnbdListPaged(
+    PWNBD_LIST_PAGED_FLAGS Flags,
+    UINT64 Cursor,
+    UINT64 ChangedSince,
+    PWNBD_CONNECTION_PAGE Page,
+    DWORD BufferSize)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    Status = WnbdIoctlListPaged(
+        Handle, Flags, Cursor, ChangedSince, Page, BufferSize);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
+DWORD WnbdWaitChange(
+    UINT64 Sequence,
+    UINT32 TimeoutMs,
+    PUINT64 CurrentSequence)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    Status = WnbdIoctlWaitChange(Handle, Sequence, TimeoutMs, CurrentSequence);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
 DWORD WnbdGetUserspaceStats(
     PWNBD_DEVICE Device,
     PWNBD_USR_STATS Stats)
@@ -214,6 +361,74 @@ DWORD WnbdGetDriverStats(
     return Status;
 }
 
+DWORD WnbdGetDriverIoStats(
+    const char* InstanceName,
+    PWNBD_IO_STATS Stats)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    Status = WnbdIoctlIoStats(Handle, InstanceName, Stats);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
+DWORD WnbdCbtSnapshot(
+    const char* InstanceName,
+    PWNBD_CBT_SNAPSHOT_INFO SnapshotInfo)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    Status = WnbdIoctlCbtSnapshot(Handle, InstanceName, SnapshotInfo);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
+DWORD WnbdCbtFetch(
+    const char* InstanceName,
+    UINT64 SnapshotId,
+    UINT64 StartBlock,
+    PWNBD_CBT_BITMAP Bitmap,
+    DWORD BitmapBufferSize)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    Status = WnbdIoctlCbtFetch(Handle, InstanceName, SnapshotId, StartBlock,
+                               Bitmap, BitmapBufferSize);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
+DWORD WnbdSetQos(
+    const char* InstanceName,
+    PWNBD_QOS_LIMITS Limits)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    Status = WnbdIoctlSetQos(Handle, InstanceName, Limits);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
 DWORD WnbdGetLibVersion(PWNBD_VERSION Version)
 {
     if (!Version) {
@@ -243,6 +458,20 @@ DWORD WnbdGetDriverVersion(PWNBD_VERSION Version)
     return Status;
 }
 
+DWORD WnbdGetAdapterStats(PWNBD_ADAPTER_STATS Stats)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    Status = WnbdIoctlAdapterStats(Handle, Stats);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
 DWORD WnbdGetConnectionInfo(
     PWNBD_DEVICE Device,
     PWNBD_CONNECTION_INFO ConnectionInfo)
@@ -298,6 +527,175 @@ Exit:
     return Status;
 }
 
+void WnbdRingFree(PWNBD_RING_CONTEXT Ring)
+{
+    if (Ring->Buffer)
+        UnmapViewOfFile(Ring->Buffer);
+    if (Ring->RequestEvent)
+        CloseHandle(Ring->RequestEvent);
+    if (Ring->ResponseEvent)
+        CloseHandle(Ring->ResponseEvent);
+    free(Ring);
+}
+
+DWORD WnbdRingSetup(PWNBD_DEVICE Device, UINT32 EntryCount)
+{
+    DWORD ErrorCode = ERROR_SUCCESS;
+    WNBD_RING_INFO RingInfo = { 0 };
+    PWNBD_RING_CONTEXT Ring = (PWNBD_RING_CONTEXT) calloc(
+        1, sizeof(WNBD_RING_CONTEXT));
+    if (!Ring) {
+        LogError(Device, "Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    InitializeSRWLock(&Ring->ResponseLock);
+
+    Ring->RequestEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    Ring->ResponseEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (!Ring->RequestEvent || !Ring->ResponseEvent) {
+        ErrorCode = GetLastError();
+        LogError(Device, "Could not create ring events. Error: %d.",
+                 ErrorCode);
+        goto Exit;
+    }
+
+    ErrorCode = WnbdIoctlRingSetup(
+        Device->Handle, Device->ConnectionInfo.ConnectionId,
+        EntryCount, WNBD_DEFAULT_MAX_TRANSFER_LENGTH,
+        Ring->RequestEvent, Ring->ResponseEvent, &RingInfo);
+    if (ErrorCode) {
+        LogError(Device, "Could not set up the device rings. "
+                 "Entries: %u. Error: %d.", EntryCount, ErrorCode);
+        goto Exit;
+    }
+
+    Ring->Buffer = RingInfo.RingBuffer;
+    Ring->Header = (PWNBD_RING_HEADER) RingInfo.RingBuffer;
+    Ring->EntryCount = Ring->Header->EntryCount;
+    Ring->SlotSize = Ring->Header->SlotSize;
+    Ring->Requests = (PWNBD_RING_REQUEST)
+        ((PBYTE)Ring->Buffer + Ring->Header->RequestRingOffset);
+    Ring->Responses = (PWNBD_RING_RESPONSE)
+        ((PBYTE)Ring->Buffer + Ring->Header->ResponseRingOffset);
+    Ring->Data = (PBYTE)Ring->Buffer + Ring->Header->DataOffset;
+
+    LogDebug(Device, "Ring set up. Entries: %u, slot size: %u, size: %llu.",
+             Ring->EntryCount, Ring->SlotSize, RingInfo.RingSize);
+    Device->Ring = Ring;
+
+Exit:
+    if (ErrorCode) {
+        WnbdRingFree(Ring);
+    }
+    return ErrorCode;
+}
+
+// Retrieves the next request, returning FALSE if the ring is empty.
+// "MorePending" is set if there are other requests available.
+BOOLEAN WnbdRingFetchRequest(
+    PWNBD_RING_CONTEXT Ring,
+    PWNBD_RING_REQUEST Request,
+    PBOOLEAN MorePending)
+{
+    PWNBD_RING_INDICES Indices = &Ring->Header->Requests;
+    while (TRUE) {
+        UINT32 Head = Indices->Head;
+        UINT32 Tail = Indices->Tail;
+        MemoryBarrier();
+        if (Head == Tail) {
+            return FALSE;
+        }
+
+        // The entry is copied before advancing the head, at which point
+        // it may be reused.
+        memcpy(Request, &Ring->Requests[Head & (Ring->EntryCount - 1)],
+               sizeof(WNBD_RING_REQUEST));
+        if (InterlockedCompareExchange(
+                (LONG*)&Indices->Head, Head + 1, Head) == (LONG)Head) {
+            *MorePending = Tail - Head > 1;
+            return TRUE;
+        }
+    }
+}
+
+DWORD WnbdRingSendResponse(
+    PWNBD_RING_CONTEXT Ring,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize)
+{
+    UINT32 Mask = Ring->EntryCount - 1;
+    PBYTE Slot = Ring->Data +
+        (SIZE_T)(Response->RequestHandle & Mask) * Ring->SlotSize;
+
+    // Read handlers normally use the request data slot directly.
+    if (DataBuffer && DataBufferSize && DataBuffer != Slot) {
+        if (DataBufferSize > Ring->SlotSize) {
+            return ERROR_INVALID_PARAMETER;
+        }
+        memcpy(Slot, DataBuffer, DataBufferSize);
+    }
+
+    PWNBD_RING_INDICES Indices = &Ring->Header->Responses;
+    AcquireSRWLockExclusive(&Ring->ResponseLock);
+    UINT32 Tail = Indices->Tail;
+    // Can only happen when sending unexpected responses.
+    if (Tail - Indices->Head >= Ring->EntryCount) {
+        ReleaseSRWLockExclusive(&Ring->ResponseLock);
+        return ERROR_BUFFER_OVERFLOW;
+    }
+
+    PWNBD_RING_RESPONSE Entry = &Ring->Responses[Tail & Mask];
+    memset(Entry, 0, sizeof(WNBD_RING_RESPONSE));
+    memcpy(&Entry->Response, Response, sizeof(WNBD_IO_RESPONSE));
+    // Full barrier, publishing the entry before checking the flag.
+    InterlockedExchange((LONG*)&Indices->Tail, Tail + 1);
+    BOOLEAN Signal = !!Indices->ConsumerWaiting;
+    ReleaseSRWLockExclusive(&Ring->ResponseLock);
+
+    if (Signal) {
+        SetEvent(Ring->ResponseEvent);
+    }
+    return ERROR_SUCCESS;
+}
+
+void WnbdAsyncDispatcherFree(
+    PWNBD_DEVICE Device,
+    PWNBD_ASYNC_DISPATCHER Dispatcher)
+{
+    if (Dispatcher->Handle) {
+        // The fetch buffers can only be released after the outstanding
+        // fetches complete.
+        CancelIoEx(Dispatcher->Handle, NULL);
+        while (Dispatcher->Port && Dispatcher->PendingFetches > 0) {
+            DWORD BytesReturned = 0;
+            ULONG_PTR Key = 0;
+            LPOVERLAPPED Overlapped = NULL;
+            GetQueuedCompletionStatus(Dispatcher->Port, &BytesReturned,
+                                      &Key, &Overlapped, INFINITE);
+            if (Overlapped) {
+                Dispatcher->PendingFetches--;
+            }
+        }
+        CloseHandle(Dispatcher->Handle);
+    }
+    if (Dispatcher->Port)
+        CloseHandle(Dispatcher->Port);
+
+    if (Dispatcher->Fetches) {
+        for (DWORD i = 0; i < Dispatcher->FetchCount; i++) {
+            PWNBD_ASYNC_FETCH Fetch = &Dispatcher->Fetches[i];
+            if (Fetch->Context.Buffer)
+                free(Fetch->Context.Buffer);
+            if (Fetch->Command)
+                free(Fetch->Command);
+        }
+        free(Dispatcher->Fetches);
+    }
+
+    free(Dispatcher);
+}
+
 void WnbdClose(PWNBD_DEVICE Device)
 {
     if (!Device)
@@ -310,6 +708,12 @@ void WnbdClose(PWNBD_DEVICE Device)
     if (Device->DispatcherThreads)
         free(Device->DispatcherThreads);
 
+    if (Device->Ring)
+        WnbdRingFree(Device->Ring);
+
+    if (Device->AsyncDispatcher)
+        WnbdAsyncDispatcherFree(Device, Device->AsyncDispatcher);
+
     free(Device);
 }
 
@@ -363,6 +767,36 @@ void WnbdSetSense(PWNBD_STATUS Status, UINT8 SenseKey, UINT8 Asc)
     Status->InformationValid = 0;
 }
 
+// Returns TRUE if the response is going to be sent along with the next
+// fetch request.
+BOOLEAN WnbdDeferResponse(
+    PWNBD_DEVICE Device,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize)
+{
+    PWNBD_DISPATCHER_CONTEXT Context = DispatcherContext;
+    if (!Context || Context->Device != Device ||
+            Context->ResponseCount >= WNBD_DISPATCHER_BATCH_SIZE) {
+        return FALSE;
+    }
+    // The data buffer has to remain valid until the next fetch, which
+    // is only guaranteed for the dispatcher buffer.
+    if (DataBuffer && ((PBYTE)DataBuffer < Context->Buffer ||
+            (PBYTE)DataBuffer + DataBufferSize >
+                Context->Buffer + Context->BufferSize)) {
+        return FALSE;
+    }
+
+    PWNBD_IO_RESPONSE_ENTRY Entry =
+        &Context->Responses[Context->ResponseCount++];
+    memcpy(&Entry->Response, Response, sizeof(WNBD_IO_RESPONSE));
+    Entry->DataBuffer = DataBuffer;
+    Entry->DataBufferSize = DataBufferSize;
+    Entry->BufferId = DataBuffer ? Context->BufferId : 0;
+    return TRUE;
+}
+
 DWORD WnbdSendResponse(
     PWNBD_DEVICE Device,
     PWNBD_IO_RESPONSE Response,
@@ -404,7 +838,16 @@ DWORD WnbdSendResponse(
         return ERROR_PIPE_NOT_CONNECTED;
     }
 
+    if (Device->Ring) {
+        return WnbdRingSendResponse(
+            Device->Ring, Response, DataBuffer, DataBufferSize);
+    }
+
     InterlockedIncrement64((PLONG64)&Device->Stats.PendingReplies);
+    if (WnbdDeferResponse(Device, Response, DataBuffer, DataBufferSize)) {
+        return ERROR_SUCCESS;
+    }
+
     DWORD Status = WnbdIoctlSendResponse(
         Device->Handle,
         Device->ConnectionInfo.ConnectionId,
@@ -425,6 +868,11 @@ VOID WnbdHandleRequest(PWNBD_DEVICE Device, PWNBD_IO_REQUEST Request,
     InterlockedIncrement64((PLONG64)&Device->Stats.TotalReceivedRequests);
     InterlockedIncrement64((PLONG64)&Device->Stats.UnsubmittedRequests);
 
+    // Zero-copy requests, the IO pages being accessed in place.
+    if (Request->DataAddress) {
+        Buffer = (PVOID)Request->DataAddress;
+    }
+
     switch (Request->RequestType) {
         case WnbdReqTypeDisconnect:
             LogInfo(Device, "Received disconnect request.");
@@ -481,6 +929,7 @@ VOID WnbdHandleRequest(PWNBD_DEVICE Device, PWNBD_IO_REQUEST Request,
                 Request->RequestHandle,
                 Request->Cmd.Flush.BlockAddress,
                 Request->Cmd.Flush.BlockCount);
+            break;
         case WnbdReqTypeUnmap:
             if (!Device->Interface->Unmap || !Device->Properties.Flags.UnmapSupported)
                 goto Unsupported;
@@ -491,20 +940,23 @@ VOID WnbdHandleRequest(PWNBD_DEVICE Device, PWNBD_IO_REQUEST Request,
                 goto Unsupported;
             }
 
-            if (Device->Properties.MaxUnmapDescCount <=
-                Request->Cmd.Unmap.Count)
+            if (Request->Cmd.Unmap.Count > max(1, min(
+                    Device->Properties.MaxUnmapDescCount,
+                    WNBD_MAX_UNMAP_DESC_COUNT)))
             {
                 AdditionalSenseCode = SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST;
                 goto Unsupported;
             }
 
-            LogDebug(Device, "Dispatching UNMAP # %llx.",
-                     Request->RequestHandle);
+            LogDebug(Device, "Dispatching UNMAP # %llx, descriptors: %u.",
+                     Request->RequestHandle,
+                     Request->Cmd.Unmap.Count);
             Device->Interface->Unmap(
                 Device,
                 Request->RequestHandle,
                 (PWNBD_UNMAP_DESCRIPTOR)Buffer,
                 Request->Cmd.Unmap.Count);
+            break;
         default:
         Unsupported:
             LogDebug(Device, "Received unsupported command. "
@@ -533,30 +985,98 @@ VOID WnbdHandleRequest(PWNBD_DEVICE Device, PWNBD_IO_REQUEST Request,
     }
 }
 
+DWORD WnbdFlushResponses(
+    PWNBD_DEVICE Device,
+    PWNBD_DISPATCHER_CONTEXT Context,
+    PWNBD_IO_REQUEST Requests,
+    PUINT32 RequestCount,
+    PVOID Buffer,
+    UINT32 SlotSize)
+{
+    UINT32 ResponseCount = Context->ResponseCount;
+    UINT32 FailedResponseCount = 0;
+    DWORD ErrorCode = WnbdIoctlSendResponsesFetchRequests(
+        Device->Handle,
+        Device->ConnectionInfo.ConnectionId,
+        Context->Responses,
+        ResponseCount,
+        &FailedResponseCount,
+        Requests,
+        RequestCount,
+        Buffer,
+        SlotSize,
+        Context->BufferId);
+    Context->ResponseCount = 0;
+    InterlockedAdd64((PLONG64)&Device->Stats.PendingReplies,
+                     -(LONG64)ResponseCount);
+
+    if (ErrorCode && ResponseCount) {
+        LogWarning(Device, "Could not send %u responses. Error: %d.",
+                   ResponseCount, ErrorCode);
+    } else if (FailedResponseCount) {
+        LogWarning(Device, "The driver rejected %u out of %u responses.",
+                   FailedResponseCount, ResponseCount);
+    }
+    return ErrorCode;
+}
+
 DWORD WnbdDispatcherLoop(PWNBD_DEVICE Device)
 {
     DWORD ErrorCode = 0;
-    WNBD_IO_REQUEST Request;
-    DWORD BufferSize = WNBD_DEFAULT_MAX_TRANSFER_LENGTH;
-    PVOID Buffer = malloc(BufferSize);
+    WNBD_IO_REQUEST Requests[WNBD_DISPATCHER_BATCH_SIZE];
+    DWORD SlotSize = WNBD_DEFAULT_MAX_TRANSFER_LENGTH;
+    PVOID Buffer = malloc(SlotSize * WNBD_DISPATCHER_BATCH_SIZE);
+    if (!Buffer) {
+        LogError(Device, "Could not allocate dispatcher buffer.");
+        WnbdStopDispatcher(Device, TRUE);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    WNBD_DISPATCHER_CONTEXT Context = { 0 };
+    Context.Device = Device;
+    Context.Buffer = (PBYTE)Buffer;
+    Context.BufferSize = (SIZE_T)SlotSize * WNBD_DISPATCHER_BATCH_SIZE;
+    DispatcherContext = &Context;
+
+    // The driver keeps registered buffers locked, avoiding per request
+    // locking. Unregistered buffers are still usable, so failures
+    // aren't fatal.
+    ErrorCode = WnbdIoctlRegisterBuffer(
+        Device->Handle, Device->ConnectionInfo.ConnectionId,
+        Buffer, (UINT32)Context.BufferSize, &Context.BufferId);
+    if (ErrorCode) {
+        LogDebug(Device, "Could not register dispatcher buffer. Error: %d.",
+                 ErrorCode);
+        Context.BufferId = 0;
+        ErrorCode = 0;
+    }
 
     while (WnbdIsRunning(Device)) {
-        ErrorCode = WnbdIoctlFetchRequest(
-            Device->Handle,
-            Device->ConnectionInfo.ConnectionId,
-            &Request,
-            Buffer,
-            BufferSize);
+        UINT32 RequestCount = WNBD_DISPATCHER_BATCH_SIZE;
+        // A single call sends the responses of the previous batch and
+        // retrieves all the requests that are available, up to the
+        // batch size.
+        ErrorCode = WnbdFlushResponses(Device, &Context, Requests,
+                                       &RequestCount, Buffer, SlotSize);
         if (ErrorCode) {
             LogWarning(Device,
-                       "Could not fetch request. Error: %d. "
-                       "Buffer: %p, buffer size: %d, connection id: %llu.",
-                       ErrorCode, Buffer, BufferSize,
+                       "Could not fetch requests. Error: %d. "
+                       "Buffer: %p, slot size: %d, connection id: %llu.",
+                       ErrorCode, Buffer, SlotSize,
                        Device->ConnectionInfo.ConnectionId);
             break;
         }
-        WnbdHandleRequest(Device, &Request, Buffer);
+        for (UINT32 i = 0; i < RequestCount; i++) {
+            WnbdHandleRequest(Device, &Requests[i],
+                              (PBYTE)Buffer + (SIZE_T)i * SlotSize);
+        }
+    }
+
+    if (Context.ResponseCount) {
+        UINT32 RequestCount = 0;
+        WnbdFlushResponses(Device, &Context, NULL, &RequestCount, NULL, 0);
     }
+    DispatcherContext = NULL;
 
     WnbdStopDispatcher(Device, TRUE);
     free(Buffer);
@@ -564,16 +1084,228 @@ DWORD WnbdDispatcherLoop(PWNBD_DEVICE Device)
     return ErrorCode;
 }
 
-DWORD WnbdStartDispatcher(PWNBD_DEVICE Device, DWORD ThreadCount)
+DWORD WnbdRingDispatcherLoop(PWNBD_DEVICE Device)
 {
-    DWORD ErrorCode = ERROR_SUCCESS;
-    if (ThreadCount < WNBD_MIN_DISPATCHER_THREAD_COUNT ||
-       ThreadCount > WNBD_MAX_DISPATCHER_THREAD_COUNT) {
-        LogError(Device, "Invalid number of dispatcher threads: %u",
-                 ThreadCount);
-        return ERROR_INVALID_PARAMETER;
+    PWNBD_RING_CONTEXT Ring = Device->Ring;
+    PWNBD_RING_INDICES Indices = &Ring->Header->Requests;
+    WNBD_RING_REQUEST Entry;
+    BOOLEAN MorePending = FALSE;
+
+    while (WnbdIsRunning(Device)) {
+        if (WnbdRingFetchRequest(Ring, &Entry, &MorePending)) {
+            // Waking up another dispatcher thread, the driver only
+            // signals the event when we're idle.
+            if (MorePending && Device->DispatcherThreadsCount > 1) {
+                SetEvent(Ring->RequestEvent);
+            }
+            PVOID Buffer = Entry.SlotIndex < Ring->EntryCount ?
+                Ring->Data + (SIZE_T)Entry.SlotIndex * Ring->SlotSize : NULL;
+            WnbdHandleRequest(Device, &Entry.Request, Buffer);
+            continue;
+        }
+
+        // The remaining requests are processed before stopping.
+        if (Ring->Header->Disconnected) {
+            LogInfo(Device, "The device rings were disconnected.");
+            WnbdSignalStopped(Device);
+            break;
+        }
+
+        InterlockedExchange((LONG*)&Indices->ConsumerWaiting, 1);
+        if (Indices->Head == Indices->Tail && !Ring->Header->Disconnected) {
+            WaitForSingleObject(Ring->RequestEvent, INFINITE);
+        }
+        InterlockedExchange((LONG*)&Indices->ConsumerWaiting, 0);
+    }
+
+    // Wakes up the other dispatcher threads.
+    SetEvent(Ring->RequestEvent);
+    WnbdStopDispatcher(Device, TRUE);
+
+    return 0;
+}
+
+DWORD WnbdAsyncFetchPost(PWNBD_DEVICE Device, PWNBD_ASYNC_FETCH Fetch)
+{
+    PWNBD_ASYNC_DISPATCHER Dispatcher = Device->AsyncDispatcher;
+    PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND Command = Fetch->Command;
+    UINT32 ResponseCount = Fetch->Context.ResponseCount;
+
+    memset(Command, 0, WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(1, 0));
+    Command->ConnectionId = Device->ConnectionInfo.ConnectionId;
+    Command->DataBuffer = Fetch->Context.Buffer;
+    Command->SlotSize = (UINT32)Fetch->Context.BufferSize;
+    Command->RequestCount = 1;
+    Command->ResponseCount = ResponseCount;
+    Command->BufferId = Fetch->Context.BufferId;
+    if (ResponseCount) {
+        memcpy(WNBD_SEND_RSP_FETCH_REQ_RESPONSES(Command),
+               Fetch->Context.Responses,
+               sizeof(WNBD_IO_RESPONSE_ENTRY) * ResponseCount);
+    }
+    Fetch->Context.ResponseCount = 0;
+    Fetch->PostedResponseCount = ResponseCount;
+    memset(&Fetch->Overlapped, 0, sizeof(OVERLAPPED));
+
+    InterlockedIncrement(&Dispatcher->PendingFetches);
+    DWORD ErrorCode = WnbdIoctlSendResponsesFetchRequestsAsync(
+        Dispatcher->Handle, Command, &Fetch->Overlapped);
+    // Synchronously completed fetches generate completion packets as
+    // well, unless they fail.
+    if (ErrorCode == ERROR_IO_PENDING) {
+        ErrorCode = 0;
+    }
+    if (ErrorCode) {
+        InterlockedDecrement(&Dispatcher->PendingFetches);
+        InterlockedAdd64((PLONG64)&Device->Stats.PendingReplies,
+                         -(LONG64)ResponseCount);
+        LogWarning(Device, "Could not post fetch request. Error: %d.",
+                   ErrorCode);
+    }
+    return ErrorCode;
+}
+
+DWORD WnbdAsyncDispatcherLoop(PWNBD_DEVICE Device)
+{
+    PWNBD_ASYNC_DISPATCHER Dispatcher = Device->AsyncDispatcher;
+    DWORD ErrorCode = 0;
+
+    while (WnbdIsRunning(Device)) {
+        DWORD BytesReturned = 0;
+        ULONG_PTR Key = 0;
+        LPOVERLAPPED Overlapped = NULL;
+        BOOL Completed = GetQueuedCompletionStatus(
+            Dispatcher->Port, &BytesReturned, &Key, &Overlapped, INFINITE);
+        if (!Overlapped) {
+            // Wake up packet, posted when stopping.
+            continue;
+        }
+
+        InterlockedDecrement(&Dispatcher->PendingFetches);
+        PWNBD_ASYNC_FETCH Fetch = CONTAINING_RECORD(
+            Overlapped, WNBD_ASYNC_FETCH, Overlapped);
+        PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND Command = Fetch->Command;
+        InterlockedAdd64((PLONG64)&Device->Stats.PendingReplies,
+                         -(LONG64)Fetch->PostedResponseCount);
+        if (!Completed) {
+            ErrorCode = GetLastError();
+            if (WnbdIsRunning(Device)) {
+                LogWarning(Device,
+                           "Could not fetch requests. Error: %d. "
+                           "Connection id: %llu.",
+                           ErrorCode, Device->ConnectionInfo.ConnectionId);
+            }
+            break;
+        }
+        if (Command->FailedResponseCount) {
+            LogWarning(Device, "The driver rejected %u out of %u responses.",
+                       Command->FailedResponseCount,
+                       Fetch->PostedResponseCount);
+        }
+
+        DispatcherContext = &Fetch->Context;
+        for (UINT32 i = 0; i < Command->RequestCount; i++) {
+            WnbdHandleRequest(Device, &Command->Requests[i],
+                              Fetch->Context.Buffer);
+        }
+        DispatcherContext = NULL;
+
+        if (!WnbdIsRunning(Device)) {
+            if (Fetch->Context.ResponseCount) {
+                UINT32 RequestCount = 0;
+                WnbdFlushResponses(Device, &Fetch->Context, NULL,
+                                   &RequestCount, NULL, 0);
+            }
+            break;
+        }
+
+        ErrorCode = WnbdAsyncFetchPost(Device, Fetch);
+        if (ErrorCode) {
+            break;
+        }
+    }
+
+    WnbdStopDispatcher(Device, TRUE);
+    // Without outstanding fetches, we won't get the disconnect request.
+    if (!Dispatcher->PendingFetches) {
+        WnbdSignalStopped(Device);
+    }
+    // Wakes up the other dispatcher threads.
+    for (UINT32 i = 0; i < Device->DispatcherThreadsCount; i++) {
+        PostQueuedCompletionStatus(Dispatcher->Port, 0, 0, NULL);
+    }
+
+    return ErrorCode;
+}
+
+DWORD WnbdAsyncDispatcherSetup(PWNBD_DEVICE Device, DWORD FetchCount)
+{
+    DWORD SlotSize = WNBD_DEFAULT_MAX_TRANSFER_LENGTH;
+    PWNBD_ASYNC_DISPATCHER Dispatcher = (PWNBD_ASYNC_DISPATCHER) calloc(
+        1, sizeof(WNBD_ASYNC_DISPATCHER));
+    if (!Dispatcher) {
+        LogError(Device, "Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    // Released by WnbdClose, even if the setup fails.
+    Device->AsyncDispatcher = Dispatcher;
+
+    DWORD ErrorCode = WnbdOpenDevice(&Dispatcher->Handle);
+    if (ErrorCode) {
+        Dispatcher->Handle = NULL;
+        LogError(Device, "Could not open WNBD device. Error: %d.", ErrorCode);
+        return ErrorCode;
+    }
+    Dispatcher->Port = CreateIoCompletionPort(
+        Dispatcher->Handle, NULL, 0, 0);
+    if (!Dispatcher->Port) {
+        ErrorCode = GetLastError();
+        LogError(Device, "Could not create completion port. Error: %d.",
+                 ErrorCode);
+        return ErrorCode;
     }
 
+    Dispatcher->Fetches = (PWNBD_ASYNC_FETCH) calloc(
+        FetchCount, sizeof(WNBD_ASYNC_FETCH));
+    if (!Dispatcher->Fetches) {
+        LogError(Device, "Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    Dispatcher->FetchCount = FetchCount;
+
+    for (DWORD i = 0; i < FetchCount; i++) {
+        PWNBD_ASYNC_FETCH Fetch = &Dispatcher->Fetches[i];
+        Fetch->Context.Device = Device;
+        Fetch->Context.Buffer = (PBYTE) malloc(SlotSize);
+        Fetch->Context.BufferSize = SlotSize;
+        Fetch->Command = (PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND) malloc(
+            WNBD_ASYNC_FETCH_COMMAND_SIZE);
+        if (!Fetch->Context.Buffer || !Fetch->Command) {
+            LogError(Device, "Could not allocate fetch buffers.");
+            return ERROR_OUTOFMEMORY;
+        }
+
+        // Asynchronous fetches require registered buffers.
+        ErrorCode = WnbdIoctlRegisterBuffer(
+            Device->Handle, Device->ConnectionInfo.ConnectionId,
+            Fetch->Context.Buffer, SlotSize, &Fetch->Context.BufferId);
+        if (ErrorCode) {
+            LogError(Device, "Could not register fetch buffer. Error: %d.",
+                     ErrorCode);
+            return ErrorCode;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+DWORD WnbdStartDispatcherThreads(
+    PWNBD_DEVICE Device,
+    DWORD ThreadCount,
+    LPTHREAD_START_ROUTINE DispatcherLoop)
+{
+    DWORD ErrorCode = ERROR_SUCCESS;
+
     LogDebug(Device, "Starting dispatcher. Threads: %u", ThreadCount);
     Device->DispatcherThreads = (HANDLE*)malloc(sizeof(HANDLE) * ThreadCount);
     if (!Device->DispatcherThreads) {
@@ -587,7 +1319,7 @@ DWORD WnbdStartDispatcher(PWNBD_DEVICE Device, DWORD ThreadCount)
     for (DWORD i = 0; i < ThreadCount; i++)
     {
         HANDLE Thread = CreateThread(
-            0, 0, (LPTHREAD_START_ROUTINE )WnbdDispatcherLoop, Device, 0, 0);
+            0, 0, DispatcherLoop, Device, 0, 0);
         if (!Thread)
         {
             LogError(Device, "Could not start dispatcher thread.");
@@ -603,6 +1335,94 @@ DWORD WnbdStartDispatcher(PWNBD_DEVICE Device, DWORD ThreadCount)
     return ErrorCode;
 }
 
+DWORD WnbdStartDispatcher(PWNBD_DEVICE Device, DWORD ThreadCount)
+{
+    if (ThreadCount < WNBD_MIN_DISPATCHER_THREAD_COUNT ||
+       ThreadCount > WNBD_MAX_DISPATCHER_THREAD_COUNT) {
+        LogError(Device, "Invalid number of dispatcher threads: %u",
+                 ThreadCount);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    return WnbdStartDispatcherThreads(
+        Device, ThreadCount, (LPTHREAD_START_ROUTINE)WnbdDispatcherLoop);
+}
+
+DWORD WnbdStartRingDispatcher(
+    PWNBD_DEVICE Device,
+    DWORD ThreadCount,
+    UINT32 EntryCount)
+{
+    if (ThreadCount < WNBD_MIN_DISPATCHER_THREAD_COUNT ||
+       ThreadCount > WNBD_MAX_DISPATCHER_THREAD_COUNT) {
+        LogError(Device, "Invalid number of dispatcher threads: %u",
+                 ThreadCount);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (Device->Ring) {
+        LogError(Device, "The device rings are already set up.");
+        return ERROR_ALREADY_INITIALIZED;
+    }
+
+    DWORD ErrorCode = WnbdRingSetup(Device, EntryCount);
+    if (ErrorCode) {
+        return ErrorCode;
+    }
+
+    return WnbdStartDispatcherThreads(
+        Device, ThreadCount, (LPTHREAD_START_ROUTINE)WnbdRingDispatcherLoop);
+}
+
+DWORD WnbdStartAsyncDispatcher(
+    PWNBD_DEVICE Device,
+    DWORD ThreadCount,
+    DWORD FetchCount)
+{
+    if (ThreadCount < WNBD_MIN_DISPATCHER_THREAD_COUNT ||
+       ThreadCount > WNBD_MAX_DISPATCHER_THREAD_COUNT) {
+        LogError(Device, "Invalid number of dispatcher threads: %u",
+                 ThreadCount);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (!FetchCount || FetchCount > WNBD_MAX_ASYNC_FETCH_COUNT) {
+        LogError(Device, "Invalid number of outstanding fetches: %u",
+                 FetchCount);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (Device->AsyncDispatcher) {
+        LogError(Device, "The asynchronous dispatcher is already set up.");
+        return ERROR_ALREADY_INITIALIZED;
+    }
+
+    DWORD ErrorCode = WnbdAsyncDispatcherSetup(Device, FetchCount);
+    if (ErrorCode) {
+        return ErrorCode;
+    }
+
+    ErrorCode = WnbdStartDispatcherThreads(
+        Device, ThreadCount, (LPTHREAD_START_ROUTINE)WnbdAsyncDispatcherLoop);
+    if (ErrorCode) {
+        return ErrorCode;
+    }
+
+    PWNBD_ASYNC_DISPATCHER Dispatcher = Device->AsyncDispatcher;
+    for (DWORD i = 0; i < FetchCount; i++) {
+        ErrorCode = WnbdAsyncFetchPost(Device, &Dispatcher->Fetches[i]);
+        if (ErrorCode) {
+            WnbdStopDispatcher(Device, TRUE);
+            if (!Dispatcher->PendingFetches) {
+                WnbdSignalStopped(Device);
+            }
+            for (UINT32 j = 0; j < Device->DispatcherThreadsCount; j++) {
+                PostQueuedCompletionStatus(Dispatcher->Port, 0, 0, NULL);
+            }
+            break;
+        }
+    }
+
+    return ErrorCode;
+}
+
 DWORD WnbdWaitDispatcher(PWNBD_DEVICE Device)
 {
     LogDebug(Device, "Waiting for the dispatcher to stop.");
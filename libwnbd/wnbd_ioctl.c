@@ -124,9 +124,61 @@ DWORD WnbdIoctlCreate(HANDLE Device, PWNBD_PROPERTIES Properties,
     return ErrorCode;
 }
 
+DWORD WnbdIoctlCreateEx(HANDLE Device, PWNBD_PROPERTIES Properties,
+                        PWNBD_EXTENDED_PROPERTIES ExtendedProperties,
+                        PWNBD_CONNECTION_INFO ConnectionInfo)
+{
+    DWORD ErrorCode = ERROR_SUCCESS;
+
+    if (STRING_OVERFLOWS(Properties->InstanceName, WNBD_MAX_NAME_LENGTH) ||
+        STRING_OVERFLOWS(Properties->SerialNumber, WNBD_MAX_NAME_LENGTH) ||
+        STRING_OVERFLOWS(Properties->Owner, WNBD_MAX_OWNER_LENGTH) ||
+        STRING_OVERFLOWS(Properties->NbdProperties.Hostname, WNBD_MAX_NAME_LENGTH) ||
+        STRING_OVERFLOWS(Properties->NbdProperties.ExportName, WNBD_MAX_NAME_LENGTH) ||
+        STRING_OVERFLOWS(ExtendedProperties->OverlayPath, WNBD_MAX_PATH_LENGTH) ||
+        STRING_OVERFLOWS(ExtendedProperties->MirrorProperties.NbdProperties.Hostname,
+                         WNBD_MAX_NAME_LENGTH) ||
+        STRING_OVERFLOWS(ExtendedProperties->MirrorProperties.NbdProperties.ExportName,
+                         WNBD_MAX_NAME_LENGTH))
+    {
+        return ERROR_BUFFER_OVERFLOW;
+    }
+
+    if (!Properties->InstanceName)
+        return ERROR_INVALID_PARAMETER;
+
+    DWORD BytesReturned = 0;
+    WNBD_IOCTL_CREATE_EX_COMMAND Command = { 0 };
+
+    Command.IoControlCode = IOCTL_WNBD_CREATE_EX;
+    memcpy(&Command.Properties, Properties, sizeof(WNBD_PROPERTIES));
+    memcpy(&Command.ExtendedProperties, ExtendedProperties,
+           sizeof(WNBD_EXTENDED_PROPERTIES));
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command), ConnectionInfo, sizeof(WNBD_CONNECTION_INFO),
+        &BytesReturned, NULL);
+    if (!DevStatus) {
+        ErrorCode = GetLastError();
+    }
+
+    return ErrorCode;
+}
+
 
 DWORD WnbdIoctlRemove(
     HANDLE Device, const char* InstanceName, BOOLEAN HardRemove)
+{
+    WNBD_REMOVE_COMMAND_FLAGS Flags = { 0 };
+    Flags.HardRemove = !!HardRemove;
+    return WnbdIoctlRemoveEx(Device, InstanceName, &Flags);
+}
+
+DWORD WnbdIoctlRemoveEx(
+    HANDLE Device,
+    const char* InstanceName,
+    PWNBD_REMOVE_COMMAND_FLAGS Flags)
 {
     DWORD Status = ERROR_SUCCESS;
 
@@ -134,14 +186,14 @@ DWORD WnbdIoctlRemove(
         return ERROR_BUFFER_OVERFLOW;
     }
 
-    if (!InstanceName)
+    if (!InstanceName || !Flags)
         return ERROR_INVALID_PARAMETER;
 
     DWORD BytesReturned = 0;
     WNBD_IOCTL_REMOVE_COMMAND Command = { 0 };
 
     Command.IoControlCode = IOCTL_WNBD_REMOVE;
-    Command.Flags.HardRemove = !!HardRemove;
+    Command.Flags = *Flags;
     memcpy(Command.InstanceName, InstanceName, strlen(InstanceName));
 
     BOOL DevStatus = DeviceIoControl(
@@ -186,6 +238,112 @@ DWORD WnbdIoctlFetchRequest(
     return Status;
 }
 
+DWORD WnbdIoctlFetchRequests(
+    HANDLE Device,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IO_REQUEST Requests,
+    PUINT32 RequestCount,
+    PVOID DataBuffer,
+    UINT32 SlotSize)
+{
+    DWORD Status = ERROR_SUCCESS;
+
+    if (!*RequestCount || *RequestCount > WNBD_MAX_FETCH_BATCH) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    DWORD BytesReturned = 0;
+    DWORD CommandSize = WNBD_FETCH_REQ_BATCH_COMMAND_SIZE(*RequestCount);
+    // Avoids allocating the command buffer for every call.
+    BYTE CommandBuffer[WNBD_FETCH_REQ_BATCH_COMMAND_SIZE(WNBD_MAX_FETCH_BATCH)];
+    PWNBD_IOCTL_FETCH_REQ_BATCH_COMMAND Command =
+        (PWNBD_IOCTL_FETCH_REQ_BATCH_COMMAND)CommandBuffer;
+    memset(Command, 0, CommandSize);
+
+    Command->IoControlCode = IOCTL_WNBD_FETCH_REQ_BATCH;
+    Command->ConnectionId = ConnectionId;
+    Command->DataBuffer = DataBuffer;
+    Command->SlotSize = SlotSize;
+    Command->RequestCount = *RequestCount;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        Command, CommandSize, Command, CommandSize,
+        &BytesReturned, NULL);
+    if (!DevStatus) {
+        Status = GetLastError();
+        *RequestCount = 0;
+    }
+    else {
+        *RequestCount = min(Command->RequestCount, *RequestCount);
+        memcpy(Requests, Command->Requests,
+               sizeof(WNBD_IO_REQUEST) * *RequestCount);
+    }
+
+    return Status;
+}
+
+DWORD WnbdIoctlSendResponsesFetchRequests(
+    HANDLE Device,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IO_RESPONSE_ENTRY Responses,
+    UINT32 ResponseCount,
+    PUINT32 FailedResponseCount,
+    PWNBD_IO_REQUEST Requests,
+    PUINT32 RequestCount,
+    PVOID DataBuffer,
+    UINT32 SlotSize,
+    UINT32 BufferId)
+{
+    DWORD Status = ERROR_SUCCESS;
+
+    *FailedResponseCount = 0;
+    if (*RequestCount > WNBD_MAX_FETCH_BATCH ||
+            ResponseCount > WNBD_MAX_FETCH_BATCH) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    DWORD BytesReturned = 0;
+    DWORD CommandSize = WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(
+        *RequestCount, ResponseCount);
+    // Avoids allocating the command buffer for every call.
+    BYTE CommandBuffer[WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(
+        WNBD_MAX_FETCH_BATCH, WNBD_MAX_FETCH_BATCH)];
+    PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND Command =
+        (PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND)CommandBuffer;
+    memset(Command, 0, CommandSize);
+
+    Command->IoControlCode = IOCTL_WNBD_SEND_RSP_FETCH_REQ;
+    Command->ConnectionId = ConnectionId;
+    Command->DataBuffer = DataBuffer;
+    Command->SlotSize = SlotSize;
+    Command->BufferId = BufferId;
+    Command->RequestCount = *RequestCount;
+    Command->ResponseCount = ResponseCount;
+    if (ResponseCount) {
+        memcpy(WNBD_SEND_RSP_FETCH_REQ_RESPONSES(Command), Responses,
+               sizeof(WNBD_IO_RESPONSE_ENTRY) * ResponseCount);
+    }
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        Command, CommandSize,
+        Command, WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(*RequestCount, 0),
+        &BytesReturned, NULL);
+    if (!DevStatus) {
+        Status = GetLastError();
+        *RequestCount = 0;
+    }
+    else {
+        *FailedResponseCount = Command->FailedResponseCount;
+        *RequestCount = min(Command->RequestCount, *RequestCount);
+        memcpy(Requests, Command->Requests,
+               sizeof(WNBD_IO_REQUEST) * *RequestCount);
+    }
+
+    return Status;
+}
+
 DWORD WnbdIoctlSendResponse(
     HANDLE Device,
     WNBD_CONNECTION_ID ConnectionId,
@@ -216,6 +374,69 @@ DWORD WnbdIoctlSendResponse(
     return Status;
 }
 
+DWORD WnbdIoctlSendResponsesFetchRequestsAsync(
+    HANDLE Device,
+    PWNBD_IOCTL_SEND_RSP_FETCH_REQ_COMMAND Command,
+    LPOVERLAPPED Overlapped)
+{
+    DWORD Status = ERROR_SUCCESS;
+
+    if (Command->RequestCount > WNBD_MAX_FETCH_BATCH ||
+            Command->ResponseCount > WNBD_MAX_FETCH_BATCH) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    Command->IoControlCode = IOCTL_WNBD_SEND_RSP_FETCH_REQ;
+    Command->Flags |= WNBD_FETCH_FLAG_ASYNC;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        Command,
+        WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(
+            Command->RequestCount, Command->ResponseCount),
+        Command,
+        WNBD_SEND_RSP_FETCH_REQ_COMMAND_SIZE(Command->RequestCount, 0),
+        NULL, Overlapped);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
+DWORD WnbdIoctlRingSetup(
+    HANDLE Device,
+    WNBD_CONNECTION_ID ConnectionId,
+    UINT32 EntryCount,
+    UINT32 SlotSize,
+    HANDLE RequestEvent,
+    HANDLE ResponseEvent,
+    PWNBD_RING_INFO RingInfo)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    WNBD_IOCTL_RING_SETUP_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_RING_SETUP;
+    Command.ConnectionId = ConnectionId;
+    Command.EntryCount = EntryCount;
+    Command.SlotSize = SlotSize;
+    Command.RequestEvent = RequestEvent;
+    Command.ResponseEvent = ResponseEvent;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        RingInfo, sizeof(WNBD_RING_INFO), &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
 DWORD WnbdIoctlList(
     HANDLE Device,
     PWNBD_CONNECTION_LIST ConnectionList,
@@ -236,6 +457,68 @@ DWORD WnbdIoctlList(
     return Status;
 }
 
+DWORD WnbdIoctlListPaged(
+    HANDLE Device,
+    PWNBD_LIST_PAGED_FLAGS Flags,
+    UINT64 Cursor,
+    UINT64 ChangedSince,
+    PWNBD_CONNECTION_PAGE Page,
+    DWORD BufferSize)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    if (!Page)
+        return ERROR_INVALID_PARAMETER;
+
+    WNBD_IOCTL_LIST_PAGED_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_LIST_PAGED;
+    if (Flags)
+        Command.Flags = *Flags;
+    Command.Cursor = Cursor;
+    Command.ChangedSince = ChangedSince;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        Page, BufferSize, &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
+DWORD WnbdIoctlWaitChange(
+    HANDLE Device,
+    UINT64 Sequence,
+    UINT32 TimeoutMs,
+    PUINT64 CurrentSequence)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    if (!CurrentSequence)
+        return ERROR_INVALID_PARAMETER;
+
+    WNBD_IOCTL_WAIT_CHANGE_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_WAIT_CHANGE;
+    Command.Sequence = Sequence;
+    Command.TimeoutMs = TimeoutMs;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        CurrentSequence, sizeof(UINT64), &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
 DWORD WnbdIoctlStats(HANDLE Device, const char* InstanceName,
                      PWNBD_DRV_STATS Stats)
 {
@@ -258,6 +541,29 @@ DWORD WnbdIoctlStats(HANDLE Device, const char* InstanceName,
     return Status;
 }
 
+DWORD WnbdIoctlIoStats(HANDLE Device, const char* InstanceName,
+                       PWNBD_IO_STATS Stats)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    WNBD_IOCTL_IO_STATS_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_IO_STATS;
+    Command.Version = WNBD_IO_STATS_VERSION;
+    memcpy(Command.InstanceName, InstanceName, strlen(InstanceName));
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        Stats, sizeof(WNBD_IO_STATS), &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
 DWORD WnbdIoctlReloadConfig(HANDLE Device)
 {
     DWORD BytesReturned = 0;
@@ -307,3 +613,250 @@ DWORD WnbdIoctlVersion(HANDLE Device, PWNBD_VERSION Version)
 
     return Status;
 }
+
+DWORD WnbdIoctlAdapterStats(HANDLE Device, PWNBD_ADAPTER_STATS Stats)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    if (!Stats)
+        return ERROR_INVALID_PARAMETER;
+
+    WNBD_IOCTL_ADAPTER_STATS_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_ADAPTER_STATS;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        Stats, sizeof(WNBD_ADAPTER_STATS), &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
+DWORD WnbdIoctlCbtSnapshot(
+    HANDLE Device,
+    const char* InstanceName,
+    PWNBD_CBT_SNAPSHOT_INFO SnapshotInfo)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    if (!InstanceName || !SnapshotInfo)
+        return ERROR_INVALID_PARAMETER;
+
+    if (STRING_OVERFLOWS(InstanceName, WNBD_MAX_NAME_LENGTH)) {
+        return ERROR_BUFFER_OVERFLOW;
+    }
+
+    WNBD_IOCTL_CBT_SNAPSHOT_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_CBT_SNAPSHOT;
+    memcpy(Command.InstanceName, InstanceName, strlen(InstanceName));
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        SnapshotInfo, sizeof(WNBD_CBT_SNAPSHOT_INFO), &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
+DWORD WnbdIoctlTraceControl(
+    HANDLE Device,
+    BOOLEAN Enable,
+    UINT32 RecordsPerCpu)
+{
+    DWORD BytesReturned = 0;
+
+    WNBD_IOCTL_TRACE_CONTROL_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_TRACE_CONTROL;
+    Command.Enable = Enable;
+    Command.RecordsPerCpu = RecordsPerCpu;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command), NULL, 0, &BytesReturned, NULL);
+    if (!DevStatus) {
+        return GetLastError();
+    }
+
+    return ERROR_SUCCESS;
+}
+
+DWORD WnbdIoctlTraceRead(
+    HANDLE Device,
+    PWNBD_TRACE_BUFFER Buffer,
+    DWORD BufferSize)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    if (!Buffer || BufferSize < sizeof(WNBD_TRACE_BUFFER))
+        return ERROR_INVALID_PARAMETER;
+
+    WNBD_IOCTL_TRACE_READ_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_TRACE_READ;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        Buffer, BufferSize, &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
+DWORD WnbdIoctlEventLogControl(
+    HANDLE Device,
+    UINT32 LogLevel,
+    UINT32 RecordsPerCpu)
+{
+    DWORD BytesReturned = 0;
+
+    WNBD_IOCTL_EVENT_LOG_CONTROL_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_EVENT_LOG_CONTROL;
+    Command.LogLevel = LogLevel;
+    Command.RecordsPerCpu = RecordsPerCpu;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command), NULL, 0, &BytesReturned, NULL);
+    if (!DevStatus) {
+        return GetLastError();
+    }
+
+    return ERROR_SUCCESS;
+}
+
+DWORD WnbdIoctlEventLogRead(
+    HANDLE Device,
+    PWNBD_EVENT_LOG_BUFFER Buffer,
+    DWORD BufferSize)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    if (!Buffer || BufferSize < sizeof(WNBD_EVENT_LOG_BUFFER))
+        return ERROR_INVALID_PARAMETER;
+
+    WNBD_IOCTL_EVENT_LOG_READ_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_EVENT_LOG_READ;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        Buffer, BufferSize, &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
+DWORD WnbdIoctlCbtFetch(
+    HANDLE Device,
+    const char* InstanceName,
+    UINT64 SnapshotId,
+    UINT64 StartBlock,
+    PWNBD_CBT_BITMAP Bitmap,
+    DWORD BitmapBufferSize)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    if (!InstanceName || !Bitmap)
+        return ERROR_INVALID_PARAMETER;
+
+    if (STRING_OVERFLOWS(InstanceName, WNBD_MAX_NAME_LENGTH)) {
+        return ERROR_BUFFER_OVERFLOW;
+    }
+
+    WNBD_IOCTL_CBT_FETCH_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_CBT_FETCH;
+    Command.SnapshotId = SnapshotId;
+    Command.StartBlock = StartBlock;
+    memcpy(Command.InstanceName, InstanceName, strlen(InstanceName));
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        Bitmap, BitmapBufferSize, &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
+DWORD WnbdIoctlSetQos(
+    HANDLE Device,
+    const char* InstanceName,
+    PWNBD_QOS_LIMITS Limits)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    if (!InstanceName || !Limits)
+        return ERROR_INVALID_PARAMETER;
+
+    if (STRING_OVERFLOWS(InstanceName, WNBD_MAX_NAME_LENGTH)) {
+        return ERROR_BUFFER_OVERFLOW;
+    }
+
+    WNBD_IOCTL_SET_QOS_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_SET_QOS;
+    Command.Limits = *Limits;
+    memcpy(Command.InstanceName, InstanceName, strlen(InstanceName));
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command), NULL, 0, &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    }
+
+    return Status;
+}
+
+DWORD WnbdIoctlRegisterBuffer(
+    HANDLE Device,
+    WNBD_CONNECTION_ID ConnectionId,
+    PVOID Buffer,
+    UINT32 BufferSize,
+    PUINT32 BufferId)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    WNBD_IOCTL_REGISTER_BUFFER_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_REGISTER_BUFFER;
+    Command.ConnectionId = ConnectionId;
+    Command.Buffer = Buffer;
+    Command.BufferSize = BufferSize;
+
+    BOOL DevStatus = DeviceIoControl(
+        Device, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        &Command, sizeof(Command), &BytesReturned, NULL);
+
+    if (!DevStatus) {
+        Status = GetLastError();
+    } else {
+        *BufferId = Command.BufferId;
+    }
+
+    return Status;
+}
@@ -8,8 +8,12 @@
 #include "wnbd.h"
 #include "nbd_protocol.h"
 #include "version.h"
+#include "wnbd_log_events.h"
 
+#include <algorithm>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <codecvt>
 #include <locale>
 
@@ -27,11 +31,97 @@ void PrintSyntax()
     fprintf(stderr, "wnbd-client -v\n");
     fprintf(stderr, "wnbd-client map  <InstanceName> <HostName> "
                     "<PortName> <ExportName> [<SkipNBDNegotiation> "
-                    "<ReadOnly> <DiskSize> <BlockSize>]\n");
-    fprintf(stderr, "wnbd-client unmap <InstanceName> [HardRemove]\n");
+                    "<ReadOnly> <DiskSize> <BlockSize> <ChangeTracking> "
+                    "<RequestTimeoutMs> <MaxRequestRetries> <MaxQueueDepth> "
+                    "<AdaptiveQueueDepth> <SchedulerWeight>]\n");
+    fprintf(stderr, "wnbd-client map-mirror <InstanceName> <HostName> "
+                    "<PortName> <ExportName> <MirrorHostName> "
+                    "<MirrorPortName> <MirrorExportName> [<WriteQuorum> "
+                    "<ReadOnly>]\n");
+    fprintf(stderr, "wnbd-client map-overlay <InstanceName> <HostName> "
+                    "<PortName> <ExportName> <OverlayPath> "
+                    "[<DiscardOverlay>]\n");
+    fprintf(stderr, "wnbd-client unmap <InstanceName> [HardRemove] [Async]\n");
     fprintf(stderr, "wnbd-client list \n");
+    fprintf(stderr, "wnbd-client watch\n");
     fprintf(stderr, "wnbd-client set-debug <DebugMode>\n");
     fprintf(stderr, "wnbd-client stats <InstanceName>\n");
+    fprintf(stderr, "wnbd-client adapter-stats\n");
+    fprintf(stderr, "wnbd-client cbt-snapshot <InstanceName>\n");
+    fprintf(stderr, "wnbd-client cbt-fetch <InstanceName> <SnapshotId>\n");
+    fprintf(stderr, "wnbd-client set-qos <InstanceName> <ReadIops> <WriteIops> "
+                    "<ReadBytesPerSec> <WriteBytesPerSec> [<ReadIopsBurst> "
+                    "<WriteIopsBurst> <ReadBytesBurst> <WriteBytesBurst>]\n");
+    fprintf(stderr, "wnbd-client trace-start [<RecordsPerCpu>]\n");
+    fprintf(stderr, "wnbd-client trace-stop\n");
+    fprintf(stderr, "wnbd-client trace [<DurationSec>] [<Verbose>]\n");
+    fprintf(stderr, "wnbd-client set-event-log <LogLevel> [<RecordsPerCpu>]\n");
+    fprintf(stderr, "wnbd-client event-log [<DurationSec>]\n");
+}
+
+const char* QueueDepthStateToString(WnbdQueueDepthState State)
+{
+    switch (State) {
+    case WnbdQueueDepthFixed:
+        return "Fixed";
+    case WnbdQueueDepthSlowStart:
+        return "SlowStart";
+    case WnbdQueueDepthIncrease:
+        return "Increase";
+    case WnbdQueueDepthHold:
+        return "Hold";
+    case WnbdQueueDepthBackoff:
+        return "Backoff";
+    default:
+        return "Unknown";
+    }
+}
+
+const char* IoOpToString(int Op)
+{
+    switch (Op) {
+    case WnbdIoOpRead:
+        return "Read";
+    case WnbdIoOpWrite:
+        return "Write";
+    case WnbdIoOpFlush:
+        return "Flush";
+    case WnbdIoOpUnmap:
+        return "Unmap";
+    default:
+        return "Unknown";
+    }
+}
+
+const char* LatencyTypeToString(int Type)
+{
+    switch (Type) {
+    case WnbdLatencyTotal:
+        return "Total";
+    case WnbdLatencyQueueWait:
+        return "QueueWait";
+    case WnbdLatencyWire:
+        return "Wire";
+    default:
+        return "Unknown";
+    }
+}
+
+// Returns the upper bound (in microseconds) of the histogram bucket
+// that holds the specified percentile.
+UINT64 GetLatencyPercentile(PUINT64 Buckets, UINT64 Count, double Percentile)
+{
+    UINT64 Threshold = (UINT64)(Count * Percentile / 100);
+    UINT64 Seen = 0;
+    for (UINT32 Idx = 0; Idx < WNBD_LATENCY_BUCKET_COUNT; Idx++) {
+        Seen += Buckets[Idx];
+        if (Seen > Threshold || Seen == Count) {
+            return Idx + 1 < WNBD_LATENCY_BUCKET_COUNT ?
+                WNBD_LATENCY_BUCKET_LOWER_US(Idx + 1) :
+                WNBD_LATENCY_BUCKET_LOWER_US(Idx);
+        }
+    }
+    return 0;
 }
 
 void PrintFormattedError(DWORD Error)
@@ -79,7 +169,13 @@ DWORD CmdMap(
     UINT64 DiskSize,
     UINT32 BlockSize,
     BOOLEAN SkipNegotiation,
-    BOOLEAN ReadOnly)
+    BOOLEAN ReadOnly,
+    BOOLEAN ChangeTracking,
+    UINT32 RequestTimeoutMs,
+    UINT32 MaxRequestRetries,
+    UINT32 MaxQueueDepth,
+    BOOLEAN AdaptiveQueueDepth,
+    UINT32 SchedulerWeight)
 {
     if (!PortNumber) {
         fprintf(stderr, "Missing NBD server port number.\n");
@@ -117,6 +213,12 @@ DWORD CmdMap(
 
     Props.Flags.UseNbd = TRUE;
     Props.Flags.ReadOnly = ReadOnly;
+    Props.Flags.ChangeTracking = ChangeTracking;
+    Props.RequestTimeoutMs = RequestTimeoutMs;
+    Props.MaxRequestRetries = MaxRequestRetries;
+    Props.MaxQueueDepth = MaxQueueDepth;
+    Props.Flags.AdaptiveQueueDepth = AdaptiveQueueDepth;
+    Props.SchedulerWeight = SchedulerWeight;
 
     Props.Pid = _getpid();
     Props.BlockSize = BlockSize;
@@ -133,10 +235,144 @@ DWORD CmdMap(
     return Status;
 }
 
+DWORD CmdMapMirror(
+    PCHAR InstanceName,
+    PCHAR HostName,
+    DWORD PortNumber,
+    PCHAR ExportName,
+    PCHAR MirrorHostName,
+    DWORD MirrorPortNumber,
+    PCHAR MirrorExportName,
+    UINT32 WriteQuorum,
+    BOOLEAN ReadOnly)
+{
+    if (!PortNumber || !MirrorPortNumber) {
+        fprintf(stderr, "Missing NBD server port number.\n");
+    }
+
+    WNBD_PROPERTIES Props = { 0 };
+    WNBD_EXTENDED_PROPERTIES ExProps = { 0 };
+    HANDLE WnbdDriverHandle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&WnbdDriverHandle);
+    if (Status) {
+        fprintf(
+            stderr,
+            "Could not open WNBD device. Make sure that the driver "
+            "is installed.\n");
+        return Status;
+    }
+
+    memcpy(&Props.InstanceName, InstanceName,
+        min(strlen(InstanceName) + 1, WNBD_MAX_NAME_LENGTH));
+    memcpy(&Props.SerialNumber, InstanceName,
+        min(strlen(InstanceName) + 1, WNBD_MAX_NAME_LENGTH));
+    memcpy(&Props.Owner, WNBD_CLI_OWNER_NAME,
+        strlen(WNBD_CLI_OWNER_NAME));
+
+    memcpy(&Props.NbdProperties.Hostname, HostName,
+        min(strlen(HostName) + 1, WNBD_MAX_NAME_LENGTH));
+    memcpy(&Props.NbdProperties.ExportName, ExportName,
+        min(strlen(ExportName) + 1, WNBD_MAX_NAME_LENGTH));
+    Props.NbdProperties.PortNumber = PortNumber;
+
+    PWNBD_MIRROR_PROPERTIES MirrorProps = &ExProps.MirrorProperties;
+    memcpy(&MirrorProps->NbdProperties.Hostname, MirrorHostName,
+        min(strlen(MirrorHostName) + 1, WNBD_MAX_NAME_LENGTH));
+    memcpy(&MirrorProps->NbdProperties.ExportName, MirrorExportName,
+        min(strlen(MirrorExportName) + 1, WNBD_MAX_NAME_LENGTH));
+    MirrorProps->NbdProperties.PortNumber = MirrorPortNumber;
+    MirrorProps->WriteQuorum = WriteQuorum;
+
+    Props.Flags.UseNbd = TRUE;
+    Props.Flags.UseMirror = TRUE;
+    Props.Flags.ReadOnly = ReadOnly;
+
+    Props.Pid = _getpid();
+
+    WNBD_CONNECTION_INFO ConnectionInfo = { 0 };
+    Status = WnbdIoctlCreateEx(WnbdDriverHandle, &Props, &ExProps,
+                               &ConnectionInfo);
+    if (Status) {
+        fprintf(stderr, "Could not create mapping.\n");
+        PrintFormattedError(Status);
+    }
+
+    CloseHandle(WnbdDriverHandle);
+    return Status;
+}
+
+DWORD CmdMapOverlay(
+    PCHAR InstanceName,
+    PCHAR HostName,
+    DWORD PortNumber,
+    PCHAR ExportName,
+    PCHAR OverlayPath,
+    BOOLEAN DiscardOverlay)
+{
+    if (!PortNumber) {
+        fprintf(stderr, "Missing NBD server port number.\n");
+    }
+
+    // The driver expects an NT path.
+    CHAR FullPath[MAX_PATH] = { 0 };
+    DWORD PathLength = GetFullPathNameA(OverlayPath, MAX_PATH, FullPath, NULL);
+    if (!PathLength || PathLength >= MAX_PATH ||
+            PathLength + strlen("\\??\\") >= WNBD_MAX_PATH_LENGTH) {
+        fprintf(stderr, "Invalid overlay path: %s\n", OverlayPath);
+        return ERROR_BAD_PATHNAME;
+    }
+
+    WNBD_PROPERTIES Props = { 0 };
+    WNBD_EXTENDED_PROPERTIES ExProps = { 0 };
+    HANDLE WnbdDriverHandle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&WnbdDriverHandle);
+    if (Status) {
+        fprintf(
+            stderr,
+            "Could not open WNBD device. Make sure that the driver "
+            "is installed.\n");
+        return Status;
+    }
+
+    memcpy(&Props.InstanceName, InstanceName,
+        min(strlen(InstanceName) + 1, WNBD_MAX_NAME_LENGTH));
+    memcpy(&Props.SerialNumber, InstanceName,
+        min(strlen(InstanceName) + 1, WNBD_MAX_NAME_LENGTH));
+    memcpy(&Props.Owner, WNBD_CLI_OWNER_NAME,
+        strlen(WNBD_CLI_OWNER_NAME));
+
+    memcpy(&Props.NbdProperties.Hostname, HostName,
+        min(strlen(HostName) + 1, WNBD_MAX_NAME_LENGTH));
+    memcpy(&Props.NbdProperties.ExportName, ExportName,
+        min(strlen(ExportName) + 1, WNBD_MAX_NAME_LENGTH));
+    Props.NbdProperties.PortNumber = PortNumber;
+
+    _snprintf_s(ExProps.OverlayPath, WNBD_MAX_PATH_LENGTH, _TRUNCATE,
+                "\\??\\%s", FullPath);
 
-DWORD CmdUnmap(PCHAR InstanceName, BOOLEAN HardRemove)
+    Props.Flags.UseNbd = TRUE;
+    Props.Flags.UseOverlay = TRUE;
+    Props.Flags.DiscardOverlay = DiscardOverlay;
+
+    Props.Pid = _getpid();
+
+    WNBD_CONNECTION_INFO ConnectionInfo = { 0 };
+    Status = WnbdIoctlCreateEx(WnbdDriverHandle, &Props, &ExProps,
+                               &ConnectionInfo);
+    if (Status) {
+        fprintf(stderr, "Could not create mapping.\n");
+        PrintFormattedError(Status);
+    }
+
+    CloseHandle(WnbdDriverHandle);
+    return Status;
+}
+
+DWORD CmdUnmap(PCHAR InstanceName, BOOLEAN HardRemove, BOOLEAN Async)
 {
-    DWORD Status = WnbdRemoveEx(InstanceName, HardRemove);
+    DWORD Status = Async ?
+        WnbdRemoveAsync(InstanceName, HardRemove) :
+        WnbdRemoveEx(InstanceName, HardRemove);
     if (Status) {
         CheckOpenFailed(Status);
         fprintf(stderr, "Could not disconnect WNBD device.\n");
@@ -165,60 +401,203 @@ DWORD CmdStats(PCHAR InstanceName)
     printf("AbortedSubmittedIORequests: %llu\n", Stats.AbortedSubmittedIORequests);
     printf("AbortedUnsubmittedIORequests: %llu\n", Stats.AbortedUnsubmittedIORequests);
     printf("CompletedAbortedIORequests: %llu\n", Stats.CompletedAbortedIORequests);
+    printf("MirrorDegradedWrites: %llu\n", Stats.MirrorDegradedWrites);
+    printf("MirrorDirtyRegions: %llu\n", Stats.MirrorDirtyRegions);
+    printf("MirrorResyncedBytes: %llu\n", Stats.MirrorResyncedBytes);
+    printf("MirrorLegFailures: %llu\n", Stats.MirrorLegFailures);
+    printf("OverlayCompletedIORequests: %llu\n", Stats.OverlayCompletedIORequests);
+    printf("OverlayWrittenBytes: %llu\n", Stats.OverlayWrittenBytes);
+    printf("TimedOutIORequests: %llu\n", Stats.TimedOutIORequests);
+    printf("RetriedIORequests: %llu\n", Stats.RetriedIORequests);
+    printf("QueueDepth: %llu\n", Stats.QueueDepth);
+    printf("QueueDepthState: %s\n",
+           QueueDepthStateToString((WnbdQueueDepthState)Stats.QueueDepthState));
+    printf("QueueBaseLatencyUs: %llu\n", Stats.QueueBaseLatencyUs);
+    printf("QueueAverageLatencyUs: %llu\n", Stats.QueueAverageLatencyUs);
+    printf("QueueDeviceBusyEvents: %llu\n", Stats.QueueDeviceBusyEvents);
+    printf("QosThrottledIORequests: %llu\n", Stats.QosThrottledIORequests);
+    printf("QosThrottledTimeUs: %llu\n", Stats.QosThrottledTimeUs);
+
+    WNBD_IO_STATS IoStats = { 0 };
+    Status = WnbdGetDriverIoStats(InstanceName, &IoStats);
+    if (Status) {
+        fprintf(stderr, "Could not get per operation IO stats.\n");
+        PrintFormattedError(Status);
+        return Status;
+    }
+
+    PWNBD_DRV_EXTENDED_STATS ExStats = &IoStats.DeviceStats;
+    printf("SchedulerWeight: %llu\n", ExStats->SchedulerWeight);
+    printf("SchedulerQueueDepth: %llu\n", ExStats->SchedulerQueueDepth);
+    printf("QueueWaitTimeUs: %llu\n", ExStats->QueueWaitTimeUs);
+    printf("PriorityIORequests: %llu\n", ExStats->PriorityIORequests);
+    printf("PendedFetchRequests: %llu\n", ExStats->PendedFetchRequests);
+    printf("CopiedBytes: %llu\n", ExStats->CopiedBytes);
+    printf("ZeroCopyBytes: %llu\n", ExStats->ZeroCopyBytes);
+    // Each payload is either copied once or mapped.
+    UINT64 TransferredBytes = ExStats->CopiedBytes + ExStats->ZeroCopyBytes;
+    printf("CopiedBytesPerGB: %llu\n", TransferredBytes ?
+           (UINT64)((double)ExStats->CopiedBytes / TransferredBytes * (1 << 30)) : 0);
+
+    printf("\nOperation stats:\n");
+    for (int Op = 0; Op < WnbdIoOpCount; Op++) {
+        printf("%s: Requests: %llu Bytes: %llu Errors: %llu\n",
+               IoOpToString(Op), IoStats.Requests[Op], IoStats.Bytes[Op],
+               IoStats.Errors[Op]);
+    }
+
+    printf("\nLatency (us):\n");
+    for (int Type = 0; Type < WnbdLatencyTypeCount; Type++) {
+        UINT64 Count = 0;
+        for (UINT32 Idx = 0; Idx < WNBD_LATENCY_BUCKET_COUNT; Idx++) {
+            Count += IoStats.Latency[Type][Idx];
+        }
+        if (!Count) {
+            printf("%s: no samples\n", LatencyTypeToString(Type));
+            continue;
+        }
+        PUINT64 Buckets = IoStats.Latency[Type];
+        printf("%s: Samples: %llu Avg: %llu P50: %llu P90: %llu "
+               "P99: %llu P99.9: %llu\n",
+               LatencyTypeToString(Type), Count,
+               IoStats.LatencySumUs[Type] / Count,
+               GetLatencyPercentile(Buckets, Count, 50),
+               GetLatencyPercentile(Buckets, Count, 90),
+               GetLatencyPercentile(Buckets, Count, 99),
+               GetLatencyPercentile(Buckets, Count, 99.9));
+    }
     return Status;
 }
 
+DWORD CmdCbtSnapshot(PCHAR InstanceName)
+{
+    WNBD_CBT_SNAPSHOT_INFO SnapshotInfo = { 0 };
+    DWORD Status = WnbdCbtSnapshot(InstanceName, &SnapshotInfo);
+    if (Status) {
+        CheckOpenFailed(Status);
+        fprintf(stderr, "Could not create changed block tracking snapshot.\n");
+        PrintFormattedError(Status);
+        return Status;
+    }
+
+    printf("SnapshotId: %llu\n", SnapshotInfo.SnapshotId);
+    printf("BlockSize: %u\n", SnapshotInfo.BlockSize);
+    printf("BlockCount: %llu\n", SnapshotInfo.BlockCount);
+    printf("ChangedBlockCount: %llu\n", SnapshotInfo.ChangedBlockCount);
+    return Status;
+}
 
-DWORD GetList(PWNBD_CONNECTION_LIST* ConnectionList)
+// Prints the changed extents of the specified changed block tracking
+// snapshot, using the tracking block size as unit.
+DWORD CmdCbtFetch(PCHAR InstanceName, UINT64 SnapshotId)
 {
-    DWORD CurrentBufferSize = 0;
-    DWORD BufferSize = 0;
+    DWORD BufferSize = 64 * 1024;
+    PWNBD_CBT_BITMAP Bitmap = (PWNBD_CBT_BITMAP) calloc(1, BufferSize);
+    if (!Bitmap) {
+        fprintf(stderr, "Could not allocate %d bytes.\n", BufferSize);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
     DWORD Status = 0;
-    PWNBD_CONNECTION_LIST TempList = NULL;
+    UINT64 StartBlock = 0;
+    UINT64 ExtentStart = 0;
+    UINT64 ExtentLength = 0;
 
-    // We're using a loop because other connections may show up by the time
-    // we retry.
+    printf("StartBlock BlockCount\n");
     do {
-        if (TempList)
-            free(TempList);
-
-        if (BufferSize) {
-            TempList = (PWNBD_CONNECTION_LIST) calloc(1, BufferSize);
-            if (!TempList) {
-                fprintf(stderr, "Could not allocate %d bytes.\n", BufferSize);
-                Status = ERROR_NOT_ENOUGH_MEMORY;
-                break;
+        Status = WnbdCbtFetch(InstanceName, SnapshotId, StartBlock,
+                              Bitmap, BufferSize);
+        if (Status) {
+            CheckOpenFailed(Status);
+            fprintf(stderr, "Could not fetch changed block tracking bitmap.\n");
+            PrintFormattedError(Status);
+            break;
+        }
+
+        for (UINT64 Index = 0; Index < Bitmap->BlockCount; Index++) {
+            UINT64 Block = StartBlock + Index;
+            if (Bitmap->Bitmap[Index / 8] & (1 << (Index % 8))) {
+                if (ExtentLength && ExtentStart + ExtentLength == Block) {
+                    ExtentLength++;
+                } else {
+                    if (ExtentLength) {
+                        printf("%llu %llu\n", ExtentStart, ExtentLength);
+                    }
+                    ExtentStart = Block;
+                    ExtentLength = 1;
+                }
             }
         }
+        StartBlock += Bitmap->BlockCount;
+    } while (Bitmap->BlockCount);
 
-        CurrentBufferSize = BufferSize;
-        // If the buffer is too small, the return value is 0 and "BufferSize"
-        // will contain the required size. This is counterintuitive, but
-        // Windows drivers can't return a buffer as well as a non-zero status.
-        Status = WnbdList(TempList, &BufferSize);
-        if (Status)
-            break;
-    } while (CurrentBufferSize < BufferSize);
+    if (!Status && ExtentLength) {
+        printf("%llu %llu\n", ExtentStart, ExtentLength);
+    }
 
-    if (Status) {
-        CheckOpenFailed(Status);
-        fprintf(stderr, "Could not get connection list.\n");
-        PrintFormattedError(Status);
+    free(Bitmap);
+    return Status;
+}
 
-        if (TempList)
-            free(TempList);
-    }
-    else {
-        *ConnectionList = TempList;
+// Summary records retrieved per IOCTL_WNBD_LIST_PAGED call.
+#define LIST_PAGE_RECORD_COUNT 64
+
+// Retrieves the connections changed after "ChangedSince" (all of them
+// if 0), including the removed ones. "Sequence" receives the change
+// sequence number of the first page, changes that occur while listing
+// being picked up by the next call.
+DWORD GetSummaries(
+    UINT64 ChangedSince,
+    std::vector<WNBD_CONNECTION_SUMMARY>& Connections,
+    PUINT64 Sequence,
+    PBOOLEAN HistoryTruncated)
+{
+    DWORD BufferSize = WNBD_CONNECTION_PAGE_SIZE(
+        sizeof(WNBD_CONNECTION_SUMMARY), LIST_PAGE_RECORD_COUNT);
+    PWNBD_CONNECTION_PAGE Page = (PWNBD_CONNECTION_PAGE) calloc(1, BufferSize);
+    if (!Page) {
+        fprintf(stderr, "Could not allocate %d bytes.\n", BufferSize);
+        return ERROR_NOT_ENOUGH_MEMORY;
     }
+
+    WNBD_LIST_PAGED_FLAGS Flags = { 0 };
+    Flags.Summary = 1;
+    UINT64 Cursor = 0;
+    DWORD Status = 0;
+
+    Connections.clear();
+    *HistoryTruncated = FALSE;
+    do {
+        Status = WnbdListPaged(&Flags, Cursor, ChangedSince, Page, BufferSize);
+        if (Status) {
+            CheckOpenFailed(Status);
+            fprintf(stderr, "Could not get connection list.\n");
+            PrintFormattedError(Status);
+            break;
+        }
+
+        if (!Cursor) {
+            *Sequence = Page->Sequence;
+        }
+        *HistoryTruncated |= Page->HistoryTruncated;
+        for (UINT32 Index = 0; Index < Page->Count; Index++) {
+            Connections.push_back(*(PWNBD_CONNECTION_SUMMARY)
+                WNBD_CONNECTION_PAGE_ENTRY(Page, Index));
+        }
+        Cursor = Page->NextCursor;
+    } while (Cursor);
+
+    free(Page);
     return Status;
 }
 
 // TODO: add CmdShow
 DWORD CmdList()
 {
-    PWNBD_CONNECTION_LIST ConnList = NULL;
-    DWORD err = GetList(&ConnList);
+    std::vector<WNBD_CONNECTION_SUMMARY> Connections;
+    UINT64 Sequence = 0;
+    BOOLEAN HistoryTruncated = FALSE;
+    DWORD err = GetSummaries(0, Connections, &Sequence, &HistoryTruncated);
     if (err) {
         return err;
     }
@@ -227,15 +606,13 @@ DWORD CmdList()
     HRESULT hres = WnbdCoInitializeBasic();
     if (FAILED(hres)) {
         fprintf(stderr, "Failed to initialize COM. HRESULT: 0x%x.\n", hres);
-        free(ConnList);
         return HRESULT_CODE(hres);
     }
 
     DWORD Status = 0;
     printf("%-10s  %-10s  %-5s  %-15s  %s\n", "Pid", "DiskNumber", "Nbd", "Owner", "InstanceName");
-    for (ULONG index = 0; index < ConnList->Count; index++) {
-        std::wstring SerialNumberW = to_wstring(
-            ConnList->Connections[index].Properties.SerialNumber);
+    for (auto& Connection : Connections) {
+        std::wstring SerialNumberW = to_wstring(Connection.SerialNumber);
         DWORD DiskNumber = -1;
         hres = WnbdGetDiskNumberBySerialNumber(
             SerialNumberW.c_str(), &DiskNumber);
@@ -246,13 +623,356 @@ DWORD CmdList()
             Status = HRESULT_CODE(hres);
         }
         printf("%-10d  %-10d  %-5s  %-15s  %s\n",
-               ConnList->Connections[index].Properties.Pid,
+               Connection.Pid,
                DiskNumber,
-               ConnList->Connections[index].Properties.Flags.UseNbd ? "true" : "false",
-               ConnList->Connections[index].Properties.Owner,
-               ConnList->Connections[index].Properties.InstanceName);
+               Connection.Flags.UseNbd ? "true" : "false",
+               Connection.Owner,
+               Connection.InstanceName);
+    }
+    return Status;
+}
+
+void PrintConnectionChange(PWNBD_CONNECTION_SUMMARY Connection)
+{
+    const char* State = "connected";
+    if (Connection->ConnectionFlags.Removed) {
+        State = "removed";
+    } else if (Connection->ConnectionFlags.Disconnecting) {
+        State = "disconnecting";
+    }
+    printf("%-10llu  %-14s  %s\n", Connection->ChangeSequence,
+           State, Connection->InstanceName);
+}
+
+// Prints the existing connections, followed by the connection changes
+// as they occur. Only the changed connections are retrieved.
+DWORD CmdWatch()
+{
+    std::vector<WNBD_CONNECTION_SUMMARY> Connections;
+    UINT64 Sequence = 0;
+    UINT64 CurrentSequence = 0;
+    BOOLEAN HistoryTruncated = FALSE;
+
+    DWORD Status = GetSummaries(0, Connections, &Sequence, &HistoryTruncated);
+    if (Status) {
+        return Status;
+    }
+
+    printf("%-10s  %-14s  %s\n", "Sequence", "State", "InstanceName");
+    while (TRUE) {
+        for (auto& Connection : Connections) {
+            PrintConnectionChange(&Connection);
+        }
+        fflush(stdout);
+
+        Status = WnbdWaitChange(Sequence, WNBD_WAIT_INFINITE, &CurrentSequence);
+        if (Status) {
+            CheckOpenFailed(Status);
+            fprintf(stderr, "Could not wait for connection changes.\n");
+            PrintFormattedError(Status);
+            return Status;
+        }
+        if (CurrentSequence == Sequence) {
+            Connections.clear();
+            continue;
+        }
+
+        Status = GetSummaries(Sequence, Connections, &Sequence, &HistoryTruncated);
+        if (!Status && HistoryTruncated) {
+            printf("Some removals were missed, listing all the connections.\n");
+            Status = GetSummaries(0, Connections, &Sequence, &HistoryTruncated);
+        }
+        if (Status) {
+            return Status;
+        }
+    }
+}
+
+DWORD CmdTraceControl(BOOLEAN Enable, UINT32 RecordsPerCpu)
+{
+    HANDLE WnbdDriverHandle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&WnbdDriverHandle);
+    if (Status) {
+        fprintf(
+            stderr,
+            "Could not open WNBD device. Make sure that the driver "
+            "is installed.\n");
+        return Status;
+    }
+
+    Status = WnbdIoctlTraceControl(WnbdDriverHandle, Enable, RecordsPerCpu);
+    if (Status) {
+        fprintf(stderr, "Could not %s request tracing.\n",
+                Enable ? "enable" : "disable");
+        PrintFormattedError(Status);
+    }
+
+    CloseHandle(WnbdDriverHandle);
+    return Status;
+}
+
+// Request lifecycle stages, each one ending with the event that has
+// the same index + 1.
+static const char* TraceStageNames[] = {
+    "Queue", "Submit", "Server", "Complete"
+};
+#define TRACE_STAGE_COUNT (WnbdTraceEventCount - 1)
+
+typedef struct
+{
+    UINT64 Count[TRACE_STAGE_COUNT + 1];
+    UINT64 Sum[TRACE_STAGE_COUNT + 1];
+    UINT64 Max[TRACE_STAGE_COUNT + 1];
+} TRACE_STAGE_STATS, *PTRACE_STAGE_STATS;
+
+typedef struct
+{
+    WNBD_TRACE_RECORD Record;
+    UINT64 Timestamps[WnbdTraceEventCount];
+} TRACED_REQUEST, *PTRACED_REQUEST;
+
+void AccountTraceStage(PTRACE_STAGE_STATS Stats, int Stage, UINT64 Duration)
+{
+    Stats->Count[Stage]++;
+    Stats->Sum[Stage] += Duration;
+    Stats->Max[Stage] = max(Stats->Max[Stage], Duration);
+}
+
+// Computes the stage durations (in microseconds) of a completed request.
+// Stages whose events weren't recorded (e.g. requests served by the
+// overlay) are skipped.
+void AccountTracedRequest(
+    PTRACED_REQUEST Request,
+    PTRACE_STAGE_STATS Stats,
+    BOOLEAN Verbose)
+{
+    PUINT64 Timestamps = Request->Timestamps;
+    if (Verbose) {
+        printf("%-10llu %-10llu %-6s %-14llu %-8u",
+               Request->Record.ConnectionId, Request->Record.Tag,
+               IoOpToString(Request->Record.Op),
+               Request->Record.Offset, Request->Record.Length);
+    }
+    for (int Stage = 0; Stage < TRACE_STAGE_COUNT; Stage++) {
+        if (!Timestamps[Stage] || !Timestamps[Stage + 1] ||
+                Timestamps[Stage + 1] < Timestamps[Stage]) {
+            if (Verbose) {
+                printf(" %10s", "-");
+            }
+            continue;
+        }
+        UINT64 Duration = (Timestamps[Stage + 1] - Timestamps[Stage]) / 10;
+        AccountTraceStage(Stats, Stage, Duration);
+        if (Verbose) {
+            printf(" %10llu", Duration);
+        }
+    }
+    if (Timestamps[WnbdTraceQueued]) {
+        UINT64 Total = (Timestamps[WnbdTraceCompleted] -
+                        Timestamps[WnbdTraceQueued]) / 10;
+        AccountTraceStage(Stats, TRACE_STAGE_COUNT, Total);
+        if (Verbose) {
+            printf(" %10llu", Total);
+        }
+    }
+    if (Verbose) {
+        printf("\n");
+    }
+}
+
+// Streams the trace records, printing per stage latencies. The records
+// are only ordered per CPU, so each batch is sorted before being
+// processed.
+DWORD CmdTrace(UINT32 DurationSec, BOOLEAN Verbose)
+{
+    DWORD BufferSize = (DWORD) WNBD_TRACE_BUFFER_SIZE(16384);
+    PWNBD_TRACE_BUFFER Buffer = (PWNBD_TRACE_BUFFER) calloc(1, BufferSize);
+    if (!Buffer) {
+        fprintf(stderr, "Could not allocate %d bytes.\n", BufferSize);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    HANDLE WnbdDriverHandle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&WnbdDriverHandle);
+    if (Status) {
+        fprintf(
+            stderr,
+            "Could not open WNBD device. Make sure that the driver "
+            "is installed.\n");
+        free(Buffer);
+        return Status;
+    }
+
+    std::unordered_map<UINT64, TRACED_REQUEST> Pending;
+    std::vector<WNBD_TRACE_RECORD> Records;
+    TRACE_STAGE_STATS Stats[WnbdIoOpCount] = { 0 };
+    UINT64 LostRecords = 0;
+    ULONGLONG Deadline = GetTickCount64() + (ULONGLONG)DurationSec * 1000;
+
+    if (Verbose) {
+        printf("%-10s %-10s %-6s %-14s %-8s", "Connection", "Tag", "Op",
+               "Offset", "Length");
+        for (int Stage = 0; Stage < TRACE_STAGE_COUNT; Stage++) {
+            printf(" %10s", TraceStageNames[Stage]);
+        }
+        printf(" %10s\n", "Total");
+    }
+
+    do {
+        Status = WnbdIoctlTraceRead(WnbdDriverHandle, Buffer, BufferSize);
+        if (Status) {
+            fprintf(stderr, "Could not read trace records.\n");
+            PrintFormattedError(Status);
+            break;
+        }
+        LostRecords += Buffer->LostRecords;
+
+        Records.assign(Buffer->Records, Buffer->Records + Buffer->Count);
+        std::sort(Records.begin(), Records.end(),
+            [](const WNBD_TRACE_RECORD& A, const WNBD_TRACE_RECORD& B) {
+                return A.Timestamp < B.Timestamp;
+            });
+        for (auto& Record : Records) {
+            if (Record.Event >= WnbdTraceEventCount ||
+                    Record.Op >= WnbdIoOpCount) {
+                continue;
+            }
+            PTRACED_REQUEST Request = &Pending[Record.RequestId];
+            // The tag is assigned when dequeuing the request.
+            Request->Record = Record;
+            // Requeued requests are accounted from their last submission.
+            Request->Timestamps[Record.Event] = Record.Timestamp;
+            if (Record.Event == WnbdTraceCompleted) {
+                AccountTracedRequest(Request, &Stats[Record.Op], Verbose);
+                Pending.erase(Record.RequestId);
+            }
+        }
+
+        if (Buffer->Count < 16384 && GetTickCount64() < Deadline) {
+            Sleep(200);
+        }
+    } while (GetTickCount64() < Deadline);
+
+    printf("\nLatency breakdown (us), %llu requests pending, "
+           "%llu records lost:\n", (UINT64)Pending.size(), LostRecords);
+    printf("%-6s %-10s %10s %10s %10s\n", "Op", "Stage", "Count", "Avg", "Max");
+    for (int Op = 0; Op < WnbdIoOpCount; Op++) {
+        for (int Stage = 0; Stage <= TRACE_STAGE_COUNT; Stage++) {
+            if (!Stats[Op].Count[Stage]) {
+                continue;
+            }
+            printf("%-6s %-10s %10llu %10llu %10llu\n", IoOpToString(Op),
+                   Stage < TRACE_STAGE_COUNT ? TraceStageNames[Stage] : "Total",
+                   Stats[Op].Count[Stage],
+                   Stats[Op].Sum[Stage] / Stats[Op].Count[Stage],
+                   Stats[Op].Max[Stage]);
+        }
     }
-    free(ConnList);
+
+    CloseHandle(WnbdDriverHandle);
+    free(Buffer);
+    return Status;
+}
+
+DWORD CmdEventLogControl(UINT32 LogLevel, UINT32 RecordsPerCpu)
+{
+    HANDLE WnbdDriverHandle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&WnbdDriverHandle);
+    if (Status) {
+        fprintf(
+            stderr,
+            "Could not open WNBD device. Make sure that the driver "
+            "is installed.\n");
+        return Status;
+    }
+
+    Status = WnbdIoctlEventLogControl(
+        WnbdDriverHandle, LogLevel, RecordsPerCpu);
+    if (Status) {
+        fprintf(stderr, "Could not set the event log level.\n");
+        PrintFormattedError(Status);
+    }
+
+    CloseHandle(WnbdDriverHandle);
+    return Status;
+}
+
+static const WNBD_LOG_EVENT_INFO LogEvents[] = {
+    WNBD_LOG_EVENTS(WNBD_LOG_EVENT_INFO_ENTRY)
+};
+
+// Streams the binary event log records, formatting them using the
+// event table. The records are only ordered per CPU, so each batch is
+// sorted before being printed.
+DWORD CmdEventLog(UINT32 DurationSec)
+{
+    DWORD BufferSize = (DWORD) WNBD_EVENT_LOG_BUFFER_SIZE(16384);
+    PWNBD_EVENT_LOG_BUFFER Buffer = (PWNBD_EVENT_LOG_BUFFER) calloc(
+        1, BufferSize);
+    if (!Buffer) {
+        fprintf(stderr, "Could not allocate %d bytes.\n", BufferSize);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    HANDLE WnbdDriverHandle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenDevice(&WnbdDriverHandle);
+    if (Status) {
+        fprintf(
+            stderr,
+            "Could not open WNBD device. Make sure that the driver "
+            "is installed.\n");
+        free(Buffer);
+        return Status;
+    }
+
+    std::vector<WNBD_EVENT_LOG_RECORD> Records;
+    UINT64 LostRecords = 0;
+    ULONGLONG Deadline = GetTickCount64() + (ULONGLONG)DurationSec * 1000;
+
+    do {
+        Status = WnbdIoctlEventLogRead(WnbdDriverHandle, Buffer, BufferSize);
+        if (Status) {
+            fprintf(stderr, "Could not read event log records.\n");
+            PrintFormattedError(Status);
+            break;
+        }
+        LostRecords += Buffer->LostRecords;
+
+        Records.assign(Buffer->Records, Buffer->Records + Buffer->Count);
+        std::sort(Records.begin(), Records.end(),
+            [](const WNBD_EVENT_LOG_RECORD& A, const WNBD_EVENT_LOG_RECORD& B) {
+                return A.Timestamp < B.Timestamp;
+            });
+        for (auto& Record : Records) {
+            // Events added by newer drivers can't be decoded.
+            if (Record.EventId >= WnbdEvtCount) {
+                printf("%llu.%07llu %3u: Unknown event %u.\n",
+                       Record.Timestamp / 10000000,
+                       Record.Timestamp % 10000000,
+                       Record.Cpu, Record.EventId);
+                continue;
+            }
+            // The formats only use integer conversions, the arguments
+            // being passed as 64 bit values.
+            PUINT64 Args = Record.Args;
+            printf("%llu.%07llu %3u: ", Record.Timestamp / 10000000,
+                   Record.Timestamp % 10000000, Record.Cpu);
+            printf(LogEvents[Record.EventId].Format,
+                   Args[0], Args[1], Args[2], Args[3], Args[4], Args[5]);
+            printf("\n");
+        }
+
+        if (Buffer->Count < 16384 && GetTickCount64() < Deadline) {
+            Sleep(200);
+        }
+    } while (GetTickCount64() < Deadline);
+
+    if (LostRecords) {
+        fprintf(stderr, "%llu records lost.\n", LostRecords);
+    }
+
+    CloseHandle(WnbdDriverHandle);
+    free(Buffer);
     return Status;
 }
 
@@ -286,3 +1006,42 @@ DWORD CmdVersion() {
 
     return Status;
 }
+
+DWORD CmdAdapterStats()
+{
+    WNBD_ADAPTER_STATS Stats = { 0 };
+    DWORD Status = WnbdGetAdapterStats(&Stats);
+    if (Status) {
+        CheckOpenFailed(Status);
+        fprintf(stderr, "Could not get adapter stats.\n");
+        PrintFormattedError(Status);
+        return Status;
+    }
+
+    printf("Adapter stats:\n");
+    printf("BufferPoolMaxBytes: %lld\n", Stats.BufferPoolMaxBytes);
+    printf("BufferPoolAllocatedBytes: %lld\n", Stats.BufferPoolAllocatedBytes);
+    printf("BufferPoolAllocatedHighWaterBytes: %lld\n",
+           Stats.BufferPoolAllocatedHighWaterBytes);
+    printf("BufferPoolInUseBytes: %lld\n", Stats.BufferPoolInUseBytes);
+    printf("BufferPoolInUseHighWaterBytes: %lld\n",
+           Stats.BufferPoolInUseHighWaterBytes);
+    printf("BufferPoolCacheHits: %lld\n", Stats.BufferPoolCacheHits);
+    printf("BufferPoolAllocations: %lld\n", Stats.BufferPoolAllocations);
+    printf("BufferPoolWaits: %lld\n", Stats.BufferPoolWaits);
+    printf("BufferPoolFailures: %lld\n", Stats.BufferPoolFailures);
+    printf("ReportLunsRequests: %lld\n", Stats.ReportLunsRequests);
+    printf("UnmappedLunRequests: %lld\n", Stats.UnmappedLunRequests);
+    return Status;
+}
+
+DWORD CmdSetQos(PCHAR InstanceName, PWNBD_QOS_LIMITS Limits)
+{
+    DWORD Status = WnbdSetQos(InstanceName, Limits);
+    if (Status) {
+        CheckOpenFailed(Status);
+        fprintf(stderr, "Could not set QoS limits.\n");
+        PrintFormattedError(Status);
+    }
+    return Status;
+}
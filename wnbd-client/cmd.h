@@ -30,11 +30,14 @@ void
 PrintSyntax();
 
 DWORD
-CmdUnmap(PCHAR InstanceName, BOOLEAN HardRemove);
+CmdUnmap(PCHAR InstanceName, BOOLEAN HardRemove, BOOLEAN Async);
 
 DWORD
 CmdStats(PCHAR InstanceName);
 
+DWORD
+CmdAdapterStats();
+
 DWORD
 CmdMap(
     PCHAR InstanceName,
@@ -44,11 +47,62 @@ CmdMap(
     UINT64 DiskSize,
     UINT32 BlockSize,
     BOOLEAN MustNegotiate,
+    BOOLEAN ReadOnly,
+    BOOLEAN ChangeTracking,
+    UINT32 RequestTimeoutMs,
+    UINT32 MaxRequestRetries,
+    UINT32 MaxQueueDepth,
+    BOOLEAN AdaptiveQueueDepth,
+    UINT32 SchedulerWeight);
+
+DWORD
+CmdMapMirror(
+    PCHAR InstanceName,
+    PCHAR HostName,
+    DWORD PortNumber,
+    PCHAR ExportName,
+    PCHAR MirrorHostName,
+    DWORD MirrorPortNumber,
+    PCHAR MirrorExportName,
+    UINT32 WriteQuorum,
     BOOLEAN ReadOnly);
 
+DWORD
+CmdMapOverlay(
+    PCHAR InstanceName,
+    PCHAR HostName,
+    DWORD PortNumber,
+    PCHAR ExportName,
+    PCHAR OverlayPath,
+    BOOLEAN DiscardOverlay);
+
+DWORD
+CmdCbtSnapshot(PCHAR InstanceName);
+
+DWORD
+CmdCbtFetch(PCHAR InstanceName, UINT64 SnapshotId);
+
+DWORD
+CmdSetQos(PCHAR InstanceName, PWNBD_QOS_LIMITS Limits);
+
 DWORD
 CmdList();
 
+DWORD
+CmdWatch();
+
+DWORD
+CmdTraceControl(BOOLEAN Enable, UINT32 RecordsPerCpu);
+
+DWORD
+CmdTrace(UINT32 DurationSec, BOOLEAN Verbose);
+
+DWORD
+CmdEventLogControl(UINT32 LogLevel, UINT32 RecordsPerCpu);
+
+DWORD
+CmdEventLog(UINT32 DurationSec);
+
 DWORD
 CmdRaiseLogLevel(UINT32 LogLevel);
 
@@ -34,6 +34,12 @@ int main(int argc, PCHAR argv[])
         BOOLEAN ReadOnly = FALSE;
         UINT32 DiskSize = 0;
         UINT32 BlockSize = 512;
+        BOOLEAN ChangeTracking = FALSE;
+        UINT32 RequestTimeoutMs = 0;
+        UINT32 MaxRequestRetries = 0;
+        UINT32 MaxQueueDepth = 0;
+        BOOLEAN AdaptiveQueueDepth = FALSE;
+        UINT32 SchedulerWeight = 0;
 
         // TODO: use named arguments.
         if (argc > 6) {
@@ -48,21 +54,126 @@ int main(int argc, PCHAR argv[])
         if (argc > 9) {
             BlockSize = atoi(argv[9]);
         }
+        if (argc > 10) {
+            ChangeTracking = arg_to_bool(argv[10]);
+        }
+        if (argc > 11) {
+            RequestTimeoutMs = atoi(argv[11]);
+        }
+        if (argc > 12) {
+            MaxRequestRetries = atoi(argv[12]);
+        }
+        if (argc > 13) {
+            MaxQueueDepth = atoi(argv[13]);
+        }
+        if (argc > 14) {
+            AdaptiveQueueDepth = arg_to_bool(argv[14]);
+        }
+        if (argc > 15) {
+            SchedulerWeight = atoi(argv[15]);
+        }
 
         CmdMap(InstanceName, HostName, PortNumber, ExportName, DiskSize,
-               BlockSize, SkipNegotiation, ReadOnly);
+               BlockSize, SkipNegotiation, ReadOnly, ChangeTracking,
+               RequestTimeoutMs, MaxRequestRetries, MaxQueueDepth,
+               AdaptiveQueueDepth, SchedulerWeight);
+    } else if ((argc >= 9) && !strcmp(Command, "map-mirror")) {
+        InstanceName = argv[2];
+        HostName = argv[3];
+        PortNumber = atoi(argv[4]);
+        ExportName = argv[5];
+        UINT32 WriteQuorum = 0;
+        BOOLEAN ReadOnly = FALSE;
+
+        if (argc > 9) {
+            WriteQuorum = atoi(argv[9]);
+        }
+        if (argc > 10) {
+            ReadOnly = arg_to_bool(argv[10]);
+        }
+
+        CmdMapMirror(InstanceName, HostName, PortNumber, ExportName,
+                     argv[6], atoi(argv[7]), argv[8], WriteQuorum, ReadOnly);
+    } else if ((argc >= 7) && !strcmp(Command, "map-overlay")) {
+        InstanceName = argv[2];
+        HostName = argv[3];
+        PortNumber = atoi(argv[4]);
+        ExportName = argv[5];
+        BOOLEAN DiscardOverlay = FALSE;
+
+        if (argc > 7) {
+            DiscardOverlay = arg_to_bool(argv[7]);
+        }
+
+        return CmdMapOverlay(InstanceName, HostName, PortNumber, ExportName,
+                             argv[6], DiscardOverlay);
     } else if (argc >= 3 && !strcmp(Command, "unmap")) {
         InstanceName = argv[2];
         BOOLEAN HardRemove = FALSE;
+        BOOLEAN Async = FALSE;
         if (argc > 3) {
             HardRemove = arg_to_bool(argv[3]);
         }
-        CmdUnmap(InstanceName, HardRemove);
+        if (argc > 4) {
+            Async = arg_to_bool(argv[4]);
+        }
+        CmdUnmap(InstanceName, HardRemove, Async);
     } else if (argc == 3 && !strcmp(Command, "stats")) {
         InstanceName = argv[2];
         CmdStats(InstanceName);
+    } else if (argc == 2 && !strcmp(Command, "adapter-stats")) {
+        return CmdAdapterStats();
+    } else if (argc == 3 && !strcmp(Command, "cbt-snapshot")) {
+        InstanceName = argv[2];
+        return CmdCbtSnapshot(InstanceName);
+    } else if (argc == 4 && !strcmp(Command, "cbt-fetch")) {
+        InstanceName = argv[2];
+        return CmdCbtFetch(InstanceName, _strtoui64(argv[3], NULL, 10));
+    } else if (argc >= 7 && !strcmp(Command, "set-qos")) {
+        InstanceName = argv[2];
+        WNBD_QOS_LIMITS Limits = { 0 };
+        Limits.ReadIops.Rate = _strtoui64(argv[3], NULL, 10);
+        Limits.WriteIops.Rate = _strtoui64(argv[4], NULL, 10);
+        Limits.ReadBytes.Rate = _strtoui64(argv[5], NULL, 10);
+        Limits.WriteBytes.Rate = _strtoui64(argv[6], NULL, 10);
+        if (argc > 7) {
+            Limits.ReadIops.Burst = _strtoui64(argv[7], NULL, 10);
+        }
+        if (argc > 8) {
+            Limits.WriteIops.Burst = _strtoui64(argv[8], NULL, 10);
+        }
+        if (argc > 9) {
+            Limits.ReadBytes.Burst = _strtoui64(argv[9], NULL, 10);
+        }
+        if (argc > 10) {
+            Limits.WriteBytes.Burst = _strtoui64(argv[10], NULL, 10);
+        }
+        return CmdSetQos(InstanceName, &Limits);
     } else if (argc == 2 && !strcmp(Command, "list")) {
         return CmdList();
+    } else if (argc == 2 && !strcmp(Command, "watch")) {
+        return CmdWatch();
+    } else if (argc <= 3 && !strcmp(Command, "trace-start")) {
+        return CmdTraceControl(
+            TRUE, argc > 2 ? strtoul(argv[2], NULL, 10) : 0);
+    } else if (argc == 2 && !strcmp(Command, "trace-stop")) {
+        return CmdTraceControl(FALSE, 0);
+    } else if (argc <= 4 && !strcmp(Command, "trace")) {
+        UINT32 DurationSec = 0;
+        BOOLEAN Verbose = FALSE;
+        if (argc > 2) {
+            DurationSec = strtoul(argv[2], NULL, 10);
+        }
+        if (argc > 3) {
+            Verbose = arg_to_bool(argv[3]);
+        }
+        return CmdTrace(DurationSec, Verbose);
+    } else if ((argc == 3 || argc == 4) && !strcmp(Command, "set-event-log")) {
+        return CmdEventLogControl(
+            strtoul(argv[2], NULL, 10),
+            argc > 3 ? strtoul(argv[3], NULL, 10) : 0);
+    } else if (argc <= 3 && !strcmp(Command, "event-log")) {
+        return CmdEventLog(argc > 2 ? strtoul(argv[2], NULL, 10) : 0);
     } else if (argc == 3 && !strcmp(Command, "set-debug")) {
         CmdRaiseLogLevel(arg_to_bool(argv[2]));
     } else if (argc == 2 && (